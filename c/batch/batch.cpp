@@ -0,0 +1,762 @@
+// Headless batch pipeline: the KDE of a transcript file (see transcripts.h),
+// its local maxima and, given cell type centroids, its cell type map, written
+// to a zarr store that SSAMDataset opens like one made by the Python pipeline.
+// Build with CMake from the repository root:
+//
+//   cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build
+//   build/ssam_batch --bandwidth 2.5 --centroids centroids.npy mrnas.trx out.zarr
+//
+// The stages run the same native kernels with the same parameters as
+// SSAMAnalysis.run_kde, find_localmax, normalize_vectors, scale_vectors and
+// map_celltypes, streaming the vector field chunk by chunk:
+//
+//   1. KDE of each chunk of vf, from the transcripts within the prune
+//      distance of the chunk. Writes vf, genes, vf_params, kde_computed and
+//      kde_blocks_computed.
+//   2. Local maxima and L1 norm of each chunk (with a halo of search_size // 2),
+//      and the moments of the normalized vectors above the norm threshold.
+//      Writes local_maxs and vf_norm.
+//   3. With --centroids, normalization, scaling and correlation of each chunk
+//      with the centroids (ncent x ngene, float64 or float32 .npy). Writes
+//      celltype_maps and max_correlations.
+//
+// Chunks are stored uncompressed. vf_normalized and vf_scaled are not kept;
+// they are recomputed per chunk in stage 3.
+//
+// With --shards N, every stage is split among N worker processes, each owning
+// a run of chunks in raster order (a slab of the slide) and reading the halo
+// it needs around them: the transcripts within the prune distance
+// (bandwidth * prune coefficient) in stage 1, and search_size // 2 pixels of
+// the vector field in stage 2. A chunk is written by its owner only, and the
+// per-chunk local maxima and moments are merged in raster order by the main
+// process, so the store is identical to the one of a single process. The
+// workers share nothing but the store; a worker is this program run with
+// --stage and --shard.
+#include "../kernels.h"
+#include "transcripts.h"
+#include "zarr.h"
+
+#include <float.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <string>
+
+// Kernel names of SSAMAnalysis.run_kde, indexed by KDE_KERNEL_*
+static const char *batch_kernels[] = { "gaussian_exact", "gaussian", "gaussian_binned", NULL };
+
+struct batch_params {
+    double bandwidth = 2.5;
+    double sampling_distance = 1.0;
+    double prune_coeff = 4.3;
+    int kernel = KDE_KERNEL_GAUSSIAN_SEPARABLE;
+    double max_chunk_size = 1024.0 * 1024 * 64;
+    int search_size = 3;
+    double size_after_normalization = 10;
+    const char *centroids = NULL;
+    int ncores = 1;
+    int nshards = 1;
+};
+
+// What stages 2 and 3 need of the grid
+struct batch_grid {
+    long shape[3];
+    long chunks[3];
+    long nchunks[3];
+    long ngene;
+    double norm_threshold, expression_threshold;
+};
+
+static void batch_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] TRANSCRIPTS STORE\n"
+            "  --bandwidth H           kernel bandwidth in um (default 2.5)\n"
+            "  --sampling-distance D   grid spacing in um (default 1)\n"
+            "  --kernel NAME           gaussian, gaussian_exact or gaussian_binned (default gaussian)\n"
+            "  --prune C               prune coefficient, negative to disable pruning (default 4.3)\n"
+            "  --max-chunk-size B      maximum bytes of a vf chunk (default 67108864)\n"
+            "  --search-size N         local maxima search size (default 3)\n"
+            "  --centroids FILE        .npy cell type centroids to map the cell types with\n"
+            "  --threads N             OpenMP threads per process (default: all, shared by the shards)\n"
+            "  --shards N              worker processes, each computing a slab of chunks (default 1)\n"
+            "  --stage S --shard I/N   run only stage S (kde, localmax or celltypes) of shard I of N, as a worker\n",
+            prog);
+}
+
+static double batch_seconds(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Reads a 2D float64 or float32 C-order .npy array as doubles
+static bool batch_load_npy(const char *path, std::vector<double> &out, long &rows, long &cols) {
+    FILE *f = fopen(path, "rb");
+    unsigned char pre[12];
+    std::string header;
+    bool ok = false;
+
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (fread(pre, 1, 10, f) == 10 && memcmp(pre, "\x93NUMPY", 6) == 0) {
+        size_t len = pre[8] | (pre[9] << 8);
+        if (pre[6] >= 2 && fread(pre + 10, 1, 2, f) == 2)
+            len |= ((size_t)pre[10] << 16) | ((size_t)pre[11] << 24);
+        header.resize(len);
+        ok = fread(&header[0], 1, len, f) == len;
+    }
+    size_t descr = header.find("'descr'"), shape = header.find("'shape'");
+    int itemsize = 0;
+    if (ok && descr != std::string::npos) {
+        if (header.compare(header.find('\'', descr + 7) + 1, 3, "<f8") == 0)
+            itemsize = 8;
+        else if (header.compare(header.find('\'', descr + 7) + 1, 3, "<f4") == 0)
+            itemsize = 4;
+    }
+    ok = ok && itemsize && header.find("'fortran_order': False") != std::string::npos && shape != std::string::npos &&
+         sscanf(header.c_str() + header.find('(', shape), "(%ld, %ld)", &rows, &cols) == 2 && rows > 0 && cols > 0;
+    if (!ok) {
+        fprintf(stderr, "%s: expected a 2D float64 or float32 C-order .npy array\n", path);
+        fclose(f);
+        return false;
+    }
+    std::vector<char> raw(rows * cols * itemsize);
+    ok = fread(raw.data(), 1, raw.size(), f) == raw.size();
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "%s: truncated .npy file\n", path);
+        return false;
+    }
+    out.resize(rows * cols);
+    for (long i = 0; i < rows * cols; i++)
+        out[i] = (itemsize == 8) ? ((double *)raw.data())[i] : ((float *)raw.data())[i];
+    return true;
+}
+
+// Decodes UTF-8 into code points, as stored by numpy '<U' arrays
+static std::vector<uint32_t> batch_utf32(const std::string &s) {
+    std::vector<uint32_t> out;
+    for (size_t i = 0; i < s.size();) {
+        unsigned char c = s[i++];
+        int more = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : (c >= 0xc0) ? 1 : 0;
+        uint32_t cp = more ? c & (0x3f >> more) : c;
+        for (; more > 0 && i < s.size(); more--)
+            cp = (cp << 6) | (s[i++] & 0x3f);
+        out.push_back(cp);
+    }
+    return out;
+}
+
+// A shard owns the chunks [first, last) in raster order, i.e. a slab of the
+// slide: it writes these chunks only, and reads the halo around them, so the
+// shards never write the same chunk and stitch without seams.
+struct batch_shard {
+    long first, last;
+};
+
+static batch_shard batch_shard_of(const batch_grid &g, int shard, int nshards) {
+    long n = g.nchunks[0] * g.nchunks[1] * g.nchunks[2];
+    return { n * shard / nshards, n * (shard + 1) / nshards };
+}
+
+static void batch_unravel(const batch_grid &g, long b, long *c) {
+    c[0] = b / (g.nchunks[1] * g.nchunks[2]);
+    c[1] = b / g.nchunks[2] % g.nchunks[1];
+    c[2] = b % g.nchunks[2];
+}
+
+// Origin and extent of chunk c, and the box around it with a halo of lo/hi
+static void batch_chunk_box(const batch_grid &g, const long *c, long lo, long hi, long *org, long *ext, long *horg, long *hext) {
+    for (int a = 0; a < 3; a++) {
+        org[a] = c[a] * g.chunks[a];
+        ext[a] = std::min(g.chunks[a], g.shape[a] - org[a]);
+        horg[a] = std::max(org[a] - lo, 0L);
+        hext[a] = std::min(org[a] + ext[a] + hi, g.shape[a]) - horg[a];
+    }
+}
+
+// An array of the store over the grid, with the vf chunks (and all genes if
+// vectors)
+static zarr_array batch_array(const batch_grid &g, const std::string &store, const char *name, bool vectors, size_t itemsize) {
+    zarr_array a;
+    a.path = store + "/" + name;
+    a.shape.assign(g.shape, g.shape + 3);
+    a.chunks.assign(g.chunks, g.chunks + 3);
+    if (vectors) {
+        a.shape.push_back(g.ngene);
+        a.chunks.push_back(g.ngene);
+    }
+    a.itemsize = itemsize;
+    return a;
+}
+
+// Per-chunk results of the local maxima stage, merged in raster order by
+// batch_localmax_merge: int64 nmax, int64 count, int64 maxima[nmax],
+// float64 mean[ngene], float64 m2[ngene]. The merged moments are saved in
+// the same layout (without maxima).
+static std::string batch_side_path(const std::string &store, const char *name) {
+    return store + "/.batch/" + name;
+}
+
+static bool batch_write_side(const std::string &path, const std::vector<long> &maxs, const gene_moments &m) {
+    std::vector<int64_t> buf = { (int64_t)maxs.size(), m.count };
+    buf.insert(buf.end(), maxs.begin(), maxs.end());
+    buf.resize(buf.size() + 2 * m.mean.size());
+    memcpy(&buf[2 + maxs.size()], m.mean.data(), m.mean.size() * sizeof(double));
+    memcpy(&buf[2 + maxs.size() + m.mean.size()], m.m2.data(), m.m2.size() * sizeof(double));
+    return zarr_write_file(path, buf.data(), buf.size() * sizeof(int64_t));
+}
+
+static bool batch_read_side(const std::string &path, long ngene, std::vector<long> &maxs, gene_moments &m) {
+    FILE *f = fopen(path.c_str(), "rb");
+    int64_t head[2];
+    bool ok = f != NULL && fread(head, sizeof(int64_t), 2, f) == 2 && head[0] >= 0;
+
+    if (ok) {
+        std::vector<int64_t> found(head[0]);
+        m.count = head[1];
+        m.mean.resize(ngene);
+        m.m2.resize(ngene);
+        ok = fread(found.data(), sizeof(int64_t), head[0], f) == (size_t)head[0] &&
+             fread(m.mean.data(), sizeof(double), ngene, f) == (size_t)ngene && fread(m.m2.data(), sizeof(double), ngene, f) == (size_t)ngene;
+        maxs.insert(maxs.end(), found.begin(), found.end());
+    }
+    if (f != NULL)
+        fclose(f);
+    if (!ok)
+        fprintf(stderr, "%s: missing or truncated\n", path.c_str());
+    return ok;
+}
+
+// Stage 1, as SSAMAnalysis._run_kde_multi: the transcripts are sorted by the
+// chunk containing them, and each chunk gathers those of the chunks within
+// the prune distance, in their original order (which fixes the per-gene
+// summation order). Only the transcripts within reach of the shard are kept.
+static bool batch_kde(const tx_file &tx, const batch_params &p, const batch_grid &g, const std::string &store, batch_shard sh) {
+    const long npts = tx.npts;
+    const long nblk = g.nchunks[0] * g.nchunks[1] * g.nchunks[2];
+    const double h = p.bandwidth / p.sampling_distance;
+    const double norm = pow(2 * M_PI * p.bandwidth * p.bandwidth, tx.ndim / 2.0);
+    const double sd2 = p.sampling_distance * p.sampling_distance;
+    const int maxdist = (p.prune_coeff > 0) ? (int)(h * p.prune_coeff) : -1;
+    int shape[3] = { (int)g.shape[0], (int)g.shape[1], (int)g.shape[2] };
+    std::vector<double> loc[3];
+    std::vector<long> keep, home, start(nblk + 1, 0), order;
+    long halo[3], reach0[3], reach1[3];
+    zarr_array vf = batch_array(g, store, "vf", true, sizeof(float));
+
+    if (sh.first >= sh.last)
+        return true;
+    for (int a = 0; a < 3; a++) {
+        halo[a] = (maxdist > 0) ? (maxdist + g.chunks[a] - 1) / g.chunks[a] : g.nchunks[a];
+        reach0[a] = g.nchunks[a];
+        reach1[a] = -1;
+    }
+    // The chunks whose transcripts the shard gathers
+    for (long b = sh.first; b < sh.last; b++) {
+        long c[3];
+        batch_unravel(g, b, c);
+        for (int a = 0; a < 3; a++) {
+            reach0[a] = std::min(reach0[a], c[a] - halo[a]);
+            reach1[a] = std::max(reach1[a], c[a] + halo[a]);
+        }
+    }
+    for (long i = 0; i < npts; i++) {
+        double xyz[3] = { 0, 0, 0 };
+        long b = 0;
+        bool in = true;
+        for (int a = 0; a < tx.ndim; a++) {
+            // The coordinates are divided in their own precision, like numpy
+            xyz[a] = (tx.coord_size == 8) ? tx.coord(a, i) / p.sampling_distance
+                                          : (double)((float)tx.coord(a, i) / (float)p.sampling_distance);
+        }
+        for (int a = 0; a < 3; a++) {
+            long t = (long)trunc(xyz[a]);
+            long c = (t >= 0) ? t / g.chunks[a] : -((-t + g.chunks[a] - 1) / g.chunks[a]);
+            c = std::min(std::max(c, 0L), g.nchunks[a] - 1);
+            in = in && c >= reach0[a] && c <= reach1[a];
+            b = b * g.nchunks[a] + c;
+        }
+        if (!in)
+            continue;
+        keep.push_back(i);
+        home.push_back(b);
+        for (int a = 0; a < 3; a++)
+            loc[a].push_back(xyz[a]);
+    }
+    // Counting sort by home chunk, stable like np.lexsort
+    const long nkeep = keep.size();
+    order.resize(nkeep);
+    for (long m = 0; m < nkeep; m++)
+        start[home[m] + 1]++;
+    for (long b = 0; b < nblk; b++)
+        start[b + 1] += start[b];
+    {
+        std::vector<long> fill(start.begin(), start.end() - 1);
+        for (long m = 0; m < nkeep; m++)
+            order[fill[home[m]]++] = m;
+    }
+    home = std::vector<long>();
+
+    std::vector<long> indices;
+    std::vector<int> bgene;
+    std::vector<double> bx, by, bz, out;
+    std::vector<float> block;
+    long nonempty = 0;
+    for (long b = sh.first; b < sh.last; b++) {
+        long cidx[4] = { 0, 0, 0, 0 };
+        batch_unravel(g, b, cidx);
+        const long i = cidx[0], j = cidx[1], k = cidx[2];
+        indices.clear();
+        for (long ii = std::max(0L, i - halo[0]); ii < std::min(g.nchunks[0], i + halo[0] + 1); ii++) {
+            for (long jj = std::max(0L, j - halo[1]); jj < std::min(g.nchunks[1], j + halo[1] + 1); jj++) {
+                long bb = (ii * g.nchunks[1] + jj) * g.nchunks[2];
+                long lo = start[bb + std::max(0L, k - halo[2])];
+                long hi = start[bb + std::min(g.nchunks[2] - 1, k + halo[2]) + 1];
+                indices.insert(indices.end(), order.begin() + lo, order.begin() + hi);
+            }
+        }
+        if (indices.empty())
+            continue;
+        // keep is ascending, so this is the original order
+        std::sort(indices.begin(), indices.end());
+        long n = indices.size();
+        bgene.resize(n);
+        bx.resize(n);
+        by.resize(n);
+        bz.resize(n);
+        for (long m = 0; m < n; m++) {
+            bgene[m] = tx.gene[keep[indices[m]]];
+            bx[m] = loc[0][indices[m]];
+            by[m] = loc[1][indices[m]];
+            bz[m] = loc[2][indices[m]];
+        }
+        int borg[3], bext[3];
+        long ext[4], nvox = 1;
+        for (int a = 0; a < 3; a++) {
+            borg[a] = (int)(cidx[a] * g.chunks[a]);
+            bext[a] = (int)std::min(g.chunks[a], g.shape[a] - borg[a]);
+            ext[a] = bext[a];
+            nvox *= bext[a];
+        }
+        ext[3] = g.ngene;
+        out.assign(nvox * g.ngene, 0.0);
+        if (p.kernel == KDE_KERNEL_GAUSSIAN_BINNED) {
+            double *outs[1] = { out.data() };
+            kde_binned(outs, &h, 1, bgene.data(), bx.data(), by.data(), bz.data(), shape, borg, bext, (int)g.ngene, (int)n,
+                       p.prune_coeff, p.ncores);
+        } else {
+            kde_multi(out.data(), bgene.data(), bx.data(), by.data(), bz.data(), shape, borg, bext, (int)g.ngene, (int)n,
+                      h, p.prune_coeff, p.kernel, p.ncores);
+        }
+        block.resize(out.size());
+        for (size_t v = 0; v < out.size(); v++)
+            block[v] = (float)(out[v] / norm * sd2);
+        if (!zarr_write_chunk(vf, cidx, block.data(), ext))
+            return false;
+        nonempty++;
+    }
+    fprintf(stderr, "KDE of chunks %ld-%ld: %ld with transcripts, %ld transcripts within reach\n", sh.first, sh.last - 1,
+            nonempty, nkeep);
+    return true;
+}
+
+// Flags and parameters SSAMAnalysis checks to load the KDE
+static bool batch_kde_meta(const tx_file &tx, const batch_params &p, const batch_grid &g, const std::string &store) {
+    const long nblk = g.nchunks[0] * g.nchunks[1] * g.nchunks[2];
+    zarr_array arr;
+    std::vector<long> nchunks(g.nchunks, g.nchunks + 3);
+    std::vector<char> ones(std::max(nblk, g.ngene), 1);
+    std::vector<std::vector<uint32_t> > codes(g.ngene);
+    size_t width = 1;
+    for (long n = 0; n < g.ngene; n++) {
+        codes[n] = batch_utf32(tx.genes[n]);
+        width = std::max(width, codes[n].size());
+    }
+    // numpy '<U' strings
+    std::vector<uint32_t> names(g.ngene * width, 0);
+    for (long n = 0; n < g.ngene; n++)
+        std::copy(codes[n].begin(), codes[n].end(), names.begin() + n * width);
+    std::string udtype = "<U" + std::to_string(width);
+    double vf_params[2] = { p.sampling_distance, p.bandwidth };
+    // Checked by SSAMAnalysis.append_kde
+    std::string attrs = std::string("{\n    \"kernel\": \"") + batch_kernels[p.kernel] + "\",\n"
+        "    \"prune_coefficient\": " + zarr_json_number(p.prune_coeff) + "\n}\n";
+    return zarr_create(arr, store, "kde_blocks_computed", nchunks, nchunks, "|b1", 1, "false") && zarr_write_all(arr, ones.data()) &&
+           zarr_create(arr, store, "kde_computed", { g.ngene }, { g.ngene }, "|b1", 1, "false") && zarr_write_all(arr, ones.data()) &&
+           zarr_create(arr, store, "genes", { g.ngene }, { g.ngene }, udtype.c_str(), 4 * width, "\"\"") && zarr_write_all(arr, names.data()) &&
+           zarr_create(arr, store, "vf_params", { 2 }, { 2 }, "<f8", 8, "0.0") && zarr_write_all(arr, vf_params) &&
+           zarr_write_file(arr.path + "/.zattrs", attrs.data(), attrs.size());
+}
+
+// Stage 2, as SSAMAnalysis.find_localmax and the moments of normalize_vectors.
+// The vf halo of search_size // 2 is read from the chunks of the neighbouring
+// shards, which stage 1 has completed.
+static bool batch_localmax(const batch_params &p, const batch_grid &g, const std::string &store, batch_shard sh) {
+    const long lo = p.search_size / 2, hi = (p.search_size - 1) / 2;
+    zarr_array vf = batch_array(g, store, "vf", true, sizeof(float));
+    zarr_array vf_norm = batch_array(g, store, "vf_norm", false, sizeof(double));
+    std::vector<long> maxs, found;
+    std::vector<float> box, core, normalized;
+    std::vector<double> norm, core_norm;
+
+    for (long b = sh.first; b < sh.last; b++) {
+        long c[3], org[4], ext[4], horg[4], hext[4], borg[3], zero[4] = { 0, 0, 0, 0 };
+        batch_unravel(g, b, c);
+        batch_chunk_box(g, c, lo, hi, org, ext, horg, hext);
+        org[3] = horg[3] = 0;
+        ext[3] = hext[3] = g.ngene;
+        long nbox = hext[0] * hext[1] * hext[2], ncore = ext[0] * ext[1] * ext[2];
+        for (int a = 0; a < 3; a++)
+            borg[a] = org[a] - horg[a];
+        box.resize(nbox * g.ngene);
+        norm.resize(nbox);
+        if (!zarr_read(vf, horg, hext, box.data()))
+            return false;
+
+        found.clear();
+        maxs.clear();
+        localmax_vf(found, norm.data(), box.data(), hext, g.ngene, borg, ext, p.search_size, g.norm_threshold,
+                    g.expression_threshold, p.ncores);
+        for (long f : found) {
+            long x = org[0] + f / (ext[1] * ext[2]), y = org[1] + f / ext[2] % ext[1], z = org[2] + f % ext[2];
+            maxs.push_back((x * g.shape[1] + y) * g.shape[2] + z);
+        }
+        core_norm.resize(ncore);
+        zarr_copy_box((char *)core_norm.data(), ext, zero, (const char *)norm.data(), hext, borg, ext, 3, sizeof(double));
+        if (!zarr_write_chunk(vf_norm, c, core_norm.data(), ext))
+            return false;
+
+        gene_moments part = { 0, std::vector<double>(g.ngene, 0.0), std::vector<double>(g.ngene, 0.0) };
+        core.resize(ncore * g.ngene);
+        normalized.resize(ncore * g.ngene);
+        zarr_copy_box((char *)core.data(), ext, zero, (const char *)box.data(), hext, borg, ext, 3, g.ngene * sizeof(float));
+        normalize_vf(normalized.data(), part, core.data(), ncore, g.ngene, p.size_after_normalization, true, false, true,
+                     g.norm_threshold, p.ncores);
+        if (!batch_write_side(batch_side_path(store, ("localmax." + std::to_string(b)).c_str()), maxs, part))
+            return false;
+    }
+    return true;
+}
+
+// Merges the per-chunk results of stage 2 in raster order, whatever the
+// shards, and saves local_maxs and the moments
+static bool batch_localmax_merge(const batch_grid &g, const std::string &store) {
+    const long nblk = g.nchunks[0] * g.nchunks[1] * g.nchunks[2];
+    gene_moments moments = { 0, std::vector<double>(g.ngene, 0.0), std::vector<double>(g.ngene, 0.0) };
+    std::vector<long> maxs;
+    zarr_array arr;
+
+    for (long b = 0; b < nblk; b++) {
+        gene_moments part;
+        if (!batch_read_side(batch_side_path(store, ("localmax." + std::to_string(b)).c_str()), g.ngene, maxs, part))
+            return false;
+        moments_merge(moments, part);
+    }
+
+    // As a (3, n) array, in raster order
+    std::sort(maxs.begin(), maxs.end());
+    long n = maxs.size();
+    std::vector<int64_t> coords(3 * n);
+    for (long m = 0; m < n; m++) {
+        coords[m] = maxs[m] / (g.shape[1] * g.shape[2]);
+        coords[n + m] = maxs[m] / g.shape[2] % g.shape[1];
+        coords[2 * n + m] = maxs[m] % g.shape[2];
+    }
+    fprintf(stderr, "Local maxima: %ld\n", n);
+    return zarr_create(arr, store, "local_maxs", { 3, n }, { 3, n }, "<i8", sizeof(int64_t), "0") && zarr_write_all(arr, coords.data()) &&
+           batch_write_side(batch_side_path(store, "moments"), std::vector<long>(), moments);
+}
+
+static bool batch_load_centroids(const batch_params &p, const batch_grid &g, std::vector<double> &cents, long &ncent) {
+    long ngene;
+
+    if (!batch_load_npy(p.centroids, cents, ncent, ngene))
+        return false;
+    if (ngene != g.ngene) {
+        fprintf(stderr, "%s: the centroids have %ld genes, the transcripts %ld\n", p.centroids, ngene, g.ngene);
+        return false;
+    }
+    return true;
+}
+
+// Stage 3, as SSAMAnalysis.normalize_vectors, scale_vectors and map_celltypes
+// with top_k=1
+static bool batch_celltypes(const batch_params &p, const batch_grid &g, const std::string &store, batch_shard sh) {
+    std::vector<double> cents, cent, csum, omax, norm;
+    std::vector<float> mu(g.ngene), sigma(g.ngene), core, scaled;
+    std::vector<int> oidx;
+    std::vector<int64_t> labels;
+    std::vector<long> none;
+    gene_moments moments;
+    long ncent;
+    zarr_array vf = batch_array(g, store, "vf", true, sizeof(float));
+    zarr_array vf_norm = batch_array(g, store, "vf_norm", false, sizeof(double));
+    zarr_array maps = batch_array(g, store, "celltype_maps", false, sizeof(int64_t));
+    zarr_array corrs = batch_array(g, store, "max_correlations", false, sizeof(double));
+
+    if (!batch_load_centroids(p, g, cents, ncent) || !batch_read_side(batch_side_path(store, "moments"), g.ngene, none, moments))
+        return false;
+    long ncp = ctmap_pack(cent, csum, cents.data(), ncent, g.ngene);
+    for (long n = 0; n < g.ngene; n++) {
+        mu[n] = (float)moments.mean[n];
+        sigma[n] = (float)sqrt(moments.m2[n] / moments.count);
+    }
+
+    for (long b = sh.first; b < sh.last; b++) {
+        long c[3], org[4], ext[4], horg[4], hext[4];
+        batch_unravel(g, b, c);
+        batch_chunk_box(g, c, 0, 0, org, ext, horg, hext);
+        org[3] = 0;
+        ext[3] = g.ngene;
+        long nvec = ext[0] * ext[1] * ext[2];
+        core.resize(nvec * g.ngene);
+        scaled.resize(nvec * g.ngene);
+        norm.resize(nvec);
+        if (!zarr_read(vf, org, ext, core.data()) || !zarr_read(vf_norm, org, ext, norm.data()))
+            return false;
+
+        gene_moments unused = { 0, std::vector<double>(g.ngene, 0.0), std::vector<double>(g.ngene, 0.0) };
+        normalize_vf(scaled.data(), unused, core.data(), nvec, g.ngene, p.size_after_normalization, true, false, true,
+                     INFINITY, p.ncores);
+        // np.nan_to_num((X - mu) / sigma) in float32
+        for (long v = 0; v < nvec; v++) {
+            for (long n = 0; n < g.ngene; n++) {
+                float x = (scaled[v * g.ngene + n] - mu[n]) / sigma[n];
+                if (std::isnan(x))
+                    x = 0;
+                else if (std::isinf(x))
+                    x = (x > 0) ? FLT_MAX : -FLT_MAX;
+                scaled[v * g.ngene + n] = x;
+            }
+        }
+        omax.resize(nvec);
+        oidx.resize(nvec);
+        labels.resize(nvec);
+        ctmap_multi_vf(omax.data(), oidx.data(), scaled.data(), cent.data(), csum.data(), nvec, g.ngene, ncent, ncp, 1, p.ncores);
+        for (long v = 0; v < nvec; v++) {
+            labels[v] = (norm[v] == 0) ? -1 : oidx[v];
+            if (norm[v] == 0)
+                omax[v] = -1;
+        }
+        if (!zarr_write_chunk(maps, c, labels.data(), ext) || !zarr_write_chunk(corrs, c, omax.data(), ext))
+            return false;
+    }
+    return true;
+}
+
+static bool batch_stage(const std::string &stage, const tx_file &tx, const batch_params &p, const batch_grid &g,
+                        const std::string &store, batch_shard sh) {
+    if (stage == "kde")
+        return batch_kde(tx, p, g, store, sh);
+    if (stage == "localmax")
+        return batch_localmax(p, g, store, sh);
+    if (stage == "celltypes")
+        return batch_celltypes(p, g, store, sh);
+    fprintf(stderr, "Unknown stage %s\n", stage.c_str());
+    return false;
+}
+
+// Path of this program, for the shard workers to run: /proc/self/exe on
+// Linux, elsewhere argv[0], resolved against PATH if it has no slash.
+static std::string batch_self(const char *argv0) {
+    char buf[PATH_MAX];
+
+    if (access("/proc/self/exe", X_OK) == 0)
+        return "/proc/self/exe";
+    if (strchr(argv0, '/') != NULL)
+        return realpath(argv0, buf) != NULL ? buf : argv0;
+    const char *path = getenv("PATH");
+    std::string dirs = path != NULL ? path : "";
+    for (size_t b = 0, e; b <= dirs.size(); b = e + 1) {
+        e = std::min(dirs.find(':', b), dirs.size());
+        std::string cand = (e > b ? dirs.substr(b, e - b) : ".") + "/" + argv0;
+        if (access(cand.c_str(), X_OK) == 0)
+            return cand;
+    }
+    return argv0;
+}
+
+// Runs a stage over all chunks, in this process or in one worker process per
+// shard: this program again, with --stage and --shard, sharing nothing but
+// the store. Returns when all the workers are done.
+static bool batch_run(const char *stage, const tx_file &tx, const batch_params &p, const batch_grid &g, const std::string &store,
+                      int argc, char **argv) {
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<pid_t> pids;
+    bool ok = true;
+
+    if (p.nshards == 1) {
+        ok = batch_stage(stage, tx, p, g, store, batch_shard_of(g, 0, 1));
+    } else {
+        std::string self = batch_self(argv[0]);
+        for (int s = 0; s < p.nshards; s++) {
+            std::string shard = std::to_string(s) + "/" + std::to_string(p.nshards);
+            std::vector<char *> args(argv, argv + argc);
+            args.insert(args.end(), { (char *)"--stage", (char *)stage, (char *)"--shard", (char *)shard.c_str(), NULL });
+            pid_t pid = fork();
+            if (pid == 0) {
+                execv(self.c_str(), args.data());
+                fprintf(stderr, "%s: %s\n", self.c_str(), strerror(errno));
+                _exit(127);
+            }
+            if (pid < 0) {
+                fprintf(stderr, "fork: %s\n", strerror(errno));
+                ok = false;
+                break;
+            }
+            pids.push_back(pid);
+        }
+        for (pid_t pid : pids) {
+            int status;
+            ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+        }
+    }
+    if (ok)
+        fprintf(stderr, "Stage %s done in %.2f s\n", stage, batch_seconds(t0));
+    else
+        fprintf(stderr, "Stage %s failed\n", stage);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    batch_params p;
+    std::vector<const char *> paths;
+    std::string stage;
+    int shard = 0, nshards = 0;
+    bool threads_given = false;
+    tx_file tx;
+    batch_grid g;
+
+    simd_level = simd_detect();
+    p.ncores = omp_get_max_threads();
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        bool ok = true;
+        if (a.compare(0, 2, "--") != 0) {
+            paths.push_back(argv[i]);
+            continue;
+        }
+        if (v == NULL) {
+            batch_usage(argv[0]);
+            return 2;
+        }
+        i++;
+        if (a == "--bandwidth") {
+            ok = (p.bandwidth = atof(v)) > 0;
+        } else if (a == "--sampling-distance") {
+            ok = (p.sampling_distance = atof(v)) > 0;
+        } else if (a == "--kernel") {
+            p.kernel = -1;
+            for (int k = 0; batch_kernels[k] != NULL; k++)
+                if (batch_kernels[k] == std::string(v))
+                    p.kernel = k;
+            ok = p.kernel >= 0;
+        } else if (a == "--prune") {
+            p.prune_coeff = atof(v);
+        } else if (a == "--max-chunk-size") {
+            ok = (p.max_chunk_size = atof(v)) > 0;
+        } else if (a == "--search-size") {
+            ok = (p.search_size = atoi(v)) > 0;
+        } else if (a == "--centroids") {
+            p.centroids = v;
+        } else if (a == "--threads") {
+            ok = (p.ncores = atoi(v)) > 0;
+            threads_given = true;
+        } else if (a == "--shards") {
+            ok = (p.nshards = atoi(v)) > 0;
+        } else if (a == "--stage") {
+            stage = v;
+        } else if (a == "--shard") {
+            ok = sscanf(v, "%d/%d", &shard, &nshards) == 2 && shard >= 0 && shard < nshards;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Invalid option %s %s\n", a.c_str(), v);
+            batch_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (paths.size() != 2 || stage.empty() != (nshards == 0)) {
+        batch_usage(argv[0]);
+        return 2;
+    }
+    if (p.kernel == KDE_KERNEL_GAUSSIAN_BINNED && !(p.bandwidth / p.sampling_distance >= KDE_BINNED_MIN_H)) {
+        fprintf(stderr, "The binned kernel requires a bandwidth of at least %g pixels.\n", KDE_BINNED_MIN_H);
+        return 2;
+    }
+    // The workers share the cores
+    if (!threads_given)
+        p.ncores = std::max(1, p.ncores / std::max(nshards, p.nshards));
+    if (!tx_open(tx, paths[0]))
+        return 1;
+
+    // The grid and its chunks, as SSAMAnalysis.run_kde and _kde_chunks
+    g.ngene = tx.genes.size();
+    for (int a = 0; a < 3; a++) {
+        g.shape[a] = (long)ceil(tx.extent[a] / p.sampling_distance);
+        g.chunks[a] = g.shape[a];
+        if (!(tx.extent[a] >= 1) || g.shape[a] >= INT_MAX) {
+            fprintf(stderr, "%s: invalid image dimension\n", paths[0]);
+            return 1;
+        }
+    }
+    while ((double)g.chunks[0] * g.chunks[1] * g.chunks[2] * g.ngene * 4 > p.max_chunk_size &&
+           std::max(std::max(g.chunks[0], g.chunks[1]), g.chunks[2]) > 1) {
+        int a = (int)(std::max_element(g.chunks, g.chunks + 3) - g.chunks);
+        g.chunks[a] = (g.chunks[a] + 1) / 2;
+    }
+    for (int a = 0; a < 3; a++)
+        g.nchunks[a] = (g.shape[a] + g.chunks[a] - 1) / g.chunks[a];
+    g.expression_threshold = 1 / pow(sqrt(2 * M_PI) * p.bandwidth, tx.ndim);
+    g.norm_threshold = g.expression_threshold * 2;
+    std::string store = paths[1];
+
+    // A worker: one stage of one shard, in a store prepared by the main process
+    if (!stage.empty())
+        return batch_stage(stage, tx, p, g, store, batch_shard_of(g, shard, nshards)) ? 0 : 1;
+
+    fprintf(stderr, "%ld transcripts of %ld genes, grid %ldx%ldx%ld in chunks of %ldx%ldx%ld, %d shards of %d threads\n", tx.npts,
+            g.ngene, g.shape[0], g.shape[1], g.shape[2], g.chunks[0], g.chunks[1], g.chunks[2], p.nshards, p.ncores);
+    std::vector<double> cents;
+    long ncent;
+    if (p.centroids != NULL && !batch_load_centroids(p, g, cents, ncent))
+        return 1;
+
+    // Results of an earlier run would not match the new vector field; the
+    // first five are VF_CACHES of ssam/_dataset.py
+    static const char *stale[] = { "vf_norm", "vf_unit", "vf_unit_norm", "corr_map", "localmax_regions", "vf_sparse", "kde_dirty",
+                                   "vf_normalized", "normalized_vectors", "vf_scaled", "scaled_vectors", "celltype_maps",
+                                   "max_correlations", "celltype_maps_topk", "max_correlations_topk", ".batch", NULL };
+    zarr_array vf = batch_array(g, store, "vf", true, sizeof(float));
+    zarr_array vf_norm = batch_array(g, store, "vf_norm", false, sizeof(double));
+    zarr_array maps = batch_array(g, store, "celltype_maps", false, sizeof(int64_t));
+    zarr_array corrs = batch_array(g, store, "max_correlations", false, sizeof(double));
+    if (!zarr_group(store))
+        return 1;
+    for (int s = 0; stale[s] != NULL; s++)
+        if (!zarr_remove(store + "/" + stale[s]))
+            return 1;
+    if (mkdir((store + "/.batch").c_str(), 0777) != 0) {
+        fprintf(stderr, "%s/.batch: %s\n", store.c_str(), strerror(errno));
+        return 1;
+    }
+
+    if (!zarr_create(vf, store, "vf", vf.shape, vf.chunks, "<f4", sizeof(float), "0.0") ||
+        !batch_run("kde", tx, p, g, store, argc, argv) || !batch_kde_meta(tx, p, g, store))
+        return 1;
+    if (!zarr_create(vf_norm, store, "vf_norm", vf_norm.shape, vf_norm.chunks, "<f8", sizeof(double), "0.0") ||
+        !batch_run("localmax", tx, p, g, store, argc, argv) || !batch_localmax_merge(g, store))
+        return 1;
+    if (p.centroids != NULL) {
+        if (!zarr_create(maps, store, "celltype_maps", maps.shape, maps.chunks, "<i8", sizeof(int64_t), "0") ||
+            !zarr_create(corrs, store, "max_correlations", corrs.shape, corrs.chunks, "<f8", sizeof(double), "0.0") ||
+            !batch_run("celltypes", tx, p, g, store, argc, argv))
+            return 1;
+        fprintf(stderr, "Cell types: %ld centroids mapped\n", ncent);
+    }
+    return zarr_remove(store + "/.batch") ? 0 : 1;
+}
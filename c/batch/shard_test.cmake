@@ -0,0 +1,45 @@
+# Runs the batch pipeline on synthetic data (written by ssam_bench) with one
+# and with several shards, and checks that both write the same store, byte
+# for byte. Run by ctest with -DBENCH=, -DBATCH= (the programs) and -DWORK=
+# (a scratch directory).
+function(shard_test_run)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE rc OUTPUT_QUIET ERROR_VARIABLE err)
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "${ARGN} failed (${rc}):\n${err}")
+    endif()
+endfunction()
+
+function(shard_test_files store out)
+    file(GLOB_RECURSE files RELATIVE ${store} LIST_DIRECTORIES false ${store}/*)
+    list(SORT files)
+    set(${out} ${files} PARENT_SCOPE)
+endfunction()
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+# A 2D and a 3D grid, both split into many chunks so that every shard
+# boundary needs halos
+foreach(shape 96x80 40x36x12)
+    set(dir ${WORK}/${shape})
+    file(MAKE_DIRECTORY ${dir})
+    shard_test_run(${BENCH} --shape ${shape} --genes 8 --celltypes 4 --cells 80 --points 20000
+                   --transcripts ${dir}/mrnas.trx --centroids ${dir}/centroids.npy)
+    foreach(n 1 3)
+        shard_test_run(${BATCH} --max-chunk-size 20000 --centroids ${dir}/centroids.npy --shards ${n} --threads 1
+                       ${dir}/mrnas.trx ${dir}/shards${n}.zarr)
+    endforeach()
+    shard_test_files(${dir}/shards1.zarr one)
+    shard_test_files(${dir}/shards3.zarr three)
+    if(NOT one STREQUAL three)
+        message(FATAL_ERROR "${shape}: the stores hold different files")
+    endif()
+    list(LENGTH one nfiles)
+    foreach(f ${one})
+        file(SHA256 ${dir}/shards1.zarr/${f} a)
+        file(SHA256 ${dir}/shards3.zarr/${f} b)
+        if(NOT a STREQUAL b)
+            message(FATAL_ERROR "${shape}: ${f} differs between 1 and 3 shards")
+        endif()
+    endforeach()
+    message(STATUS "${shape}: ${nfiles} files identical with 1 and 3 shards")
+endforeach()
@@ -0,0 +1,144 @@
+// Columnar transcript files, the input of the batch pipeline. Written by
+// ssam.write_transcripts() and memory-mapped here, so that the columns are
+// read straight from the page cache without parsing.
+//
+// Layout (little-endian), every section starting at a multiple of 64 bytes:
+//   header  "SSAMTRX1", uint64 npts, uint32 ngene, uint32 ndim (2 or 3),
+//           uint32 coord_size (4 or 8), uint32 reserved,
+//           float64 width, height, depth (um), uint64 names_bytes
+//   names   ngene NUL-terminated UTF-8 gene names, sorted; a transcript's
+//           gene code is the index of its name
+//   gene    int32[npts] gene codes
+//   x, y    float32 or float64 [npts] coordinates (um)
+//   z       only if ndim == 3
+#ifndef SSAM_BATCH_TRANSCRIPTS_H
+#define SSAM_BATCH_TRANSCRIPTS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define TX_MAGIC "SSAMTRX1"
+#define TX_ALIGN 64
+
+struct tx_header {
+    char magic[8];
+    uint64_t npts;
+    uint32_t ngene, ndim;
+    uint32_t coord_size, reserved;
+    double extent[3];
+    uint64_t names_bytes;
+};
+
+struct tx_file {
+    void *base = NULL;
+    size_t size = 0;
+    long npts = 0;
+    int ndim = 0;
+    double extent[3] = { 0, 0, 0 };
+    std::vector<std::string> genes;
+    const int32_t *gene = NULL;
+    const void *coords[3] = { NULL, NULL, NULL };
+    int coord_size = 0;
+
+    // Coordinate of transcript i along axis a (0 for z in 2D)
+    double coord(int a, long i) const {
+        if (coords[a] == NULL)
+            return 0;
+        return (coord_size == 8) ? ((const double *)coords[a])[i] : (double)((const float *)coords[a])[i];
+    }
+};
+
+inline size_t tx_align(size_t n) {
+    return (n + TX_ALIGN - 1) / TX_ALIGN * TX_ALIGN;
+}
+
+inline void tx_close(tx_file &f) {
+    if (f.base != NULL)
+        munmap(f.base, f.size);
+    f = tx_file();
+}
+
+// Maps a transcript file and checks its layout. Returns false (with a
+// message on stderr) if the file cannot be read or is malformed.
+inline bool tx_open(tx_file &f, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    f.size = st.st_size;
+    if (f.size < sizeof(tx_header)) {
+        fprintf(stderr, "%s: not a transcript file\n", path);
+        close(fd);
+        return false;
+    }
+    f.base = mmap(NULL, f.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (f.base == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        f.base = NULL;
+        return false;
+    }
+    madvise(f.base, f.size, MADV_WILLNEED);
+
+    const char *p = (const char *)f.base;
+    const tx_header *h = (const tx_header *)p;
+    if (memcmp(h->magic, TX_MAGIC, 8) != 0 || (h->ndim != 2 && h->ndim != 3) ||
+        (h->coord_size != 4 && h->coord_size != 8) || h->npts >= INT32_MAX) {
+        fprintf(stderr, "%s: not a transcript file\n", path);
+        tx_close(f);
+        return false;
+    }
+    f.npts = h->npts;
+    f.ndim = h->ndim;
+    f.coord_size = h->coord_size;
+    memcpy(f.extent, h->extent, sizeof(f.extent));
+
+    size_t off = tx_align(sizeof(tx_header));
+    size_t names_end = off + h->names_bytes;
+    size_t need = tx_align(names_end) + tx_align(f.npts * sizeof(int32_t)) + (f.ndim - 1) * tx_align(f.npts * f.coord_size) + f.npts * f.coord_size;
+    if (names_end > f.size || need > f.size) {
+        fprintf(stderr, "%s: truncated transcript file\n", path);
+        tx_close(f);
+        return false;
+    }
+    while (off < names_end) {
+        size_t len = strnlen(p + off, names_end - off);
+        f.genes.push_back(std::string(p + off, len));
+        off += len + 1;
+    }
+    if (f.genes.size() != h->ngene) {
+        fprintf(stderr, "%s: expected %u gene names, found %zu\n", path, h->ngene, f.genes.size());
+        tx_close(f);
+        return false;
+    }
+    off = tx_align(names_end);
+    f.gene = (const int32_t *)(p + off);
+    off += tx_align(f.npts * sizeof(int32_t));
+    for (int a = 0; a < f.ndim; a++) {
+        f.coords[a] = p + off;
+        off += tx_align(f.npts * f.coord_size);
+    }
+    for (long i = 0; i < f.npts; i++) {
+        if (f.gene[i] < 0 || f.gene[i] >= (int32_t)h->ngene) {
+            fprintf(stderr, "%s: gene code %d of transcript %ld is out of range\n", path, f.gene[i], i);
+            tx_close(f);
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,255 @@
+// A minimal Zarr v2 directory store: groups, and uncompressed C-order arrays
+// written and read chunk by chunk. Enough for the batch pipeline to write the
+// arrays SSAMDataset opens (zarr.DirectoryStore reads uncompressed chunks
+// like any other) and to read back the vector field it wrote.
+#ifndef SSAM_BATCH_ZARR_H
+#define SSAM_BATCH_ZARR_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct zarr_array {
+    std::string path;
+    std::vector<long> shape, chunks;
+    size_t itemsize;
+
+    int ndim() const { return (int)shape.size(); }
+    long nchunks(int a) const { return (shape[a] + chunks[a] - 1) / chunks[a]; }
+};
+
+static bool zarr_write_file(const std::string &path, const void *data, size_t size) {
+    FILE *f = fopen(path.c_str(), "wb");
+    bool ok = f != NULL && fwrite(data, 1, size, f) == size;
+
+    if (f != NULL && fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    return ok;
+}
+
+static int zarr_remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    return remove(path);
+}
+
+// Removes a (possibly missing) array or group with everything in it
+static bool zarr_remove(const std::string &path) {
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+        return true;
+    if (nftw(path.c_str(), zarr_remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Opens a group, creating it if it does not exist
+static bool zarr_group(const std::string &path) {
+    static const char zgroup[] = "{\n    \"zarr_format\": 2\n}\n";
+    struct stat st;
+
+    if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    if (stat((path + "/.zgroup").c_str(), &st) == 0)
+        return true;
+    return zarr_write_file(path + "/.zgroup", zgroup, sizeof(zgroup) - 1);
+}
+
+static std::string zarr_json_list(const std::vector<long> &v) {
+    std::string s = "[";
+    for (size_t i = 0; i < v.size(); i++)
+        s += (i ? ", " : "") + std::to_string(v[i]);
+    return s + "]";
+}
+
+// Shortest decimal that reads back as v, like Python's repr()
+static std::string zarr_json_number(double v) {
+    char buf[32];
+    for (int prec = 1; prec <= 17; prec++) {
+        snprintf(buf, sizeof(buf), "%.*g", prec, v);
+        if (strtod(buf, NULL) == v)
+            break;
+    }
+    return buf;
+}
+
+// Creates (or replaces) the array name of a group. dtype is a numpy type
+// string ("<f4", "|b1", "<U12", ...) and fill_value its JSON fill value.
+static bool zarr_create(zarr_array &a, const std::string &group, const std::string &name, const std::vector<long> &shape,
+                        const std::vector<long> &chunks, const char *dtype, size_t itemsize, const char *fill_value) {
+    a.path = group + "/" + name;
+    a.shape = shape;
+    a.chunks = chunks;
+    a.itemsize = itemsize;
+    for (long &c : a.chunks)
+        c = std::max(c, 1L);
+    if (!zarr_remove(a.path))
+        return false;
+    if (mkdir(a.path.c_str(), 0777) != 0) {
+        fprintf(stderr, "%s: %s\n", a.path.c_str(), strerror(errno));
+        return false;
+    }
+    std::string meta = "{\n"
+        "    \"chunks\": " + zarr_json_list(a.chunks) + ",\n"
+        "    \"compressor\": null,\n"
+        "    \"dtype\": \"" + dtype + "\",\n"
+        "    \"fill_value\": " + fill_value + ",\n"
+        "    \"filters\": null,\n"
+        "    \"order\": \"C\",\n"
+        "    \"shape\": " + zarr_json_list(a.shape) + ",\n"
+        "    \"zarr_format\": 2\n"
+        "}\n";
+    return zarr_write_file(a.path + "/.zarray", meta.data(), meta.size());
+}
+
+static std::string zarr_chunk_path(const zarr_array &a, const long *cidx) {
+    std::string s = a.path + "/";
+    for (int d = 0; d < a.ndim(); d++)
+        s += (d ? "." : "") + std::to_string(cidx[d]);
+    return s;
+}
+
+// Copies the box ext of an nd C-order array (src, of shape sdims) at sorg to
+// dorg in another one (dst, of shape ddims), one contiguous run at a time.
+// Without src, the box of dst is zeroed.
+static void zarr_copy_box(char *dst, const long *ddims, const long *dorg, const char *src, const long *sdims, const long *sorg,
+                          const long *ext, int nd, size_t itemsize) {
+    std::vector<long> idx(nd, 0);
+    size_t run = ext[nd - 1] * itemsize;
+
+    for (int d = 0; d < nd; d++)
+        if (ext[d] <= 0)
+            return;
+    while (true) {
+        long doff = 0, soff = 0;
+        for (int d = 0; d < nd; d++) {
+            doff = doff * ddims[d] + dorg[d] + idx[d];
+            soff = soff * sdims[d] + sorg[d] + idx[d];
+        }
+        if (src != NULL)
+            memcpy(dst + doff * itemsize, src + soff * itemsize, run);
+        else
+            memset(dst + doff * itemsize, 0, run);
+        int d = nd - 2;
+        while (d >= 0 && ++idx[d] == ext[d])
+            idx[d--] = 0;
+        if (d < 0)
+            break;
+    }
+}
+
+// Writes the chunk cidx from a C-order block of its (possibly clipped) extent
+// ext; edge chunks are padded to the chunk shape with zeros.
+static bool zarr_write_chunk(const zarr_array &a, const long *cidx, const void *data, const long *ext) {
+    const int nd = a.ndim();
+    size_t n = a.itemsize;
+    bool full = true;
+
+    for (int d = 0; d < nd; d++) {
+        n *= a.chunks[d];
+        full = full && ext[d] == a.chunks[d];
+    }
+    if (full)
+        return zarr_write_file(zarr_chunk_path(a, cidx), data, n);
+    std::vector<char> buf(n, 0);
+    std::vector<long> zero(nd, 0);
+    zarr_copy_box(buf.data(), a.chunks.data(), zero.data(), (const char *)data, ext, zero.data(), ext, nd, a.itemsize);
+    return zarr_write_file(zarr_chunk_path(a, cidx), buf.data(), n);
+}
+
+// Writes a whole array held in memory (C order)
+static bool zarr_write_all(const zarr_array &a, const void *data) {
+    const int nd = a.ndim();
+    std::vector<long> cidx(nd, 0), org(nd), ext(nd), zero(nd, 0);
+    size_t n = a.itemsize;
+
+    for (int d = 0; d < nd; d++)
+        n *= a.chunks[d];
+    std::vector<char> buf(n);
+    for (int d = 0; d < nd; d++)
+        if (a.shape[d] == 0)
+            return true;
+    while (true) {
+        for (int d = 0; d < nd; d++) {
+            org[d] = cidx[d] * a.chunks[d];
+            ext[d] = std::min(a.chunks[d], a.shape[d] - org[d]);
+        }
+        std::fill(buf.begin(), buf.end(), 0);
+        zarr_copy_box(buf.data(), a.chunks.data(), zero.data(), (const char *)data, a.shape.data(), org.data(), ext.data(), nd, a.itemsize);
+        if (!zarr_write_file(zarr_chunk_path(a, cidx.data()), buf.data(), n))
+            return false;
+        int d = nd - 1;
+        while (d >= 0 && ++cidx[d] == a.nchunks(d))
+            cidx[d--] = 0;
+        if (d < 0)
+            return true;
+    }
+}
+
+// Reads the box ext at org into out (C order), memory-mapping the chunks it
+// overlaps. Missing chunks read as zeros (the fill value of the arrays
+// written here).
+static bool zarr_read(const zarr_array &a, const long *org, const long *ext, void *out) {
+    const int nd = a.ndim();
+    std::vector<long> c0(nd), c1(nd), cidx(nd), sorg(nd), dorg(nd), bext(nd);
+    size_t n = a.itemsize, total = a.itemsize;
+
+    for (int d = 0; d < nd; d++) {
+        n *= a.chunks[d];
+        total *= ext[d];
+        c0[d] = org[d] / a.chunks[d];
+        c1[d] = (org[d] + ext[d] - 1) / a.chunks[d];
+        cidx[d] = c0[d];
+    }
+    if (total == 0)
+        return true;
+    while (true) {
+        std::string path = zarr_chunk_path(a, cidx.data());
+        for (int d = 0; d < nd; d++) {
+            long lo = std::max(org[d], cidx[d] * a.chunks[d]);
+            long hi = std::min(org[d] + ext[d], (cidx[d] + 1) * a.chunks[d]);
+            sorg[d] = lo - cidx[d] * a.chunks[d];
+            dorg[d] = lo - org[d];
+            bext[d] = hi - lo;
+        }
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0 && errno != ENOENT) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        if (fd < 0) {
+            zarr_copy_box((char *)out, ext, dorg.data(), NULL, a.chunks.data(), sorg.data(), bext.data(), nd, a.itemsize);
+        } else {
+            struct stat st;
+            void *p = (fstat(fd, &st) == 0 && (size_t)st.st_size == n) ? mmap(NULL, n, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (p == MAP_FAILED) {
+                fprintf(stderr, "%s: not an uncompressed chunk of %zu bytes\n", path.c_str(), n);
+                return false;
+            }
+            zarr_copy_box((char *)out, ext, dorg.data(), (const char *)p, a.chunks.data(), sorg.data(), bext.data(), nd, a.itemsize);
+            munmap(p, n);
+        }
+        int d = nd - 1;
+        while (d >= 0 && ++cidx[d] > c1[d])
+            cidx[d] = c0[d], d--;
+        if (d < 0)
+            return true;
+    }
+}
+
+#endif
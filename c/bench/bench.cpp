@@ -0,0 +1,411 @@
+// Benchmarks of the native kernels (kernels.h) on synthetic data.
+//
+// The kernels come from the header-only library kernels.h, so the
+// benchmarks run without Python. Build with CMake from the repository root:
+//
+//   cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build
+//   build/ssam_bench --shape 512x512 --threads 1,2,4 --json bench.json
+//
+// Every case is run once to warm up and then --repeat times per thread
+// count; the minimum and median wall times are reported with the
+// throughput (items/s, GB/s of vector field read) and the speedup over the
+// first thread count. Run with --list for the cases, --filter to pick some.
+// With --transcripts or --centroids, the synthetic data is written as input
+// of the batch pipeline (c/batch) instead.
+#include "../kernels.h"
+#include "../batch/transcripts.h"
+#include "synth.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <chrono>
+#include <functional>
+#include <string>
+
+struct bench_case {
+    const char *name;
+    const char *unit;     // what items counts
+    double items;         // processed per run
+    double bytes;         // vector field (or transcript) bytes read per run
+    std::function<void(int)> run;
+};
+
+struct bench_result {
+    std::string name;
+    const char *unit;
+    int threads;
+    double min_s, median_s, items, bytes, speedup;
+};
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --shape XxY[xZ]    grid shape (default 512x512)\n"
+            "  --genes N          number of genes (default 64)\n"
+            "  --celltypes N      number of cell types (default 12)\n"
+            "  --cells N          number of cells (default 4000)\n"
+            "  --points N         number of transcripts (default 1000000)\n"
+            "  --radius R         transcript spread around a cell in voxels (default 4)\n"
+            "  --seed N           generator seed (default 1)\n"
+            "  --bandwidth H      KDE bandwidth (default 2.5)\n"
+            "  --threads LIST     comma-separated thread counts (default 1 and the maximum)\n"
+            "  --repeat N         timed runs per case and thread count (default 3)\n"
+            "  --filter LIST      comma-separated substrings of the cases to run\n"
+            "  --simd LEVEL       scalar, avx2 or avx512 (default: detected)\n"
+            "  --json FILE        write the results as JSON\n"
+            "  --list             list the cases and exit\n"
+            "  --transcripts FILE write the transcripts as a transcript file and exit\n"
+            "  --centroids FILE   write the cell type profiles as a .npy array and exit\n", prog);
+}
+
+static bool bench_parse_list(const char *s, std::vector<long> &out) {
+    char *end;
+    out.clear();
+    while (*s) {
+        long v = strtol(s, &end, 10);
+        if (end == s || v < 1)
+            return false;
+        out.push_back(v);
+        s = (*end == ',' || *end == 'x') ? end + 1 : end;
+        if (*end && *end != ',' && *end != 'x')
+            return false;
+    }
+    return out.size() > 0;
+}
+
+// Writes the transcripts in the layout of c/batch/transcripts.h, with the
+// genes named gene0000, gene0001, ... so that the codes are in name order.
+static bool bench_write_transcripts(const char *path, const synth_data &d) {
+    static const char zeros[TX_ALIGN] = { 0 };
+    tx_header h;
+    std::string names;
+    std::vector<char> buf;
+    FILE *f = fopen(path, "wb");
+
+    for (long g = 0; g < d.p.ngene; g++) {
+        char name[32];
+        snprintf(name, sizeof(name), "gene%04ld", g);
+        names.append(name, strlen(name) + 1);
+    }
+    memcpy(h.magic, TX_MAGIC, 8);
+    h.npts = d.p.npts;
+    h.ngene = d.p.ngene;
+    h.ndim = d.nd;
+    h.coord_size = sizeof(double);
+    h.reserved = 0;
+    for (int a = 0; a < 3; a++)
+        h.extent[a] = d.p.shape[a];
+    h.names_bytes = names.size();
+    auto section = [&](const void *data, size_t n) {
+        return fwrite(data, 1, n, f) == n && fwrite(zeros, 1, tx_align(n) - n, f) == tx_align(n) - n;
+    };
+    const std::vector<double> *coords[3] = { &d.x, &d.y, &d.z };
+    bool ok = f != NULL && section(&h, sizeof(h)) && section(names.data(), names.size()) &&
+              section(d.gene.data(), d.p.npts * sizeof(int32_t));
+    for (int a = 0; ok && a < d.nd; a++)
+        ok = section(coords[a]->data(), d.p.npts * sizeof(double));
+    if (f != NULL && fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return ok;
+}
+
+// Writes the cell type profiles (ncelltype x ngene) as a float64 .npy array
+static bool bench_write_centroids(const char *path, const synth_data &d) {
+    std::string header = "{'descr': '<f8', 'fortran_order': False, 'shape': (" + std::to_string(d.p.ncelltype) + ", " +
+                         std::to_string(d.p.ngene) + "), }";
+    header.append(63 - (10 + header.size()) % 64, ' ');
+    header += '\n';
+    unsigned char pre[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, (unsigned char)(header.size() & 0xff), (unsigned char)(header.size() >> 8) };
+    FILE *f = fopen(path, "wb");
+    bool ok = f != NULL && fwrite(pre, 1, 10, f) == 10 && fwrite(header.data(), 1, header.size(), f) == header.size() &&
+              fwrite(d.profiles.data(), sizeof(double), d.profiles.size(), f) == d.profiles.size();
+
+    if (f != NULL && fclose(f) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return ok;
+}
+
+static bool bench_match(const std::string &name, const std::vector<std::string> &filters) {
+    if (filters.empty())
+        return true;
+    for (const std::string &f : filters)
+        if (name.find(f) != std::string::npos)
+            return true;
+    return false;
+}
+
+static void bench_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void bench_write_json(FILE *f, const synth_params &p, double h, int repeat, const std::vector<bench_result> &results) {
+    fprintf(f, "{\n  \"schema\": 1,\n  \"params\": {\"shape\": [%ld, %ld, %ld], \"genes\": %ld, \"celltypes\": %ld, \"cells\": %ld, "
+               "\"points\": %ld, \"radius\": %g, \"seed\": %llu, \"bandwidth\": %g, \"repeat\": %d},\n",
+            p.shape[0], p.shape[1], p.shape[2], p.ngene, p.ncelltype, p.ncell, p.npts, p.cell_radius,
+            (unsigned long long)p.seed, h, repeat);
+    fprintf(f, "  \"system\": {\"simd\": \"%s\", \"max_threads\": %d, \"compiler\": ", simd_names[simd_level], omp_get_max_threads());
+    bench_json_string(f, __VERSION__);
+    fprintf(f, "},\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result &r = results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"threads\": %d, \"min_s\": %.6g, \"median_s\": %.6g, \"unit\": \"%s\", \"items\": %.0f, "
+                   "\"items_per_s\": %.6g, \"gb_per_s\": %.6g, \"speedup\": %.4g}%s\n",
+                r.name.c_str(), r.threads, r.min_s, r.median_s, r.unit, r.items, r.items / r.min_s,
+                r.bytes / r.min_s * 1e-9, r.speedup, (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    synth_params p;
+    double h = 2.5, prune_coeff = 4.0;
+    int repeat = 3;
+    bool list = false;
+    const char *json = NULL, *transcripts = NULL, *centroids = NULL;
+    std::vector<long> threads = { 1 }, shape;
+    std::vector<std::string> filters;
+
+    simd_level = simd_detect();
+    if (omp_get_max_threads() > 1)
+        threads.push_back(omp_get_max_threads());
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        bool ok = true;
+        if (a == "--list") {
+            list = true;
+            continue;
+        }
+        if (v == NULL) {
+            bench_usage(argv[0]);
+            return 2;
+        }
+        i++;
+        if (a == "--shape") {
+            ok = bench_parse_list(v, shape) && shape.size() >= 2 && shape.size() <= 3;
+            for (size_t d = 0; ok && d < 3; d++)
+                p.shape[d] = (d < shape.size()) ? shape[d] : 1;
+        } else if (a == "--genes") {
+            ok = (p.ngene = atol(v)) > 0;
+        } else if (a == "--celltypes") {
+            ok = (p.ncelltype = atol(v)) > 0;
+        } else if (a == "--cells") {
+            ok = (p.ncell = atol(v)) > 0;
+        } else if (a == "--points") {
+            ok = (p.npts = atol(v)) > 0 && p.npts < INT_MAX;
+        } else if (a == "--radius") {
+            ok = (p.cell_radius = atof(v)) > 0;
+        } else if (a == "--seed") {
+            p.seed = strtoull(v, NULL, 10);
+        } else if (a == "--bandwidth") {
+            ok = (h = atof(v)) > 0;
+        } else if (a == "--threads") {
+            ok = bench_parse_list(v, threads);
+        } else if (a == "--repeat") {
+            ok = (repeat = atoi(v)) > 0;
+        } else if (a == "--filter") {
+            std::string s = v;
+            for (size_t b = 0, e; b <= s.size(); b = e + 1) {
+                e = s.find(',', b);
+                if (e == std::string::npos)
+                    e = s.size();
+                if (e > b)
+                    filters.push_back(s.substr(b, e - b));
+            }
+        } else if (a == "--simd") {
+            int level = -1;
+            for (int l = 0; simd_names[l] != NULL; l++)
+                if (simd_names[l] == std::string(v))
+                    level = l;
+            ok = level >= 0 && level <= simd_detect();
+            simd_level = ok ? level : simd_level;
+        } else if (a == "--json") {
+            json = v;
+        } else if (a == "--transcripts") {
+            transcripts = v;
+        } else if (a == "--centroids") {
+            centroids = v;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Invalid option: %s %s\n", a.c_str(), v);
+            bench_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    synth_data d;
+    if (!list) {
+        auto t0 = std::chrono::steady_clock::now();
+        synth_generate(d, p);
+        fprintf(stderr, "Generated %ld transcripts and a %ldx%ldx%ldx%ld vector field in %.2f s\n", p.npts,
+                p.shape[0], p.shape[1], p.shape[2], p.ngene,
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        if (transcripts != NULL || centroids != NULL) {
+            bool ok = (transcripts == NULL || bench_write_transcripts(transcripts, d)) &&
+                      (centroids == NULL || bench_write_centroids(centroids, d));
+            return ok ? 0 : 1;
+        }
+    }
+
+    const long nvox = p.shape[0] * p.shape[1] * p.shape[2];
+    const long ngene = p.ngene;
+    const double vf_bytes = (double)nvox * ngene * sizeof(float);
+    const double pts_bytes = (double)p.npts * 3 * sizeof(double);
+    const intptr_t vf_dims[4] = { p.shape[0], p.shape[1], p.shape[2], ngene };
+    const long dims[3] = { p.shape[0], p.shape[1], p.shape[2] };
+    int ishape[3] = { (int)p.shape[0], (int)p.shape[1], (int)p.shape[2] };
+    int borg[3] = { 0, 0, 0 };
+    // Scratch shared by the cases; sized on first use
+    std::vector<double> map, out;
+    std::vector<float> unit;
+    std::vector<double> norms;
+    std::vector<kde_part> parts;
+    std::vector<std::vector<kde_part> > binned;
+    std::vector<int> idx;
+
+    std::vector<bench_case> cases = {
+        { "kde_separable", "points", (double)p.npts, pts_bytes, [&](int nc) {
+            kde(parts, d.x.data(), d.y.data(), d.z.data(), ishape, p.npts, h, prune_coeff, KDE_KERNEL_GAUSSIAN_SEPARABLE, nc);
+        } },
+        { "kde_exact", "points", (double)p.npts, pts_bytes, [&](int nc) {
+            kde(parts, d.x.data(), d.y.data(), d.z.data(), ishape, p.npts, h, prune_coeff, KDE_KERNEL_GAUSSIAN, nc);
+        } },
+        { "kde_binned", "points", (double)p.npts, pts_bytes, [&](int nc) {
+            kde_binned_parts(binned, d.x.data(), d.y.data(), d.z.data(), ishape, p.npts, &h, 1, prune_coeff, nc);
+        } },
+        { "kde_multi", "voxels", (double)nvox, pts_bytes, [&](int nc) {
+            out.assign(nvox * ngene, 0.0);
+            kde_multi(out.data(), d.gene.data(), d.x.data(), d.y.data(), d.z.data(), ishape, borg, ishape,
+                      ngene, p.npts, h, prune_coeff, KDE_KERNEL_GAUSSIAN_SEPARABLE, nc);
+        } },
+        { "corr", "pairs", (double)(nvox - 1), vf_bytes, [&](int nc) {
+            map.resize(nvox);
+            #pragma omp parallel for num_threads(nc)
+            for (long i = 0; i < nvox - 1; i++)
+                map[i] = __corr__(&d.vf[i * ngene], &d.vf[(i + 1) * ngene], ngene);
+        } },
+        { "unit_vectors", "voxels", (double)nvox, vf_bytes, [&](int nc) {
+            unit.resize(nvox * ngene);
+            norms.resize(nvox);
+            unit_vf(unit.data(), norms.data(), d.vf.data(), nvox, ngene, nc);
+        } },
+        { "corrmap_direct", "voxels", (double)nvox, vf_bytes, [&](int nc) {
+            map.assign(nvox, NAN);
+            corrmap_vf(map.data(), d.vf.data(), (const double *)NULL, vf_dims, d.nd + 1, ngene, 1, nc);
+        } },
+        { "corrmap_sliding", "voxels", (double)nvox, vf_bytes, [&](int nc) {
+            map.assign(nvox, NAN);
+            corrmap_sliding_vf(map.data(), d.vf.data(), (const double *)NULL, vf_dims, d.nd + 1, ngene, 1, nc);
+        } },
+        { "corrmap_unit", "voxels", (double)nvox, vf_bytes, [&](int nc) {
+            if (unit.size() != (size_t)(nvox * ngene)) {
+                unit.resize(nvox * ngene);
+                norms.resize(nvox);
+                unit_vf(unit.data(), norms.data(), d.vf.data(), nvox, ngene, nc);
+            }
+            map.assign(nvox, NAN);
+            corrmap_sliding_vf(map.data(), unit.data(), norms.data(), vf_dims, d.nd + 1, ngene, 1, nc);
+        } },
+        { "ctmap", "voxels", (double)nvox, vf_bytes, [&](int nc) {
+            map.resize(nvox);
+            ctmap_vf(map.data(), d.profiles.data(), d.vf.data(), nvox, ngene, false, nc);
+        } },
+        { "ctmap_multi", "voxels", (double)nvox, vf_bytes, [&](int nc) {
+            std::vector<double> cent, csum;
+            long ncp = ctmap_pack(cent, csum, d.profiles.data(), p.ncelltype, ngene);
+            map.resize(nvox);
+            idx.resize(nvox);
+            ctmap_multi_vf(map.data(), idx.data(), d.vf.data(), cent.data(), csum.data(), nvox, ngene, p.ncelltype, ncp, 1, nc);
+        } },
+        { "flood_fill", "seeds", (double)p.ncell, vf_bytes, [&](int nc) {
+            #pragma omp parallel num_threads(nc)
+            {
+                std::vector<long> region;
+                #pragma omp for schedule(dynamic)
+                for (long c = 0; c < p.ncell; c++) {
+                    const double *pos = &d.cells[c * 3];
+                    long seed = I3D((long)pos[0], (long)pos[1], (long)pos[2], dims[1], dims[2]);
+                    flood_grow(region, d.vf.data(), seed, dims, ngene, 0.6, 2000, false);
+                }
+            }
+        } },
+        { "normalize", "voxels", (double)nvox, vf_bytes, [&](int nc) {
+            gene_moments moments;
+            std::vector<float> normalized(nvox * ngene);
+            moments.count = 0;
+            moments.mean.assign(ngene, 0.0);
+            moments.m2.assign(ngene, 0.0);
+            normalize_vf(normalized.data(), moments, d.vf.data(), nvox, ngene, 1.0, true, false, true, 0.0, nc);
+        } },
+        { "knn_graph", "vectors", (double)std::min(nvox, 20000L), 0, [&](int nc) {
+            // Stands in for the local maxima sampled for clustering: every
+            // nth voxel, skipping the empty ones
+            std::vector<float> vecs;
+            for (long i = 0, step = std::max(1L, nvox / 20000); i < nvox && (long)vecs.size() < 20000 * ngene; i += step)
+                if (*std::max_element(&d.vf[i * ngene], &d.vf[(i + 1) * ngene]) > 0)
+                    vecs.insert(vecs.end(), &d.vf[i * ngene], &d.vf[(i + 1) * ngene]);
+            long n = vecs.size() / ngene;
+            const int K = (int)std::min(29L, n - 1);
+            knn_index x;
+            knn_prepare(x, vecs.data(), n, ngene, KNN_CORRELATION, nc);
+            std::vector<int> ids(n * K, -1);
+            std::vector<double> dists(n * K, INFINITY);
+            knn_descent(ids.data(), dists.data(), x, K, 0, nc);
+        } },
+    };
+
+    if (list) {
+        for (const bench_case &c : cases)
+            printf("%s\n", c.name);
+        return 0;
+    }
+
+    std::vector<bench_result> results;
+    printf("%-16s %7s %10s %10s %14s %9s %8s\n", "case", "threads", "min (s)", "median (s)", "items/s", "GB/s", "speedup");
+    for (const bench_case &c : cases) {
+        if (!bench_match(c.name, filters))
+            continue;
+        double base = 0;
+        for (long nc : threads) {
+            std::vector<double> times;
+            c.run((int)nc); // warm-up
+            for (int r = 0; r < repeat; r++) {
+                auto t0 = std::chrono::steady_clock::now();
+                c.run((int)nc);
+                times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+            }
+            std::sort(times.begin(), times.end());
+            bench_result r = { c.name, c.unit, (int)nc, times[0], times[times.size() / 2], c.items, c.bytes, 1.0 };
+            if (base == 0)
+                base = r.min_s;
+            r.speedup = base / r.min_s;
+            printf("%-16s %7d %10.4f %10.4f %14.4g %9.3f %8.2f\n", r.name.c_str(), r.threads, r.min_s, r.median_s,
+                   r.items / r.min_s, r.bytes / r.min_s * 1e-9, r.speedup);
+            fflush(stdout);
+            results.push_back(r);
+        }
+    }
+
+    if (json != NULL) {
+        FILE *f = fopen(json, "w");
+        if (f == NULL) {
+            perror(json);
+            return 1;
+        }
+        bench_write_json(f, p, h, repeat, results);
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+// Checks flood_grow() (kernels.h) on a small grid where the region reaches
+// the first row and column (x = 0, y = 0) from index 1 and grows along +z,
+// the neighbours the flood fill once missed. Run by ctest; exits non-zero
+// with a message on stderr if a region differs from the expected voxels.
+#include "../kernels.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+// Voxels of region get the profile 1, 2, 3, 4 and all others 4, 3, 2, 1
+// (correlation -1), so that flood_grow() from seed should return region.
+static bool flood_check(const char *name, const long *dims, long seed, std::vector<long> region, long max_pixels, bool expect_ok) {
+    const long ngene = 4;
+    long nvox = dims[0] * dims[1] * dims[2];
+    std::vector<float> vf(nvox * ngene);
+    std::vector<long> got;
+
+    for (long v = 0; v < nvox; v++) {
+        bool in = std::find(region.begin(), region.end(), v) != region.end();
+        for (long g = 0; g < ngene; g++)
+            vf[v * ngene + g] = in ? g + 1 : ngene - g;
+    }
+    bool ok = flood_grow(got, vf.data(), seed, dims, ngene, 0.6, max_pixels, false);
+    std::sort(got.begin(), got.end());
+    std::sort(region.begin(), region.end());
+    if (ok != expect_ok || (expect_ok && got != region) || (!expect_ok && (long)got.size() != max_pixels)) {
+        fprintf(stderr, "%s: flood_grow returned %s with", name, ok ? "true" : "false");
+        for (long v : got)
+            fprintf(stderr, " %ld", v);
+        fprintf(stderr, ", expected %s with", expect_ok ? "true" : "false");
+        for (long v : region)
+            fprintf(stderr, " %ld", v);
+        fprintf(stderr, "\n");
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    const long dims3[3] = { 4, 4, 3 }, dims2[3] = { 4, 4, 1 };
+    auto idx3 = [&](long x, long y, long z) { return (x * dims3[1] + y) * dims3[2] + z; };
+    auto idx2 = [&](long x, long y) { return x * dims2[1] + y; };
+    bool ok = true;
+
+    simd_level = simd_detect();
+    // From (1, 1, 0): x - 1 and y - 1 to index 0, then z + 1 twice
+    std::vector<long> region3 = { idx3(1, 1, 0), idx3(0, 1, 0), idx3(1, 0, 0), idx3(1, 1, 1), idx3(1, 1, 2) };
+    ok &= flood_check("3D", dims3, idx3(1, 1, 0), region3, 2000, true);
+    ok &= flood_check("3D, max_pixels", dims3, idx3(1, 1, 0), region3, 3, false);
+    // The same in 2D, where z is skipped; (1, 3) touches the last column
+    std::vector<long> region2 = { idx2(1, 1), idx2(0, 1), idx2(1, 0), idx2(1, 2), idx2(1, 3) };
+    ok &= flood_check("2D", dims2, idx2(1, 1), region2, 2000, true);
+    return ok ? 0 : 1;
+}
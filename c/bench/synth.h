@@ -0,0 +1,185 @@
+// Deterministic synthetic spatial transcriptomics data for the benchmarks.
+//
+// Cells are scattered over the grid and grouped into spatial domains, each
+// dominated by one cell type. Every cell type has its own expression profile
+// (a handful of marker genes over a low background). Transcripts are drawn
+// around the cell centres with a Gaussian spread, and the vector field is the
+// sum of the profiles weighted by a Gaussian of the distance to each cell,
+// which is what a KDE of the transcripts looks like. The output depends only
+// on the parameters (and the seed), never on the thread count.
+#ifndef SSAM_BENCH_SYNTH_H
+#define SSAM_BENCH_SYNTH_H
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+struct synth_params {
+    long shape[3] = { 512, 512, 1 };
+    long ngene = 64;
+    long ncelltype = 12;
+    long ncell = 4000;
+    long npts = 1000000;
+    double cell_radius = 4.0;    // transcript spread around a cell centre
+    double domain_purity = 0.8;  // probability that a cell has its domain's type
+    double noise = 0.05;         // relative multiplicative noise of the vector field
+    uint64_t seed = 1;
+};
+
+struct synth_rng {
+    uint64_t s;
+
+    explicit synth_rng(uint64_t seed) : s(seed) {}
+
+    // splitmix64
+    uint64_t next() {
+        uint64_t z = (s += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    long below(long n) { return (long)(next() % (uint64_t)n); }
+    double normal() {
+        double u = 1.0 - uniform(), v = uniform();
+        return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+    }
+};
+
+struct synth_data {
+    synth_params p;
+    int nd;
+    std::vector<double> profiles;  // ncelltype x ngene, each row sums to 1
+    std::vector<double> cells;     // ncell x 3 centres
+    std::vector<int> cell_type;
+    // Transcripts
+    std::vector<double> x, y, z;
+    std::vector<int> gene;
+    // Vector field, shape[0] x shape[1] x shape[2] x ngene
+    std::vector<float> vf;
+
+    long nvox() const { return p.shape[0] * p.shape[1] * p.shape[2]; }
+};
+
+static void synth_profiles(synth_data &d, synth_rng &rng) {
+    const long ngene = d.p.ngene;
+    const long nmarker = std::max(1L, ngene / 8);
+
+    d.profiles.assign(d.p.ncelltype * ngene, 0.0);
+    for (long t = 0; t < d.p.ncelltype; t++) {
+        double *prof = &d.profiles[t * ngene];
+        double sum = 0;
+        for (long g = 0; g < ngene; g++)
+            prof[g] = 0.05 * rng.uniform();
+        for (long m = 0; m < nmarker; m++)
+            prof[rng.below(ngene)] += 1.0 + 4.0 * rng.uniform();
+        for (long g = 0; g < ngene; g++)
+            sum += prof[g];
+        for (long g = 0; g < ngene; g++)
+            prof[g] /= sum;
+    }
+}
+
+static void synth_cells(synth_data &d, synth_rng &rng) {
+    // One domain per cell type; a cell takes the type of its nearest domain
+    // centre most of the time, so the types form spatial clusters.
+    std::vector<double> domains(d.p.ncelltype * 3, 0.0);
+    for (long t = 0; t < d.p.ncelltype; t++)
+        for (int a = 0; a < d.nd; a++)
+            domains[t * 3 + a] = rng.uniform() * d.p.shape[a];
+
+    d.cells.assign(d.p.ncell * 3, 0.0);
+    d.cell_type.resize(d.p.ncell);
+    for (long c = 0; c < d.p.ncell; c++) {
+        double *pos = &d.cells[c * 3];
+        long best = 0;
+        double bestd = INFINITY;
+        for (int a = 0; a < d.nd; a++)
+            pos[a] = rng.uniform() * (d.p.shape[a] - 1);
+        for (long t = 0; t < d.p.ncelltype; t++) {
+            double dist = 0;
+            for (int a = 0; a < d.nd; a++)
+                dist += (pos[a] - domains[t * 3 + a]) * (pos[a] - domains[t * 3 + a]);
+            if (dist < bestd) {
+                bestd = dist;
+                best = t;
+            }
+        }
+        d.cell_type[c] = (rng.uniform() < d.p.domain_purity) ? (int)best : (int)rng.below(d.p.ncelltype);
+    }
+}
+
+static void synth_transcripts(synth_data &d, synth_rng &rng) {
+    const long ngene = d.p.ngene;
+    std::vector<double> cdf(d.profiles.size());
+
+    for (long t = 0; t < d.p.ncelltype; t++) {
+        double acc = 0;
+        for (long g = 0; g < ngene; g++)
+            cdf[t * ngene + g] = (acc += d.profiles[t * ngene + g]);
+    }
+    d.x.resize(d.p.npts);
+    d.y.resize(d.p.npts);
+    d.z.resize(d.p.npts);
+    d.gene.resize(d.p.npts);
+    for (long i = 0; i < d.p.npts; i++) {
+        long c = rng.below(d.p.ncell);
+        const double *row = &cdf[d.cell_type[c] * ngene];
+        double pos[3] = { 0, 0, 0 };
+        d.gene[i] = (int)std::min(ngene - 1, (long)(std::lower_bound(row, row + ngene, rng.uniform() * row[ngene - 1]) - row));
+        for (int a = 0; a < d.nd; a++) {
+            pos[a] = d.cells[c * 3 + a] + d.p.cell_radius * rng.normal();
+            pos[a] = std::min(std::max(pos[a], 0.0), d.p.shape[a] - 1e-6);
+        }
+        d.x[i] = pos[0];
+        d.y[i] = pos[1];
+        d.z[i] = pos[2];
+    }
+}
+
+static void synth_vf(synth_data &d, synth_rng &rng) {
+    const long ngene = d.p.ngene;
+    const double r = d.p.cell_radius;
+    const long reach = (long)ceil(3 * r);
+    // Expected transcripts per cell, so the field has realistic magnitudes
+    const double scale = (double)d.p.npts / d.p.ncell / pow(sqrt(2 * M_PI) * r, d.nd);
+
+    d.vf.assign(d.nvox() * ngene, 0.0f);
+    for (long c = 0; c < d.p.ncell; c++) {
+        const double *pos = &d.cells[c * 3];
+        const double *prof = &d.profiles[d.cell_type[c] * ngene];
+        long s[3], e[3];
+        for (int a = 0; a < 3; a++) {
+            s[a] = (a < d.nd) ? std::max(0L, (long)pos[a] - reach) : 0;
+            e[a] = (a < d.nd) ? std::min(d.p.shape[a], (long)pos[a] + reach + 1) : 1;
+        }
+        for (long vx = s[0]; vx < e[0]; vx++) {
+            for (long vy = s[1]; vy < e[1]; vy++) {
+                for (long vz = s[2]; vz < e[2]; vz++) {
+                    double dx = vx - pos[0], dy = vy - pos[1], dz = (d.nd == 3) ? vz - pos[2] : 0;
+                    double w = scale * exp(-(dx * dx + dy * dy + dz * dz) / (2 * r * r));
+                    float *v = &d.vf[((vx * d.p.shape[1] + vy) * d.p.shape[2] + vz) * ngene];
+                    for (long g = 0; g < ngene; g++)
+                        v[g] += (float)(w * prof[g]);
+                }
+            }
+        }
+    }
+    for (float &v : d.vf)
+        if (v > 0)
+            v *= (float)(1.0 + d.p.noise * (2 * rng.uniform() - 1));
+}
+
+static void synth_generate(synth_data &d, const synth_params &p) {
+    synth_rng rng(p.seed);
+
+    d.p = p;
+    d.nd = (p.shape[2] > 1) ? 3 : 2;
+    synth_profiles(d, rng);
+    synth_cells(d, rng);
+    synth_transcripts(d, rng);
+    synth_vf(d, rng);
+}
+
+#endif
@@ -0,0 +1,2744 @@
+// The native kernels of SSAM: kernel density estimation, correlation and
+// cell type maps, local maxima, normalization, nearest neighbour graphs and
+// the block-sparse vector field. They depend only on the C++ standard library
+// and OpenMP, and work on plain C arrays, so that they can be used without
+// Python: the module (utils.cpp) wraps them for NumPy, and the benchmarks and
+// the batch pipeline (c/bench, c/batch) call them directly.
+//
+// This is a header-only library (C++17). Functions are inline and the shared
+// state (SIMD level, thread budget, statistics) lives in inline variables, so
+// a program has one copy of it however many translation units include this.
+#ifndef SSAM_KERNELS_H
+#define SSAM_KERNELS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <complex>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#else
+typedef int omp_int_t;
+inline omp_int_t omp_get_thread_num() { return 0;}
+inline omp_int_t omp_get_max_threads() { return 1;}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h> // AVX intrinsics
+#else
+#define SIMD_X86 0
+#endif
+
+#define I2D(X, Y, YL) ((X) * (YL) + (Y))
+#define I3D(X, Y, Z, YL, ZL) (((X) * (YL) * (ZL)) + ((Y) * (ZL)) + (Z))
+
+struct pos3d {
+    long x;
+    long y;
+    long z;
+};
+
+// SIMD kernels are compiled for each instruction set with target attributes
+// and picked at run time, so the module runs on any x86-64 CPU. The SIMD
+// variants use the same lane layout and explicit FMAs (the module is built
+// with -ffp-contract=off), so they return bit-identical results. The scalar
+// fallbacks multiply and add separately, since fma() is a slow library call
+// on CPUs without FMA, and may differ from them in the last bit.
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+
+inline const char *simd_names[] = { "scalar", "avx2", "avx512", NULL };
+inline int simd_level = SIMD_SCALAR;
+
+inline int simd_detect() {
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+#if SIMD_X86
+__attribute__((target("avx2,fma"))) inline __m256d simd_load4(const double *p) { return _mm256_loadu_pd(p); }
+__attribute__((target("avx2,fma"))) inline __m256d simd_load4(const float *p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+__attribute__((target("avx512f"))) inline __m512d simd_load8(const double *p) { return _mm512_loadu_pd(p); }
+__attribute__((target("avx512f"))) inline __m512d simd_load8(const float *p) { return _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(p)); } // maskz avoids a spurious -Wmaybe-uninitialized in GCC 12
+#endif
+
+// Budget of threads shared by all concurrent calls into the module (0 for no
+// limit). Every call releases the GIL for its compute section and leases up
+// to ncores threads from the budget for it; a call gets at least one thread,
+// so it never waits for the others.
+inline std::mutex thread_lock;
+inline int thread_budget = 0;
+inline int threads_leased = 0;
+
+inline int threads_lease(int ncores) {
+    std::lock_guard<std::mutex> lock(thread_lock);
+    if (ncores < 1)
+        ncores = 1;
+    if (thread_budget > 0)
+        ncores = std::max(1, std::min(ncores, thread_budget - threads_leased));
+    threads_leased += ncores;
+    return ncores;
+}
+
+inline void threads_return(int ncores) {
+    std::lock_guard<std::mutex> lock(thread_lock);
+    threads_leased -= ncores;
+}
+
+// Runtime instrumentation, off by default (stats_on). Every entry point keeps
+// a stats_call on its stack, which times the call and gathers its
+// counters. The worksharing loops of the kernels report when each thread
+// finished its share through a stats_loop; the rest of the loop's wall time
+// is that thread's idle time (load imbalance). Only the calling thread sees
+// the active call, so the counters are updated from outside the parallel
+// regions, or through the loop. While the statistics are off, all this
+// costs a branch per call and per loop.
+//
+// Calls are aggregated per function, and recorded (with the per-thread
+// spans of their loops) as Chrome trace events, up to STATS_MAX_EVENTS.
+#define STATS_MAX_EVENTS (1 << 20)
+
+struct call_stats {
+    long calls = 0;
+    double wall = 0, busy = 0, idle = 0; // seconds; busy and idle summed over threads
+    long voxels = 0;          // voxels (or vectors) processed
+    long evals = 0;           // kernel evaluations (densities, correlations, distances)
+    long bytes_converted = 0; // input arrays NumPy had to convert or copy
+    long bytes_copied = 0;    // results copied into NumPy arrays
+    long peak_scratch = 0;    // peak of the scratch buffers of a call
+};
+
+struct stats_event {
+    std::string name;
+    const char *cat;
+    double ts, dur; // microseconds
+    long tid;
+};
+
+inline std::atomic<bool> stats_on(false);
+inline std::mutex stats_lock;
+inline std::map<std::string, call_stats> stats_table;
+inline std::vector<stats_event> stats_events;
+inline long stats_dropped = 0;
+
+inline double stats_now() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline long stats_tid() {
+    return (long)syscall(SYS_gettid);
+}
+
+// Must be called with stats_lock held.
+inline void stats_trace(const std::string &name, const char *cat, double ts, double dur, long tid) {
+    if (stats_events.size() >= STATS_MAX_EVENTS) {
+        stats_dropped++;
+        return;
+    }
+    stats_events.push_back(stats_event{name, cat, ts, dur, tid});
+}
+
+struct stats_call;
+inline thread_local stats_call *stats_active = NULL;
+
+struct stats_call {
+    const char *name;
+    bool on;
+    double t0 = 0;
+    long scratch = 0;
+    call_stats s;
+    std::atomic<long> evals; // also counted by the threads of a stats_loop
+    stats_call *outer;
+
+    explicit stats_call(const char *name) : name(name), on(stats_on.load(std::memory_order_relaxed)), evals(0), outer(stats_active) {
+        if (!on)
+            return;
+        t0 = stats_now();
+        stats_active = this;
+    }
+
+    ~stats_call() {
+        if (!on)
+            return;
+        double t1 = stats_now();
+        stats_active = outer;
+        std::lock_guard<std::mutex> lock(stats_lock);
+        call_stats &a = stats_table[name];
+        a.calls++;
+        a.wall += (t1 - t0) * 1e-6;
+        a.busy += s.busy;
+        a.idle += s.idle;
+        a.voxels += s.voxels;
+        a.evals += s.evals + evals.load();
+        a.bytes_converted += s.bytes_converted;
+        a.bytes_copied += s.bytes_copied;
+        a.peak_scratch = std::max(a.peak_scratch, s.peak_scratch);
+        stats_trace(name, "native", t0, t1 - t0, stats_tid());
+    }
+};
+
+// Counters of the active call; no-ops if there is none.
+inline void stats_count(long voxels, long evals) {
+    if (stats_active != NULL) {
+        stats_active->s.voxels += voxels;
+        stats_active->s.evals += evals;
+    }
+}
+
+inline void stats_copied(long bytes) {
+    if (stats_active != NULL)
+        stats_active->s.bytes_copied += bytes;
+}
+
+// Scratch memory allocated (or freed, if negative) by the active call.
+inline void stats_scratch(long bytes) {
+    stats_call *c = stats_active;
+    if (c != NULL) {
+        c->scratch += bytes;
+        c->s.peak_scratch = std::max(c->s.peak_scratch, c->scratch);
+    }
+}
+
+// Busy and idle time of the threads of a worksharing loop. Construct it
+// before the parallel region; every thread calls done() right after its
+// share of the loop (an 'omp for nowait'), and end() is called after the
+// region.
+struct stats_loop {
+    stats_call *call;
+    const char *name;
+    double t0 = 0;
+    std::vector<double> finished;
+    std::vector<long> tids;
+
+    stats_loop(const char *name, int ncores) : call(stats_active), name(name) {
+        if (call == NULL)
+            return;
+        finished.assign(ncores, 0.0);
+        tids.assign(ncores, 0);
+        t0 = stats_now();
+    }
+
+    void done() {
+        if (call == NULL)
+            return;
+        int t = omp_get_thread_num();
+        finished[t] = stats_now();
+        tids[t] = stats_tid();
+    }
+
+    void count(long evals) {
+        if (call != NULL)
+            call->evals.fetch_add(evals, std::memory_order_relaxed);
+    }
+
+    void end() {
+        if (call == NULL)
+            return;
+        double t1 = stats_now();
+        std::lock_guard<std::mutex> lock(stats_lock);
+        for (size_t t = 0; t < finished.size(); t++) {
+            if (finished[t] == 0)
+                continue; // the region ran with fewer threads
+            call->s.busy += (finished[t] - t0) * 1e-6;
+            call->s.idle += (t1 - finished[t]) * 1e-6;
+            stats_trace(name, "thread", t0, finished[t] - t0, tids[t]);
+        }
+    }
+};
+
+inline double gauss_kernel(double x, double y, double z) {
+    return exp(-0.5 * (x*x + y*y + z*z));
+}
+
+// Output tiles of the KDE engine. Each tile is owned by exactly one thread,
+// so tiles are accumulated densely without any hashing or merging.
+#define KDE_TILE_X 64
+#define KDE_TILE_Y 64
+#define KDE_TILE_Z 64
+
+#define KDE_KERNEL_GAUSSIAN 0
+#define KDE_KERNEL_GAUSSIAN_SEPARABLE 1
+#define KDE_KERNEL_GAUSSIAN_BINNED 2
+
+// The binned kernel needs a bandwidth of at least this many pixels, and
+// without pruning reaches this many bandwidths beyond a block.
+#define KDE_BINNED_MIN_H 0.7
+#define KDE_BINNED_REACH 6
+// Dense slabs along x of the binned kernel in calc_kde()
+#define KDE_BINNED_SLAB 256
+
+#define CORRMAP_DIRECT 0
+#define CORRMAP_SLIDING 1
+
+#define KNN_CORRELATION 0
+#define KNN_COSINE 1
+#define KNN_EUCLIDEAN 2
+
+// Up to this many vectors, knn_graph() is exact (brute force) by default
+#define KNN_EXACT_MAX 4096
+// NN-descent: nodes joined before their updates are applied, the maximum
+// number of iterations, and the fraction of updated neighbours at which the
+// graph is considered converged
+#define KNN_BATCH 4096
+#define KNN_MAX_ITERS 20
+#define KNN_DELTA 0.001
+
+struct kde_part {
+    std::vector<pos3d> pos;
+    std::vector<double> val;
+};
+
+struct kde_tiling {
+    int org[3];   // tiled region of the grid
+    int ext[3];
+    int tsize[3];
+    int ntiles[3];
+    std::vector<long> tile_ptr; // CSR offsets into tile_pts, one row per tile
+    std::vector<int> tile_pts;  // point indices, in bucketing order within each tile
+    bool shared = false;        // no prune window: tile_pts is one row, shared by all tiles
+
+    // Points of tile tidx are tile_pts[begin(tidx), end(tidx))
+    long begin(long tidx) const { return shared ? 0 : tile_ptr[tidx]; }
+    long end(long tidx) const { return shared ? (long)tile_pts.size() : tile_ptr[tidx + 1]; }
+};
+
+// Prune window of a point, clipped to the grid. Returns false if empty.
+inline bool kde_window(double px, double py, double pz, int *shape, int maxdist, int *s, int *e) {
+    int p0[3] = { static_cast<int>(px), static_cast<int>(py), static_cast<int>(pz) };
+    for (int d = 0; d < 3; d++) {
+        s[d] = (maxdist > 0) ? std::max(0, p0[d] - maxdist) : 0;
+        e[d] = (maxdist > 0) ? std::min(shape[d], p0[d] + maxdist + 1) : shape[d];
+    }
+    return s[0] < e[0] && s[1] < e[1] && s[2] < e[2];
+}
+
+// Origin and extent of a tile in grid coordinates.
+inline void kde_tile_box(const kde_tiling &t, long tidx, int *org, int *ext) {
+    long tile[3] = { tidx / ((long)t.ntiles[1] * t.ntiles[2]), (tidx / t.ntiles[2]) % t.ntiles[1], tidx % t.ntiles[2] };
+    for (int d = 0; d < 3; d++) {
+        org[d] = t.org[d] + (int)tile[d] * t.tsize[d];
+        ext[d] = std::min(t.tsize[d], t.org[d] + t.ext[d] - org[d]);
+    }
+}
+
+// Buckets the points into every output tile of the region [org, org + ext)
+// their prune window overlaps. Points are visited in the given order (or in
+// index order if order is NULL) and keep it inside a tile, so the per-voxel
+// summation order is the same as a sequential pass over all points. Without
+// a prune window (maxdist <= 0) every point reaches every tile, so the points
+// are listed once, in a row shared by all tiles.
+inline void kde_bucket(kde_tiling &t, double *xx, double *yy, double *zz, int *shape, const int *org, const int *ext,
+                       const int *order, int npts, int maxdist) {
+    int s[3], e[3], d;
+    long ntiles;
+
+    t.tsize[0] = std::min(KDE_TILE_X, ext[0]);
+    t.tsize[1] = std::min(KDE_TILE_Y, ext[1]);
+    t.tsize[2] = std::min(KDE_TILE_Z, ext[2]);
+    for (d = 0; d < 3; d++) {
+        t.org[d] = org[d];
+        t.ext[d] = ext[d];
+        t.ntiles[d] = (ext[d] + t.tsize[d] - 1) / t.tsize[d];
+    }
+    ntiles = (long)t.ntiles[0] * t.ntiles[1] * t.ntiles[2];
+    t.shared = maxdist <= 0;
+    if (t.shared) {
+        t.tile_ptr.clear();
+        t.tile_pts.resize(npts);
+        for (int k = 0; k < npts; k++)
+            t.tile_pts[k] = order ? order[k] : k;
+        return;
+    }
+    t.tile_ptr.assign(ntiles + 1, 0);
+
+    for (int pass = 0; pass < 2; pass++) {
+        std::vector<long> fill;
+        if (pass == 1) {
+            for (long i = 0; i < ntiles; i++)
+                t.tile_ptr[i + 1] += t.tile_ptr[i];
+            t.tile_pts.resize(t.tile_ptr[ntiles]);
+            fill.assign(t.tile_ptr.begin(), t.tile_ptr.end() - 1);
+        }
+        for (int k = 0; k < npts; k++) {
+            int i = order ? order[k] : k;
+            if (!kde_window(xx[i], yy[i], zz[i], shape, maxdist, s, e))
+                continue;
+            for (d = 0; d < 3; d++) {
+                s[d] = std::max(s[d], org[d]) - org[d];
+                e[d] = std::min(e[d], org[d] + ext[d]) - org[d];
+            }
+            if (s[0] >= e[0] || s[1] >= e[1] || s[2] >= e[2])
+                continue;
+            for (int tx = s[0] / t.tsize[0]; tx <= (e[0] - 1) / t.tsize[0]; tx++) {
+                for (int ty = s[1] / t.tsize[1]; ty <= (e[1] - 1) / t.tsize[1]; ty++) {
+                    for (int tz = s[2] / t.tsize[2]; tz <= (e[2] - 1) / t.tsize[2]; tz++) {
+                        long tidx = I3D(tx, ty, tz, (long)t.ntiles[1], (long)t.ntiles[2]);
+                        if (pass == 0)
+                            t.tile_ptr[tidx + 1]++;
+                        else
+                            t.tile_pts[fill[tidx]++] = i;
+                    }
+                }
+            }
+        }
+    }
+}
+
+inline void axpy_scalar(double *y, const double *x, double a, int n) {
+    for (int i = 0; i < n; i++)
+        y[i] += a * x[i];
+}
+
+#if SIMD_X86
+__attribute__((target("avx2,fma"))) inline void axpy_avx2(double *y, const double *x, double a, int n) {
+    __m256d va = _mm256_set1_pd(a);
+    int i;
+
+    for (i = 0; i <= n - 4; i += 4) {
+        __m256d vy = _mm256_loadu_pd(&y[i]);
+        _mm256_storeu_pd(&y[i], _mm256_fmadd_pd(va, _mm256_loadu_pd(&x[i]), vy));
+    }
+    for (; i < n; i++)
+        y[i] = fma(a, x[i], y[i]);
+}
+
+__attribute__((target("avx512f,fma"))) inline void axpy_avx512(double *y, const double *x, double a, int n) {
+    __m512d va = _mm512_set1_pd(a);
+    int i;
+
+    for (i = 0; i <= n - 8; i += 8) {
+        __m512d vy = _mm512_loadu_pd(&y[i]);
+        _mm512_storeu_pd(&y[i], _mm512_fmadd_pd(va, _mm512_loadu_pd(&x[i]), vy));
+    }
+    for (; i < n; i++)
+        y[i] = fma(a, x[i], y[i]); // fused like the vector part, so tiling does not change the rounding
+}
+#endif
+
+inline void __axpy__(double *y, const double *x, double a, int n) {
+#if SIMD_X86
+    if (simd_level == SIMD_AVX512)
+        return axpy_avx512(y, x, a, n);
+    if (simd_level == SIMD_AVX2)
+        return axpy_avx2(y, x, a, n);
+#endif
+    axpy_scalar(y, x, a, n);
+}
+
+// Adds the contributions of the points tile_pts[kb:ke] to a dense tile buffer
+// laid out as [x][y][z], covering [org, org + ext) of the grid.
+// KDE_KERNEL_GAUSSIAN evaluates the kernel at every voxel of the prune window.
+// KDE_KERNEL_GAUSSIAN_SEPARABLE evaluates three 1D weight tables per point
+// (bounded by the prune window) and accumulates their outer product with
+// vector FMAs along the contiguous axis of the tile.
+inline long kde_tile(double *buf, const int *org, const int *ext, const int *tile_pts, long kb, long ke,
+                     double *xx, double *yy, double *zz, int *shape, int maxdist, double bandwidth, int kernel) {
+    int s[3], e[3];
+    double wx[KDE_TILE_X], wy[KDE_TILE_Y], wz[KDE_TILE_Z];
+    double *w[3] = { wx, wy, wz };
+    long evals = 0;
+
+    for (long k = kb; k < ke; k++) {
+        int i = tile_pts[k];
+        kde_window(xx[i], yy[i], zz[i], shape, maxdist, s, e);
+        for (int d = 0; d < 3; d++) {
+            s[d] = std::max(s[d], org[d]);
+            e[d] = std::min(e[d], org[d] + ext[d]);
+        }
+        evals += (long)std::max(0, e[0] - s[0]) * std::max(0, e[1] - s[1]) * std::max(0, e[2] - s[2]);
+        if (kernel == KDE_KERNEL_GAUSSIAN_SEPARABLE) {
+            double p[3] = { xx[i], yy[i], zz[i] };
+            for (int d = 0; d < 3; d++) {
+                for (int c = s[d]; c < e[d]; c++) {
+                    double u = (c - p[d]) / bandwidth;
+                    w[d][c - s[d]] = exp(-0.5 * u * u);
+                }
+            }
+            if (shape[2] == 1) {
+                // 2D grid: y is the contiguous axis
+                for (int x = s[0]; x < e[0]; x++)
+                    __axpy__(&buf[I2D(x - org[0], s[1] - org[1], ext[1])], w[1], w[0][x - s[0]] * w[2][0], e[1] - s[1]);
+            } else {
+                for (int x = s[0]; x < e[0]; x++) {
+                    for (int y = s[1]; y < e[1]; y++) {
+                        __axpy__(&buf[I3D(x - org[0], y - org[1], s[2] - org[2], ext[1], ext[2])], w[2],
+                                 w[0][x - s[0]] * w[1][y - s[1]], e[2] - s[2]);
+                    }
+                }
+            }
+        } else {
+            for (int x = s[0]; x < e[0]; x++) {
+                for (int y = s[1]; y < e[1]; y++) {
+                    double *row = &buf[I3D(x - org[0], y - org[1], 0, ext[1], ext[2])];
+                    for (int z = s[2]; z < e[2]; z++) {
+                        row[z - org[2]] += gauss_kernel((x - xx[i]) / bandwidth, (y - yy[i]) / bandwidth, (z - zz[i]) / bandwidth);
+                    }
+                }
+            }
+        }
+    }
+    return evals;
+}
+
+inline void kde(std::vector<kde_part> &parts, double *xx, double *yy, double *zz, int *shape, int npts, double bandwidth, double prune_coeff, int kernel, int ncores) {
+    int maxdist;
+    if (prune_coeff > 0) {
+        maxdist = static_cast<int>(bandwidth * prune_coeff);
+    } else {
+        maxdist = -1;
+    }
+
+    kde_tiling t;
+    int zero[3] = { 0, 0, 0 };
+    kde_bucket(t, xx, yy, zz, shape, zero, shape, NULL, npts, maxdist);
+    long ntiles = (long)t.ntiles[0] * t.ntiles[1] * t.ntiles[2];
+    long tile_bytes = (long)t.tsize[0] * t.tsize[1] * t.tsize[2] * sizeof(double);
+    parts.resize(ncores);
+    stats_scratch(t.tile_pts.size() * sizeof(int) + ncores * tile_bytes);
+    stats_loop loop("kde", ncores);
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        kde_part &part = parts[omp_get_thread_num()];
+        std::vector<double> buf((size_t)t.tsize[0] * t.tsize[1] * t.tsize[2]);
+
+        #pragma omp for schedule(dynamic) nowait
+        for (long tidx = 0; tidx < ntiles; tidx++) {
+            if (t.begin(tidx) == t.end(tidx))
+                continue;
+            int org[3], ext[3];
+            kde_tile_box(t, tidx, org, ext);
+            std::fill(buf.begin(), buf.end(), 0.0);
+            loop.count(kde_tile(buf.data(), org, ext, t.tile_pts.data(), t.begin(tidx), t.end(tidx),
+                                xx, yy, zz, shape, maxdist, bandwidth, kernel));
+
+            for (int x = 0; x < ext[0]; x++) {
+                for (int y = 0; y < ext[1]; y++) {
+                    for (int z = 0; z < ext[2]; z++) {
+                        double v = buf[I3D(x, y, z, ext[1], ext[2])];
+                        if (v == 0)
+                            continue;
+                        part.pos.push_back(pos3d{org[0] + x, org[1] + y, org[2] + z});
+                        part.val.push_back(v);
+                    }
+                }
+            }
+        }
+        loop.done();
+    }
+    loop.end();
+    stats_scratch(-(long)(t.tile_pts.size() * sizeof(int) + ncores * tile_bytes));
+}
+
+// Multi-channel KDE over the block [borg, borg + bext) of the grid. All
+// channels (genes) are computed in one parallel pass and written into a dense
+// block laid out as [x][y][z][gene]. Work is split into (tile, gene) tasks,
+// each of which owns its output cells, so no merging is needed. For every
+// gene, the result is identical to kde() run on that gene's points alone.
+inline void kde_multi(double *out, int *gene, double *xx, double *yy, double *zz, int *shape, int *borg, int *bext,
+               int ngene, int npts, double bandwidth, double prune_coeff, int kernel, int ncores) {
+    int maxdist;
+    if (prune_coeff > 0) {
+        maxdist = static_cast<int>(bandwidth * prune_coeff);
+    } else {
+        maxdist = -1;
+    }
+
+    // Stable counting sort by gene, so each tile lists its points gene by gene
+    std::vector<int> order(npts);
+    std::vector<long> gptr(ngene + 1, 0);
+    for (int i = 0; i < npts; i++)
+        gptr[gene[i] + 1]++;
+    for (int g = 0; g < ngene; g++)
+        gptr[g + 1] += gptr[g];
+    for (int i = 0; i < npts; i++)
+        order[gptr[gene[i]]++] = i;
+
+    kde_tiling t;
+    kde_bucket(t, xx, yy, zz, shape, borg, bext, order.data(), npts, maxdist);
+    long ntiles = (long)t.ntiles[0] * t.ntiles[1] * t.ntiles[2];
+
+    struct task { long tidx, kb, ke; };
+    std::vector<task> tasks;
+    for (long tidx = 0; tidx < ntiles; tidx++) {
+        long kb = t.begin(tidx), ke = t.end(tidx);
+        for (long k = kb; k < ke; k++) {
+            if (k + 1 == ke || gene[t.tile_pts[k + 1]] != gene[t.tile_pts[kb]]) {
+                tasks.push_back(task{tidx, kb, k + 1});
+                kb = k + 1;
+            }
+        }
+    }
+    long ntasks = tasks.size();
+    long scratch = (npts + t.tile_pts.size()) * sizeof(int) + ntasks * sizeof(task) +
+                   (long)ncores * t.tsize[0] * t.tsize[1] * t.tsize[2] * sizeof(double);
+    stats_scratch(scratch);
+    stats_loop loop("kde_multi", ncores);
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        std::vector<double> buf((size_t)t.tsize[0] * t.tsize[1] * t.tsize[2]);
+
+        #pragma omp for schedule(dynamic) nowait
+        for (long j = 0; j < ntasks; j++) {
+            const task &tk = tasks[j];
+            int g = gene[t.tile_pts[tk.kb]];
+            int org[3], ext[3], s[3], e[3], lo[3], hi[3];
+            kde_tile_box(t, tk.tidx, org, ext);
+
+            // Only the bounding box of this gene's windows is touched
+            for (int d = 0; d < 3; d++) {
+                lo[d] = ext[d];
+                hi[d] = 0;
+            }
+            for (long k = tk.kb; k < tk.ke; k++) {
+                int i = t.tile_pts[k];
+                kde_window(xx[i], yy[i], zz[i], shape, maxdist, s, e);
+                for (int d = 0; d < 3; d++) {
+                    lo[d] = std::min(lo[d], std::max(s[d], org[d]) - org[d]);
+                    hi[d] = std::max(hi[d], std::min(e[d], org[d] + ext[d]) - org[d]);
+                }
+            }
+            for (int x = lo[0]; x < hi[0]; x++)
+                for (int y = lo[1]; y < hi[1]; y++)
+                    std::fill_n(&buf[I3D(x, y, lo[2], ext[1], ext[2])], hi[2] - lo[2], 0.0);
+
+            loop.count(kde_tile(buf.data(), org, ext, t.tile_pts.data(), tk.kb, tk.ke,
+                                xx, yy, zz, shape, maxdist, bandwidth, kernel));
+
+            for (int x = lo[0]; x < hi[0]; x++) {
+                for (int y = lo[1]; y < hi[1]; y++) {
+                    for (int z = lo[2]; z < hi[2]; z++) {
+                        long oidx = I3D((long)(org[0] - borg[0] + x), (long)(org[1] - borg[1] + y), (long)(org[2] - borg[2] + z),
+                                        (long)bext[1], (long)bext[2]);
+                        out[oidx * ngene + g] = buf[I3D(x, y, z, ext[1], ext[2])];
+                    }
+                }
+            }
+        }
+        loop.done();
+    }
+    loop.end();
+    stats_scratch(-scratch);
+}
+
+// Recursive Gaussian filter of Deriche (1993), in its parallel form: the
+// sampled Gaussian exp(-x^2 / 2 sigma^2) is approximated by the sum of four
+// exponentials (two conjugate pole pairs), each applied to a line by a
+// causal and an anti-causal first order recursion. The cost does not depend
+// on sigma, the two passes are independent, so a line ends without any
+// boundary correction, and the error is below 1e-3 of the peak.
+struct gauss_iir {
+    std::complex<double> pole[2], coef[2];
+};
+
+inline gauss_iir gauss_iir_design(double sigma) {
+    const double a0 = 1.680, a1 = 3.735, b0 = 1.783, b1 = 1.723, w0 = 0.6318, w1 = 1.997, c0 = -0.6803, c1 = -0.2598;
+    gauss_iir g;
+    g.pole[0] = std::exp(std::complex<double>(-b0, w0) / sigma);
+    g.pole[1] = std::exp(std::complex<double>(-b1, w1) / sigma);
+    g.coef[0] = std::complex<double>(a0, -a1) / 2.0;
+    g.coef[1] = std::complex<double>(c0, -c1) / 2.0;
+    return g;
+}
+
+// Filters a line of n values, using out as scratch.
+inline void gauss_iir_filter(double *line, double *out, long n, const gauss_iir &g) {
+    std::fill_n(out, n, 0.0);
+    for (int k = 0; k < 2; k++) {
+        std::complex<double> s = 0;
+        for (long i = 0; i < n; i++) {
+            s = line[i] + g.pole[k] * s;
+            out[i] += 2 * std::real(g.coef[k] * s);
+        }
+        s = 0;
+        for (long i = n - 1; i >= 0; i--) {
+            out[i] += 2 * std::real(g.coef[k] * s);
+            s = g.pole[k] * (line[i] + s);
+        }
+    }
+    std::copy(out, out + n, line);
+}
+
+// Sets every cell of a 0/1 line to 1 if any cell within r of it is 1.
+inline void dilate_line(double *line, double *tmp, long n, long r) {
+    double run = 0;
+    std::copy(line, line + n, tmp);
+    for (long i = 0; i < std::min(r, n); i++)
+        run += tmp[i];
+    for (long i = 0; i < n; i++) {
+        if (i + r < n)
+            run += tmp[i + r];
+        if (i - r - 1 >= 0)
+            run -= tmp[i - r - 1];
+        line[i] = (run > 0) ? 1 : 0;
+    }
+}
+
+// Calls f(line, scratch, n) for every line along axis d of a grid laid out as
+// [x][y][z] with extents ge. line holds a copy of the line and is written
+// back.
+template <typename F>
+inline void grid_lines(double *grid, const long *ge, int d, int ncores, F f) {
+    const long steps[3] = { ge[1] * ge[2], ge[2], 1 };
+    const int a = (d == 0) ? 1 : 0, b = (d == 2) ? 1 : 2;
+    const long nlines = ge[a] * ge[b], n = ge[d];
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        std::vector<double> line(n), scratch(n);
+
+        #pragma omp for schedule(static)
+        for (long j = 0; j < nlines; j++) {
+            double *p = grid + (j / ge[b]) * steps[a] + (j % ge[b]) * steps[b];
+            for (long i = 0; i < n; i++)
+                line[i] = p[i * steps[d]];
+            f(line.data(), scratch.data(), n);
+            for (long i = 0; i < n; i++)
+                p[i * steps[d]] = line[i];
+        }
+    }
+}
+
+// Multi-channel KDE with the binned kernel over the block [borg, borg + bext)
+// of the grid, for nh bandwidths at once: outs[b] receives the block of
+// bandwidth hs[b], laid out like kde_multi(). The points of each gene are
+// linearly splatted onto the pixels of the block and a margin around it, and
+// the splat is filtered by a recursive Gaussian along each axis, so the cost
+// per pixel does not grow with the bandwidth. The filter is narrowed by the
+// variance the splat adds (1/6 pixel^2 on average). With a prune
+// coefficient, a pixel is nonzero only if it lies in the prune window of a
+// point, as with the other kernels, so the output is equally sparse.
+inline void kde_binned(double **outs, const double *hs, int nh, const int *gene, const double *xx, const double *yy, const double *zz,
+                const int *shape, const int *borg, const int *bext, int ngene, int npts, double prune_coeff, int ncores) {
+    const int nd = (shape[2] > 1) ? 3 : 2;
+    std::vector<int> maxdist(nh);
+    std::vector<gauss_iir> filters(nh);
+    long pad = 0, go[3], ge[3], nvox;
+
+    for (int b = 0; b < nh; b++) {
+        maxdist[b] = (prune_coeff > 0) ? static_cast<int>(hs[b] * prune_coeff) : -1;
+        pad = std::max(pad, (maxdist[b] > 0) ? (long)maxdist[b] + 1 : (long)ceil(KDE_BINNED_REACH * hs[b]) + 1);
+        filters[b] = gauss_iir_design(sqrt(hs[b] * hs[b] - 1.0 / 6));
+    }
+    for (int d = 0; d < 3; d++) {
+        go[d] = borg[d] - ((d < nd) ? pad : 0);
+        ge[d] = bext[d] + ((d < nd) ? 2 * pad : 0);
+    }
+    nvox = ge[0] * ge[1] * ge[2];
+
+    // Stable counting sort by gene
+    std::vector<int> order(npts);
+    std::vector<long> gptr(ngene + 1, 0);
+    for (int i = 0; i < npts; i++)
+        gptr[gene[i] + 1]++;
+    for (int g = 0; g < ngene; g++)
+        gptr[g + 1] += gptr[g];
+    for (int i = 0; i < npts; i++)
+        order[gptr[gene[i]]++] = i;
+    for (int g = ngene; g > 0; g--)
+        gptr[g] = gptr[g - 1];
+    gptr[0] = 0;
+
+    // Genes run in parallel; a single gene parallelizes over the lines instead
+    const int outer = (ngene > 1) ? ncores : 1, inner = (ngene > 1) ? 1 : ncores;
+    const long scratch = npts * sizeof(int) + outer * nvox * ((prune_coeff > 0) ? 4 : 2) * sizeof(double);
+    stats_scratch(scratch);
+    stats_loop loop("kde_binned", outer);
+    #pragma omp parallel num_threads(outer)
+    {
+        std::vector<double> splat(nvox), filt(nvox), occ, mask;
+        if (prune_coeff > 0) {
+            occ.resize(nvox);
+            mask.resize(nvox);
+        }
+
+        #pragma omp for schedule(dynamic) nowait
+        for (int g = 0; g < ngene; g++) {
+            if (gptr[g] == gptr[g + 1])
+                continue;
+            // Splatted corners and filtered samples
+            loop.count(8 * (gptr[g + 1] - gptr[g]) + nh * nd * nvox);
+            std::fill(splat.begin(), splat.end(), 0.0);
+            std::fill(occ.begin(), occ.end(), 0.0);
+            for (long k = gptr[g]; k < gptr[g + 1]; k++) {
+                int i = order[k];
+                const double p[3] = { xx[i] - go[0], yy[i] - go[1], zz[i] - go[2] };
+                long c[3], q[3];
+                double f[3];
+                bool inside = true;
+                for (int d = 0; d < 3; d++) {
+                    c[d] = (long)floor(p[d]);
+                    f[d] = p[d] - c[d];
+                    // The pixel whose prune window the point spans, as in kde_window()
+                    q[d] = static_cast<int>((d == 0) ? xx[i] : (d == 1) ? yy[i] : zz[i]) - go[d];
+                    inside = inside && q[d] >= 0 && q[d] < ge[d];
+                }
+                if (inside && !occ.empty())
+                    occ[I3D(q[0], q[1], q[2], ge[1], ge[2])] = 1;
+                for (int corner = 0; corner < 8; corner++) {
+                    double w = 1;
+                    long cc[3];
+                    for (int d = 0; d < 3; d++) {
+                        int hi = (corner >> (2 - d)) & 1;
+                        cc[d] = c[d] + hi;
+                        w *= hi ? f[d] : 1 - f[d];
+                    }
+                    if (w == 0 || cc[0] < 0 || cc[0] >= ge[0] || cc[1] < 0 || cc[1] >= ge[1] || cc[2] < 0 || cc[2] >= ge[2])
+                        continue;
+                    splat[I3D(cc[0], cc[1], cc[2], ge[1], ge[2])] += w;
+                }
+            }
+
+            for (int b = 0; b < nh; b++) {
+                const gauss_iir &gf = filters[b];
+                const long r = maxdist[b];
+                // Scales the narrowed Gaussian to the mass of the kernel
+                const double scale = pow(hs[b] / sqrt(hs[b] * hs[b] - 1.0 / 6), nd);
+                std::copy(splat.begin(), splat.end(), filt.begin());
+                for (int d = 0; d < nd; d++)
+                    grid_lines(filt.data(), ge, d, inner, [&](double *line, double *tmp, long n) { gauss_iir_filter(line, tmp, n, gf); });
+                if (!occ.empty()) {
+                    std::copy(occ.begin(), occ.end(), mask.begin());
+                    for (int d = 0; d < nd; d++)
+                        grid_lines(mask.data(), ge, d, inner, [&](double *line, double *tmp, long n) { dilate_line(line, tmp, n, r); });
+                }
+                for (long x = 0; x < bext[0]; x++) {
+                    for (long y = 0; y < bext[1]; y++) {
+                        for (long z = 0; z < bext[2]; z++) {
+                            long gi = I3D(x + borg[0] - go[0], y + borg[1] - go[1], z + borg[2] - go[2], ge[1], ge[2]);
+                            double v = filt[gi] * scale;
+                            outs[b][I3D(x, y, z, (long)bext[1], (long)bext[2]) * ngene + g] = (v > 0 && (mask.empty() || mask[gi] > 0)) ? v : 0;
+                        }
+                    }
+                }
+            }
+        }
+        loop.done();
+    }
+    loop.end();
+    stats_scratch(-scratch);
+}
+
+// kde() for the binned kernel and nh bandwidths: parts[b] receives the
+// nonzero pixels of bandwidth hs[b]. The grid is computed in dense slabs
+// along x, so the buffers stay small.
+inline void kde_binned_parts(std::vector<std::vector<kde_part> > &parts, double *xx, double *yy, double *zz, int *shape, int npts,
+                      const double *hs, int nh, double prune_coeff, int ncores) {
+    std::vector<int> gene(npts, 0);
+    std::vector<std::vector<double> > slabs(nh);
+    std::vector<double *> outs(nh);
+
+    parts.assign(nh, std::vector<kde_part>(ncores));
+    const long scratch = npts * sizeof(int) + (long)nh * std::min(KDE_BINNED_SLAB, shape[0]) * shape[1] * shape[2] * sizeof(double);
+    stats_scratch(scratch);
+    for (int x0 = 0; x0 < shape[0]; x0 += KDE_BINNED_SLAB) {
+        int borg[3] = { x0, 0, 0 };
+        int bext[3] = { std::min(KDE_BINNED_SLAB, shape[0] - x0), shape[1], shape[2] };
+        for (int b = 0; b < nh; b++) {
+            slabs[b].assign((size_t)bext[0] * bext[1] * bext[2], 0.0);
+            outs[b] = slabs[b].data();
+        }
+        kde_binned(outs.data(), hs, nh, gene.data(), xx, yy, zz, shape, borg, bext, 1, npts, prune_coeff, ncores);
+
+        #pragma omp parallel num_threads(ncores)
+        {
+            int tid = omp_get_thread_num();
+            #pragma omp for schedule(static)
+            for (int x = 0; x < bext[0]; x++) {
+                for (int b = 0; b < nh; b++) {
+                    kde_part &part = parts[b][tid];
+                    for (int y = 0; y < bext[1]; y++) {
+                        for (int z = 0; z < bext[2]; z++) {
+                            double v = slabs[b][I3D((long)x, (long)y, (long)z, (long)bext[1], (long)bext[2])];
+                            if (v == 0)
+                                continue;
+                            part.pos.push_back(pos3d{x0 + x, y, z});
+                            part.val.push_back(v);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    stats_scratch(-scratch);
+}
+
+// Per-lane sums of a, b, a^2 and b^2 over the first n (a multiple of 8)
+// elements, stored as sums[0..7], sums[8..15], sums[16..23] and sums[24..31].
+template <typename TA, typename TB>
+inline void corr_sums_scalar(const TA *a, const TB *b, int n, double *sums) {
+    std::fill_n(sums, 32, 0.0);
+    for (int i = 0; i < n; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            double va = a[i + j], vb = b[i + j];
+            sums[j] += va;
+            sums[8 + j] += vb;
+            sums[16 + j] += va * va;
+            sums[24 + j] += vb * vb;
+        }
+    }
+}
+
+// Per-lane sums of (a - a_mean) * (b - b_mean) over the first n elements.
+template <typename TA, typename TB>
+inline void corr_dot_scalar(const TA *a, const TB *b, int n, double a_mean, double b_mean, double *sums) {
+    std::fill_n(sums, 8, 0.0);
+    for (int i = 0; i < n; i += 8) {
+        for (int j = 0; j < 8; j++)
+            sums[j] += ((double)a[i + j] - a_mean) * ((double)b[i + j] - b_mean);
+    }
+}
+
+#if SIMD_X86
+template <typename TA, typename TB>
+__attribute__((target("avx2,fma"))) inline void corr_sums_avx2(const TA *a, const TB *b, int n, double *sums) {
+    // Two registers per sum, to keep the lane layout of the AVX-512 version
+    __m256d sum_a[2], sum_b[2], sum_aa[2], sum_bb[2];
+    for (int h = 0; h < 2; h++)
+        sum_a[h] = sum_b[h] = sum_aa[h] = sum_bb[h] = _mm256_setzero_pd();
+
+    for (int i = 0; i < n; i += 8) {
+        for (int h = 0; h < 2; h++) {
+            __m256d va = simd_load4(&a[i + h * 4]);
+            __m256d vb = simd_load4(&b[i + h * 4]);
+
+            sum_a[h] = _mm256_add_pd(sum_a[h], va);
+            sum_b[h] = _mm256_add_pd(sum_b[h], vb);
+            sum_aa[h] = _mm256_fmadd_pd(va, va, sum_aa[h]);
+            sum_bb[h] = _mm256_fmadd_pd(vb, vb, sum_bb[h]);
+        }
+    }
+    for (int h = 0; h < 2; h++) {
+        _mm256_storeu_pd(&sums[h * 4], sum_a[h]);
+        _mm256_storeu_pd(&sums[8 + h * 4], sum_b[h]);
+        _mm256_storeu_pd(&sums[16 + h * 4], sum_aa[h]);
+        _mm256_storeu_pd(&sums[24 + h * 4], sum_bb[h]);
+    }
+}
+
+template <typename TA, typename TB>
+__attribute__((target("avx2,fma"))) inline void corr_dot_avx2(const TA *a, const TB *b, int n, double a_mean, double b_mean, double *sums) {
+    __m256d sum_ab_diff[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+    __m256d vam = _mm256_set1_pd(a_mean), vbm = _mm256_set1_pd(b_mean);
+
+    for (int i = 0; i < n; i += 8) {
+        for (int h = 0; h < 2; h++) {
+            __m256d va = _mm256_sub_pd(simd_load4(&a[i + h * 4]), vam);
+            __m256d vb = _mm256_sub_pd(simd_load4(&b[i + h * 4]), vbm);
+            sum_ab_diff[h] = _mm256_fmadd_pd(va, vb, sum_ab_diff[h]);
+        }
+    }
+    _mm256_storeu_pd(&sums[0], sum_ab_diff[0]);
+    _mm256_storeu_pd(&sums[4], sum_ab_diff[1]);
+}
+
+template <typename TA, typename TB>
+__attribute__((target("avx512f"))) inline void corr_sums_avx512(const TA *a, const TB *b, int n, double *sums) {
+    __m512d sum_a = _mm512_setzero_pd();
+    __m512d sum_b = _mm512_setzero_pd();
+    __m512d sum_aa = _mm512_setzero_pd();
+    __m512d sum_bb = _mm512_setzero_pd();
+
+    for (int i = 0; i < n; i += 8) {
+        __m512d va = simd_load8(&a[i]);
+        __m512d vb = simd_load8(&b[i]);
+
+        sum_a = _mm512_add_pd(sum_a, va);
+        sum_b = _mm512_add_pd(sum_b, vb);
+
+        sum_aa = _mm512_fmadd_pd(va, va, sum_aa);
+        sum_bb = _mm512_fmadd_pd(vb, vb, sum_bb);
+    }
+    _mm512_storeu_pd(&sums[0], sum_a);
+    _mm512_storeu_pd(&sums[8], sum_b);
+    _mm512_storeu_pd(&sums[16], sum_aa);
+    _mm512_storeu_pd(&sums[24], sum_bb);
+}
+
+template <typename TA, typename TB>
+__attribute__((target("avx512f"))) inline void corr_dot_avx512(const TA *a, const TB *b, int n, double a_mean, double b_mean, double *sums) {
+    __m512d sum_ab_diff = _mm512_setzero_pd();
+    __m512d vam = _mm512_set1_pd(a_mean), vbm = _mm512_set1_pd(b_mean);
+
+    for (int i = 0; i < n; i += 8) {
+        __m512d va = _mm512_sub_pd(simd_load8(&a[i]), vam);
+        __m512d vb = _mm512_sub_pd(simd_load8(&b[i]), vbm);
+        sum_ab_diff = _mm512_fmadd_pd(va, vb, sum_ab_diff);
+    }
+    _mm512_storeu_pd(sums, sum_ab_diff);
+}
+#endif
+
+// Pearson's correlation coefficient of two vectors, each either float32 or
+// float64. Everything is accumulated in double precision, so float32 input
+// gives the same result as the same data converted to float64.
+template <typename TA, typename TB>
+inline double __corr__(const TA *a, const TB *b, int ngene) {
+    double sums[32];
+    int n8 = ngene - ngene % 8;
+    int i;
+
+#if SIMD_X86
+    if (simd_level == SIMD_AVX512)
+        corr_sums_avx512(a, b, n8, sums);
+    else if (simd_level == SIMD_AVX2)
+        corr_sums_avx2(a, b, n8, sums);
+    else
+#endif
+        corr_sums_scalar(a, b, n8, sums);
+
+    double a_mean = 0, b_mean = 0, aa_mean = 0, bb_mean = 0;
+    for(int j = 0; j < 8; j++) {
+        a_mean += sums[j];
+        b_mean += sums[8 + j];
+        aa_mean += sums[16 + j];
+        bb_mean += sums[24 + j];
+    }
+    a_mean /= ngene;
+    b_mean /= ngene;
+    aa_mean /= ngene;
+    bb_mean /= ngene;
+
+    // Handle remainder
+    for (i = n8; i < ngene; i++) {
+        a_mean += a[i] / (double)ngene;
+        b_mean += b[i] / (double)ngene;
+        aa_mean += (double)a[i] * a[i] / ngene;
+        bb_mean += (double)b[i] * b[i] / ngene;
+    }
+
+    double a_std = sqrt(aa_mean - a_mean * a_mean);
+    double b_std = sqrt(bb_mean - b_mean * b_mean);
+    double rtn = 0;
+
+    if (a_std != 0 && b_std != 0) {
+#if SIMD_X86
+        if (simd_level == SIMD_AVX512)
+            corr_dot_avx512(a, b, n8, a_mean, b_mean, sums);
+        else if (simd_level == SIMD_AVX2)
+            corr_dot_avx2(a, b, n8, a_mean, b_mean, sums);
+        else
+#endif
+            corr_dot_scalar(a, b, n8, a_mean, b_mean, sums);
+
+        for(int j = 0; j < 8; j++) {
+            rtn += sums[j];
+        }
+
+        for (i = n8; i < ngene; i++) {
+            rtn += (a[i] - a_mean) * (b[i] - b_mean);
+        }
+
+        rtn /= (a_std * b_std * ngene);
+    }
+
+    return rtn;
+}
+
+// Mean and sum of squared deviations of a vector, with 8 independent partial
+// sums so the compiler can vectorize the reductions.
+template <typename T>
+inline void vec_moments(const T *vec, long n, double *mean, double *ss) {
+    double ps[8] = { 0 }, m = 0, d = 0;
+    long n8 = n - n % 8, i;
+
+    for (i = 0; i < n8; i += 8)
+        for (int j = 0; j < 8; j++)
+            ps[j] += vec[i + j];
+    for (int j = 0; j < 8; j++)
+        m += ps[j];
+    for (; i < n; i++)
+        m += vec[i];
+    m /= n;
+
+    std::fill_n(ps, 8, 0.0);
+    for (i = 0; i < n8; i += 8)
+        for (int j = 0; j < 8; j++)
+            ps[j] += (vec[i + j] - m) * (vec[i + j] - m);
+    for (int j = 0; j < 8; j++)
+        d += ps[j];
+    for (; i < n; i++)
+        d += (vec[i] - m) * (vec[i] - m);
+
+    *mean = m;
+    *ss = d;
+}
+
+// Dot product of two vectors, with 8 independent partial sums like
+// vec_moments(). For the unit vectors of unit_vf() this is Pearson's
+// correlation coefficient.
+template <typename TA, typename TB>
+inline double unit_dot(const TA *a, const TB *b, long n) {
+    double ps[8] = { 0 }, d = 0;
+    long n8 = n - n % 8, i;
+
+    for (i = 0; i < n8; i += 8)
+        for (int j = 0; j < 8; j++)
+            ps[j] += (double)a[i + j] * b[i + j];
+    for (int j = 0; j < 8; j++)
+        d += ps[j];
+    for (; i < n; i++)
+        d += (double)a[i] * b[i];
+    return d;
+}
+
+// Correlation of a unit vector with a centred vector s.
+template <typename T>
+inline double unit_corr(const T *u, const double *s, long n) {
+    double ss = unit_dot(s, s, n);
+    return (ss > 0) ? unit_dot(u, s, n) / sqrt(ss) : 0;
+}
+
+// Centres every vector and divides it by its L2 norm (the square root of its
+// sum of squared deviations), so that the correlation of two vectors is the
+// dot product of their unit vectors. Vectors with zero variance become zero.
+// norms receives the L2 norms of the centred vectors.
+template <typename T>
+inline void unit_vf(T *out, double *norms, const T *vecs, long nvec, long ngene, int ncores) {
+    long i;
+
+    #pragma omp parallel for num_threads(ncores)
+    for (i = 0; i < nvec; i++) {
+        const T *v = vecs + i * ngene;
+        double mean, ss;
+        vec_moments(v, ngene, &mean, &ss);
+        norms[i] = sqrt(ss);
+        for (long g = 0; g < ngene; g++)
+            out[i * ngene + g] = (ss > 0) ? (T)((v[g] - mean) / norms[i]) : 0;
+    }
+}
+
+// Copies the per-thread KDE results into flat coordinate and value arrays.
+template <typename TI, typename TV>
+inline void kde_export(const std::vector<kde_part> &parts, const std::vector<long> &offs,
+                       void *ox, void *oy, void *oz, void *ov, int ncores) {
+    TI *xo = (TI *)ox, *yo = (TI *)oy, *zo = (TI *)oz;
+    TV *vo = (TV *)ov;
+    long nparts = parts.size();
+
+    #pragma omp parallel for num_threads(ncores) schedule(dynamic)
+    for (long j = 0; j < nparts; j++) {
+        const kde_part &part = parts[j];
+        long o = offs[j];
+        for (size_t k = 0; k < part.val.size(); k++) {
+            xo[o + k] = (TI)part.pos[k].x;
+            yo[o + k] = (TI)part.pos[k].y;
+            zo[o + k] = (TI)part.pos[k].z;
+            vo[o + k] = (TV)part.val[k];
+        }
+    }
+}
+
+// Block-sparse vector field. The grid is split into tiles of tile[0] x
+// tile[1] x tile[2] pixels, numbered in raster order. Each tile has an
+// occupancy bitmap of nwords 64-bit words, where bit i is set if the pixel at
+// raster index i of the (unclipped) tile has any nonzero gene. The occupied
+// pixels of tile t are [tile_ptr[t], tile_ptr[t + 1]) in bit order, and
+// occupied pixel v lists its nonzero genes in increasing order as
+// genes[vox_ptr[v]:vox_ptr[v + 1]], with their values. In Python, a field is
+// the tuple (shape, tile_shape, tile_ptr, bitmap, vox_ptr, genes, values).
+#define SVF_NARRAYS 7
+
+struct svf_view {
+    long shape[3];
+    long ngene;
+    long tile[3];
+    long ntiles[3];
+    long nwords;
+    const int64_t *tile_ptr;
+    const uint64_t *bitmap;
+    const int64_t *vox_ptr;
+    const int32_t *genes;
+    const float *values;
+    std::vector<long> rank; // occupied pixels of a tile before each bitmap word
+};
+
+// Grid position of the pixel at raster index l of tile t.
+inline void svf_pixel(const svf_view &v, long t, long l, long *p) {
+    p[0] = t / (v.ntiles[1] * v.ntiles[2]) * v.tile[0] + l / (v.tile[1] * v.tile[2]);
+    p[1] = (t / v.ntiles[2]) % v.ntiles[1] * v.tile[1] + (l / v.tile[2]) % v.tile[1];
+    p[2] = t % v.ntiles[2] * v.tile[2] + l % v.tile[2];
+}
+
+// Index of the occupied pixel at a grid position, or -1 if the pixel is empty.
+inline long svf_find(const svf_view &v, long x, long y, long z) {
+    long t = I3D(x / v.tile[0], y / v.tile[1], z / v.tile[2], v.ntiles[1], v.ntiles[2]);
+    long l = I3D(x % v.tile[0], y % v.tile[1], z % v.tile[2], v.tile[1], v.tile[2]);
+    uint64_t w = v.bitmap[t * v.nwords + l / 64];
+    if (!((w >> (l % 64)) & 1))
+        return -1;
+    return v.tile_ptr[t] + v.rank[t * v.nwords + l / 64] + __builtin_popcountll(w & ((1ULL << (l % 64)) - 1));
+}
+
+// Calls visit(pixel index, grid position) for every occupied pixel of tile t.
+template <typename F>
+inline void svf_visit(const svf_view &v, long t, F visit) {
+    long vox = v.tile_ptr[t], p[3];
+    for (long w = 0; w < v.nwords; w++) {
+        uint64_t bits = v.bitmap[t * v.nwords + w];
+        while (bits) {
+            svf_pixel(v, t, w * 64 + __builtin_ctzll(bits), p);
+            visit(vox++, p);
+            bits &= bits - 1;
+        }
+    }
+}
+
+// Builds a sparse field from the dense block vf (dims[0] x dims[1] x dims[2]
+// x ngene), in two passes over the tiles. The first pass (with NULL outputs)
+// counts the occupied pixels and nonzero values of every tile into npix and
+// nnz; the second, given the arrays sized from those counts, fills them.
+template <typename T, typename TV>
+inline void svf_build(std::vector<long> &npix, std::vector<long> &nnz, const T *vf, const long *dims, long ngene, const long *tile,
+                      int64_t *tile_ptr, uint64_t *bitmap, int64_t *vox_ptr, int32_t *genes, TV *values, int ncores) {
+    const long ntiles[3] = { (dims[0] + tile[0] - 1) / tile[0], (dims[1] + tile[1] - 1) / tile[1], (dims[2] + tile[2] - 1) / tile[2] };
+    const long nt = ntiles[0] * ntiles[1] * ntiles[2];
+    const long nwords = (tile[0] * tile[1] * tile[2] + 63) / 64;
+    const bool fill = tile_ptr != NULL;
+    std::vector<long> nnz_ptr;
+
+    if (fill) {
+        // Value offsets of the tiles; pixel offsets are in tile_ptr
+        nnz_ptr.assign(nt + 1, 0);
+        tile_ptr[0] = 0;
+        for (long t = 0; t < nt; t++) {
+            tile_ptr[t + 1] = tile_ptr[t] + npix[t];
+            nnz_ptr[t + 1] = nnz_ptr[t] + nnz[t];
+        }
+        vox_ptr[tile_ptr[nt]] = nnz_ptr[nt];
+    } else {
+        npix.assign(nt, 0);
+        nnz.assign(nt, 0);
+    }
+
+    #pragma omp parallel for num_threads(ncores) schedule(dynamic)
+    for (long t = 0; t < nt; t++) {
+        const long o[3] = { t / (ntiles[1] * ntiles[2]) * tile[0], (t / ntiles[2]) % ntiles[1] * tile[1], t % ntiles[2] * tile[2] };
+        long vox = fill ? tile_ptr[t] : 0, k = fill ? nnz_ptr[t] : 0;
+        if (fill)
+            std::fill_n(bitmap + t * nwords, nwords, (uint64_t)0);
+        for (long x = o[0]; x < std::min(o[0] + tile[0], dims[0]); x++) {
+            for (long y = o[1]; y < std::min(o[1] + tile[1], dims[1]); y++) {
+                for (long z = o[2]; z < std::min(o[2] + tile[2], dims[2]); z++) {
+                    const T *vec = vf + I3D(x, y, z, dims[1], dims[2]) * ngene;
+                    long k0 = k;
+                    for (long g = 0; g < ngene; g++) {
+                        if (vec[g] == 0)
+                            continue;
+                        if (fill) {
+                            genes[k] = (int32_t)g;
+                            values[k] = (TV)vec[g];
+                        }
+                        k++;
+                    }
+                    if (k == k0)
+                        continue;
+                    if (fill) {
+                        long l = I3D(x - o[0], y - o[1], z - o[2], tile[1], tile[2]);
+                        bitmap[t * nwords + l / 64] |= (uint64_t)1 << (l % 64);
+                        vox_ptr[vox] = k0;
+                    }
+                    vox++;
+                }
+            }
+        }
+        if (!fill) {
+            npix[t] = vox;
+            nnz[t] = k;
+        }
+    }
+}
+
+// Writes the block [borg, borg + bext) of a sparse field into a zeroed dense
+// block, laid out as [x][y][z][gene]. Only the tiles overlapping the block
+// are decoded.
+inline void svf_dense(float *out, const svf_view &v, const long *borg, const long *bext, int ncores) {
+    long tlo[3], thi[3], nt[3];
+    for (int d = 0; d < 3; d++) {
+        tlo[d] = borg[d] / v.tile[d];
+        thi[d] = (borg[d] + bext[d] + v.tile[d] - 1) / v.tile[d];
+        nt[d] = thi[d] - tlo[d];
+    }
+
+    #pragma omp parallel for num_threads(ncores) schedule(dynamic)
+    for (long j = 0; j < nt[0] * nt[1] * nt[2]; j++) {
+        long t = I3D(tlo[0] + j / (nt[1] * nt[2]), tlo[1] + (j / nt[2]) % nt[1], tlo[2] + j % nt[2], v.ntiles[1], v.ntiles[2]);
+        svf_visit(v, t, [&](long vox, const long *p) {
+            long q[3];
+            for (int d = 0; d < 3; d++) {
+                q[d] = p[d] - borg[d];
+                if (q[d] < 0 || q[d] >= bext[d])
+                    return;
+            }
+            float *o = out + I3D(q[0], q[1], q[2], bext[1], bext[2]) * v.ngene;
+            for (long k = v.vox_ptr[vox]; k < v.vox_ptr[vox + 1]; k++)
+                o[v.genes[k]] = v.values[k];
+        });
+    }
+}
+
+// Mean over all genes (empty ones included) and sum of squared deviations of
+// an occupied pixel, in two passes like vec_moments(): the empty genes each
+// deviate by -mean.
+inline void svf_moments(const svf_view &v, long vox, double *mean, double *ss) {
+    double s1 = 0, d = 0;
+    for (long k = v.vox_ptr[vox]; k < v.vox_ptr[vox + 1]; k++)
+        s1 += v.values[k];
+    *mean = s1 / v.ngene;
+    for (long k = v.vox_ptr[vox]; k < v.vox_ptr[vox + 1]; k++)
+        d += (v.values[k] - *mean) * (v.values[k] - *mean);
+    *ss = d + (v.ngene - (v.vox_ptr[vox + 1] - v.vox_ptr[vox])) * *mean * *mean;
+}
+
+// calc_ctmap() for a sparse field. ucent is the unit vector of the centroid
+// (see unit_vf()); it sums to zero, so only the nonzero genes of a pixel
+// contribute: corr = (v . ucent) / |v - mean(v)|. Empty pixels keep their
+// score of 0, like vectors with zero variance in __corr__.
+inline void ctmap_sparse(double *scores, const double *ucent, const svf_view &v, int ncores) {
+    long nt = v.ntiles[0] * v.ntiles[1] * v.ntiles[2];
+
+    #pragma omp parallel for num_threads(ncores) schedule(dynamic)
+    for (long t = 0; t < nt; t++) {
+        svf_visit(v, t, [&](long vox, const long *p) {
+            double mean, ss, dot = 0;
+            svf_moments(v, vox, &mean, &ss);
+            for (long k = v.vox_ptr[vox]; k < v.vox_ptr[vox + 1]; k++)
+                dot += v.values[k] * ucent[v.genes[k]];
+            scores[I3D(p[0], p[1], p[2], v.shape[1], v.shape[2])] = (ss > 0) ? dot / sqrt(ss) : 0;
+        });
+    }
+}
+
+// calc_corrmap() for a sparse field: correlates every occupied pixel at least
+// csize away from the border with the sum of its occupied neighbours. The
+// other pixels of the inner region are empty, and correlated 0.
+inline void corrmap_sparse(double *corrmap, const svf_view &v, int csize, int ncores) {
+    const long r[3] = { csize, csize, (v.shape[2] > 1) ? csize : 0 };
+    long nt = v.ntiles[0] * v.ntiles[1] * v.ntiles[2];
+    long x;
+
+    for (int d = 0; d < 3; d++)
+        if (v.shape[d] - 2 * r[d] <= 0)
+            return;
+    #pragma omp parallel for num_threads(ncores)
+    for (x = r[0]; x < v.shape[0] - r[0]; x++)
+        for (long y = r[1]; y < v.shape[1] - r[1]; y++)
+            std::fill_n(&corrmap[I3D(x, y, r[2], v.shape[1], v.shape[2])], v.shape[2] - 2 * r[2], 0.0);
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        std::vector<double> nb(v.ngene);
+
+        #pragma omp for schedule(dynamic)
+        for (long t = 0; t < nt; t++) {
+            svf_visit(v, t, [&](long vox, const long *p) {
+                for (int d = 0; d < 3; d++)
+                    if (p[d] < r[d] || p[d] >= v.shape[d] - r[d])
+                        return;
+                std::fill(nb.begin(), nb.end(), 0.0);
+                for (long dx = -r[0]; dx <= r[0]; dx++) {
+                    for (long dy = -r[1]; dy <= r[1]; dy++) {
+                        for (long dz = -r[2]; dz <= r[2]; dz++) {
+                            long q;
+                            if ((dx == 0 && dy == 0 && dz == 0) || (q = svf_find(v, p[0] + dx, p[1] + dy, p[2] + dz)) < 0)
+                                continue;
+                            for (long k = v.vox_ptr[q]; k < v.vox_ptr[q + 1]; k++)
+                                nb[v.genes[k]] += v.values[k];
+                        }
+                    }
+                }
+                double mean, ss, nmean, nss, dot = 0;
+                svf_moments(v, vox, &mean, &ss);
+                vec_moments(nb.data(), v.ngene, &nmean, &nss);
+                for (long k = v.vox_ptr[vox]; k < v.vox_ptr[vox + 1]; k++)
+                    dot += v.values[k] * (nb[v.genes[k]] - nmean);
+                corrmap[I3D(p[0], p[1], p[2], v.shape[1], v.shape[2])] = (ss > 0 && nss > 0) ? dot / sqrt(ss * nss) : 0;
+            });
+        }
+    }
+}
+
+// Grows the region of voxels correlated with the seed by more than r,
+// breadth first from the seed, over the 4 (2D) or 6 (3D) neighbours of each
+// voxel. region receives the linear indices of the region in visiting order.
+// Returns false (with a partial region) if it grows beyond max_pixels.
+// The seed is centred and normalised once; each candidate voxel's mean and
+// variance are computed once per seed, when it is first tested. If unit, vf
+// holds the unit vectors of unit_vf() and the correlation is a dot product.
+template <typename T>
+inline bool flood_grow(std::vector<long> &region, const T *vf, long seed, const long *dims, long ngene, double r, long max_pixels, bool unit) {
+    const long steps[3] = { dims[1] * dims[2], dims[2], 1 };
+    std::vector<double> u(ngene);
+    std::unordered_set<long> visited;
+    std::queue<long> queue;
+    double mean, ss, usum = 0;
+
+    region.clear();
+    if (unit) {
+        for (long g = 0; g < ngene; g++)
+            u[g] = vf[seed * ngene + g];
+    } else {
+        vec_moments(vf + seed * ngene, ngene, &mean, &ss);
+    }
+    if (!unit && ss > 0) {
+        for (long g = 0; g < ngene; g++) {
+            u[g] = (vf[seed * ngene + g] - mean) / sqrt(ss);
+            usum += u[g];
+        }
+    }
+
+    visited.insert(seed);
+    queue.push(seed);
+    while (queue.size() > 0) {
+        long idx = queue.front();
+        queue.pop();
+        if ((long)region.size() >= max_pixels)
+            return false;
+        region.push_back(idx);
+
+        long pos[3] = { idx / steps[0], (idx / steps[1]) % dims[1], idx % dims[2] };
+        for (int d = 0; d < 3; d++) {
+            if (dims[d] == 1)
+                continue;
+            for (int dir = 1; dir >= -1; dir -= 2) {
+                if (pos[d] + dir < 0 || pos[d] + dir >= dims[d])
+                    continue;
+                long nidx = idx + dir * steps[d];
+                if (!visited.insert(nidx).second)
+                    continue;
+                const T *v = vf + nidx * ngene;
+                double vmean = 0, vss = 1, dot[8] = { 0 }, c = 0;
+                long g;
+                if (!unit)
+                    vec_moments(v, ngene, &vmean, &vss);
+                if (vss > 0) {
+                    for (g = 0; g + 8 <= ngene; g += 8)
+                        for (int j = 0; j < 8; j++)
+                            dot[j] += u[g + j] * v[g + j];
+                    for (int j = 0; j < 8; j++)
+                        c += dot[j];
+                    for (; g < ngene; g++)
+                        c += u[g] * v[g];
+                    c = (c - vmean * usum) / sqrt(vss);
+                }
+                if (c > r)
+                    queue.push(nidx);
+            }
+        }
+    }
+    return true;
+}
+
+// Correlates every voxel with the sum of its neighbours. If norms is given,
+// vecs holds the unit vectors of unit_vf() and norms their L2 norms; the
+// neighbours are then summed up as their centred vectors (norm * unit vector),
+// and each correlation is a dot product with the voxel's unit vector.
+template <typename T>
+inline void corrmap_vf(double *corrmap, const T *vecs, const double *norms, const intptr_t *dimsp, long nd, long ngene, int csize, int ncores) {
+    long i, x, y, z, dx, dy, dz;
+    double *tmpvec;
+
+    stats_loop loop("corrmap", ncores);
+    if (nd == 3) {
+        // 2D
+        #pragma omp parallel num_threads(ncores) private(tmpvec)
+        {
+            tmpvec = (double *)calloc(ngene, sizeof(double)); // zero initialized
+            #pragma omp for collapse(2) nowait
+            for (x=csize; x<dimsp[0]-csize; x++) {
+                for (y=csize; y<dimsp[1]-csize; y++) {
+                    for (i=0; i<ngene; i++)
+                        tmpvec[i] = 0;
+                    for (dx=-csize; dx<csize+1; dx++) {
+                        for (dy=-csize; dy<csize+1; dy++) {
+                            if (dx == 0 && dy == 0) continue;
+                            long nidx = I2D(x+dx, y+dy, dimsp[1]);
+                            double w = norms ? norms[nidx] : 1.0;
+                            for (i=0; i<ngene; i++)
+                                tmpvec[i] += w * (vecs + nidx*ngene)[i];
+                        }
+                    }
+                    // tmpvec[i] /= (csize * 2 + 1) * (csize * 2 + 1) - 1;
+                    if (norms)
+                        corrmap[I2D(x, y, dimsp[1])] = unit_corr(vecs + I2D(x, y, dimsp[1])*ngene, tmpvec, ngene);
+                    else
+                        corrmap[I2D(x, y, dimsp[1])] = __corr__(vecs + I2D(x, y, dimsp[1])*ngene, tmpvec, ngene);
+                }
+            }
+            loop.done();
+            free((void*)tmpvec);
+        }
+    } else {
+        // 3D (nd == 4)
+        #pragma omp parallel num_threads(ncores) private(tmpvec)
+        {
+            tmpvec = (double *)calloc(ngene, sizeof(double));
+            #pragma omp for collapse(3) nowait
+            for (x=csize; x<dimsp[0]-csize; x++) {
+                for (y=csize; y<dimsp[1]-csize; y++) {
+                    for (z=csize; z<dimsp[2]-csize; z++) {
+                        for (i=0; i<ngene; i++)
+                            tmpvec[i] = 0;
+                        for (dx=-csize; dx<csize+1; dx++) {
+                            for (dy=-csize; dy<csize+1; dy++) {
+                                for (dz=-csize; dz<csize+1; dz++) {
+                                    if (dx == 0 && dy == 0 && dz == 0) continue;
+                                    long nidx = I3D(x+dx, y+dy, z+dz, dimsp[1], dimsp[2]);
+                                    double w = norms ? norms[nidx] : 1.0;
+                                    for (i=0; i<ngene; i++)
+                                        tmpvec[i] += w * (vecs + nidx*ngene)[i];
+                                }
+                            }
+                        }
+                        //for (i=0; i<ngene; i++)
+                        //    tmpvec[i] /= (csize * 2 + 1) * (csize * 2 + 1) * (csize * 2 + 1) - 1;
+                        if (norms)
+                            corrmap[I3D(x, y, z, dimsp[1], dimsp[2])] =
+                                unit_corr(vecs + I3D(x, y, z, dimsp[1], dimsp[2])*ngene, tmpvec, ngene);
+                        else
+                            corrmap[I3D(x, y, z, dimsp[1], dimsp[2])] =
+                                __corr__(vecs + I3D(x, y, z, dimsp[1], dimsp[2])*ngene, tmpvec, ngene);
+                    }
+                }
+            }
+            loop.done();
+            free((void*)tmpvec);
+        }
+    }
+    loop.end();
+}
+
+// Bytes of the per-thread running-sum buffer of the sliding-window corrmap.
+// Tiles are shrunk until the neighbourhood sums of a tile plus its halo fit.
+#define CORRMAP_TILE_BYTES (1 << 21)
+
+// Same as corrmap_vf(), but the neighbourhood sums are built with running sums
+// along z, y and x over cache-sized tiles, so each voxel costs O(ngene)
+// regardless of the window size. The sum of the (2 * csize + 1)^d window minus
+// the centre equals the direct kernel's neighbour sum up to rounding.
+template <typename T>
+inline void corrmap_sliding_vf(double *corrmap, const T *vecs, const double *norms, const intptr_t *dimsp, long nd, long ngene, int csize, int ncores) {
+    long dims[3] = { dimsp[0], dimsp[1], (nd == 4) ? dimsp[2] : 1 };
+    long r[3] = { csize, csize, (nd == 4) ? csize : 0 };
+    long lo[3], ts[3], nt[3];
+    long ntiles = 1;
+    int d;
+
+    for (d = 0; d < 3; d++) {
+        lo[d] = r[d];
+        if (dims[d] - 2 * r[d] <= 0)
+            return;
+    }
+    ts[0] = ts[1] = 32;
+    ts[2] = (nd == 4) ? 32 : 1;
+    while ((ts[0] + 2 * r[0]) * (ts[1] + 2 * r[1]) * ts[2] * ngene * (long)sizeof(double) > CORRMAP_TILE_BYTES &&
+           (ts[0] > 1 || ts[1] > 1 || ts[2] > 1)) {
+        d = (ts[2] >= ts[0] && ts[2] >= ts[1]) ? 2 : ((ts[1] >= ts[0]) ? 1 : 0);
+        ts[d] = (ts[d] + 1) / 2;
+    }
+    for (d = 0; d < 3; d++) {
+        nt[d] = (dims[d] - 2 * r[d] + ts[d] - 1) / ts[d];
+        ntiles *= nt[d];
+    }
+
+    const long scratch = ncores * ((ts[0] + 2 * r[0]) * (ts[1] + 2 * r[1] + ts[1]) * ts[2] + 1) * ngene * (long)sizeof(double);
+    stats_scratch(scratch);
+    stats_loop loop("corrmap_sliding", ncores);
+    #pragma omp parallel num_threads(ncores)
+    {
+        std::vector<double> sz((ts[0] + 2 * r[0]) * (ts[1] + 2 * r[1]) * ts[2] * ngene);
+        std::vector<double> syz((ts[0] + 2 * r[0]) * ts[1] * ts[2] * ngene);
+        std::vector<double> box(ngene);
+
+        #pragma omp for schedule(dynamic) nowait
+        for (long tidx = 0; tidx < ntiles; tidx++) {
+            long tile[3] = { tidx / (nt[1] * nt[2]), (tidx / nt[2]) % nt[1], tidx % nt[2] };
+            long o[3], e[3];
+            for (int k = 0; k < 3; k++) {
+                o[k] = lo[k] + tile[k] * ts[k];
+                e[k] = std::min(ts[k], dims[k] - r[k] - o[k]);
+            }
+            long ex = e[0] + 2 * r[0], ey = e[1] + 2 * r[1];
+            long g, i, j, k;
+
+            // Window sums along z, over the tile and its halo in x and y
+            for (i = 0; i < ex; i++) {
+                for (j = 0; j < ey; j++) {
+                    long lidx = I3D(o[0] - r[0] + i, o[1] - r[1] + j, 0, dims[1], dims[2]);
+                    const T *line = vecs + lidx * ngene;
+                    const double *lw = norms ? norms + lidx : NULL;
+                    double *out = &sz[I3D(i, j, 0, ey, e[2]) * ngene];
+                    std::fill_n(out, ngene, 0.0);
+                    for (long dz = -r[2]; dz <= r[2]; dz++) {
+                        double w = lw ? lw[o[2] + dz] : 1.0;
+                        for (g = 0; g < ngene; g++)
+                            out[g] += w * line[(o[2] + dz) * ngene + g];
+                    }
+                    for (k = 1; k < e[2]; k++) {
+                        const T *add = line + (o[2] + k + r[2]) * ngene;
+                        const T *sub = line + (o[2] + k - 1 - r[2]) * ngene;
+                        double wa = lw ? lw[o[2] + k + r[2]] : 1.0, ws = lw ? lw[o[2] + k - 1 - r[2]] : 1.0;
+                        for (g = 0; g < ngene; g++)
+                            out[k * ngene + g] = out[(k - 1) * ngene + g] + wa * add[g] - ws * sub[g];
+                    }
+                }
+            }
+
+            // Window sums along y
+            for (i = 0; i < ex; i++) {
+                for (k = 0; k < e[2]; k++) {
+                    double *out = &syz[I3D(i, 0, k, e[1], e[2]) * ngene];
+                    std::fill_n(out, ngene, 0.0);
+                    for (j = 0; j <= 2 * r[1]; j++)
+                        for (g = 0; g < ngene; g++)
+                            out[g] += sz[I3D(i, j, k, ey, e[2]) * ngene + g];
+                    for (j = 1; j < e[1]; j++) {
+                        double *cur = &syz[I3D(i, j, k, e[1], e[2]) * ngene];
+                        const double *prev = &syz[I3D(i, j - 1, k, e[1], e[2]) * ngene];
+                        const double *add = &sz[I3D(i, j + 2 * r[1], k, ey, e[2]) * ngene];
+                        const double *sub = &sz[I3D(i, j - 1, k, ey, e[2]) * ngene];
+                        for (g = 0; g < ngene; g++)
+                            cur[g] = prev[g] + add[g] - sub[g];
+                    }
+                }
+            }
+
+            // Window sums along x, then correlate each voxel with its neighbours
+            for (j = 0; j < e[1]; j++) {
+                for (k = 0; k < e[2]; k++) {
+                    std::fill(box.begin(), box.end(), 0.0);
+                    for (i = 0; i <= 2 * r[0]; i++)
+                        for (g = 0; g < ngene; g++)
+                            box[g] += syz[I3D(i, j, k, e[1], e[2]) * ngene + g];
+                    for (i = 0; i < e[0]; i++) {
+                        if (i > 0) {
+                            const double *add = &syz[I3D(i + 2 * r[0], j, k, e[1], e[2]) * ngene];
+                            const double *sub = &syz[I3D(i - 1, j, k, e[1], e[2]) * ngene];
+                            for (g = 0; g < ngene; g++)
+                                box[g] += add[g] - sub[g];
+                        }
+                        long vidx = I3D(o[0] + i, o[1] + j, o[2] + k, dims[1], dims[2]);
+                        const T *center = vecs + vidx * ngene;
+                        double *nb = &sz[0]; // z sums of this tile are no longer needed
+                        double w = norms ? norms[vidx] : 1.0;
+                        for (g = 0; g < ngene; g++)
+                            nb[g] = box[g] - w * center[g];
+                        corrmap[vidx] = norms ? unit_corr(center, nb, ngene) : __corr__(center, nb, ngene);
+                    }
+                }
+            }
+        }
+        loop.done();
+    }
+    loop.end();
+    stats_scratch(-scratch);
+}
+
+// Correlates every voxel with each of its neighbours, in the order of the
+// offsets (dx, dy[, dz]) without the centre. Only the voxels at least csize
+// away from the border get correlations. The correlation is symmetric, so
+// each pair is computed once, from the voxel it is a forward offset of:
+// offset k of a voxel is offset nnb - 1 - k of its neighbour. If unit, vecs
+// holds the unit vectors of unit_vf() and each correlation is a dot product.
+template <typename T>
+inline void corrmap_2_vf(double *corrmap, const T *vecs, const intptr_t *dimsp, long nd, long ngene, int csize, bool unit, int ncores) {
+    const long dims[3] = { dimsp[0], dimsp[1], (nd == 4) ? dimsp[2] : 1 };
+    const long r[3] = { csize, csize, (nd == 4) ? csize : 0 };
+    const long w[3] = { 2 * r[0] + 1, 2 * r[1] + 1, 2 * r[2] + 1 };
+    const long nnb = w[0] * w[1] * w[2] - 1;
+    std::vector<long> offs;
+    long x, y;
+
+    // Offsets past the centre, as (dx, dy, dz) triples
+    for (long j = nnb / 2 + 1; j <= nnb; j++) {
+        offs.push_back(j / (w[1] * w[2]) - r[0]);
+        offs.push_back((j / w[2]) % w[1] - r[1]);
+        offs.push_back(j % w[2] - r[2]);
+    }
+
+    #pragma omp parallel for collapse(2) num_threads(ncores)
+    for (x=0; x<dims[0]; x++) {
+        for (y=0; y<dims[1]; y++) {
+            for (long z=0; z<dims[2]; z++) {
+                const long p[3] = { x, y, z };
+                bool inner = true;
+                for (int d = 0; d < 3; d++)
+                    inner = inner && p[d] >= r[d] && p[d] < dims[d] - r[d];
+                long vidx = I3D(x, y, z, dims[1], dims[2]);
+                for (long k = nnb / 2; k < nnb; k++) {
+                    const long *o = &offs[(k - nnb / 2) * 3];
+                    bool ninner = true, inside = true;
+                    for (int d = 0; d < 3; d++) {
+                        long q = p[d] + o[d];
+                        inside = inside && q >= 0 && q < dims[d];
+                        ninner = ninner && q >= r[d] && q < dims[d] - r[d];
+                    }
+                    if (!inside || !(inner || ninner))
+                        continue;
+                    long nidx = I3D(x + o[0], y + o[1], z + o[2], dims[1], dims[2]);
+                    const T *a = vecs + vidx * ngene, *b = vecs + nidx * ngene;
+                    double c = unit ? unit_dot(a, b, ngene) : __corr__(a, b, ngene);
+                    if (inner)
+                        corrmap[vidx * nnb + k] = c;
+                    if (ninner)
+                        corrmap[nidx * nnb + nnb - 1 - k] = c;
+                }
+            }
+        }
+    }
+}
+
+// If unit, vecs holds the unit vectors of unit_vf(); the centroid is then
+// turned into a unit vector once, and each correlation is a dot product.
+template <typename T>
+inline void ctmap_vf(double *scores, const double *cent, const T *vecs, long nvec, long ngene, bool unit, int ncores) {
+    std::vector<double> ucent;
+    double norm;
+    long i;
+
+    if (unit) {
+        ucent.resize(ngene);
+        unit_vf(ucent.data(), &norm, cent, 1, ngene, 1);
+    }
+
+    stats_loop loop("ctmap", ncores);
+    #pragma omp parallel num_threads(ncores)
+    {
+        #pragma omp for nowait
+        for (i=0; i<nvec; i++) {
+            if (unit)
+                scores[i] = unit_dot(ucent.data(), vecs + (i*ngene), ngene);
+            else
+                scores[i] = __corr__(cent, vecs + (i*ngene), ngene);
+        }
+        loop.done();
+    }
+    loop.end();
+}
+
+// Vectors per task of the batched cell-type mapper, and the width of the
+// centroid strips the multiply is register-blocked over. The centroid matrix
+// is packed as [strip][gene][CTMAP_STRIP] and zero padded to whole strips.
+#define CTMAP_BLOCK_VEC 64
+#define CTMAP_STRIP 16
+
+// acc[v][c] = vecs[v] . cent[c] for nv vectors, as a sequential FMA chain over
+// the genes in the SIMD variants. acc has room for a multiple of 8 vectors;
+// the rows past nv are scratch.
+template <typename T>
+inline void ctmap_gemm_scalar(double *acc, const T *vecs, long nv, long ngene, const double *cent, long ncp) {
+    for (long v = 0; v < nv; v++) {
+        const T *vec = vecs + v * ngene;
+        for (long c0 = 0; c0 < ncp; c0 += CTMAP_STRIP) {
+            const double *strip = cent + c0 * ngene;
+            double *out = acc + v * ncp + c0;
+            std::fill_n(out, CTMAP_STRIP, 0.0);
+            for (long g = 0; g < ngene; g++) {
+                for (int c = 0; c < CTMAP_STRIP; c++)
+                    out[c] += (double)vec[g] * strip[g * CTMAP_STRIP + c];
+            }
+        }
+    }
+}
+
+#if SIMD_X86
+template <typename T>
+__attribute__((target("avx2,fma"))) inline void ctmap_gemm_avx2(double *acc, const T *vecs, long nv, long ngene, const double *cent, long ncp) {
+    for (long v = 0; v < nv; v += 4) {
+        const T *r[4];
+        for (int j = 0; j < 4; j++)
+            r[j] = vecs + std::min(v + j, nv - 1) * ngene;
+        for (long c0 = 0; c0 < ncp; c0 += 8) {
+            // Half a strip at a time, to fit the accumulators in 16 registers
+            const double *strip = cent + (c0 / CTMAP_STRIP) * CTMAP_STRIP * ngene + c0 % CTMAP_STRIP;
+            __m256d s[4][2];
+            for (int j = 0; j < 4; j++)
+                s[j][0] = s[j][1] = _mm256_setzero_pd();
+            for (long g = 0; g < ngene; g++) {
+                __m256d c_lo = _mm256_loadu_pd(&strip[g * CTMAP_STRIP]);
+                __m256d c_hi = _mm256_loadu_pd(&strip[g * CTMAP_STRIP + 4]);
+                for (int j = 0; j < 4; j++) {
+                    __m256d va = _mm256_set1_pd((double)r[j][g]);
+                    s[j][0] = _mm256_fmadd_pd(va, c_lo, s[j][0]);
+                    s[j][1] = _mm256_fmadd_pd(va, c_hi, s[j][1]);
+                }
+            }
+            for (int j = 0; j < 4; j++) {
+                _mm256_storeu_pd(&acc[(v + j) * ncp + c0], s[j][0]);
+                _mm256_storeu_pd(&acc[(v + j) * ncp + c0 + 4], s[j][1]);
+            }
+        }
+    }
+}
+
+template <typename T>
+__attribute__((target("avx512f"))) inline void ctmap_gemm_avx512(double *acc, const T *vecs, long nv, long ngene, const double *cent, long ncp) {
+    for (long v = 0; v < nv; v += 8) {
+        const T *r[8];
+        for (int j = 0; j < 8; j++)
+            r[j] = vecs + std::min(v + j, nv - 1) * ngene;
+        for (long c0 = 0; c0 < ncp; c0 += CTMAP_STRIP) {
+            const double *strip = cent + c0 * ngene;
+            __m512d s[8][2];
+            for (int j = 0; j < 8; j++)
+                s[j][0] = s[j][1] = _mm512_setzero_pd();
+            for (long g = 0; g < ngene; g++) {
+                __m512d c_lo = _mm512_loadu_pd(&strip[g * CTMAP_STRIP]);
+                __m512d c_hi = _mm512_loadu_pd(&strip[g * CTMAP_STRIP + 8]);
+                for (int j = 0; j < 8; j++) {
+                    __m512d va = _mm512_set1_pd((double)r[j][g]);
+                    s[j][0] = _mm512_fmadd_pd(va, c_lo, s[j][0]);
+                    s[j][1] = _mm512_fmadd_pd(va, c_hi, s[j][1]);
+                }
+            }
+            for (int j = 0; j < 8; j++) {
+                _mm512_storeu_pd(&acc[(v + j) * ncp + c0], s[j][0]);
+                _mm512_storeu_pd(&acc[(v + j) * ncp + c0 + 8], s[j][1]);
+            }
+        }
+    }
+}
+#endif
+
+// Correlates every vector with all centroids at once and keeps the k best
+// matches per vector, in descending order of correlation (ties keep the lower
+// centroid index first). cent holds the centroids z-scored and divided by
+// ngene, and csum their per-centroid sums, so that
+// corr = (v . c - mean(v) * csum) / std(v). Vectors with zero variance are
+// correlated 0 with every centroid, like __corr__. k must not exceed ncent:
+// the first k centroids fill the slots, so every slot names a centroid even
+// if all the correlations are -1 or NaN (NaN ranks below any number).
+template <typename T>
+inline void ctmap_multi_vf(double *omax, int *oidx, const T *vecs, const double *cent, const double *csum,
+                           long nvec, long ngene, long ncent, long ncp, int k, int ncores) {
+    long nblocks = (nvec + CTMAP_BLOCK_VEC - 1) / CTMAP_BLOCK_VEC;
+    stats_loop loop("ctmap_multi", ncores);
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        std::vector<double> acc(CTMAP_BLOCK_VEC * ncp);
+
+        #pragma omp for schedule(static) nowait
+        for (long b = 0; b < nblocks; b++) {
+            long v0 = b * CTMAP_BLOCK_VEC;
+            long nv = std::min((long)CTMAP_BLOCK_VEC, nvec - v0);
+
+#if SIMD_X86
+            if (simd_level == SIMD_AVX512)
+                ctmap_gemm_avx512(acc.data(), vecs + v0 * ngene, nv, ngene, cent, ncp);
+            else if (simd_level == SIMD_AVX2)
+                ctmap_gemm_avx2(acc.data(), vecs + v0 * ngene, nv, ngene, cent, ncp);
+            else
+#endif
+                ctmap_gemm_scalar(acc.data(), vecs + v0 * ngene, nv, ngene, cent, ncp);
+
+            for (long v = 0; v < nv; v++) {
+                const T *vec = vecs + (v0 + v) * ngene;
+                double *best = omax + (v0 + v) * k;
+                int *bidx = oidx + (v0 + v) * k;
+                double mean = 0, ss = 0;
+                vec_moments(vec, ngene, &mean, &ss);
+                double sd = sqrt(ss / ngene);
+
+                auto above = [](double a, double b) { return a > b || (b != b && a == a); };
+                int n = 0;
+                for (long c = 0; c < ncent; c++) {
+                    double r = (sd > 0) ? (acc[v * ncp + c] - mean * csum[c]) / sd : 0;
+                    if (n == k && !above(r, best[k - 1]))
+                        continue;
+                    int j = (n < k) ? n++ : k - 1;
+                    for (; j > 0 && above(r, best[j - 1]); j--) {
+                        best[j] = best[j - 1];
+                        bidx[j] = bidx[j - 1];
+                    }
+                    best[j] = r;
+                    bidx[j] = (int)c;
+                }
+            }
+        }
+        loop.done();
+    }
+    loop.end();
+}
+
+// z-scores the centroids once for ctmap_multi_vf(), packed into strips of
+// CTMAP_STRIP centroids. Returns the padded number of centroids.
+inline long ctmap_pack(std::vector<double> &cent, std::vector<double> &csum, const double *cents, long ncent, long ngene) {
+    long ncp = (ncent + CTMAP_STRIP - 1) / CTMAP_STRIP * CTMAP_STRIP;
+    cent.assign(ngene * ncp, 0.0);
+    csum.assign(ncent, 0.0);
+    for (long c = 0; c < ncent; c++) {
+        const double *cv = cents + c * ngene;
+        double *strip = &cent[(c / CTMAP_STRIP) * CTMAP_STRIP * ngene + c % CTMAP_STRIP];
+        double mean = 0, ss = 0;
+        for (long g = 0; g < ngene; g++)
+            mean += cv[g];
+        mean /= ngene;
+        for (long g = 0; g < ngene; g++)
+            ss += (cv[g] - mean) * (cv[g] - mean);
+        double sd = sqrt(ss / ngene);
+        if (sd == 0)
+            continue; // correlated 0 with everything, like __corr__
+        for (long g = 0; g < ngene; g++) {
+            strip[g * CTMAP_STRIP] = (cv[g] - mean) / (sd * ngene);
+            csum[c] += strip[g * CTMAP_STRIP];
+        }
+    }
+    return ncp;
+}
+
+// Per-gene running mean and sum of squared deviations (Welford), merged
+// across threads and chunks with Chan's update.
+struct gene_moments {
+    long count;
+    std::vector<double> mean;
+    std::vector<double> m2;
+};
+
+inline void moments_merge(gene_moments &a, const gene_moments &b) {
+    if (b.count == 0)
+        return;
+    double n = a.count + b.count;
+    for (size_t g = 0; g < a.mean.size(); g++) {
+        double delta = b.mean[g] - a.mean[g];
+        a.mean[g] += delta * b.count / n;
+        a.m2[g] += b.m2[g] + delta * delta * a.count * b.count / n;
+    }
+    a.count += b.count;
+}
+
+// Normalizes each vector with a positive L1 norm to the given size, then by
+// its median (if normalize_median), then log transforms it; other vectors
+// become zero. The moments of the normalized vectors are accumulated over the
+// vectors whose L1 norm (before normalization) exceeds moments_threshold.
+// If sv is given, the vectors are its nvec occupied pixels instead of vecs.
+// Normalization keeps zeros zero, so out then receives the normalized values
+// of the nonzero genes only, laid out like sv->values.
+template <typename T>
+inline void normalize_vf(float *out, gene_moments &moments, const T *vecs, long nvec, long ngene, double size,
+                         bool normalize_vector, bool normalize_median, bool log_transform, double moments_threshold, int ncores,
+                         const svf_view *sv = NULL) {
+    std::vector<gene_moments> parts(ncores);
+    long i;
+
+    for (auto &part : parts) {
+        part.count = 0;
+        part.mean.assign(ngene, 0.0);
+        part.m2.assign(ngene, 0.0);
+    }
+
+    stats_loop loop("normalize", ncores);
+    #pragma omp parallel num_threads(ncores)
+    {
+        gene_moments &part = parts[omp_get_thread_num()];
+        std::vector<double> v(ngene), sorted(ngene);
+        std::vector<T> sparse_vec(sv ? ngene : 0);
+        std::vector<float> sparse_out(sv ? ngene : 0);
+
+        // Static chunks are handed out in order, so the moments merge deterministically
+        #pragma omp for schedule(static) nowait
+        for (i = 0; i < nvec; i++) {
+            const T *vec = sv ? sparse_vec.data() : vecs + i * ngene;
+            float *o = sv ? sparse_out.data() : out + i * ngene;
+            double l1 = 0;
+            long g;
+
+            if (sv) {
+                std::fill(sparse_vec.begin(), sparse_vec.end(), (T)0);
+                for (long k = sv->vox_ptr[i]; k < sv->vox_ptr[i + 1]; k++)
+                    sparse_vec[sv->genes[k]] = (T)sv->values[k];
+            }
+
+            for (g = 0; g < ngene; g++)
+                l1 += vec[g];
+            if (!(l1 > 0)) {
+                std::fill_n(o, ngene, 0.0f);
+            } else {
+                for (g = 0; g < ngene; g++)
+                    v[g] = normalize_vector ? vec[g] / l1 * size : vec[g];
+                if (normalize_median) {
+                    double s = 0, m;
+                    sorted = v;
+                    std::nth_element(sorted.begin(), sorted.begin() + ngene / 2, sorted.end());
+                    m = sorted[ngene / 2];
+                    if (ngene % 2 == 0)
+                        m = (m + *std::max_element(sorted.begin(), sorted.begin() + ngene / 2)) / 2;
+                    for (g = 0; g < ngene; g++)
+                        s += v[g];
+                    if (m > 0 && s / m > 0) {
+                        for (g = 0; g < ngene; g++)
+                            v[g] /= s / m;
+                    }
+                }
+                for (g = 0; g < ngene; g++)
+                    o[g] = (float)(log_transform ? log1p(v[g]) : v[g]);
+            }
+            if (l1 > moments_threshold) {
+                part.count += 1;
+                for (g = 0; g < ngene; g++) {
+                    double delta = o[g] - part.mean[g];
+                    part.mean[g] += delta / part.count;
+                    part.m2[g] += delta * (o[g] - part.mean[g]);
+                }
+            }
+            if (sv) {
+                for (long k = sv->vox_ptr[i]; k < sv->vox_ptr[i + 1]; k++)
+                    out[k] = o[sv->genes[k]];
+            }
+        }
+        loop.done();
+    }
+    loop.end();
+
+    for (const auto &part : parts)
+        moments_merge(moments, part);
+}
+
+// Finds the local maxima of the L1 norm in the inner block (borg, bext) of a
+// block of vectors (dims), in one pass over the vectors: a voxel is a local
+// maximum if its norm is the maximum of its size^3 neighbourhood (as
+// ndimage.maximum_filter, clipped at the block border), exceeds norm_threshold
+// and any of its genes exceeds expression_threshold. norm receives the norm
+// of every voxel of the block; found the linear indices (in the inner block)
+// of the local maxima, in ascending order.
+template <typename T>
+inline void localmax_vf(std::vector<long> &found, double *norm, const T *vf, const long *dims, long ngene, const long *borg, const long *bext,
+                        int size, double norm_threshold, double expression_threshold, int ncores) {
+    const long nvec = dims[0] * dims[1] * dims[2];
+    const long steps[3] = { dims[1] * dims[2], dims[2], 1 };
+    const long ninner = bext[0] * bext[1] * bext[2];
+    const long lo = size / 2, hi = (size - 1) / 2;
+    std::vector<char> expressed(nvec);
+    std::vector<double> mx(nvec), tmp(nvec);
+    std::vector<std::vector<long> > parts(ncores);
+    long i;
+
+    stats_scratch(nvec * (1 + 2 * sizeof(double)));
+
+    #pragma omp parallel for num_threads(ncores)
+    for (i = 0; i < nvec; i++) {
+        const T *v = vf + i * ngene;
+        double s = 0;
+        bool e = false;
+        for (long g = 0; g < ngene; g++) {
+            s += v[g];
+            e |= v[g] > expression_threshold;
+        }
+        norm[i] = s;
+        expressed[i] = e;
+    }
+
+    // Separable max filter, one axis at a time
+    mx.assign(norm, norm + nvec);
+    for (int d = 0; d < 3; d++) {
+        if (dims[d] == 1 || size < 2)
+            continue;
+        tmp.swap(mx);
+        #pragma omp parallel for num_threads(ncores)
+        for (i = 0; i < nvec; i++) {
+            long p = (i / steps[d]) % dims[d];
+            long a = std::max(p - lo, 0L), b = std::min(p + hi, dims[d] - 1);
+            double m = tmp[i + (a - p) * steps[d]];
+            for (long q = a + 1; q <= b; q++)
+                m = std::max(m, tmp[i + (q - p) * steps[d]]);
+            mx[i] = m;
+        }
+    }
+
+    // Static chunks are handed out in order, so the parts concatenate sorted
+    #pragma omp parallel for num_threads(ncores) schedule(static)
+    for (i = 0; i < ninner; i++) {
+        long x = borg[0] + i / (bext[1] * bext[2]), y = borg[1] + (i / bext[2]) % bext[1], z = borg[2] + i % bext[2];
+        long j = I3D(x, y, z, dims[1], dims[2]);
+        if (expressed[j] && norm[j] > norm_threshold && norm[j] == mx[j])
+            parts[omp_get_thread_num()].push_back(i);
+    }
+    for (const auto &part : parts)
+        found.insert(found.end(), part.begin(), part.end());
+    stats_scratch(-(long)(nvec * (1 + 2 * sizeof(double))));
+}
+
+// Counts the cell types in a sphere of the given radius around every lattice
+// point (lat[0] x lat[1] x lat[2]) of a cell type map (-1 for background).
+// The sphere is decomposed into spans along y, one per (dx, dz), and the map
+// is swept one x slab at a time: each slab holds running counts of every cell
+// type along y, so a span costs ncelltypes operations whatever its length,
+// and only one slab of counts is kept in memory.
+inline void bin_celltypes(int64_t *counts, const int *ctmap, const long *dims, const long *const *lat, const long *nlat,
+                          long radius, long ncelltypes, int ncores) {
+    const long ylen = dims[1] + 1, dia = 2 * radius + 1;
+    const long nyz = nlat[1] * nlat[2];
+    std::vector<int> prefix(dims[2] * ylen * ncelltypes);
+    std::vector<long> half(dia * dia);
+
+    // Half length of the span at (dx, dz), -1 if outside of the sphere
+    for (long dx = -radius; dx <= radius; dx++) {
+        for (long dz = -radius; dz <= radius; dz++) {
+            long rest = radius * radius - dx * dx - dz * dz, h = -1;
+            if (rest >= 0) {
+                h = (long)sqrt((double)rest);
+                while (h * h > rest) h--;
+                while ((h + 1) * (h + 1) <= rest) h++;
+            }
+            half[(dx + radius) * dia + dz + radius] = h;
+        }
+    }
+
+    std::fill_n(counts, nlat[0] * nyz * ncelltypes, 0);
+    for (long xs = 0; xs < dims[0]; xs++) {
+        long lo = 0, hi;
+        while (lo < nlat[0] && lat[0][lo] < xs - radius)
+            lo++;
+        for (hi = lo; hi < nlat[0] && lat[0][hi] <= xs + radius; hi++);
+        if (lo == hi)
+            continue;
+
+        #pragma omp parallel for num_threads(ncores)
+        for (long z = 0; z < dims[2]; z++) {
+            int *p = &prefix[z * ylen * ncelltypes];
+            std::fill_n(p, ncelltypes, 0);
+            for (long y = 0; y < dims[1]; y++) {
+                int ct = ctmap[I3D(xs, y, z, dims[1], dims[2])];
+                std::copy(p + y * ncelltypes, p + (y + 1) * ncelltypes, p + (y + 1) * ncelltypes);
+                if (ct >= 0 && ct < ncelltypes)
+                    p[(y + 1) * ncelltypes + ct] += 1;
+            }
+        }
+
+        #pragma omp parallel for num_threads(ncores) schedule(dynamic)
+        for (long w = lo * nyz; w < hi * nyz; w++) {
+            long i = w / nyz, j = (w / nlat[2]) % nlat[1], k = w % nlat[2];
+            long yc = lat[1][j], zc = lat[2][k];
+            const long *hrow = &half[(xs - lat[0][i] + radius) * dia + radius];
+            int64_t *cnt = counts + w * ncelltypes;
+            for (long z = std::max(zc - radius, 0L); z <= std::min(zc + radius, dims[2] - 1); z++) {
+                long h = hrow[z - zc];
+                long y0 = std::max(yc - h, 0L), y1 = std::min(yc + h, dims[1] - 1);
+                if (h < 0 || y0 > y1)
+                    continue;
+                const int *p0 = &prefix[(z * ylen + y0) * ncelltypes];
+                const int *p1 = &prefix[(z * ylen + y1 + 1) * ncelltypes];
+                for (long c = 0; c < ncelltypes; c++)
+                    cnt[c] += p1[c] - p0[c];
+            }
+        }
+    }
+}
+
+struct label_pair_hash {
+    size_t operator()(const std::pair<long, long> &p) const {
+        return std::hash<long>()(p.first) * 31 + std::hash<long>()(p.second);
+    }
+};
+
+typedef std::unordered_map<std::pair<long, long>, long, label_pair_hash> label_contacts;
+
+// Counts the contacts between different labels of a label volume, over the 26
+// neighbours of each voxel: every pair of adjacent voxels (a, b) with a < b
+// adds one to contacts[(a, b)]. Voxels labelled background are skipped.
+inline void label_adjacency_vol(label_contacts &contacts, const long *labels, const long *dims, long background, int ncores) {
+    std::vector<label_contacts> parts(ncores);
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        label_contacts &part = parts[omp_get_thread_num()];
+
+        #pragma omp for schedule(dynamic)
+        for (long x = 0; x < dims[0]; x++) {
+            for (long y = 0; y < dims[1]; y++) {
+                for (long z = 0; z < dims[2]; z++) {
+                    long a = labels[I3D(x, y, z, dims[1], dims[2])];
+                    if (a == background)
+                        continue;
+                    // The 13 forward neighbours, so that each pair is seen once
+                    for (int o = 14; o < 27; o++) {
+                        long nx = x + o / 9 - 1, ny = y + (o / 3) % 3 - 1, nz = z + o % 3 - 1;
+                        if (nx >= dims[0] || ny < 0 || ny >= dims[1] || nz < 0 || nz >= dims[2])
+                            continue;
+                        long b = labels[I3D(nx, ny, nz, dims[1], dims[2])];
+                        if (b == background || b == a)
+                            continue;
+                        part[std::make_pair(std::min(a, b), std::max(a, b))] += 1;
+                    }
+                }
+            }
+        }
+    }
+    for (const auto &part : parts)
+        for (const auto &kv : part)
+            contacts[kv.first] += kv.second;
+}
+
+// Counts the transcripts of every gene in every segment of a 2D label image
+// (-1 for no segment), in one parallel pass with per-thread sparse counts.
+// Transcripts are snapped to the nearest pixel (halves to even, as np.round);
+// those outside of the image, of unknown genes (< 0) or without segment are
+// ignored. cells receives the sorted (segment * ngene + gene, count) pairs.
+inline void cell_by_gene_counts(std::vector<std::pair<long, long> > &cells, const double *x, const double *y, const long *gene, long npts,
+                                const long *segments, const long *dims, long nseg, long ngene, int ncores) {
+    std::vector<std::unordered_map<long, long> > parts(ncores);
+    long i;
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        std::unordered_map<long, long> &part = parts[omp_get_thread_num()];
+
+        #pragma omp for
+        for (i = 0; i < npts; i++) {
+            double px = nearbyint(x[i]), py = nearbyint(y[i]);
+            if (!(px >= 0 && px < dims[0] && py >= 0 && py < dims[1]) || gene[i] < 0 || gene[i] >= ngene)
+                continue;
+            long seg = segments[I2D((long)px, (long)py, dims[1])];
+            if (seg < 0 || seg >= nseg)
+                continue;
+            part[seg * ngene + gene[i]] += 1;
+        }
+    }
+    for (auto &part : parts) {
+        cells.insert(cells.end(), part.begin(), part.end());
+        std::unordered_map<long, long>().swap(part);
+    }
+    std::sort(cells.begin(), cells.end());
+    // Merge the counts of the threads
+    size_t n = 0;
+    for (size_t k = 0; k < cells.size(); k++) {
+        if (n > 0 && cells[n - 1].first == cells[k].first)
+            cells[n - 1].second += cells[k].second;
+        else
+            cells[n++] = cells[k];
+    }
+    cells.resize(n);
+}
+
+inline long uf_find(std::vector<long> &parent, long i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+inline void uf_union(std::vector<long> &parent, long a, long b) {
+    a = uf_find(parent, a);
+    b = uf_find(parent, b);
+    // The lower index becomes the root, so the roots do not depend on the order of unions
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+// Unions a voxel with its forward 26-neighbours of the same label, in x
+// between x0 and x1 (exclusive).
+inline void blob_unions(std::vector<long> &parent, const int *labels, const long *dims, long x, long x1) {
+    for (long y = 0; y < dims[1]; y++) {
+        for (long z = 0; z < dims[2]; z++) {
+            long i = I3D(x, y, z, dims[1], dims[2]);
+            if (labels[i] < 0)
+                continue;
+            for (int o = 14; o < 27; o++) {
+                long nx = x + o / 9 - 1, ny = y + (o / 3) % 3 - 1, nz = z + o % 3 - 1;
+                if (nx >= x1 || ny < 0 || ny >= dims[1] || nz < 0 || nz >= dims[2])
+                    continue;
+                long j = I3D(nx, ny, nz, dims[1], dims[2]);
+                if (labels[j] == labels[i])
+                    uf_union(parent, i, j);
+            }
+        }
+    }
+}
+
+// Finds the blobs (26-connected components of equal labels, -1 for
+// background) of a label volume, and computes their hole-filled mask: holes
+// are the voxels of a blob's bounding box that are not 6-connected to the
+// faces of the box through voxels outside of the blob, as in regionprops'
+// filled_image. Holes are filled (if fill), then the blobs whose filled area
+// is less than min_area are cleared. mask receives the result.
+inline void filter_blobs_vol(bool *mask, const int *labels, const long *dims, long min_area, bool fill, int ncores) {
+    const long nvox = dims[0] * dims[1] * dims[2];
+    const long tile = std::max(1L, (dims[0] + ncores - 1) / ncores);
+    std::vector<long> parent(nvox), comp(nvox, -1), roots;
+    std::vector<std::vector<long> > holes;
+    std::vector<long> area, filled_area, bbox;
+    long i;
+
+    #pragma omp parallel for num_threads(ncores)
+    for (i = 0; i < nvox; i++)
+        parent[i] = i;
+    // Union within x tiles in parallel, then across the tile borders
+    #pragma omp parallel for num_threads(ncores) schedule(static, 1)
+    for (long t = 0; t < dims[0]; t += tile)
+        for (long x = t; x < std::min(t + tile, dims[0]); x++)
+            blob_unions(parent, labels, dims, x, std::min(t + tile, dims[0]));
+    for (long t = tile; t < dims[0]; t += tile)
+        blob_unions(parent, labels, dims, t - 1, t + 1);
+
+    // Number the blobs in raster order of their first voxel, which is their root
+    for (i = 0; i < nvox; i++) {
+        if (labels[i] < 0)
+            continue;
+        long r = uf_find(parent, i);
+        if (r == i) {
+            comp[i] = roots.size();
+            roots.push_back(i);
+        } else {
+            comp[i] = comp[r];
+        }
+    }
+
+    long nblob = roots.size();
+    area.assign(nblob, 0);
+    bbox.resize(nblob * 6);
+    for (long b = 0; b < nblob; b++) {
+        for (int d = 0; d < 3; d++) {
+            bbox[b * 6 + d] = dims[d];
+            bbox[b * 6 + 3 + d] = -1;
+        }
+    }
+    for (i = 0; i < nvox; i++) {
+        if (comp[i] < 0)
+            continue;
+        long b = comp[i], p[3] = { i / (dims[1] * dims[2]), (i / dims[2]) % dims[1], i % dims[2] };
+        area[b] += 1;
+        for (int d = 0; d < 3; d++) {
+            bbox[b * 6 + d] = std::min(bbox[b * 6 + d], p[d]);
+            bbox[b * 6 + 3 + d] = std::max(bbox[b * 6 + 3 + d], p[d]);
+        }
+    }
+
+    // Holes of each blob, within its bounding box
+    holes.resize(nblob);
+    filled_area = area;
+    #pragma omp parallel for num_threads(ncores) schedule(dynamic)
+    for (long b = 0; b < nblob; b++) {
+        const long *lo = &bbox[b * 6], *hi = &bbox[b * 6 + 3];
+        const long ext[3] = { hi[0] - lo[0] + 1, hi[1] - lo[1] + 1, hi[2] - lo[2] + 1 };
+        const long n = ext[0] * ext[1] * ext[2];
+        if (n == area[b])
+            continue;
+        std::vector<char> seen(n, 0);
+        std::queue<long> queue;
+        for (long k = 0; k < n; k++) {
+            long p[3] = { k / (ext[1] * ext[2]), (k / ext[2]) % ext[1], k % ext[2] };
+            if (comp[I3D(lo[0] + p[0], lo[1] + p[1], lo[2] + p[2], dims[1], dims[2])] == b) {
+                seen[k] = 1;
+            } else if (p[0] == 0 || p[1] == 0 || p[2] == 0 || p[0] == ext[0] - 1 || p[1] == ext[1] - 1 || p[2] == ext[2] - 1) {
+                seen[k] = 1;
+                queue.push(k);
+            }
+        }
+        const long steps[3] = { ext[1] * ext[2], ext[2], 1 };
+        while (queue.size() > 0) {
+            long k = queue.front();
+            queue.pop();
+            long p[3] = { k / steps[0], (k / steps[1]) % ext[1], k % ext[2] };
+            for (int d = 0; d < 3; d++) {
+                for (int dir = -1; dir <= 1; dir += 2) {
+                    if (p[d] + dir < 0 || p[d] + dir >= ext[d] || seen[k + dir * steps[d]])
+                        continue;
+                    seen[k + dir * steps[d]] = 1;
+                    queue.push(k + dir * steps[d]);
+                }
+            }
+        }
+        for (long k = 0; k < n; k++) {
+            if (seen[k])
+                continue;
+            filled_area[b] += 1;
+            if (fill)
+                holes[b].push_back(I3D(lo[0] + k / steps[0], lo[1] + (k / steps[1]) % ext[1], lo[2] + k % ext[2], dims[1], dims[2]));
+        }
+    }
+
+    #pragma omp parallel for num_threads(ncores)
+    for (i = 0; i < nvox; i++)
+        mask[i] = labels[i] >= 0;
+    for (long b = 0; b < nblob; b++)
+        for (long k : holes[b])
+            mask[k] = true;
+    // Clearing after filling, so a small blob in the hole of a larger one is cleared
+    #pragma omp parallel for num_threads(ncores)
+    for (i = 0; i < nvox; i++) {
+        if (comp[i] >= 0 && filled_area[comp[i]] < min_area)
+            mask[i] = false;
+    }
+}
+
+// Vectors of a kNN index in float32, zero padded to a multiple of 8
+// dimensions. For the correlation metric they are centred and scaled to unit
+// norm, for the cosine metric only scaled, so the distance is 1 - their dot
+// product; for the Euclidean metric it is the squared distance. Vectors with
+// zero norm become zero, at distance 1 from all others.
+struct knn_index {
+    std::vector<float> vecs;
+    long n, dim;
+    int metric;
+};
+
+// Per-lane sums of a * b (or (a - b)^2 if L2) over n (a multiple of 8)
+// elements, with the lane layout of the correlation kernels.
+template <bool L2>
+inline void knn_lanes_scalar(const float *a, const float *b, long n, double *sums) {
+    std::fill_n(sums, 8, 0.0);
+    for (long i = 0; i < n; i += 8) {
+        for (int j = 0; j < 8; j++) {
+            double va = a[i + j], vb = b[i + j];
+            if (L2)
+                va = vb = va - vb;
+            sums[j] += va * vb;
+        }
+    }
+}
+
+#if SIMD_X86
+template <bool L2>
+__attribute__((target("avx2,fma"))) inline void knn_lanes_avx2(const float *a, const float *b, long n, double *sums) {
+    __m256d acc[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+    for (long i = 0; i < n; i += 8) {
+        for (int h = 0; h < 2; h++) {
+            __m256d va = simd_load4(&a[i + h * 4]), vb = simd_load4(&b[i + h * 4]);
+            if (L2)
+                va = vb = _mm256_sub_pd(va, vb);
+            acc[h] = _mm256_fmadd_pd(va, vb, acc[h]);
+        }
+    }
+    _mm256_storeu_pd(&sums[0], acc[0]);
+    _mm256_storeu_pd(&sums[4], acc[1]);
+}
+
+template <bool L2>
+__attribute__((target("avx512f"))) inline void knn_lanes_avx512(const float *a, const float *b, long n, double *sums) {
+    __m512d acc = _mm512_setzero_pd();
+    for (long i = 0; i < n; i += 8) {
+        __m512d va = simd_load8(&a[i]), vb = simd_load8(&b[i]);
+        if (L2)
+            va = vb = _mm512_sub_pd(va, vb);
+        acc = _mm512_fmadd_pd(va, vb, acc);
+    }
+    _mm512_storeu_pd(sums, acc);
+}
+#endif
+
+template <bool L2>
+inline double knn_sum(const float *a, const float *b, long n) {
+    double sums[8], s = 0;
+#if SIMD_X86
+    if (simd_level == SIMD_AVX512)
+        knn_lanes_avx512<L2>(a, b, n, sums);
+    else if (simd_level == SIMD_AVX2)
+        knn_lanes_avx2<L2>(a, b, n, sums);
+    else
+#endif
+        knn_lanes_scalar<L2>(a, b, n, sums);
+    for (int j = 0; j < 8; j++)
+        s += sums[j];
+    return s;
+}
+
+inline double knn_dist(const knn_index &x, long i, long j) {
+    const float *a = &x.vecs[i * x.dim], *b = &x.vecs[j * x.dim];
+    if (x.metric == KNN_EUCLIDEAN)
+        return knn_sum<true>(a, b, x.dim);
+    return 1 - knn_sum<false>(a, b, x.dim);
+}
+
+template <typename T>
+inline void knn_prepare(knn_index &x, const T *vecs, long n, long ngene, int metric, int ncores) {
+    long i;
+    x.n = n;
+    x.dim = (ngene + 7) / 8 * 8;
+    x.metric = metric;
+    x.vecs.assign(n * x.dim, 0.0f);
+
+    #pragma omp parallel for num_threads(ncores)
+    for (i = 0; i < n; i++) {
+        const T *v = vecs + i * ngene;
+        double mean = 0, ss = 0;
+        if (metric == KNN_CORRELATION)
+            vec_moments(v, ngene, &mean, &ss);
+        else if (metric == KNN_COSINE)
+            ss = unit_dot(v, v, ngene);
+        double scale = (metric == KNN_EUCLIDEAN) ? 1 : (ss > 0) ? 1 / sqrt(ss) : 0;
+        for (long g = 0; g < ngene; g++)
+            x.vecs[i * x.dim + g] = (float)((v[g] - mean) * scale);
+    }
+}
+
+// Inserts the neighbour id at distance d into a list of K neighbours sorted
+// by (distance, id), unless it is already listed or not closer than the
+// last one. Inserted neighbours are flagged as new.
+inline bool knn_insert(int *ids, double *dists, char *flags, int K, int id, double d) {
+    if (d > dists[K - 1] || (d == dists[K - 1] && id >= ids[K - 1]))
+        return false;
+    for (int k = 0; k < K; k++)
+        if (ids[k] == id)
+            return false;
+    int k = K - 1;
+    for (; k > 0 && (dists[k - 1] > d || (dists[k - 1] == d && ids[k - 1] > id)); k--) {
+        ids[k] = ids[k - 1];
+        dists[k] = dists[k - 1];
+        flags[k] = flags[k - 1];
+    }
+    ids[k] = id;
+    dists[k] = d;
+    flags[k] = 1;
+    return true;
+}
+
+inline uint64_t knn_mix(uint64_t z) {
+    // splitmix64
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Exact K nearest neighbours (other than itself) of every vector.
+inline void knn_exact(int *ids, double *dists, const knn_index &x, int K, int ncores) {
+    long i;
+    stats_loop loop("knn_exact", ncores);
+    #pragma omp parallel num_threads(ncores)
+    {
+        std::vector<char> flags(K);
+        #pragma omp for schedule(dynamic, 16) nowait
+        for (i = 0; i < x.n; i++) {
+            for (long j = 0; j < x.n; j++)
+                if (j != i)
+                    knn_insert(&ids[i * K], &dists[i * K], flags.data(), K, (int)j, knn_dist(x, i, j));
+        }
+        loop.done();
+    }
+    loop.end();
+    stats_count(0, x.n * (x.n - 1));
+}
+
+// Approximate K nearest neighbours (other than itself) of every vector by
+// NN-descent (Dong et al., 2011): starting from random neighbours, the
+// neighbours of each node's neighbours (up to K new and K old ones, sampled
+// from the forward and reverse lists) are compared with each other, until
+// few lists change. Updates are collected per batch of nodes and applied in
+// (distance, id) order, so the graph only depends on the seed, not on the
+// number of threads.
+inline void knn_descent(int *ids, double *dists, const knn_index &x, int K, uint64_t seed, int ncores) {
+    const long n = x.n;
+    std::vector<char> flags(n * K, 1);
+    std::vector<int> fnew(n * K), fold(n * K), nnew(n), nold(n);
+    std::vector<long> rptr_new(n + 1), rptr_old(n + 1);
+    std::vector<int> rnew, rold;
+    long i;
+
+    #pragma omp parallel for num_threads(ncores)
+    for (i = 0; i < n; i++) {
+        uint64_t r = knn_mix(seed ^ knn_mix(i));
+        while (ids[i * K + K - 1] < 0) {
+            r = knn_mix(r);
+            long j = (long)(r % (n - 1));
+            if (j >= i)
+                j++;
+            knn_insert(&ids[i * K], &dists[i * K], &flags[i * K], K, (int)j, knn_dist(x, i, j));
+        }
+    }
+
+    for (int iter = 0; iter < KNN_MAX_ITERS; iter++) {
+        // Forward lists: the new neighbours (then flagged old) and the old ones
+        #pragma omp parallel for num_threads(ncores)
+        for (i = 0; i < n; i++) {
+            nnew[i] = nold[i] = 0;
+            for (int k = 0; k < K; k++) {
+                if (flags[i * K + k]) {
+                    fnew[i * K + nnew[i]++] = ids[i * K + k];
+                    flags[i * K + k] = 0;
+                } else {
+                    fold[i * K + nold[i]++] = ids[i * K + k];
+                }
+            }
+        }
+        // Reverse lists, in order of the source node
+        std::fill(rptr_new.begin(), rptr_new.end(), 0);
+        std::fill(rptr_old.begin(), rptr_old.end(), 0);
+        for (i = 0; i < n; i++) {
+            for (int k = 0; k < nnew[i]; k++)
+                rptr_new[fnew[i * K + k] + 1]++;
+            for (int k = 0; k < nold[i]; k++)
+                rptr_old[fold[i * K + k] + 1]++;
+        }
+        for (i = 0; i < n; i++) {
+            rptr_new[i + 1] += rptr_new[i];
+            rptr_old[i + 1] += rptr_old[i];
+        }
+        rnew.resize(rptr_new[n]);
+        rold.resize(rptr_old[n]);
+        {
+            std::vector<long> fn(rptr_new.begin(), rptr_new.end() - 1), fo(rptr_old.begin(), rptr_old.end() - 1);
+            for (i = 0; i < n; i++) {
+                for (int k = 0; k < nnew[i]; k++)
+                    rnew[fn[fnew[i * K + k]]++] = (int)i;
+                for (int k = 0; k < nold[i]; k++)
+                    rold[fo[fold[i * K + k]]++] = (int)i;
+            }
+        }
+
+        long updates = 0;
+        for (long b0 = 0; b0 < n; b0 += KNN_BATCH) {
+            const long b1 = std::min(n, b0 + KNN_BATCH);
+            struct update { int tgt, src; double d; };
+            std::vector<std::vector<update> > parts(ncores);
+            stats_loop loop("knn_descent", ncores);
+
+            #pragma omp parallel num_threads(ncores)
+            {
+                std::vector<update> &part = parts[omp_get_thread_num()];
+                std::vector<int> cnew, cold;
+                long njoin = 0;
+
+                #pragma omp for schedule(dynamic, 16) nowait
+                for (i = b0; i < b1; i++) {
+                    // Candidates of each kind: up to K sampled from the forward
+                    // and reverse lists together
+                    uint64_t r = knn_mix(seed ^ knn_mix(((uint64_t)iter << 40) ^ i));
+                    auto sample = [&](std::vector<int> &c, const int *fwd, int nf, const std::vector<int> &rev, long rb, long re) {
+                        c.assign(fwd, fwd + nf);
+                        c.insert(c.end(), rev.begin() + rb, rev.begin() + re);
+                        std::sort(c.begin(), c.end());
+                        c.erase(std::unique(c.begin(), c.end()), c.end());
+                        if ((long)c.size() > K) {
+                            for (long a = 0; a < K; a++) {
+                                r = knn_mix(r);
+                                std::swap(c[a], c[a + (long)(r % (c.size() - a))]);
+                            }
+                            c.resize(K);
+                            std::sort(c.begin(), c.end());
+                        }
+                    };
+                    sample(cnew, &fnew[i * K], nnew[i], rnew, rptr_new[i], rptr_new[i + 1]);
+                    sample(cold, &fold[i * K], nold[i], rold, rptr_old[i], rptr_old[i + 1]);
+                    auto join = [&](int u, int v) {
+                        if (u == v)
+                            return;
+                        njoin++;
+                        double d = knn_dist(x, u, v);
+                        if (d < dists[(long)u * K + K - 1])
+                            part.push_back(update{u, v, d});
+                        if (d < dists[(long)v * K + K - 1])
+                            part.push_back(update{v, u, d});
+                    };
+                    for (size_t a = 0; a < cnew.size(); a++) {
+                        for (size_t c = a + 1; c < cnew.size(); c++)
+                            join(cnew[a], cnew[c]);
+                        for (int v : cold)
+                            if (!std::binary_search(cnew.begin(), cnew.end(), v))
+                                join(cnew[a], v);
+                    }
+                }
+                loop.count(njoin);
+                loop.done();
+            }
+            loop.end();
+
+            // Groups the updates by target node and applies them in order
+            std::vector<long> uptr(n + 1, 0);
+            for (const auto &part : parts)
+                for (const update &u : part)
+                    uptr[u.tgt + 1]++;
+            for (i = 0; i < n; i++)
+                uptr[i + 1] += uptr[i];
+            std::vector<update> ups(uptr[n]);
+            {
+                std::vector<long> fill(uptr.begin(), uptr.end() - 1);
+                for (const auto &part : parts)
+                    for (const update &u : part)
+                        ups[fill[u.tgt]++] = u;
+            }
+            #pragma omp parallel for num_threads(ncores) schedule(dynamic, 64) reduction(+:updates)
+            for (i = 0; i < n; i++) {
+                if (uptr[i] == uptr[i + 1])
+                    continue;
+                std::sort(ups.begin() + uptr[i], ups.begin() + uptr[i + 1], [](const update &a, const update &b) {
+                    return a.d < b.d || (a.d == b.d && a.src < b.src);
+                });
+                for (long k = uptr[i]; k < uptr[i + 1]; k++)
+                    updates += knn_insert(&ids[i * K], &dists[i * K], &flags[i * K], K, ups[k].src, ups[k].d);
+            }
+        }
+        if (updates <= KNN_DELTA * n * K)
+            break;
+    }
+}
+
+// Shared nearest neighbour graph of a kNN graph (n x k neighbour indices,
+// each node included in its own list), as in Seurat: the weight of (i, j) is
+// the Jaccard index s / (2k - s) of their lists, s the number of neighbours
+// they share. Edges of weight >= prune are kept (self loops
+// included). Thread t emits the edges of a contiguous range of rows into
+// src[t], dst[t] and weight[t], in row-major order.
+inline void snn_edges(std::vector<std::vector<int> > &src, std::vector<std::vector<int> > &dst, std::vector<std::vector<double> > &weight,
+                      const int *nbrs, long n, int k, double prune, int ncores) {
+    std::vector<long> rptr(n + 1, 0);
+    std::vector<int> rev(n * k);
+    long i;
+
+    for (i = 0; i < n * k; i++)
+        rptr[nbrs[i] + 1]++;
+    for (i = 0; i < n; i++)
+        rptr[i + 1] += rptr[i];
+    {
+        std::vector<long> fill(rptr.begin(), rptr.end() - 1);
+        for (i = 0; i < n * k; i++)
+            rev[fill[nbrs[i]]++] = (int)(i / k);
+    }
+    src.assign(ncores, std::vector<int>());
+    dst.assign(ncores, std::vector<int>());
+    weight.assign(ncores, std::vector<double>());
+
+    #pragma omp parallel num_threads(ncores)
+    {
+        int t = omp_get_thread_num();
+        std::vector<int> shared(n, 0), touched;
+
+        #pragma omp for schedule(static)
+        for (i = 0; i < n; i++) {
+            touched.clear();
+            for (int a = 0; a < k; a++) {
+                int m = nbrs[i * k + a];
+                for (long b = rptr[m]; b < rptr[m + 1]; b++)
+                    if (shared[rev[b]]++ == 0)
+                        touched.push_back(rev[b]);
+            }
+            std::sort(touched.begin(), touched.end());
+            for (int j : touched) {
+                double w = shared[j] / (double)(k + (k - shared[j]));
+                shared[j] = 0;
+                if (w < prune || w <= 0)
+                    continue;
+                src[t].push_back((int)i);
+                dst[t].push_back(j);
+                weight[t].push_back(w);
+            }
+        }
+    }
+}
+
+#endif
@@ -1,212 +1,314 @@
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
-#include <stdio.h>
-#include <math.h>
-#include <queue>
-#include <unordered_map>
-
-#if defined(_OPENMP)
-#include <omp.h>
-#else
-typedef int omp_int_t;
-inline omp_int_t omp_get_thread_num() { return 0;}
-inline omp_int_t omp_get_max_threads() { return 1;}
-#endif
-
-#include <immintrin.h> // AVX intrinsics
+#include "kernels.h"
 
 #include <Python.h>
 #include "numpy/npy_math.h"
 #include "numpy/arrayobject.h"
 
-#define I2D(X, Y, YL) ((X) * (YL) + (Y))
-#define I3D(X, Y, Z, YL, ZL) (((X) * (YL) * (ZL)) + ((Y) * (ZL)) + (Z))
-
-struct pos2d {
-    long x;
-    long y;
-};
+// PyArray_FROM_OTF, counting the bytes NumPy had to convert or copy.
+static PyArrayObject *array_from(PyObject *obj, int type, int flags) {
+    PyArrayObject *arr = (PyArrayObject *)PyArray_FROM_OTF(obj, type, flags);
+    if (arr != NULL && (PyObject *)arr != obj && stats_active != NULL)
+        stats_active->s.bytes_converted += PyArray_NBYTES(arr);
+    return arr;
+}
 
-struct pos3d {
-    long x;
-    long y;
-    long z;
-};
+// Reads a sparse field tuple. arrs receives the arrays, which the caller
+// releases with svf_release() whether this succeeds or not.
+static bool svf_from_object(PyObject *obj, svf_view &v, PyArrayObject **arrs) {
+    static const int types[SVF_NARRAYS] = { NPY_INT64, NPY_INT64, NPY_INT64, NPY_UINT64, NPY_INT64, NPY_INT32, NPY_FLOAT };
+    long ntiles, nvox;
+    int i;
 
-namespace std {
-    template <>
-    struct hash<pos3d> {
-        std::size_t operator()(const pos3d &p) const {
-            const std::size_t prime1 = 73856093;
-            const std::size_t prime2 = 19349663;
-            const std::size_t prime3 = 83492791;
-            
-            std::size_t hx = std::hash<long>()(p.x);
-            std::size_t hy = std::hash<long>()(p.y);
-            std::size_t hz = std::hash<long>()(p.z);
-            
-            return hx * prime1 ^ hy * prime2 ^ hz * prime3;
+    std::fill_n(arrs, SVF_NARRAYS, (PyArrayObject *)NULL);
+    if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != SVF_NARRAYS) {
+        PyErr_SetString(PyExc_ValueError, "A sparse vector field must be a tuple of 7 arrays.");
+        return false;
+    }
+    for (i = 0; i < SVF_NARRAYS; i++) {
+        arrs[i] = array_from(PyTuple_GET_ITEM(obj, i), types[i], NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+        if (arrs[i] == NULL)
+            return false;
+    }
+    if (PyArray_SIZE(arrs[0]) != 4 || PyArray_SIZE(arrs[1]) != 3) {
+        PyErr_SetString(PyExc_ValueError, "Invalid shape or tile shape of the sparse vector field.");
+        return false;
+    }
+    ntiles = 1;
+    for (i = 0; i < 3; i++) {
+        v.shape[i] = ((npy_int64 *)PyArray_DATA(arrs[0]))[i];
+        v.tile[i] = ((npy_int64 *)PyArray_DATA(arrs[1]))[i];
+        if (v.shape[i] < 1 || v.tile[i] < 1) {
+            PyErr_SetString(PyExc_ValueError, "Invalid shape or tile shape of the sparse vector field.");
+            return false;
+        }
+        v.ntiles[i] = (v.shape[i] + v.tile[i] - 1) / v.tile[i];
+        ntiles *= v.ntiles[i];
+    }
+    v.ngene = ((npy_int64 *)PyArray_DATA(arrs[0]))[3];
+    v.nwords = (v.tile[0] * v.tile[1] * v.tile[2] + 63) / 64;
+    v.tile_ptr = (const npy_int64 *)PyArray_DATA(arrs[2]);
+    v.bitmap = (const npy_uint64 *)PyArray_DATA(arrs[3]);
+    v.vox_ptr = (const npy_int64 *)PyArray_DATA(arrs[4]);
+    v.genes = (const npy_int32 *)PyArray_DATA(arrs[5]);
+    v.values = (const float *)PyArray_DATA(arrs[6]);
+    nvox = PyArray_SIZE(arrs[4]) - 1;
+    if (PyArray_SIZE(arrs[2]) != ntiles + 1 || PyArray_SIZE(arrs[3]) != ntiles * v.nwords || nvox < 0 ||
+        v.tile_ptr[ntiles] != nvox || v.vox_ptr[nvox] != PyArray_SIZE(arrs[5]) || PyArray_SIZE(arrs[5]) != PyArray_SIZE(arrs[6])) {
+        PyErr_SetString(PyExc_ValueError, "Inconsistent sparse vector field.");
+        return false;
+    }
+    v.rank.resize(ntiles * v.nwords);
+    for (long t = 0; t < ntiles; t++) {
+        long n = 0;
+        for (long w = 0; w < v.nwords; w++) {
+            v.rank[t * v.nwords + w] = n;
+            n += __builtin_popcountll(v.bitmap[t * v.nwords + w]);
+        }
+        if (n != v.tile_ptr[t + 1] - v.tile_ptr[t]) {
+            PyErr_SetString(PyExc_ValueError, "Inconsistent sparse vector field.");
+            return false;
         }
-    };
+    }
+    return true;
 }
 
-bool operator==(const pos3d& a, const pos3d& b) {
-    return a.x == b.x && a.y == b.y && a.z == b.z;
+static void svf_release(PyArrayObject **arrs) {
+    for (int i = 0; i < SVF_NARRAYS; i++)
+        Py_XDECREF(arrs[i]);
 }
 
-static double gauss_kernel(double x, double y, double z) {
-    return exp(-0.5 * (x*x + y*y + z*z));
-}
+// Builds the sparse field of the dense block vf as a Python tuple, with
+// values of the type vtype.
+template <typename T>
+static PyObject *svf_export(const T *vf, const long *dims, long ngene, const long *tile, int vtype, int ncores) {
+    PyArrayObject *oarrs[SVF_NARRAYS] = { NULL };
+    std::vector<long> npix, nnz;
+    npy_intp n;
+    long nt = 1, nwords = (tile[0] * tile[1] * tile[2] + 63) / 64, nvox = 0, nval = 0;
+    int i;
 
-void kde(std::unordered_map<pos3d, double> &arr, double *xx, double *yy, double *zz, int *shape, int npts, double bandwidth, double prune_coeff, int ncores) {
-    int maxdist;
-    if (prune_coeff > 0) {
-        maxdist = static_cast<int>(bandwidth * prune_coeff);
-    } else {
-        maxdist = -1;
-    }
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    svf_build(npix, nnz, vf, dims, ngene, tile, (npy_int64 *)NULL, (npy_uint64 *)NULL, (npy_int64 *)NULL, (npy_int32 *)NULL, (float *)NULL, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
 
-    #pragma omp parallel num_threads(ncores)
+    for (i = 0; i < 3; i++)
+        nt *= (dims[i] + tile[i] - 1) / tile[i];
+    for (long t = 0; t < nt; t++) {
+        nvox += npix[t];
+        nval += nnz[t];
+    }
+    n = 4;
+    if ((oarrs[0] = (PyArrayObject *)PyArray_SimpleNew(1, &n, NPY_INT64)) == NULL) goto fail;
+    n = 3;
+    if ((oarrs[1] = (PyArrayObject *)PyArray_SimpleNew(1, &n, NPY_INT64)) == NULL) goto fail;
+    n = nt + 1;
+    if ((oarrs[2] = (PyArrayObject *)PyArray_SimpleNew(1, &n, NPY_INT64)) == NULL) goto fail;
     {
-        std::unordered_map<pos3d, double> local_map;
-
-        #pragma omp for
-        for (int i = 0; i < npts; i++) {
-            int x0 = static_cast<int>(xx[i]);
-            int y0 = static_cast<int>(yy[i]);
-            int z0 = static_cast<int>(zz[i]);
-
-            int xs = (maxdist > 0) ? std::max(0, x0 - maxdist) : 0;
-            int xe = (maxdist > 0) ? std::min(shape[0], x0 + maxdist + 1) : shape[0];
-            int ys = (maxdist > 0) ? std::max(0, y0 - maxdist) : 0;
-            int ye = (maxdist > 0) ? std::min(shape[1], y0 + maxdist + 1) : shape[1];
-            int zs = (maxdist > 0) ? std::max(0, z0 - maxdist) : 0;
-            int ze = (maxdist > 0) ? std::min(shape[2], z0 + maxdist + 1) : shape[2];
-
-            for (int x = xs; x < xe; x++) {
-                for (int y = ys; y < ye; y++) {
-                    for (int z = zs; z < ze; z++) {
-                        pos3d key{x, y, z};
-                        double value = gauss_kernel((x - xx[i]) / bandwidth, (y - yy[i]) / bandwidth, (z - zz[i]) / bandwidth);
-                        local_map[key] += value;
-                    }
-                }
-            }
-        }
+        npy_intp bdims[2] = { nt, nwords };
+        if ((oarrs[3] = (PyArrayObject *)PyArray_SimpleNew(2, bdims, NPY_UINT64)) == NULL) goto fail;
+    }
+    n = nvox + 1;
+    if ((oarrs[4] = (PyArrayObject *)PyArray_SimpleNew(1, &n, NPY_INT64)) == NULL) goto fail;
+    n = nval;
+    if ((oarrs[5] = (PyArrayObject *)PyArray_SimpleNew(1, &n, NPY_INT32)) == NULL) goto fail;
+    if ((oarrs[6] = (PyArrayObject *)PyArray_SimpleNew(1, &n, vtype)) == NULL) goto fail;
+    for (i = 0; i < 3; i++) {
+        ((npy_int64 *)PyArray_DATA(oarrs[0]))[i] = dims[i];
+        ((npy_int64 *)PyArray_DATA(oarrs[1]))[i] = tile[i];
+    }
+    ((npy_int64 *)PyArray_DATA(oarrs[0]))[3] = ngene;
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (vtype == NPY_FLOAT)
+        svf_build(npix, nnz, vf, dims, ngene, tile, (npy_int64 *)PyArray_DATA(oarrs[2]), (npy_uint64 *)PyArray_DATA(oarrs[3]),
+                  (npy_int64 *)PyArray_DATA(oarrs[4]), (npy_int32 *)PyArray_DATA(oarrs[5]), (float *)PyArray_DATA(oarrs[6]), ncores);
+    else
+        svf_build(npix, nnz, vf, dims, ngene, tile, (npy_int64 *)PyArray_DATA(oarrs[2]), (npy_uint64 *)PyArray_DATA(oarrs[3]),
+                  (npy_int64 *)PyArray_DATA(oarrs[4]), (npy_int32 *)PyArray_DATA(oarrs[5]), (double *)PyArray_DATA(oarrs[6]), ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(dims[0] * dims[1] * dims[2], 0);
+    for (i = 0; i < SVF_NARRAYS; i++)
+        stats_copied(PyArray_NBYTES(oarrs[i]));
+
+    return Py_BuildValue("NNNNNNN", oarrs[0], oarrs[1], oarrs[2], oarrs[3], oarrs[4], oarrs[5], oarrs[6]);
+
+fail:
+    for (i = 0; i < SVF_NARRAYS; i++)
+        Py_XDECREF(oarrs[i]);
+    return NULL;
+}
 
-        #pragma omp critical
-        for (const auto& pair : local_map) {
-            arr[pair.first] += pair.second;
+// Reads the bandwidth of calc_kde() and calc_kde_multi(): a number, or with
+// the binned kernel a sequence of bandwidths computed from one binning (many
+// is then set).
+static bool kde_bandwidths(PyObject *obj, int kernel, std::vector<double> &hs, bool &many) {
+    if (kernel != KDE_KERNEL_GAUSSIAN && kernel != KDE_KERNEL_GAUSSIAN_SEPARABLE && kernel != KDE_KERNEL_GAUSSIAN_BINNED) {
+        PyErr_SetString(PyExc_ValueError, "Unknown kernel.");
+        return false;
+    }
+    many = !PyNumber_Check(obj);
+    if (many) {
+        PyObject *seq = PySequence_Fast(obj, "Bandwidth must be a number or a sequence of numbers.");
+        if (seq == NULL)
+            return false;
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++)
+            hs.push_back(PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i)));
+        Py_DECREF(seq);
+    } else {
+        hs.push_back(PyFloat_AsDouble(obj));
+    }
+    if (PyErr_Occurred())
+        return false;
+    if (hs.empty() || (many && kernel != KDE_KERNEL_GAUSSIAN_BINNED)) {
+        PyErr_SetString(PyExc_ValueError, "Several bandwidths are only supported by the binned kernel.");
+        return false;
+    }
+    for (double h : hs) {
+        if (kernel == KDE_KERNEL_GAUSSIAN_BINNED && !(h >= KDE_BINNED_MIN_H)) {
+            PyErr_Format(PyExc_ValueError, "The binned kernel requires a bandwidth of at least %g pixels.", KDE_BINNED_MIN_H);
+            return false;
         }
     }
+    return true;
 }
 
-static double __corr__(double *a, double *b, int ngene) {
-    __m512d sum_a = _mm512_setzero_pd();
-    __m512d sum_b = _mm512_setzero_pd();
-    __m512d sum_aa = _mm512_setzero_pd();
-    __m512d sum_bb = _mm512_setzero_pd();
-    __m512d sum_ab_diff = _mm512_setzero_pd();
-
+// Builds the ((x, y, z), value) result of calc_kde() from the per-thread
+// parts, in new arrays of the types itype and vtype, or in the caller's
+// buffers out.
+static PyObject *kde_result(const std::vector<kde_part> &parts, int itype, int vtype, PyObject *out, int ncores) {
+    PyArrayObject *oarrs[4] = { NULL, NULL, NULL, NULL };
+    std::vector<long> offs;
+    long nnz = 0;
     int i;
 
-    // Handle bulk of data with AVX-512
-    for (i = 0; i <= ngene - 8; i += 8) {
-        __m512d va = _mm512_loadu_pd(&a[i]);
-        __m512d vb = _mm512_loadu_pd(&b[i]);
-
-        sum_a = _mm512_add_pd(sum_a, va);
-        sum_b = _mm512_add_pd(sum_b, vb);
-        
-        sum_aa = _mm512_add_pd(sum_aa, _mm512_mul_pd(va, va));
-        sum_bb = _mm512_add_pd(sum_bb, _mm512_mul_pd(vb, vb));
-    }
-
-    double arr_a[8], arr_b[8], arr_aa[8], arr_bb[8];
-    _mm512_storeu_pd(arr_a, sum_a);
-    _mm512_storeu_pd(arr_b, sum_b);
-    _mm512_storeu_pd(arr_aa, sum_aa);
-    _mm512_storeu_pd(arr_bb, sum_bb);
-
-    double a_mean = 0, b_mean = 0, aa_mean = 0, bb_mean = 0;
-    for(int j = 0; j < 8; j++) {
-        a_mean += arr_a[j];
-        b_mean += arr_b[j];
-        aa_mean += arr_aa[j];
-        bb_mean += arr_bb[j];
-    }
-    a_mean /= ngene;
-    b_mean /= ngene;
-    aa_mean /= ngene;
-    bb_mean /= ngene;
-
-    // Handle remainder
-    for (; i < ngene; i++) {
-        a_mean += a[i] / ngene;
-        b_mean += b[i] / ngene;
-        aa_mean += a[i] * a[i] / ngene;
-        bb_mean += b[i] * b[i] / ngene;
-    }
-
-    double a_std = sqrt(aa_mean - a_mean * a_mean);
-    double b_std = sqrt(bb_mean - b_mean * b_mean);
-    double rtn = 0;
-
-    if (a_std != 0 && b_std != 0) {
-        for (i = 0; i <= ngene - 8; i += 8) {
-            __m512d va = _mm512_loadu_pd(&a[i]);
-            __m512d vb = _mm512_loadu_pd(&b[i]);
-
-            va = _mm512_sub_pd(va, _mm512_set1_pd(a_mean));
-            vb = _mm512_sub_pd(vb, _mm512_set1_pd(b_mean));
+    for (const auto& part : parts) {
+        offs.push_back(nnz);
+        nnz += part.val.size();
+    }
 
-            sum_ab_diff = _mm512_add_pd(sum_ab_diff, _mm512_mul_pd(va, vb));
+    if (out != NULL && out != Py_None) {
+        for (i = 0; i < 4; i++) {
+            PyArrayObject *o = (PyArrayObject *)PyTuple_GET_ITEM(out, i);
+            if (PyArray_DIMS(o)[0] < nnz) {
+                PyErr_Format(PyExc_ValueError, "Output buffers are too small (%ld elements required).", nnz);
+                goto fail;
+            }
+            if ((oarrs[i] = (PyArrayObject *)PySequence_GetSlice((PyObject *)o, 0, nnz)) == NULL) goto fail;
         }
-
-        double arr_ab_diff[8];
-        _mm512_storeu_pd(arr_ab_diff, sum_ab_diff);
-        for(int j = 0; j < 8; j++) {
-            rtn += arr_ab_diff[j];
+    } else {
+        npy_intp dims[1] = { nnz };
+        for (i = 0; i < 4; i++) {
+            if ((oarrs[i] = (PyArrayObject *)PyArray_SimpleNew(1, dims, i < 3 ? itype : vtype)) == NULL) goto fail;
         }
+    }
 
-        for (; i < ngene; i++) {
-            rtn += (a[i] - a_mean) * (b[i] - b_mean);
-        }
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (itype == NPY_INT32 && vtype == NPY_FLOAT32)
+        kde_export<npy_int32, npy_float32>(parts, offs, PyArray_DATA(oarrs[0]), PyArray_DATA(oarrs[1]), PyArray_DATA(oarrs[2]), PyArray_DATA(oarrs[3]), ncores);
+    else if (itype == NPY_INT32)
+        kde_export<npy_int32, npy_float64>(parts, offs, PyArray_DATA(oarrs[0]), PyArray_DATA(oarrs[1]), PyArray_DATA(oarrs[2]), PyArray_DATA(oarrs[3]), ncores);
+    else if (vtype == NPY_FLOAT32)
+        kde_export<npy_int64, npy_float32>(parts, offs, PyArray_DATA(oarrs[0]), PyArray_DATA(oarrs[1]), PyArray_DATA(oarrs[2]), PyArray_DATA(oarrs[3]), ncores);
+    else
+        kde_export<npy_int64, npy_float64>(parts, offs, PyArray_DATA(oarrs[0]), PyArray_DATA(oarrs[1]), PyArray_DATA(oarrs[2]), PyArray_DATA(oarrs[3]), ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(PyArray_SIZE(oarrs[3]), 0);
+    for (i = 0; i < 4; i++)
+        stats_copied(PyArray_NBYTES(oarrs[i]));
 
-        rtn /= (a_std * b_std * ngene);
-    }
+    return Py_BuildValue("(NNN)N", oarrs[0], oarrs[1], oarrs[2], oarrs[3]);
 
-    return rtn;
+fail:
+    for (i = 0; i < 4; i++)
+        Py_XDECREF(oarrs[i]);
+    return NULL;
 }
 
 static PyObject *calc_kde(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("calc_kde");
+    PyObject *arg0 = NULL;
     PyObject *arg1 = NULL;
     PyObject *arg2 = NULL;
     PyObject *arg3 = NULL;
     PyObject *arg4 = NULL;
+    PyObject *arg5 = NULL;
     PyArrayObject *arr1 = NULL;
     PyArrayObject *arr2 = NULL;
     PyArrayObject *arr3 = NULL;
     PyArrayObject *arr4 = NULL;
+    PyArray_Descr *vdescr = NULL;
+    PyArray_Descr *idescr = NULL;
     int ncores = omp_get_max_threads();
-    PyObject *rtn, *poslist, *xlist, *ylist, *zlist, *vlist;
+    PyObject *rtn = NULL;
     double *x, *y, *z;
     int *shape;
-    double h, prune_coeff;
+    double prune_coeff;
     int kernel = 0;
+    int itype = NPY_INT64, vtype = NPY_FLOAT64;
     unsigned int npts;
-    int cnt;
-    std::unordered_map<pos3d, double> oarr_map;
-    std::unordered_map<pos3d, double>::iterator it;
-
-    static const char *kwlist[] = { "h", "x", "y", "z", "shape", "prune_coeff", "kernel", "ncores", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "dOOOOd|ii", const_cast<char **>(kwlist), &h, &arg1, &arg2, &arg3, &arg4, &prune_coeff, &kernel, &ncores)) return NULL;
-    if ((arr1 = (PyArrayObject*)PyArray_FROM_OTF(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;
-    if ((arr2 = (PyArrayObject*)PyArray_FROM_OTF(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
-    if ((arr3 = (PyArrayObject*)PyArray_FROM_OTF(arg3, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
-    if ((arr4 = (PyArrayObject*)PyArray_FROM_OTF(arg4, NPY_INT, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
+    int i;
+    bool many;
+    std::vector<double> hs;
+    std::vector<std::vector<kde_part> > parts;
+
+    static const char *kwlist[] = { "h", "x", "y", "z", "shape", "prune_coeff", "kernel", "ncores", "dtype", "index_dtype", "out", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOOd|iiO&O&O", const_cast<char **>(kwlist), &arg0, &arg1, &arg2, &arg3, &arg4, &prune_coeff, &kernel, &ncores,
+                                     PyArray_DescrConverter2, &vdescr, PyArray_DescrConverter2, &idescr, &arg5)) return NULL;
+    if (vdescr != NULL) {
+        vtype = vdescr->type_num;
+        Py_DECREF(vdescr);
+    }
+    if (idescr != NULL) {
+        itype = idescr->type_num;
+        Py_DECREF(idescr);
+    }
+    if (!kde_bandwidths(arg0, kernel, hs, many))
+        return NULL;
+    if (arg5 != NULL && arg5 != Py_None) {
+        // Caller-provided output buffers (x, y, z, value)
+        if (!PyTuple_Check(arg5) || PyTuple_GET_SIZE(arg5) != 4) {
+            PyErr_SetString(PyExc_ValueError, "out must be a tuple of four arrays (x, y, z, value).");
+            return NULL;
+        }
+        if (many) {
+            PyErr_SetString(PyExc_ValueError, "out is not supported with several bandwidths.");
+            return NULL;
+        }
+        for (i = 0; i < 4; i++) {
+            PyObject *o = PyTuple_GET_ITEM(arg5, i);
+            if (!PyArray_Check(o) || PyArray_NDIM((PyArrayObject *)o) != 1 || !PyArray_ISCARRAY((PyArrayObject *)o)) {
+                PyErr_SetString(PyExc_ValueError, "Output buffers must be writeable, contiguous 1D arrays.");
+                return NULL;
+            }
+        }
+        itype = PyArray_TYPE((PyArrayObject *)PyTuple_GET_ITEM(arg5, 0));
+        vtype = PyArray_TYPE((PyArrayObject *)PyTuple_GET_ITEM(arg5, 3));
+        for (i = 1; i < 3; i++) {
+            if (PyArray_TYPE((PyArrayObject *)PyTuple_GET_ITEM(arg5, i)) != itype) {
+                PyErr_SetString(PyExc_ValueError, "Coordinate buffers must have the same dtype.");
+                return NULL;
+            }
+        }
+    }
+    if ((itype != NPY_INT32 && itype != NPY_INT64) || (vtype != NPY_FLOAT32 && vtype != NPY_FLOAT64)) {
+        PyErr_SetString(PyExc_ValueError, "Coordinates must be int32 or int64, values float32 or float64.");
+        return NULL;
+    }
+    if ((arr1 = array_from(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;
+    if ((arr2 = array_from(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
+    if ((arr3 = array_from(arg3, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
+    if ((arr4 = array_from(arg4, NPY_INT, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
     
     if (PyArray_NDIM(arr1) != 1 || PyArray_NDIM(arr2) != 1 || PyArray_NDIM(arr3) != 1 || PyArray_NDIM(arr4) != 1)
     {
+        PyErr_SetString(PyExc_ValueError, "x, y, z and shape must be 1D arrays.");
         goto fail;
     }
 
@@ -217,27 +319,31 @@ static PyObject *calc_kde(PyObject *self, PyObject *args, PyObject *kwargs) {
     z = (double *)PyArray_DATA(arr3);
     shape = (int *)PyArray_DATA(arr4);
 
-    kde(oarr_map, x, y, z, shape, npts, h, prune_coeff, ncores);
-    rtn = (PyObject *)PyTuple_New(2);
-    poslist = (PyObject *)PyList_New(3);
-    xlist = (PyObject *)PyList_New(oarr_map.size());
-    ylist = (PyObject *)PyList_New(oarr_map.size());
-    zlist = (PyObject *)PyList_New(oarr_map.size());
-    vlist = (PyObject *)PyList_New(oarr_map.size());
-    
-    cnt = 0;
-    for (const auto& pair : oarr_map) {
-        PyList_SetItem(xlist, cnt, PyLong_FromLong((long)(pair.first.x)));
-        PyList_SetItem(ylist, cnt, PyLong_FromLong((long)(pair.first.y)));
-        PyList_SetItem(zlist, cnt, PyLong_FromLong((long)(pair.first.z)));
-        PyList_SetItem(vlist, cnt, PyFloat_FromDouble(pair.second));
-        cnt++;
-    }
-    PyList_SetItem(poslist, 0, xlist);
-    PyList_SetItem(poslist, 1, ylist);
-    PyList_SetItem(poslist, 2, zlist);
-    PyTuple_SetItem(rtn, 0, poslist);
-    PyTuple_SetItem(rtn, 1, vlist);
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (kernel == KDE_KERNEL_GAUSSIAN_BINNED) {
+        kde_binned_parts(parts, x, y, z, shape, npts, hs.data(), hs.size(), prune_coeff, ncores);
+    } else {
+        parts.resize(1);
+        kde(parts[0], x, y, z, shape, npts, hs[0], prune_coeff, kernel, ncores);
+    }
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+
+    if (many) {
+        // One result per bandwidth
+        if ((rtn = PyList_New(hs.size())) == NULL) goto fail;
+        for (size_t b = 0; b < hs.size(); b++) {
+            PyObject *r = kde_result(parts[b], itype, vtype, NULL, ncores);
+            if (r == NULL) {
+                Py_CLEAR(rtn);
+                goto fail;
+            }
+            PyList_SET_ITEM(rtn, b, r);
+        }
+    } else {
+        if ((rtn = kde_result(parts[0], itype, vtype, arg5, ncores)) == NULL) goto fail;
+    }
     
     Py_DECREF(arr1);
     Py_DECREF(arr2);
@@ -254,337 +360,518 @@ fail:
     return NULL;
 }
 
+static PyObject *calc_kde_multi(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("calc_kde_multi");
+    PyObject *arg0 = NULL;
+    PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
+    PyObject *arg3 = NULL;
+    PyObject *arg4 = NULL;
+    PyObject *arg5 = NULL;
+    PyObject *arg6 = NULL;
+    PyObject *arg7 = NULL;
+    PyObject *arg8 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *arr2 = NULL;
+    PyArrayObject *arr3 = NULL;
+    PyArrayObject *arr4 = NULL;
+    PyArrayObject *arr5 = NULL;
+    PyArrayObject *arr6 = NULL;
+    PyArrayObject *arr7 = NULL;
+    PyArrayObject *arr8 = NULL;
+    PyObject *oarrs = NULL;
+    PyObject *rtn = NULL;
+    int ncores = omp_get_max_threads();
+    int *gene, *shape, *borg, *bext;
+    double *x, *y, *z;
+    double prune_coeff;
+    int kernel = KDE_KERNEL_GAUSSIAN_SEPARABLE;
+    int ngene, npts, i;
+    int zero[3] = { 0, 0, 0 };
+    npy_intp odims[4];
+    long dims[3], tile[3];
+    bool many;
+    std::vector<double> hs;
+    std::vector<double *> outs;
+
+    static const char *kwlist[] = { "h", "gene", "x", "y", "z", "shape", "ngene", "prune_coeff", "kernel", "ncores", "origin", "block_shape", "tile_shape", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOOOid|iiOOO", const_cast<char **>(kwlist), &arg0, &arg1, &arg2, &arg3, &arg4, &arg5, &ngene, &prune_coeff, &kernel, &ncores, &arg6, &arg7, &arg8)) return NULL;
+    if (!kde_bandwidths(arg0, kernel, hs, many))
+        return NULL;
+    if ((arr1 = array_from(arg1, NPY_INT, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if ((arr2 = array_from(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
+    if ((arr3 = array_from(arg3, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
+    if ((arr4 = array_from(arg4, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
+    if ((arr5 = array_from(arg5, NPY_INT, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if (arg6 != NULL && arg6 != Py_None && (arr6 = array_from(arg6, NPY_INT, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if ((arr7 = array_from((arg7 != NULL && arg7 != Py_None) ? arg7 : arg5, NPY_INT, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if (arg8 != NULL && arg8 != Py_None && (arr8 = array_from(arg8, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+
+    npts = PyArray_SIZE(arr1);
+    if (PyArray_SIZE(arr2) != npts || PyArray_SIZE(arr3) != npts || PyArray_SIZE(arr4) != npts ||
+        PyArray_SIZE(arr5) != 3 || PyArray_SIZE(arr7) != 3 || (arr6 && PyArray_SIZE(arr6) != 3) || (arr8 && PyArray_SIZE(arr8) != 3)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid array dimensions.");
+        goto fail;
+    }
+
+    gene = (int *)PyArray_DATA(arr1);
+    x = (double *)PyArray_DATA(arr2);
+    y = (double *)PyArray_DATA(arr3);
+    z = (double *)PyArray_DATA(arr4);
+    shape = (int *)PyArray_DATA(arr5);
+    bext = (int *)PyArray_DATA(arr7);
+    borg = arr6 ? (int *)PyArray_DATA(arr6) : zero;
+    for (i = 0; i < npts; i++) {
+        if (gene[i] < 0 || gene[i] >= ngene) {
+            PyErr_SetString(PyExc_ValueError, "Gene code out of range.");
+            goto fail;
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        if (borg[i] < 0 || bext[i] < 1 || borg[i] + bext[i] > shape[i]) {
+            PyErr_SetString(PyExc_ValueError, "Block is out of the grid.");
+            goto fail;
+        }
+        odims[i] = bext[i];
+        dims[i] = bext[i];
+        tile[i] = arr8 ? ((long *)PyArray_DATA(arr8))[i] : 1;
+        if (tile[i] < 1) {
+            PyErr_SetString(PyExc_ValueError, "Tile sizes must be positive.");
+            goto fail;
+        }
+    }
+    odims[3] = ngene;
+    // One block per bandwidth
+    if ((oarrs = PyList_New(hs.size())) == NULL) goto fail;
+    for (size_t b = 0; b < hs.size(); b++) {
+        PyArrayObject *oarr = (PyArrayObject*)PyArray_ZEROS(4, odims, NPY_DOUBLE, NPY_CORDER);
+        if (oarr == NULL) goto fail;
+        PyList_SET_ITEM(oarrs, b, (PyObject *)oarr);
+        outs.push_back((double *)PyArray_DATA(oarr));
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (kernel == KDE_KERNEL_GAUSSIAN_BINNED)
+        kde_binned(outs.data(), hs.data(), hs.size(), gene, x, y, z, shape, borg, bext, ngene, npts, prune_coeff, ncores);
+    else
+        kde_multi(outs[0], gene, x, y, z, shape, borg, bext, ngene, npts, hs[0], prune_coeff, kernel, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count((long)bext[0] * bext[1] * bext[2], 0);
+
+    Py_DECREF(arr1);
+    Py_DECREF(arr2);
+    Py_DECREF(arr3);
+    Py_DECREF(arr4);
+    Py_DECREF(arr5);
+    Py_XDECREF(arr6);
+    Py_DECREF(arr7);
+
+    // With a tile shape, the blocks are returned as block-sparse fields. They
+    // are computed densely first, so the peak memory is that of the dense
+    // blocks (8 bytes per pixel and gene, per bandwidth) plus the sparse
+    // copy; callers bound it with the block shape (run_kde() computes one
+    // tile per call).
+    if (arr8 != NULL) {
+        for (size_t b = 0; b < hs.size(); b++) {
+            PyObject *svf = svf_export(outs[b], dims, ngene, tile, NPY_DOUBLE, ncores);
+            if (svf == NULL) {
+                Py_DECREF(arr8);
+                Py_DECREF(oarrs);
+                return NULL;
+            }
+            PyList_SetItem(oarrs, b, svf);
+        }
+        Py_DECREF(arr8);
+    }
+    if (many)
+        return oarrs;
+    rtn = PyList_GET_ITEM(oarrs, 0);
+    Py_INCREF(rtn);
+    Py_DECREF(oarrs);
+    return rtn;
+
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(arr2);
+    Py_XDECREF(arr3);
+    Py_XDECREF(arr4);
+    Py_XDECREF(arr5);
+    Py_XDECREF(arr6);
+    Py_XDECREF(arr7);
+    Py_XDECREF(arr8);
+    Py_XDECREF(oarrs);
+    return NULL;
+}
+
+// Returns obj as a C-contiguous array for the correlation kernels. float32
+// vector fields are used in place; anything else is converted to float64.
+static PyArrayObject *vf_from_object(PyObject *obj) {
+    int type = NPY_DOUBLE;
+    if (PyArray_Check(obj) && PyArray_TYPE((PyArrayObject *)obj) == NPY_FLOAT)
+        type = NPY_FLOAT;
+    return array_from(obj, type, NPY_ARRAY_IN_ARRAY);
+}
+
+// Reads nseed seed positions of ndim coordinates each into linear voxel indices.
+static bool flood_seeds(std::vector<long> &seeds, PyArrayObject *arr, long nseed, const long *dims, long ndim) {
+    const long *pos = (const long *)PyArray_DATA(arr);
+
+    seeds.resize(nseed);
+    for (long i = 0; i < nseed; i++) {
+        long p[3] = { 0, 0, 0 };
+        for (long d = 0; d < ndim; d++) {
+            p[d] = pos[i * ndim + d];
+            if (p[d] < 0 || p[d] >= dims[d]) {
+                PyErr_SetString(PyExc_ValueError, "Seed position is out of bounds.");
+                return false;
+            }
+        }
+        seeds[i] = I3D(p[0], p[1], p[2], dims[1], dims[2]);
+    }
+    return true;
+}
+
 static PyObject *flood_fill(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("flood_fill");
     PyObject *arg1 = NULL;
     PyObject *arg2 = NULL;
-    PyObject* filled_poslist = NULL;
     PyArrayObject *arr1 = NULL;
     PyArrayObject *arr2 = NULL;
-    long nvec, nd, ngene = 0;
-    long *pos, x, y, z, cnt;
-    double r = 0.6, *vf;
+    PyArrayObject *oarr = NULL;
+    long nd, ngene = 0;
+    long dims[3] = { 1, 1, 1 };
+    double r = 0.6;
     npy_intp *dimsp;
     int min_pixels = 10, max_pixels=2000;
+    int unit = 0;
     int i;
-    bool *mask;
+    bool ok;
+    std::vector<long> seeds, filled;
+    npy_intp odims[2];
 
-    static const char *kwlist[] = { "pos", "vf", "r", "min_pixels", "max_pixels", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|dii", const_cast<char **>(kwlist), &arg1, &arg2, &r, &min_pixels, &max_pixels)) return NULL;
-    if ((arr1 = (PyArrayObject*)PyArray_FROM_OTF(arg1, NPY_LONG, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;
-    if ((arr2 = (PyArrayObject*)PyArray_FROM_OTF(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
-    if (PyArray_NDIM(arr1) != 1) goto fail;
+    static const char *kwlist[] = { "pos", "vf", "r", "min_pixels", "max_pixels", "unit", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|diip", const_cast<char **>(kwlist), &arg1, &arg2, &r, &min_pixels, &max_pixels, &unit)) return NULL;
+    if ((arr1 = array_from(arg1, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if ((arr2 = vf_from_object(arg2)) == NULL) goto fail;
     nd = PyArray_NDIM(arr2);
+    if (nd != 3 && nd != 4) { // only 2D or 3D array is expected
+        PyErr_SetString(PyExc_ValueError, "vf must be a 3D or 4D array.");
+        goto fail;
+    }
+    if (PyArray_NDIM(arr1) != 1 || PyArray_DIMS(arr1)[0] != nd - 1) {
+        PyErr_SetString(PyExc_ValueError, "pos must have one coordinate per spatial dimension of vf.");
+        goto fail;
+    }
     dimsp = PyArray_DIMS(arr2);
-    nvec = 1;
     for (i=0; i<nd-1; i++)
-        nvec *= dimsp[i];
+        dims[i] = dimsp[i];
     ngene = dimsp[nd-1];
-    filled_poslist = PyList_New(0);
-    pos = (long *)PyArray_DATA(arr1);
-    vf = (double *)PyArray_DATA(arr2);
-    mask = (bool *) calloc(nvec, sizeof(bool));
-    cnt = 0;
-    if (nd == 3) {
-        // 2D
-        std::queue<pos2d> queue2d;
-        queue2d.push(pos2d());
-        queue2d.back().x = pos[0];
-        queue2d.back().y = pos[1];
-        while (queue2d.size() > 0) {
-            x = queue2d.front().x;
-            y = queue2d.front().y;
-            PyObject *t = PyTuple_New(2);
-            PyTuple_SetItem(t, 0, PyLong_FromLong(x));
-            PyTuple_SetItem(t, 1, PyLong_FromLong(y));
-            cnt += 1;
-            if (cnt > max_pixels) 
-                break;
-            PyList_Append(filled_poslist, t);
-            queue2d.pop();
-            if (x < dimsp[0] - 1 && mask[I2D(x + 1, y, dimsp[1])] == false &&
-                    __corr__(vf + (I2D(pos[0], pos[1], dimsp[1]) * ngene),
-                             vf + (I2D(x + 1, y, dimsp[1]) * ngene), ngene) > r) {
-                mask[I2D(x + 1, y, dimsp[1])] = true;
-                queue2d.push(pos2d());
-                queue2d.back().x = x + 1;
-                queue2d.back().y = y;
-            }
-            if (x > 1 && mask[I2D(x - 1, y, dimsp[1])] == false &&
-                    __corr__(vf + (I2D(pos[0], pos[1], dimsp[1]) * ngene),
-                             vf + (I2D(x - 1, y, dimsp[1]) * ngene), ngene) > r) {
-                mask[I2D(x - 1, y, dimsp[1])] = true;
-                queue2d.push(pos2d());
-                queue2d.back().x = x - 1;
-                queue2d.back().y = y;
-            }
-            if (y < dimsp[1] - 1 && mask[I2D(x, y + 1, dimsp[1])] == false &&
-                    __corr__(vf + (I2D(pos[0], pos[1], dimsp[1]) * ngene),
-                             vf + (I2D(x, y + 1, dimsp[1]) * ngene), ngene) > r) {
-                mask[I2D(x, y + 1, dimsp[1])] = true;
-                queue2d.push(pos2d());
-                queue2d.back().x = x;
-                queue2d.back().y = y + 1;
-            }
-            if (y > 1 && mask[I2D(x, y - 1, dimsp[1])] == false &&
-                    __corr__(vf + (I2D(pos[0], pos[1], dimsp[1]) * ngene),
-                             vf + (I2D(x, y - 1, dimsp[1]) * ngene), ngene) > r) {
-                mask[I2D(x, y - 1, dimsp[1])] = true;
-                queue2d.push(pos2d());
-                queue2d.back().x = x;
-                queue2d.back().y = y - 1;
-            }
-        }
-    } else if (nd == 4) {
-        // 3D
-        std::queue<pos3d> queue3d;
-        queue3d.push(pos3d());
-        queue3d.back().x = pos[0];
-        queue3d.back().y = pos[1];
-        queue3d.back().z = pos[2];
-        while (queue3d.size() > 0) {
-            x = queue3d.front().x;
-            y = queue3d.front().y;
-            z = queue3d.front().z;
-            PyObject *t = PyTuple_New(3);
-            PyTuple_SetItem(t, 0, PyLong_FromLong(x));
-            PyTuple_SetItem(t, 1, PyLong_FromLong(y));
-            PyTuple_SetItem(t, 2, PyLong_FromLong(z));
-            PyList_Append(filled_poslist, t);
-            cnt += 1;
-            if (cnt > max_pixels) 
-                break;
-            queue3d.pop();
-            if (x < dimsp[0] - 1 && mask[I3D(x + 1, y, z, dimsp[1], dimsp[2])] == false &&
-                    __corr__(vf + I3D(pos[0], pos[1], pos[2], dimsp[1], dimsp[2]) * ngene,
-                             vf + I3D(x + 1, y, z, dimsp[1], dimsp[2]) * ngene, ngene) > r) {
-                mask[I3D(x + 1, y, z, dimsp[1], dimsp[2])] = true;
-                queue3d.push(pos3d());
-                queue3d.back().x = x + 1;
-                queue3d.back().y = y;
-                queue3d.back().z = z;
-            }
-            if (x > 1 && mask[I3D(x - 1, y, z, dimsp[1], dimsp[2])] == false &&
-                    __corr__(vf + I3D(pos[0], pos[1], pos[2], dimsp[1], dimsp[2]) * ngene,
-                             vf + I3D(x - 1, y, z, dimsp[1], dimsp[2]) * ngene, ngene) > r) {
-                mask[I3D(x - 1, y, z, dimsp[1], dimsp[2])] = true;
-                queue3d.push(pos3d());
-                queue3d.back().x = x - 1;
-                queue3d.back().y = y;
-                queue3d.back().z = z;
-            }
-            if (y < dimsp[1] - 1 && mask[I3D(x, y + 1, z, dimsp[1], dimsp[2])] == false &&
-                    __corr__(vf + I3D(pos[0], pos[1], pos[2], dimsp[1], dimsp[2]) * ngene,
-                             vf + I3D(x, y + 1, z, dimsp[1], dimsp[2]) * ngene, ngene) > r) {
-                mask[I3D(x, y + 1, z, dimsp[1], dimsp[2])] = true;
-                queue3d.push(pos3d());
-                queue3d.back().x = x;
-                queue3d.back().y = y + 1;
-                queue3d.back().z = z;
-            }
-            if (y > 1 && mask[I3D(x, y - 1, z, dimsp[1], dimsp[2])] == false &&
-                    __corr__(vf + I3D(pos[0], pos[1], pos[2], dimsp[1], dimsp[2]) * ngene,
-                             vf + I3D(x, y - 1, z, dimsp[1], dimsp[2]) * ngene, ngene) > r) {
-                mask[I3D(x, y - 1, z, dimsp[1], dimsp[2])] = true;
-                queue3d.push(pos3d());
-                queue3d.back().x = x;
-                queue3d.back().y = y - 1;
-                queue3d.back().z = z;
-            }
-            if (z < dimsp[2] - 1 && mask[I3D(x, y, z + 1, dimsp[1], dimsp[2])] == false &&
-                    __corr__(vf + I3D(pos[0], pos[1], pos[2], dimsp[1], dimsp[2]) * ngene,
-                             vf + I3D(x, y, z + 1, dimsp[1], dimsp[2]) * ngene, ngene) > r) {
-                mask[I3D(x, y, z, dimsp[1], dimsp[2])] = true;
-                queue3d.push(pos3d());
-                queue3d.back().x = x;
-                queue3d.back().y = y;
-                queue3d.back().z = z + 1;
-            }
-            if (z > 1 && mask[I3D(x, y, z - 1, dimsp[1], dimsp[2])] == false &&
-                    __corr__(vf + I3D(pos[0], pos[1], pos[2], dimsp[1], dimsp[2]) * ngene,
-                             vf + I3D(x, y, z - 1, dimsp[1], dimsp[2]) * ngene, ngene) > r) {
-                mask[I3D(x, y, z - 1, dimsp[1], dimsp[2])] = true;
-                queue3d.push(pos3d());
-                queue3d.back().x = x;
-                queue3d.back().y = y;
-                queue3d.back().z = z - 1;
+    if (!flood_seeds(seeds, arr1, 1, dims, nd - 1)) goto fail;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (PyArray_TYPE(arr2) == NPY_FLOAT)
+        ok = flood_grow(filled, (float *)PyArray_DATA(arr2), seeds[0], dims, ngene, r, max_pixels, unit);
+    else
+        ok = flood_grow(filled, (double *)PyArray_DATA(arr2), seeds[0], dims, ngene, r, max_pixels, unit);
+    Py_END_ALLOW_THREADS
+    stats_count(filled.size(), filled.size());
+    Py_DECREF(arr1);
+    Py_DECREF(arr2);
+    // Returns an (n, ndim) array of the filled positions, empty if the region is out of bounds
+    if (!ok || (long)filled.size() < min_pixels)
+        filled.clear();
+    odims[0] = filled.size();
+    odims[1] = nd - 1;
+    if ((oarr = (PyArrayObject *)PyArray_SimpleNew(2, odims, NPY_INT64)) == NULL) return NULL;
+    for (size_t k = 0; k < filled.size(); k++) {
+        npy_int64 *p = (npy_int64 *)PyArray_GETPTR2(oarr, k, 0);
+        p[0] = filled[k] / (dims[1] * dims[2]);
+        p[1] = (filled[k] / dims[2]) % dims[1];
+        if (nd == 4)
+            p[2] = filled[k] % dims[2];
+    }
+    return (PyObject *) oarr;
+ 
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(arr2);
+    return NULL;
+}
+
+static PyObject *flood_fill_many(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("flood_fill_many");
+    PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *arr2 = NULL;
+    PyArrayObject *oarr = NULL;
+    long nd, nseed, ngene = 0;
+    long dims[3] = { 1, 1, 1 };
+    double r = 0.6;
+    npy_intp *dimsp;
+    int *labels;
+    int min_pixels = 10, max_pixels=2000;
+    int ncores = omp_get_max_threads();
+    int unit = 0;
+    int i;
+    std::vector<long> seeds;
+    std::vector<std::vector<long> > regions;
+
+    static const char *kwlist[] = { "seeds", "vf", "r", "min_pixels", "max_pixels", "ncores", "unit", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|diiip", const_cast<char **>(kwlist), &arg1, &arg2, &r, &min_pixels, &max_pixels, &ncores, &unit)) return NULL;
+    if ((arr1 = array_from(arg1, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if ((arr2 = vf_from_object(arg2)) == NULL) goto fail;
+    nd = PyArray_NDIM(arr2);
+    if (nd != 3 && nd != 4) { // only 2D or 3D array is expected
+        PyErr_SetString(PyExc_ValueError, "vf must be a 3D or 4D array.");
+        goto fail;
+    }
+    if (PyArray_NDIM(arr1) != 2 || PyArray_DIMS(arr1)[1] != nd - 1) {
+        PyErr_SetString(PyExc_ValueError, "Seeds must be an (n, ndim) array.");
+        goto fail;
+    }
+    dimsp = PyArray_DIMS(arr2);
+    for (i=0; i<nd-1; i++)
+        dims[i] = dimsp[i];
+    ngene = dimsp[nd-1];
+    nseed = PyArray_DIMS(arr1)[0];
+    if (!flood_seeds(seeds, arr1, nseed, dims, nd - 1)) goto fail;
+    if ((oarr = (PyArrayObject *)PyArray_SimpleNew(nd - 1, dimsp, NPY_INT)) == NULL) goto fail;
+    labels = (int *)PyArray_DATA(oarr);
+    regions.resize(nseed);
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    {
+        stats_loop loop("flood_fill_many", ncores);
+        #pragma omp parallel num_threads(ncores)
+        {
+            #pragma omp for schedule(dynamic) nowait
+            for (long s = 0; s < nseed; s++) {
+                bool ok;
+                if (PyArray_TYPE(arr2) == NPY_FLOAT)
+                    ok = flood_grow(regions[s], (float *)PyArray_DATA(arr2), seeds[s], dims, ngene, r, max_pixels, unit);
+                else
+                    ok = flood_grow(regions[s], (double *)PyArray_DATA(arr2), seeds[s], dims, ngene, r, max_pixels, unit);
+                // Each voxel of the region was correlated with the seed
+                loop.count(regions[s].size());
+                if (!ok || (long)regions[s].size() < min_pixels)
+                    std::vector<long>().swap(regions[s]);
             }
+            loop.done();
         }
+        loop.end();
     }
-    free((void*)mask);
+
+    // Label the regions (-1 for background). Where regions overlap, the seed
+    // given first wins.
+    std::fill_n(labels, dims[0] * dims[1] * dims[2], -1);
+    for (long s = nseed - 1; s >= 0; s--)
+        for (long idx : regions[s])
+            labels[idx] = (int)s;
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    for (const auto &region : regions)
+        stats_count(region.size(), 0);
+
     Py_DECREF(arr1);
     Py_DECREF(arr2);
-    if (cnt > max_pixels || cnt < min_pixels) 
-        PyList_SetSlice(filled_poslist, 0, PyList_Size(filled_poslist), NULL);
-    return (PyObject *) filled_poslist;
- 
+    return (PyObject *) oarr;
+
 fail:
     Py_XDECREF(arr1);
     Py_XDECREF(arr2);
+    Py_XDECREF(oarr);
     return NULL;
 }
 
+// calc_ctmap() and calc_corrmap() for a sparse field tuple.
+static PyObject *calc_ctmap_sparse(PyArrayObject *cent, PyObject *obj, int ncores) {
+    PyArrayObject *arrs[SVF_NARRAYS];
+    PyArrayObject *oarr = NULL;
+    svf_view v;
+    npy_intp odims[3];
+    std::vector<double> ucent;
+    double norm;
+
+    if (!svf_from_object(obj, v, arrs)) goto fail;
+    if (PyArray_NDIM(cent) != 1 || PyArray_DIMS(cent)[0] != v.ngene) {
+        PyErr_SetString(PyExc_ValueError, "Centroid and vectors must have the same number of genes.");
+        goto fail;
+    }
+    for (int d = 0; d < 3; d++)
+        odims[d] = v.shape[d];
+    if ((oarr = (PyArrayObject*)PyArray_ZEROS(3, odims, NPY_DOUBLE, NPY_CORDER)) == NULL) goto fail;
+    ucent.resize(v.ngene);
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    unit_vf(ucent.data(), &norm, (const double *)PyArray_DATA(cent), 1, v.ngene, 1);
+    ctmap_sparse((double *)PyArray_DATA(oarr), ucent.data(), v, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(v.tile_ptr[v.ntiles[0] * v.ntiles[1] * v.ntiles[2]], v.tile_ptr[v.ntiles[0] * v.ntiles[1] * v.ntiles[2]]);
+
+fail:
+    svf_release(arrs);
+    return (PyObject *) oarr;
+}
+
+static PyObject *calc_corrmap_sparse(PyObject *obj, int csize, int ncores) {
+    PyArrayObject *arrs[SVF_NARRAYS];
+    PyArrayObject *oarr = NULL;
+    svf_view v;
+    npy_intp odims[3];
+    double *corrmap;
+
+    if (!svf_from_object(obj, v, arrs)) goto fail;
+    for (int d = 0; d < 3; d++)
+        odims[d] = v.shape[d];
+    if ((oarr = (PyArrayObject*)PyArray_ZEROS(3, odims, NPY_DOUBLE, NPY_CORDER)) == NULL) goto fail;
+    corrmap = (double *)PyArray_DATA(oarr);
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    std::fill_n(corrmap, PyArray_SIZE(oarr), NPY_NAN);
+    corrmap_sparse(corrmap, v, csize, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(v.tile_ptr[v.ntiles[0] * v.ntiles[1] * v.ntiles[2]], v.tile_ptr[v.ntiles[0] * v.ntiles[1] * v.ntiles[2]]);
+
+fail:
+    svf_release(arrs);
+    return (PyObject *) oarr;
+}
+
 static PyObject *calc_corrmap(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("calc_corrmap");
     PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
     PyArrayObject *arr1 = NULL;
+    PyArrayObject *arr2 = NULL;
     PyArrayObject *oarr = NULL;
-    long i, x, y, z, dx, dy, dz;
+    long i;
     long nvec, nd, ngene = 0;
-    double *vecs, *corrmap;
+    double *corrmap;
+    const double *norms = NULL;
     npy_intp *dimsp;
     int ncores = omp_get_max_threads();
     int csize = 1;
-    double *tmpvec;
+    int method = CORRMAP_DIRECT;
 
-    static const char *kwlist[] = { "vf", "ncores", "size", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ii", const_cast<char **>(kwlist), &arg1, &ncores, &csize)) return NULL;
-    if ((arr1 = (PyArrayObject*)PyArray_FROM_OTF(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;   
+    static const char *kwlist[] = { "vf", "ncores", "size", "method", "norms", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiiO", const_cast<char **>(kwlist), &arg1, &ncores, &csize, &method, &arg2)) return NULL;
+    if (method != CORRMAP_DIRECT && method != CORRMAP_SLIDING) {
+        PyErr_SetString(PyExc_ValueError, "Unknown method.");
+        return NULL;
+    }
+    // Sparse fields sum up the occupied neighbours of each pixel directly, whatever the method
+    if (PyTuple_Check(arg1))
+        return calc_corrmap_sparse(arg1, csize, ncores);
+    if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
     nd = PyArray_NDIM(arr1);
-    if (nd != 3 && nd != 4) goto fail; // only 2D or 3D array is expected
+    if (nd != 3 && nd != 4) { // only 2D or 3D array is expected
+        PyErr_SetString(PyExc_ValueError, "vf must be a 3D or 4D array.");
+        goto fail;
+    }
     dimsp = PyArray_DIMS(arr1);
-    oarr = (PyArrayObject*)PyArray_ZEROS(nd - 1, dimsp, NPY_DOUBLE, NPY_CORDER);
     ngene = dimsp[nd-1];
-    corrmap = (double *)PyArray_DATA(oarr);
-    vecs = (double *)PyArray_DATA(arr1);
     nvec = 1;
     for (i=0; i<nd-1; i++)
         nvec *= dimsp[i];
+    // With norms, vf holds the unit vectors of unit_vectors()
+    if (arg2 != NULL && arg2 != Py_None) {
+        if ((arr2 = array_from(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
+        if (PyArray_SIZE(arr2) != nvec) {
+            PyErr_SetString(PyExc_ValueError, "Norms must have one value per vector.");
+            goto fail;
+        }
+        norms = (const double *)PyArray_DATA(arr2);
+    }
+    if ((oarr = (PyArrayObject*)PyArray_ZEROS(nd - 1, dimsp, NPY_DOUBLE, NPY_CORDER)) == NULL) goto fail;
+    corrmap = (double *)PyArray_DATA(oarr);
     
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
     // initialize corrmap with NANs
     #pragma omp parallel for num_threads(ncores)
     for (i=0; i<nvec; i++)
         corrmap[i] = NPY_NAN;
 
-    if (nd == 3) {
-        // 2D
-        #pragma omp parallel num_threads(ncores) private(tmpvec)
-        {
-            tmpvec = (double *)calloc(ngene, sizeof(double)); // zero initialized
-            #pragma omp for collapse(2)
-            for (x=csize; x<dimsp[0]-csize; x++) {
-                for (y=csize; y<dimsp[1]-csize; y++) {
-                    for (i=0; i<ngene; i++)
-                        tmpvec[i] = 0;
-                    for (dx=-csize; dx<csize+1; dx++) {
-                        for (dy=-csize; dy<csize+1; dy++) {
-                            if (dx == 0 && dy == 0) continue;
-                            for (i=0; i<ngene; i++)
-                                tmpvec[i] += (vecs + I2D(x+dx, y+dy, dimsp[1])*ngene)[i];
-                        }
-                    }
-                    // tmpvec[i] /= (csize * 2 + 1) * (csize * 2 + 1) - 1;
-                    corrmap[I2D(x, y, dimsp[1])] = __corr__(vecs + I2D(x, y, dimsp[1])*ngene, tmpvec, ngene);
-                }
-            }
-            free((void*)tmpvec);
-        }
-    } else {
-        // 3D (nd == 4)
-        #pragma omp parallel num_threads(ncores) private(tmpvec)
-        {
-            tmpvec = (double *)calloc(ngene, sizeof(double));
-            #pragma omp for collapse(3)
-            for (x=csize; x<dimsp[0]-csize; x++) {
-                for (y=csize; y<dimsp[1]-csize; y++) {
-                    for (z=csize; z<dimsp[2]-csize; z++) {
-                        for (i=0; i<ngene; i++)
-                            tmpvec[i] = 0;
-                        for (dx=-csize; dx<csize+1; dx++) {
-                            for (dy=-csize; dy<csize+1; dy++) {
-                                for (dz=-csize; dz<csize+1; dz++) {
-                                    if (dx == 0 && dy == 0 && dz == 0) continue;
-                                    for (i=0; i<ngene; i++)
-                                        tmpvec[i] += (vecs + I3D(x+dx, y+dy, z+dz, dimsp[1], dimsp[2])*ngene)[i];
-                                }
-                            }
-                        }
-                        //for (i=0; i<ngene; i++)
-                        //    tmpvec[i] /= (csize * 2 + 1) * (csize * 2 + 1) * (csize * 2 + 1) - 1;
-                        corrmap[I3D(x, y, z, dimsp[1], dimsp[2])] =
-                            __corr__(vecs + I3D(x, y, z, dimsp[1], dimsp[2])*ngene, tmpvec, ngene);
-                    }
-                }
-            }
-            free((void*)tmpvec);
-        }
-    }
+    if (method == CORRMAP_SLIDING && PyArray_TYPE(arr1) == NPY_FLOAT)
+        corrmap_sliding_vf(corrmap, (float *)PyArray_DATA(arr1), norms, dimsp, nd, ngene, csize, ncores);
+    else if (method == CORRMAP_SLIDING)
+        corrmap_sliding_vf(corrmap, (double *)PyArray_DATA(arr1), norms, dimsp, nd, ngene, csize, ncores);
+    else if (PyArray_TYPE(arr1) == NPY_FLOAT)
+        corrmap_vf(corrmap, (float *)PyArray_DATA(arr1), norms, dimsp, nd, ngene, csize, ncores);
+    else
+        corrmap_vf(corrmap, (double *)PyArray_DATA(arr1), norms, dimsp, nd, ngene, csize, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(nvec, nvec);
     Py_DECREF(arr1);
+    Py_XDECREF(arr2);
 
     return (PyObject *) oarr;
  fail:
     Py_XDECREF(arr1);
+    Py_XDECREF(arr2);
     return NULL;
 }
 
 static PyObject *calc_corrmap_2(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("calc_corrmap_2");
     PyObject *arg1 = NULL;
     PyArrayObject *arr1 = NULL;
     PyArrayObject *oarr = NULL;
-    long i, k, x, y, z, dx, dy, dz;
+    long i;
     long nvec, nd, ngene = 0;
-    double *vecs, *corrmap;
+    double *corrmap;
     npy_intp *dimsp;
     npy_intp dimsp2[4];
     int ncores = omp_get_max_threads();
     int csize = 1;
+    int unit = 0;
 
-    static const char *kwlist[] = { "vf", "ncores", "size", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ii", const_cast<char **>(kwlist), &arg1, &ncores, &csize)) return NULL;
-    if ((arr1 = (PyArrayObject*)PyArray_FROM_OTF(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;   
+    static const char *kwlist[] = { "vf", "ncores", "size", "unit", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iip", const_cast<char **>(kwlist), &arg1, &ncores, &csize, &unit)) return NULL;
+    if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
     nd = PyArray_NDIM(arr1);
-    if (nd != 3 && nd != 4) goto fail; // only 2D or 3D array is expected
+    if (nd != 3 && nd != 4) { // only 2D or 3D array is expected
+        PyErr_SetString(PyExc_ValueError, "vf must be a 3D or 4D array.");
+        goto fail;
+    }
     dimsp = PyArray_DIMS(arr1);
-    for (i=0; i<nd-1; i++)
+    dimsp2[nd-1] = 1;
+    for (i=0; i<nd-1; i++) {
         dimsp2[i] = dimsp[i];
-    dimsp2[nd-1] = (csize * 2 + 1) * (csize * 2 + 1) - 1;
-    oarr = (PyArrayObject*)PyArray_ZEROS(nd, dimsp2, NPY_DOUBLE, NPY_CORDER);
+        dimsp2[nd-1] *= csize * 2 + 1;
+    }
+    dimsp2[nd-1] -= 1;
+    if ((oarr = (PyArrayObject*)PyArray_ZEROS(nd, dimsp2, NPY_DOUBLE, NPY_CORDER)) == NULL) goto fail;
     ngene = dimsp[nd-1];
     corrmap = (double *)PyArray_DATA(oarr);
-    vecs = (double *)PyArray_DATA(arr1);
     nvec = 1;
     for (i=0; i<nd; i++)
         nvec *= dimsp2[i];
 
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
     // initialize corrmap with NANs
     #pragma omp parallel for num_threads(ncores)
     for (i=0; i<nvec; i++)
         corrmap[i] = NPY_NAN;
 
-    if (nd == 3) {
-        // 2D
-        #pragma omp parallel for collapse(2) private(k, dx, dy)
-        for (x=csize; x<dimsp[0]-csize; x++) {
-            for (y=csize; y<dimsp[1]-csize; y++) {
-                k = 0;
-                for (dx=-csize; dx<csize+1; dx++) {
-                    for (dy=-csize; dy<csize+1; dy++) {
-                        if (dx == 0 && dy == 0) continue;
-                        corrmap[I2D(x, y, dimsp2[1])*dimsp2[2] + (k++)] = 
-                            __corr__(vecs + I2D(x, y, dimsp[1])*ngene,
-                                     vecs + I2D(x+dx, y+dy, dimsp[1])*ngene, ngene);
-                    }
-                }
-            }
-        }
-    } else {
-        // 3D
-        #pragma omp parallel for collapse(3) private(k, dx, dy, dz)
-        for (x=csize; x<dimsp[0]-csize; x++) {
-            for (y=csize; y<dimsp[1]-csize; y++) {
-                for (z=csize; z<dimsp[2]-csize; z++) {
-                    k = 0;
-                    for (dx=-csize; dx<csize+1; dx++) {
-                        for (dy=-csize; dy<csize+1; dy++) {
-                            for (dz=-csize; dz<csize+1; dz++) {
-                                if (dx == 0 && dy == 0 && dz == 0) continue;
-                                corrmap[I3D(x, y, z, dimsp2[1], dimsp2[2])*dimsp2[3] + (k++)] =
-                                    __corr__(vecs + I3D(x, y, z, dimsp[1], dimsp[2])*ngene, vecs + I3D(x+dx, y+dy, z+dz, dimsp[1], dimsp[2])*ngene, ngene);
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
+    if (PyArray_TYPE(arr1) == NPY_FLOAT)
+        corrmap_2_vf(corrmap, (float *)PyArray_DATA(arr1), dimsp, nd, ngene, csize, unit, ncores);
+    else
+        corrmap_2_vf(corrmap, (double *)PyArray_DATA(arr1), dimsp, nd, ngene, csize, unit, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    // Each pair of neighbours is correlated once
+    stats_count(nvec, nvec * (((nd == 4) ? (2 * csize + 1) * (2 * csize + 1) * (2 * csize + 1) : (2 * csize + 1) * (2 * csize + 1)) - 1) / 2);
     Py_DECREF(arr1);
 
     return (PyObject *) oarr;
@@ -594,24 +881,37 @@ static PyObject *calc_corrmap_2(PyObject *self, PyObject *args, PyObject *kwargs
 }
 
 static PyObject *calc_ctmap(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("calc_ctmap");
     PyObject *arg1 = NULL;
     PyObject *arg2 = NULL;
     PyArrayObject *arr1 = NULL;
     PyArrayObject *arr2 = NULL;
     PyArrayObject *oarr = NULL;
     long nvec, nd, ngene = 0;
-    double *cent, *vecs, *scores;
+    double *cent, *scores;
     npy_intp *dimsp;
     int ncores = omp_get_max_threads();
+    int unit = 0;
     int i;
 
-    static const char *kwlist[] = { "vec", "vf", "ncores", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i", const_cast<char **>(kwlist), &arg1, &arg2, &ncores)) return NULL;
-    if ((arr1 = (PyArrayObject*)PyArray_FROM_OTF(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;
-    if ((arr2 = (PyArrayObject*)PyArray_FROM_OTF(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
-    if (PyArray_NDIM(arr1) != 1) goto fail;
+    static const char *kwlist[] = { "vec", "vf", "ncores", "unit", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|ip", const_cast<char **>(kwlist), &arg1, &arg2, &ncores, &unit)) return NULL;
+    if ((arr1 = array_from(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;
+    if (PyTuple_Check(arg2)) {
+        oarr = (PyArrayObject *)calc_ctmap_sparse(arr1, arg2, ncores);
+        Py_DECREF(arr1);
+        return (PyObject *) oarr;
+    }
+    if ((arr2 = vf_from_object(arg2)) == NULL) goto fail;
+    if (PyArray_NDIM(arr1) != 1) {
+        PyErr_SetString(PyExc_ValueError, "vec must be a 1D array.");
+        goto fail;
+    }
     nd = PyArray_NDIM(arr2);
-    if((ngene = *PyArray_DIMS(arr1)) != PyArray_DIMS(arr2)[nd-1]) goto fail;
+    if ((ngene = *PyArray_DIMS(arr1)) != PyArray_DIMS(arr2)[nd-1]) {
+        PyErr_SetString(PyExc_ValueError, "vec must have one value per gene of vf.");
+        goto fail;
+    }
 
     dimsp = PyArray_DIMS(arr2);
     oarr = (PyArrayObject*)PyArray_ZEROS(nd - 1, dimsp, NPY_DOUBLE, NPY_CORDER);
@@ -622,12 +922,16 @@ static PyObject *calc_ctmap(PyObject *self, PyObject *args, PyObject *kwargs) {
 
     scores = (double *)PyArray_DATA(oarr);
     cent = (double *)PyArray_DATA(arr1);
-    vecs = (double *)PyArray_DATA(arr2);
 
-    #pragma omp parallel for num_threads(ncores)
-    for (i=0; i<nvec; i++) {
-        scores[i] = __corr__(cent, vecs + (i*ngene), ngene);
-    }
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (PyArray_TYPE(arr2) == NPY_FLOAT)
+        ctmap_vf(scores, cent, (float *)PyArray_DATA(arr2), nvec, ngene, unit, ncores);
+    else
+        ctmap_vf(scores, cent, (double *)PyArray_DATA(arr2), nvec, ngene, unit, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(nvec, nvec);
 
     Py_DECREF(arr1);
     Py_DECREF(arr2);
@@ -639,45 +943,1025 @@ static PyObject *calc_ctmap(PyObject *self, PyObject *args, PyObject *kwargs) {
     return NULL;
 }
 
-static PyObject *corr(PyObject *self, PyObject *args) {
+static PyObject *calc_ctmap_multi(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("calc_ctmap_multi");
     PyObject *arg1 = NULL;
     PyObject *arg2 = NULL;
     PyArrayObject *arr1 = NULL;
     PyArrayObject *arr2 = NULL;
-    long ngene = 0;
-    double *a;
-    double *b;
-    double rtn = 0;
+    PyArrayObject *oarr1 = NULL;
+    PyArrayObject *oarr2 = NULL;
+    long nvec, nd, ngene, ncent, ncp;
+    npy_intp *dimsp;
+    npy_intp odims[2];
+    int ncores = omp_get_max_threads();
+    int k = 1;
+    int i;
+    std::vector<double> cent, csum;
+
+    static const char *kwlist[] = { "centroids", "vf", "k", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|ii", const_cast<char **>(kwlist), &arg1, &arg2, &k, &ncores)) return NULL;
+    if ((arr1 = array_from(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;
+    if ((arr2 = vf_from_object(arg2)) == NULL) goto fail;
+    nd = PyArray_NDIM(arr2);
+    if (PyArray_NDIM(arr1) != 2 || nd < 1) {
+        PyErr_SetString(PyExc_ValueError, "Centroids must be a 2D array, one row per centroid.");
+        goto fail;
+    }
+    ncent = PyArray_DIMS(arr1)[0];
+    dimsp = PyArray_DIMS(arr2);
+    if ((ngene = PyArray_DIMS(arr1)[1]) != dimsp[nd-1] || ngene == 0) {
+        PyErr_SetString(PyExc_ValueError, "Centroids and vectors must have the same number of genes.");
+        goto fail;
+    }
+    if (k < 1 || k > ncent) {
+        PyErr_SetString(PyExc_ValueError, "k must be between 1 and the number of centroids.");
+        goto fail;
+    }
+
+    nvec = 1;
+    for (i=0; i<nd-1; i++)
+        nvec *= dimsp[i];
 
-    if (!PyArg_ParseTuple(args, "OO", &arg1, &arg2)) return NULL;
-    if ((arr1 = (PyArrayObject*)PyArray_FROM_OTF(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) return NULL;
-    if ((arr2 = (PyArrayObject*)PyArray_FROM_OTF(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY)) == NULL) goto fail;
-    if (PyArray_NDIM(arr1) != 1) goto fail;
-    if (PyArray_NDIM(arr2) != 1) goto fail;
-    if((ngene = *PyArray_DIMS(arr1)) != *PyArray_DIMS(arr2)) goto fail;
+    ncp = ctmap_pack(cent, csum, (double *)PyArray_DATA(arr1), ncent, ngene);
 
-    a = (double *)PyArray_DATA(arr1);
-    b = (double *)PyArray_DATA(arr2);
+    odims[0] = nvec;
+    odims[1] = k;
+    if ((oarr1 = (PyArrayObject *)PyArray_SimpleNew(2, odims, NPY_DOUBLE)) == NULL) goto fail;
+    if ((oarr2 = (PyArrayObject *)PyArray_SimpleNew(2, odims, NPY_INT)) == NULL) goto fail;
 
-    rtn = __corr__(a, b, ngene);
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (PyArray_TYPE(arr2) == NPY_FLOAT)
+        ctmap_multi_vf((double *)PyArray_DATA(oarr1), (int *)PyArray_DATA(oarr2), (float *)PyArray_DATA(arr2),
+                       cent.data(), csum.data(), nvec, ngene, ncent, ncp, k, ncores);
+    else
+        ctmap_multi_vf((double *)PyArray_DATA(oarr1), (int *)PyArray_DATA(oarr2), (double *)PyArray_DATA(arr2),
+                       cent.data(), csum.data(), nvec, ngene, ncent, ncp, k, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(nvec, nvec * ncent);
 
     Py_DECREF(arr1);
     Py_DECREF(arr2);
 
-    return PyFloat_FromDouble(rtn);
+    return Py_BuildValue("NN", oarr1, oarr2);
  fail:
     Py_XDECREF(arr1);
     Py_XDECREF(arr2);
+    Py_XDECREF(oarr1);
+    Py_XDECREF(oarr2);
     return NULL;
 }
 
-static struct PyMethodDef module_methods[] = {
-    {"corr", (PyCFunction)corr, METH_VARARGS, "Calculates Pearson's correlation coefficient."},
-    {"calc_ctmap", (PyCFunction)calc_ctmap, METH_VARARGS | METH_KEYWORDS, "Creates a cell type map."},
-    {"calc_corrmap", (PyCFunction)calc_corrmap, METH_VARARGS | METH_KEYWORDS, "Creates a correlation map."},
-    {"calc_corrmap_2", (PyCFunction)calc_corrmap_2, METH_VARARGS | METH_KEYWORDS, "Creates a correlation map."},
-    {"calc_kde", (PyCFunction)calc_kde, METH_VARARGS | METH_KEYWORDS, "Run kernel density estimation."},
+static PyObject *normalize_vectors(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("normalize_vectors");
+    PyObject *arg1 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *arrs[SVF_NARRAYS] = { NULL };
+    PyArrayObject *oarrs[3] = { NULL, NULL, NULL };
+    svf_view v;
+    bool sparse;
+    long nvec, ngene;
+    double size = 10, moments_threshold = NPY_INFINITY;
+    int normalize_vector = 1, normalize_median = 0, log_transform = 1;
+    int ncores = omp_get_max_threads();
+    int i;
+    npy_intp odims[2];
+    gene_moments moments;
+
+    static const char *kwlist[] = { "vecs", "size", "normalize_vector", "normalize_median", "log_transform", "moments_threshold", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|dpppdi", const_cast<char **>(kwlist), &arg1, &size, &normalize_vector, &normalize_median, &log_transform,
+                                     &moments_threshold, &ncores)) return NULL;
+    // A sparse field is normalized pixel by pixel, and gives the normalized values of its nonzero genes
+    if ((sparse = PyTuple_Check(arg1))) {
+        if (!svf_from_object(arg1, v, arrs)) goto fail;
+        nvec = v.tile_ptr[v.ntiles[0] * v.ntiles[1] * v.ntiles[2]];
+        ngene = v.ngene;
+        odims[0] = v.vox_ptr[nvec];
+        if ((oarrs[0] = (PyArrayObject *)PyArray_SimpleNew(1, odims, NPY_FLOAT)) == NULL) goto fail;
+    } else {
+        if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
+        if (PyArray_NDIM(arr1) != 2) {
+            PyErr_SetString(PyExc_ValueError, "Vectors must be a 2D array, one row per vector.");
+            goto fail;
+        }
+        nvec = PyArray_DIMS(arr1)[0];
+        ngene = PyArray_DIMS(arr1)[1];
+        odims[0] = nvec;
+        odims[1] = ngene;
+        if ((oarrs[0] = (PyArrayObject *)PyArray_SimpleNew(2, odims, NPY_FLOAT)) == NULL) goto fail;
+    }
+    odims[1] = ngene;
+    if ((oarrs[1] = (PyArrayObject *)PyArray_SimpleNew(1, &odims[1], NPY_DOUBLE)) == NULL) goto fail;
+    if ((oarrs[2] = (PyArrayObject *)PyArray_SimpleNew(1, &odims[1], NPY_DOUBLE)) == NULL) goto fail;
+    moments.count = 0;
+    moments.mean.assign(ngene, 0.0);
+    moments.m2.assign(ngene, 0.0);
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (sparse) {
+        normalize_vf((float *)PyArray_DATA(oarrs[0]), moments, (float *)NULL, nvec, ngene, size,
+                     normalize_vector, normalize_median, log_transform, moments_threshold, ncores, &v);
+        // Empty pixels have an L1 norm of 0 and normalize to zero vectors
+        if (0 > moments_threshold) {
+            gene_moments empty;
+            empty.count = v.shape[0] * v.shape[1] * v.shape[2] - nvec;
+            empty.mean.assign(ngene, 0.0);
+            empty.m2.assign(ngene, 0.0);
+            moments_merge(moments, empty);
+        }
+    } else if (PyArray_TYPE(arr1) == NPY_FLOAT) {
+        normalize_vf((float *)PyArray_DATA(oarrs[0]), moments, (float *)PyArray_DATA(arr1), nvec, ngene, size,
+                     normalize_vector, normalize_median, log_transform, moments_threshold, ncores);
+    } else {
+        normalize_vf((float *)PyArray_DATA(oarrs[0]), moments, (double *)PyArray_DATA(arr1), nvec, ngene, size,
+                     normalize_vector, normalize_median, log_transform, moments_threshold, ncores);
+    }
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(nvec, 0);
+
+    std::copy(moments.mean.begin(), moments.mean.end(), (double *)PyArray_DATA(oarrs[1]));
+    std::copy(moments.m2.begin(), moments.m2.end(), (double *)PyArray_DATA(oarrs[2]));
+    Py_XDECREF(arr1);
+    svf_release(arrs);
+    // Returns the normalized vectors and (count, mean, m2) of the moments
+    return Py_BuildValue("N(lNN)", oarrs[0], moments.count, oarrs[1], oarrs[2]);
+
+fail:
+    Py_XDECREF(arr1);
+    svf_release(arrs);
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(oarrs[i]);
+    return NULL;
+}
+
+static PyObject *find_localmax(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("find_localmax");
+    PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
+    PyObject *arg3 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *arr2 = NULL;
+    PyArrayObject *arr3 = NULL;
+    PyArrayObject *oarrs[3] = { NULL, NULL, NULL };
+    PyArrayObject *narr = NULL;
+    long nd, ngene;
+    long dims[3] = { 1, 1, 1 }, borg[3] = { 0, 0, 0 }, bext[3];
+    double norm_threshold = 0, expression_threshold = -NPY_INFINITY;
+    int size = 3;
+    int ncores = omp_get_max_threads();
+    int i;
+    std::vector<long> found;
+    std::vector<double> norm;
+    npy_intp odims[3];
+
+    static const char *kwlist[] = { "vf", "size", "norm_threshold", "expression_threshold", "origin", "block_shape", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iddOOi", const_cast<char **>(kwlist), &arg1, &size, &norm_threshold, &expression_threshold, &arg2, &arg3, &ncores)) return NULL;
+    if (size < 1) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive.");
+        return NULL;
+    }
+    if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
+    nd = PyArray_NDIM(arr1);
+    if (nd != 3 && nd != 4) { // only 2D or 3D array is expected
+        PyErr_SetString(PyExc_ValueError, "vf must be a 3D or 4D array.");
+        goto fail;
+    }
+    for (i = 0; i < nd - 1; i++)
+        dims[i] = PyArray_DIMS(arr1)[i];
+    ngene = PyArray_DIMS(arr1)[nd - 1];
+    if (arg2 != NULL && arg2 != Py_None && (arr2 = array_from(arg2, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if (arg3 != NULL && arg3 != Py_None && (arr3 = array_from(arg3, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if ((arr2 && PyArray_SIZE(arr2) != nd - 1) || (arr3 && PyArray_SIZE(arr3) != nd - 1)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid array dimensions.");
+        goto fail;
+    }
+    // The inner block defaults to the whole block
+    for (i = 0; i < 3; i++) {
+        if (i < nd - 1 && arr2)
+            borg[i] = ((long *)PyArray_DATA(arr2))[i];
+        bext[i] = (i < nd - 1 && arr3) ? ((long *)PyArray_DATA(arr3))[i] : dims[i] - borg[i];
+        if (borg[i] < 0 || bext[i] < 0 || borg[i] + bext[i] > dims[i]) {
+            PyErr_SetString(PyExc_ValueError, "Block is out of the vector field.");
+            goto fail;
+        }
+        odims[i] = bext[i];
+    }
+    norm.resize(dims[0] * dims[1] * dims[2]);
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (PyArray_TYPE(arr1) == NPY_FLOAT)
+        localmax_vf(found, norm.data(), (float *)PyArray_DATA(arr1), dims, ngene, borg, bext, size, norm_threshold, expression_threshold, ncores);
+    else
+        localmax_vf(found, norm.data(), (double *)PyArray_DATA(arr1), dims, ngene, borg, bext, size, norm_threshold, expression_threshold, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(dims[0] * dims[1] * dims[2], 0);
+
+    // Returns the local maxima as in np.where, and the norm of the inner block
+    if ((narr = (PyArrayObject *)PyArray_SimpleNew(nd - 1, odims, NPY_DOUBLE)) == NULL) goto fail;
+    for (long x = 0; x < bext[0]; x++)
+        for (long y = 0; y < bext[1]; y++)
+            memcpy((double *)PyArray_DATA(narr) + I3D(x, y, 0, bext[1], bext[2]),
+                   &norm[I3D(borg[0] + x, borg[1] + y, borg[2], dims[1], dims[2])], bext[2] * sizeof(double));
+    for (i = 0; i < nd - 1; i++) {
+        npy_intp n = found.size();
+        if ((oarrs[i] = (PyArrayObject *)PyArray_SimpleNew(1, &n, NPY_INT64)) == NULL) goto fail;
+        npy_int64 *p = (npy_int64 *)PyArray_DATA(oarrs[i]);
+        for (size_t k = 0; k < found.size(); k++)
+            p[k] = i == 0 ? found[k] / (bext[1] * bext[2]) : i == 1 ? (found[k] / bext[2]) % bext[1] : found[k] % bext[2];
+    }
+
+    Py_DECREF(arr1);
+    Py_XDECREF(arr2);
+    Py_XDECREF(arr3);
+    if (nd == 3)
+        return Py_BuildValue("(NN)N", oarrs[0], oarrs[1], narr);
+    return Py_BuildValue("(NNN)N", oarrs[0], oarrs[1], oarrs[2], narr);
+
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(arr2);
+    Py_XDECREF(arr3);
+    Py_XDECREF(narr);
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(oarrs[i]);
+    return NULL;
+}
+
+static PyObject *bin_celltypemaps(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("bin_celltypemaps");
+    PyObject *arg1 = NULL;
+    PyObject *largs[3] = { NULL, NULL, NULL };
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *larrs[3] = { NULL, NULL, NULL };
+    PyArrayObject *oarr = NULL;
+    long dims[3], nlat[3];
+    const long *lat[3];
+    long radius, ncelltypes;
+    int ncores = omp_get_max_threads();
+    int i;
+    npy_intp odims[4];
+
+    static const char *kwlist[] = { "ctmap", "x", "y", "z", "radius", "ncelltypes", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOll|i", const_cast<char **>(kwlist), &arg1, &largs[0], &largs[1], &largs[2], &radius, &ncelltypes, &ncores)) return NULL;
+    if (radius < 0 || ncelltypes < 0) {
+        PyErr_SetString(PyExc_ValueError, "radius and ncelltypes must not be negative.");
+        return NULL;
+    }
+    if ((arr1 = array_from(arg1, NPY_INT, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if (PyArray_NDIM(arr1) != 3) {
+        PyErr_SetString(PyExc_ValueError, "The cell type map must be a 3D array.");
+        goto fail;
+    }
+    for (i = 0; i < 3; i++) {
+        dims[i] = PyArray_DIMS(arr1)[i];
+        if ((larrs[i] = array_from(largs[i], NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+        if (PyArray_NDIM(larrs[i]) != 1) {
+            PyErr_SetString(PyExc_ValueError, "Lattice coordinates must be 1D arrays.");
+            goto fail;
+        }
+        nlat[i] = PyArray_DIMS(larrs[i])[0];
+        lat[i] = (const long *)PyArray_DATA(larrs[i]);
+        for (long j = 0; j < nlat[i]; j++) {
+            if (lat[i][j] < 0 || lat[i][j] >= dims[i] || (j > 0 && lat[i][j] < lat[i][j - 1])) {
+                PyErr_SetString(PyExc_ValueError, "Lattice coordinates must be sorted and inside of the map.");
+                goto fail;
+            }
+        }
+        odims[i] = nlat[i];
+    }
+    odims[3] = ncelltypes;
+    if ((oarr = (PyArrayObject *)PyArray_SimpleNew(4, odims, NPY_INT64)) == NULL) goto fail;
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    bin_celltypes((npy_int64 *)PyArray_DATA(oarr), (const int *)PyArray_DATA(arr1), dims, lat, nlat, radius, ncelltypes, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(PyArray_SIZE(arr1), 0);
+
+    Py_DECREF(arr1);
+    for (i = 0; i < 3; i++)
+        Py_DECREF(larrs[i]);
+    return (PyObject *) oarr;
+
+fail:
+    Py_XDECREF(arr1);
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(larrs[i]);
+    Py_XDECREF(oarr);
+    return NULL;
+}
+
+static PyObject *label_adjacency(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("label_adjacency");
+    PyObject *arg1 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *oarr1 = NULL;
+    PyArrayObject *oarr2 = NULL;
+    long dims[3] = { 1, 1, 1 };
+    long background = 0;
+    int ncores = omp_get_max_threads();
+    int i;
+    label_contacts contacts;
+    std::vector<std::pair<std::pair<long, long>, long> > sorted;
+    npy_intp odims[2];
+
+    static const char *kwlist[] = { "labels", "background", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|li", const_cast<char **>(kwlist), &arg1, &background, &ncores)) return NULL;
+    if ((arr1 = array_from(arg1, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if (PyArray_NDIM(arr1) < 1 || PyArray_NDIM(arr1) > 3) {
+        PyErr_SetString(PyExc_ValueError, "Labels must be a 1D, 2D or 3D array.");
+        goto fail;
+    }
+    for (i = 0; i < PyArray_NDIM(arr1); i++)
+        dims[i] = PyArray_DIMS(arr1)[i];
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    label_adjacency_vol(contacts, (const long *)PyArray_DATA(arr1), dims, background, ncores);
+    threads_return(ncores);
+    sorted.assign(contacts.begin(), contacts.end());
+    std::sort(sorted.begin(), sorted.end());
+    Py_END_ALLOW_THREADS
+    stats_count(PyArray_SIZE(arr1), 0);
+
+    // Returns the label pairs (n, 2), in ascending order, and their contact counts
+    odims[0] = sorted.size();
+    odims[1] = 2;
+    if ((oarr1 = (PyArrayObject *)PyArray_SimpleNew(2, odims, NPY_INT64)) == NULL) goto fail;
+    if ((oarr2 = (PyArrayObject *)PyArray_SimpleNew(1, odims, NPY_INT64)) == NULL) goto fail;
+    for (size_t k = 0; k < sorted.size(); k++) {
+        ((npy_int64 *)PyArray_DATA(oarr1))[2 * k] = sorted[k].first.first;
+        ((npy_int64 *)PyArray_DATA(oarr1))[2 * k + 1] = sorted[k].first.second;
+        ((npy_int64 *)PyArray_DATA(oarr2))[k] = sorted[k].second;
+    }
+
+    Py_DECREF(arr1);
+    return Py_BuildValue("NN", oarr1, oarr2);
+
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(oarr1);
+    Py_XDECREF(oarr2);
+    return NULL;
+}
+
+static PyObject *cell_by_gene(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("cell_by_gene");
+    PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
+    PyObject *arg3 = NULL;
+    PyObject *arg4 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *arr2 = NULL;
+    PyArrayObject *arr3 = NULL;
+    PyArrayObject *arr4 = NULL;
+    PyArrayObject *oarrs[3] = { NULL, NULL, NULL };
+    long npts, nseg, ngene;
+    long dims[2];
+    int ncores = omp_get_max_threads();
+    int i;
+    npy_intp odims[1];
+    npy_int64 *data, *indices, *indptr;
+    std::vector<std::pair<long, long> > cells;
+
+    static const char *kwlist[] = { "x", "y", "gene", "segments", "nseg", "ngene", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOll|i", const_cast<char **>(kwlist), &arg1, &arg2, &arg3, &arg4, &nseg, &ngene, &ncores)) return NULL;
+    if (nseg < 0 || ngene < 0) {
+        PyErr_SetString(PyExc_ValueError, "nseg and ngene must not be negative.");
+        return NULL;
+    }
+    if ((arr1 = array_from(arg1, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if ((arr2 = array_from(arg2, NPY_DOUBLE, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if ((arr3 = array_from(arg3, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if ((arr4 = array_from(arg4, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    npts = PyArray_SIZE(arr1);
+    if (PyArray_SIZE(arr2) != npts || PyArray_SIZE(arr3) != npts || PyArray_NDIM(arr4) != 2) {
+        PyErr_SetString(PyExc_ValueError, "Invalid array dimensions.");
+        goto fail;
+    }
+    dims[0] = PyArray_DIMS(arr4)[0];
+    dims[1] = PyArray_DIMS(arr4)[1];
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    cell_by_gene_counts(cells, (double *)PyArray_DATA(arr1), (double *)PyArray_DATA(arr2), (long *)PyArray_DATA(arr3), npts,
+                        (long *)PyArray_DATA(arr4), dims, nseg, ngene, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+
+    // Returns the (data, indices, indptr) of a CSR matrix of nseg rows
+    odims[0] = cells.size();
+    if ((oarrs[0] = (PyArrayObject *)PyArray_SimpleNew(1, odims, NPY_INT64)) == NULL) goto fail;
+    if ((oarrs[1] = (PyArrayObject *)PyArray_SimpleNew(1, odims, NPY_INT64)) == NULL) goto fail;
+    odims[0] = nseg + 1;
+    if ((oarrs[2] = (PyArrayObject *)PyArray_ZEROS(1, odims, NPY_INT64, NPY_CORDER)) == NULL) goto fail;
+    data = (npy_int64 *)PyArray_DATA(oarrs[0]);
+    indices = (npy_int64 *)PyArray_DATA(oarrs[1]);
+    indptr = (npy_int64 *)PyArray_DATA(oarrs[2]);
+    for (size_t k = 0; k < cells.size(); k++) {
+        data[k] = cells[k].second;
+        indices[k] = cells[k].first % ngene;
+        indptr[cells[k].first / ngene + 1] += 1;
+    }
+    for (long s = 0; s < nseg; s++)
+        indptr[s + 1] += indptr[s];
+    stats_count(npts, cells.size());
+
+    Py_DECREF(arr1);
+    Py_DECREF(arr2);
+    Py_DECREF(arr3);
+    Py_DECREF(arr4);
+    return Py_BuildValue("NNN", oarrs[0], oarrs[1], oarrs[2]);
+
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(arr2);
+    Py_XDECREF(arr3);
+    Py_XDECREF(arr4);
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(oarrs[i]);
+    return NULL;
+}
+
+static PyObject *filter_blobs(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("filter_blobs");
+    PyObject *arg1 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *oarr = NULL;
+    long dims[3] = { 1, 1, 1 };
+    long min_area = 0;
+    int fill = 1;
+    int ncores = omp_get_max_threads();
+    int i;
+
+    static const char *kwlist[] = { "labels", "min_area", "fill", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|lpi", const_cast<char **>(kwlist), &arg1, &min_area, &fill, &ncores)) return NULL;
+    if ((arr1 = array_from(arg1, NPY_INT, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if (PyArray_NDIM(arr1) < 1 || PyArray_NDIM(arr1) > 3) {
+        PyErr_SetString(PyExc_ValueError, "Labels must be a 1D, 2D or 3D array.");
+        goto fail;
+    }
+    for (i = 0; i < PyArray_NDIM(arr1); i++)
+        dims[i] = PyArray_DIMS(arr1)[i];
+    if ((oarr = (PyArrayObject *)PyArray_SimpleNew(PyArray_NDIM(arr1), PyArray_DIMS(arr1), NPY_BOOL)) == NULL) goto fail;
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    filter_blobs_vol((bool *)PyArray_DATA(oarr), (const int *)PyArray_DATA(arr1), dims, min_area, fill, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(PyArray_SIZE(arr1), 0);
+
+    Py_DECREF(arr1);
+    return (PyObject *) oarr;
+
+fail:
+    Py_XDECREF(arr1);
+    return NULL;
+}
+
+static PyObject *vf_to_sparse(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("vf_to_sparse");
+    PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *arr2 = NULL;
+    PyObject *rtn = NULL;
+    long nd, ngene;
+    long dims[3] = { 1, 1, 1 }, tile[3] = { 1, 1, 1 };
+    int ncores = omp_get_max_threads();
+    int i;
+
+    static const char *kwlist[] = { "vf", "tile_shape", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i", const_cast<char **>(kwlist), &arg1, &arg2, &ncores)) return NULL;
+    if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
+    if ((arr2 = array_from(arg2, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    nd = PyArray_NDIM(arr1);
+    if (nd != 3 && nd != 4) {
+        PyErr_SetString(PyExc_ValueError, "Vector field must be a 3D or 4D array.");
+        goto fail;
+    }
+    if (PyArray_SIZE(arr2) != nd - 1) {
+        PyErr_SetString(PyExc_ValueError, "Tile shape must have one size per spatial dimension.");
+        goto fail;
+    }
+    for (i = 0; i < nd - 1; i++) {
+        dims[i] = PyArray_DIMS(arr1)[i];
+        tile[i] = ((long *)PyArray_DATA(arr2))[i];
+        if (tile[i] < 1) {
+            PyErr_SetString(PyExc_ValueError, "Tile sizes must be positive.");
+            goto fail;
+        }
+    }
+    ngene = PyArray_DIMS(arr1)[nd-1];
+
+    if (PyArray_TYPE(arr1) == NPY_FLOAT)
+        rtn = svf_export((float *)PyArray_DATA(arr1), dims, ngene, tile, NPY_FLOAT, ncores);
+    else
+        rtn = svf_export((double *)PyArray_DATA(arr1), dims, ngene, tile, NPY_FLOAT, ncores);
+
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(arr2);
+    return rtn;
+}
+
+static PyObject *vf_from_sparse(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("vf_from_sparse");
+    PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
+    PyObject *arg3 = NULL;
+    PyArrayObject *arrs[SVF_NARRAYS];
+    PyArrayObject *arr2 = NULL;
+    PyArrayObject *arr3 = NULL;
+    PyArrayObject *oarr = NULL;
+    svf_view v;
+    long borg[3] = { 0, 0, 0 }, bext[3];
+    npy_intp odims[4];
+    int ncores = omp_get_max_threads();
+    int i;
+
+    static const char *kwlist[] = { "svf", "origin", "block_shape", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOi", const_cast<char **>(kwlist), &arg1, &arg2, &arg3, &ncores)) return NULL;
+    if (!svf_from_object(arg1, v, arrs)) goto fail;
+    if (arg2 != NULL && arg2 != Py_None && (arr2 = array_from(arg2, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if (arg3 != NULL && arg3 != Py_None && (arr3 = array_from(arg3, NPY_LONG, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) goto fail;
+    if ((arr2 && PyArray_SIZE(arr2) != 3) || (arr3 && PyArray_SIZE(arr3) != 3)) {
+        PyErr_SetString(PyExc_ValueError, "Origin and block shape must have 3 elements.");
+        goto fail;
+    }
+    for (i = 0; i < 3; i++) {
+        if (arr2)
+            borg[i] = ((long *)PyArray_DATA(arr2))[i];
+        bext[i] = arr3 ? ((long *)PyArray_DATA(arr3))[i] : v.shape[i] - borg[i];
+        if (borg[i] < 0 || bext[i] < 1 || borg[i] + bext[i] > v.shape[i]) {
+            PyErr_SetString(PyExc_ValueError, "Block is out of the grid.");
+            goto fail;
+        }
+        odims[i] = bext[i];
+    }
+    odims[3] = v.ngene;
+    if ((oarr = (PyArrayObject*)PyArray_ZEROS(4, odims, NPY_FLOAT, NPY_CORDER)) == NULL) goto fail;
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    svf_dense((float *)PyArray_DATA(oarr), v, borg, bext, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count((long)bext[0] * bext[1] * bext[2], 0);
+
+    svf_release(arrs);
+    Py_XDECREF(arr2);
+    Py_XDECREF(arr3);
+    return (PyObject *) oarr;
+
+fail:
+    svf_release(arrs);
+    Py_XDECREF(arr2);
+    Py_XDECREF(arr3);
+    return NULL;
+}
+
+static PyObject *unit_vectors(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("unit_vectors");
+    PyObject *arg1 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *oarr1 = NULL;
+    PyArrayObject *oarr2 = NULL;
+    long nvec, nd, ngene;
+    int ncores = omp_get_max_threads();
+    int i;
+
+    static const char *kwlist[] = { "vf", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", const_cast<char **>(kwlist), &arg1, &ncores)) return NULL;
+    if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
+    if ((nd = PyArray_NDIM(arr1)) < 1) {
+        PyErr_SetString(PyExc_ValueError, "Vectors must be at least a 1D array.");
+        goto fail;
+    }
+    ngene = PyArray_DIMS(arr1)[nd-1];
+    nvec = 1;
+    for (i=0; i<nd-1; i++)
+        nvec *= PyArray_DIMS(arr1)[i];
+    // Unit vectors keep the precision of the input; norms are one per vector
+    if ((oarr1 = (PyArrayObject *)PyArray_SimpleNew(nd, PyArray_DIMS(arr1), PyArray_TYPE(arr1))) == NULL) goto fail;
+    if ((oarr2 = (PyArrayObject *)PyArray_SimpleNew(nd - 1, PyArray_DIMS(arr1), NPY_DOUBLE)) == NULL) goto fail;
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (PyArray_TYPE(arr1) == NPY_FLOAT)
+        unit_vf((float *)PyArray_DATA(oarr1), (double *)PyArray_DATA(oarr2), (float *)PyArray_DATA(arr1), nvec, ngene, ncores);
+    else
+        unit_vf((double *)PyArray_DATA(oarr1), (double *)PyArray_DATA(oarr2), (double *)PyArray_DATA(arr1), nvec, ngene, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(nvec, 0);
+
+    Py_DECREF(arr1);
+    return Py_BuildValue("NN", oarr1, oarr2);
+
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(oarr1);
+    return NULL;
+}
+
+static PyObject *knn_graph(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("knn_graph");
+    PyObject *arg1 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *oarr1 = NULL;
+    PyArrayObject *oarr2 = NULL;
+    long n, ngene;
+    int k, K, metric = KNN_CORRELATION, exact = -1;
+    unsigned long long seed = 0;
+    int ncores = omp_get_max_threads();
+    npy_intp odims[2];
+    knn_index x;
+    std::vector<int> ids;
+    std::vector<double> dists;
+
+    static const char *kwlist[] = { "vecs", "k", "metric", "exact", "seed", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|iiKi", const_cast<char **>(kwlist), &arg1, &k, &metric, &exact, &seed, &ncores)) return NULL;
+    if (metric != KNN_CORRELATION && metric != KNN_COSINE && metric != KNN_EUCLIDEAN) {
+        PyErr_SetString(PyExc_ValueError, "Unknown metric.");
+        return NULL;
+    }
+    if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
+    if (PyArray_NDIM(arr1) != 2) {
+        PyErr_SetString(PyExc_ValueError, "Vectors must be a 2D array, one row per vector.");
+        goto fail;
+    }
+    n = PyArray_DIMS(arr1)[0];
+    ngene = PyArray_DIMS(arr1)[1];
+    if (k < 1 || k > n) {
+        PyErr_SetString(PyExc_ValueError, "k must be between 1 and the number of vectors.");
+        goto fail;
+    }
+    if (n >= INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "Too many vectors.");
+        goto fail;
+    }
+    odims[0] = n;
+    odims[1] = k;
+    if ((oarr1 = (PyArrayObject *)PyArray_SimpleNew(2, odims, NPY_INT32)) == NULL) goto fail;
+    if ((oarr2 = (PyArrayObject *)PyArray_SimpleNew(2, odims, NPY_DOUBLE)) == NULL) goto fail;
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    if (PyArray_TYPE(arr1) == NPY_FLOAT)
+        knn_prepare(x, (float *)PyArray_DATA(arr1), n, ngene, metric, ncores);
+    else
+        knn_prepare(x, (double *)PyArray_DATA(arr1), n, ngene, metric, ncores);
+    // Neighbours other than the node itself
+    K = k - 1;
+    ids.assign(n * K, -1);
+    dists.assign(n * K, NPY_INFINITY);
+    if (K > 0 && (exact > 0 || (exact < 0 && n <= KNN_EXACT_MAX)))
+        knn_exact(ids.data(), dists.data(), x, K, ncores);
+    else if (K > 0)
+        knn_descent(ids.data(), dists.data(), x, K, seed, ncores);
+    {
+        npy_int32 *oids = (npy_int32 *)PyArray_DATA(oarr1);
+        double *odists = (double *)PyArray_DATA(oarr2);
+        for (long i = 0; i < n; i++) {
+            // The node itself comes first, like kneighbors_graph(include_self=True)
+            oids[i * k] = (npy_int32)i;
+            odists[i * k] = 0;
+            for (int j = 0; j < K; j++) {
+                oids[i * k + j + 1] = ids[i * K + j];
+                odists[i * k + j + 1] = (metric == KNN_EUCLIDEAN) ? sqrt(dists[i * K + j]) : dists[i * K + j];
+            }
+        }
+    }
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+    stats_count(n, 0);
+    stats_copied(PyArray_NBYTES(oarr1) + PyArray_NBYTES(oarr2));
+
+    Py_DECREF(arr1);
+    return Py_BuildValue("NN", oarr1, oarr2);
+
+fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(oarr1);
+    Py_XDECREF(oarr2);
+    return NULL;
+}
+
+static PyObject *snn_graph(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("snn_graph");
+    PyObject *arg1 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *oarrs[3] = { NULL, NULL, NULL };
+    double prune = 0;
+    int ncores = omp_get_max_threads();
+    long n, nedges = 0;
+    int k, i;
+    npy_intp odims[1];
+    std::vector<std::vector<int> > src, dst;
+    std::vector<std::vector<double> > weight;
+
+    static const char *kwlist[] = { "indices", "prune", "ncores", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|di", const_cast<char **>(kwlist), &arg1, &prune, &ncores)) return NULL;
+    if ((arr1 = array_from(arg1, NPY_INT32, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST)) == NULL) return NULL;
+    if (PyArray_NDIM(arr1) != 2) {
+        PyErr_SetString(PyExc_ValueError, "Neighbour indices must be a 2D array, one row per node.");
+        goto fail;
+    }
+    n = PyArray_DIMS(arr1)[0];
+    k = PyArray_DIMS(arr1)[1];
+    for (long j = 0; j < n * k; j++) {
+        if (((npy_int32 *)PyArray_DATA(arr1))[j] < 0 || ((npy_int32 *)PyArray_DATA(arr1))[j] >= n) {
+            PyErr_SetString(PyExc_ValueError, "Neighbour index out of range.");
+            goto fail;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ncores = threads_lease(ncores);
+    snn_edges(src, dst, weight, (npy_int32 *)PyArray_DATA(arr1), n, k, prune, ncores);
+    threads_return(ncores);
+    Py_END_ALLOW_THREADS
+
+    for (const auto &part : src)
+        nedges += part.size();
+    odims[0] = nedges;
+    if ((oarrs[0] = (PyArrayObject *)PyArray_SimpleNew(1, odims, NPY_INT32)) == NULL) goto fail;
+    if ((oarrs[1] = (PyArrayObject *)PyArray_SimpleNew(1, odims, NPY_INT32)) == NULL) goto fail;
+    if ((oarrs[2] = (PyArrayObject *)PyArray_SimpleNew(1, odims, NPY_DOUBLE)) == NULL) goto fail;
+    nedges = 0;
+    for (size_t t = 0; t < src.size(); t++) {
+        std::copy(src[t].begin(), src[t].end(), (npy_int32 *)PyArray_DATA(oarrs[0]) + nedges);
+        std::copy(dst[t].begin(), dst[t].end(), (npy_int32 *)PyArray_DATA(oarrs[1]) + nedges);
+        std::copy(weight[t].begin(), weight[t].end(), (double *)PyArray_DATA(oarrs[2]) + nedges);
+        nedges += src[t].size();
+    }
+
+    stats_count(n, 0);
+    stats_copied(PyArray_NBYTES(oarrs[0]) + PyArray_NBYTES(oarrs[1]) + PyArray_NBYTES(oarrs[2]));
+
+    Py_DECREF(arr1);
+    // Returns the edges as (sources, targets, weights)
+    return Py_BuildValue("NNN", oarrs[0], oarrs[1], oarrs[2]);
+
+fail:
+    Py_XDECREF(arr1);
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(oarrs[i]);
+    return NULL;
+}
+
+static PyObject *corr(PyObject *self, PyObject *args, PyObject *kwargs) {
+    stats_call sc("corr");
+    PyObject *arg1 = NULL;
+    PyObject *arg2 = NULL;
+    PyArrayObject *arr1 = NULL;
+    PyArrayObject *arr2 = NULL;
+    long ngene = 0;
+    void *a;
+    void *b;
+    double rtn = 0;
+    int unit = 0;
+
+    static const char *kwlist[] = { "a", "b", "unit", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|p", const_cast<char **>(kwlist), &arg1, &arg2, &unit)) return NULL;
+    if ((arr1 = vf_from_object(arg1)) == NULL) return NULL;
+    if ((arr2 = vf_from_object(arg2)) == NULL) goto fail;
+    if (PyArray_NDIM(arr1) != 1) {
+        PyErr_SetString(PyExc_ValueError, "a must be a 1D array.");
+        goto fail;
+    }
+    if (PyArray_NDIM(arr2) != 1) {
+        PyErr_SetString(PyExc_ValueError, "b must be a 1D array.");
+        goto fail;
+    }
+    if ((ngene = *PyArray_DIMS(arr1)) != *PyArray_DIMS(arr2)) {
+        PyErr_SetString(PyExc_ValueError, "a and b must have the same length.");
+        goto fail;
+    }
+
+    a = PyArray_DATA(arr1);
+    b = PyArray_DATA(arr2);
+
+    // Unit vectors (from unit_vectors()) are correlated by their dot product
+    if (unit && PyArray_TYPE(arr1) == NPY_FLOAT && PyArray_TYPE(arr2) == NPY_FLOAT)
+        rtn = unit_dot((float *)a, (float *)b, ngene);
+    else if (unit && PyArray_TYPE(arr1) == NPY_FLOAT)
+        rtn = unit_dot((float *)a, (double *)b, ngene);
+    else if (unit && PyArray_TYPE(arr2) == NPY_FLOAT)
+        rtn = unit_dot((double *)a, (float *)b, ngene);
+    else if (unit)
+        rtn = unit_dot((double *)a, (double *)b, ngene);
+    else if (PyArray_TYPE(arr1) == NPY_FLOAT && PyArray_TYPE(arr2) == NPY_FLOAT)
+        rtn = __corr__((float *)a, (float *)b, ngene);
+    else if (PyArray_TYPE(arr1) == NPY_FLOAT)
+        rtn = __corr__((float *)a, (double *)b, ngene);
+    else if (PyArray_TYPE(arr2) == NPY_FLOAT)
+        rtn = __corr__((double *)a, (float *)b, ngene);
+    else
+        rtn = __corr__((double *)a, (double *)b, ngene);
+    stats_count(0, 1);
+
+    Py_DECREF(arr1);
+    Py_DECREF(arr2);
+
+    return PyFloat_FromDouble(rtn);
+ fail:
+    Py_XDECREF(arr1);
+    Py_XDECREF(arr2);
+    return NULL;
+}
+
+static PyObject *get_simd(PyObject *self, PyObject *args) {
+    return PyUnicode_FromString(simd_names[simd_level]);
+}
+
+static PyObject *set_simd(PyObject *self, PyObject *args) {
+    const char *name;
+    int level;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+    for (level = 0; simd_names[level] != NULL; level++) {
+        if (strcmp(simd_names[level], name) == 0)
+            break;
+    }
+    if (simd_names[level] == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Unknown instruction set.");
+        return NULL;
+    }
+    if (level > simd_detect()) {
+        PyErr_Format(PyExc_ValueError, "Instruction set %s is not supported by this CPU.", name);
+        return NULL;
+    }
+    simd_level = level;
+    Py_RETURN_NONE;
+}
+
+static PyObject *get_thread_budget(PyObject *self, PyObject *args) {
+    std::lock_guard<std::mutex> lock(thread_lock);
+    return Py_BuildValue("i", thread_budget);
+}
+
+static PyObject *set_thread_budget(PyObject *self, PyObject *args) {
+    int budget;
+
+    if (!PyArg_ParseTuple(args, "i", &budget)) return NULL;
+    if (budget < 0) {
+        PyErr_SetString(PyExc_ValueError, "Thread budget must be 0 (no limit) or positive.");
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(thread_lock);
+    thread_budget = budget;
+    Py_RETURN_NONE;
+}
+
+static PyObject *get_threads_in_use(PyObject *self, PyObject *args) {
+    std::lock_guard<std::mutex> lock(thread_lock);
+    return Py_BuildValue("i", threads_leased);
+}
+
+static PyObject *get_stats_enabled(PyObject *self, PyObject *args) {
+    return PyBool_FromLong(stats_on.load());
+}
+
+static PyObject *set_stats_enabled(PyObject *self, PyObject *args) {
+    int enabled;
+
+    if (!PyArg_ParseTuple(args, "p", &enabled)) return NULL;
+    return PyBool_FromLong(stats_on.exchange(enabled != 0));
+}
+
+static void stats_clear() {
+    stats_table.clear();
+    stats_events.clear();
+    stats_events.shrink_to_fit();
+    stats_dropped = 0;
+}
+
+static PyObject *reset_stats(PyObject *self, PyObject *args) {
+    std::lock_guard<std::mutex> lock(stats_lock);
+    stats_clear();
+    Py_RETURN_NONE;
+}
+
+static PyObject *get_stats(PyObject *self, PyObject *args, PyObject *kwargs) {
+    int reset = 0;
+    PyObject *rtn, *entry;
+
+    static const char *kwlist[] = { "reset", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", const_cast<char **>(kwlist), &reset)) return NULL;
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+    rtn = PyDict_New();
+    if (rtn == NULL) return NULL;
+    for (const auto &it : stats_table) {
+        const call_stats &a = it.second;
+        entry = Py_BuildValue("{s:l,s:d,s:d,s:d,s:l,s:l,s:l,s:l,s:l}",
+            "calls", a.calls, "wall_s", a.wall, "busy_s", a.busy, "idle_s", a.idle,
+            "voxels", a.voxels, "evals", a.evals, "bytes_converted", a.bytes_converted,
+            "bytes_copied", a.bytes_copied, "peak_scratch", a.peak_scratch);
+        if (entry == NULL || PyDict_SetItemString(rtn, it.first.c_str(), entry) < 0) {
+            Py_XDECREF(entry);
+            Py_DECREF(rtn);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+    if (reset)
+        stats_clear();
+    return rtn;
+}
+
+static PyObject *stats_clock(PyObject *self, PyObject *args) {
+    return PyFloat_FromDouble(stats_now());
+}
+
+static PyObject *trace_event(PyObject *self, PyObject *args, PyObject *kwargs) {
+    const char *name, *cat = "python";
+    double ts, end;
+
+    static const char *kwlist[] = { "name", "ts", "end", "cat", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sdd|s", const_cast<char **>(kwlist), &name, &ts, &end, &cat)) return NULL;
+
+    // The category must outlive the event; only a few fixed ones are kept.
+    static const char *cats[] = { "python", "stage", NULL };
+    const char *kept = "python";
+    for (int i = 0; cats[i] != NULL; i++)
+        if (strcmp(cat, cats[i]) == 0)
+            kept = cats[i];
+    std::lock_guard<std::mutex> lock(stats_lock);
+    stats_trace(name, kept, ts, end - ts, stats_tid());
+    Py_RETURN_NONE;
+}
+
+static PyObject *get_trace(PyObject *self, PyObject *args, PyObject *kwargs) {
+    int reset = 0;
+    long pid = (long)getpid();
+    PyObject *events = NULL, *ev, *rtn;
+
+    static const char *kwlist[] = { "reset", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", const_cast<char **>(kwlist), &reset)) return NULL;
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+    events = PyList_New(stats_events.size());
+    if (events == NULL) return NULL;
+    for (size_t i = 0; i < stats_events.size(); i++) {
+        const stats_event &e = stats_events[i];
+        ev = Py_BuildValue("{s:s,s:s,s:s,s:d,s:d,s:l,s:l}",
+            "name", e.name.c_str(), "cat", e.cat, "ph", "X", "ts", e.ts, "dur", e.dur, "pid", pid, "tid", e.tid);
+        if (ev == NULL) {
+            Py_DECREF(events);
+            return NULL;
+        }
+        PyList_SET_ITEM(events, i, ev);
+    }
+    rtn = Py_BuildValue("{s:N,s:{s:l}}", "traceEvents", events, "otherData", "dropped_events", stats_dropped);
+    if (rtn != NULL && reset)
+        stats_clear();
+    return rtn;
+}
+
+static struct PyMethodDef module_methods[] = {
+    {"corr", (PyCFunction)corr, METH_VARARGS | METH_KEYWORDS, "Calculates Pearson's correlation coefficient."},
+    {"calc_ctmap", (PyCFunction)calc_ctmap, METH_VARARGS | METH_KEYWORDS, "Creates a cell type map."},
+    {"calc_ctmap_multi", (PyCFunction)calc_ctmap_multi, METH_VARARGS | METH_KEYWORDS, "Maps the best matching centroids for every vector."},
+    {"calc_corrmap", (PyCFunction)calc_corrmap, METH_VARARGS | METH_KEYWORDS, "Creates a correlation map."},
+    {"calc_corrmap_2", (PyCFunction)calc_corrmap_2, METH_VARARGS | METH_KEYWORDS, "Creates a correlation map."},
+    {"calc_kde", (PyCFunction)calc_kde, METH_VARARGS | METH_KEYWORDS, "Run kernel density estimation."},
+    {"calc_kde_multi", (PyCFunction)calc_kde_multi, METH_VARARGS | METH_KEYWORDS, "Run kernel density estimation for all genes in a block."},
     {"flood_fill", (PyCFunction)flood_fill, METH_VARARGS | METH_KEYWORDS, "Performs 3d flood fill based on correlation."},
+    {"find_localmax", (PyCFunction)find_localmax, METH_VARARGS | METH_KEYWORDS, "Finds the local maxima of the L1 norm of the vector field."},
+    {"normalize_vectors", (PyCFunction)normalize_vectors, METH_VARARGS | METH_KEYWORDS, "Normalizes vectors and accumulates the moments of the normalized genes."},
+    {"bin_celltypemaps", (PyCFunction)bin_celltypemaps, METH_VARARGS | METH_KEYWORDS, "Counts the cell types in a sphere around every lattice point."},
+    {"label_adjacency", (PyCFunction)label_adjacency, METH_VARARGS | METH_KEYWORDS, "Builds the region adjacency graph of a label volume with contact counts."},
+    {"cell_by_gene", (PyCFunction)cell_by_gene, METH_VARARGS | METH_KEYWORDS, "Counts the transcripts of every gene in every segment as a CSR matrix."},
+    {"filter_blobs", (PyCFunction)filter_blobs, METH_VARARGS | METH_KEYWORDS, "Fills the holes of the blobs of a label volume and clears the small ones."},
+    {"unit_vectors", (PyCFunction)unit_vectors, METH_VARARGS | METH_KEYWORDS, "Centres the vectors and scales them to unit L2 norm, so correlations become dot products."},
+    {"vf_to_sparse", (PyCFunction)vf_to_sparse, METH_VARARGS | METH_KEYWORDS, "Converts a dense vector field into a block-sparse one."},
+    {"vf_from_sparse", (PyCFunction)vf_from_sparse, METH_VARARGS | METH_KEYWORDS, "Converts (a block of) a block-sparse vector field into a dense one."},
+    {"knn_graph", (PyCFunction)knn_graph, METH_VARARGS | METH_KEYWORDS, "Finds the k nearest neighbours of every vector (exactly, or approximately by NN-descent)."},
+    {"snn_graph", (PyCFunction)snn_graph, METH_VARARGS | METH_KEYWORDS, "Builds the weighted edge list of the shared nearest neighbour graph of a kNN graph."},
+    {"flood_fill_many", (PyCFunction)flood_fill_many, METH_VARARGS | METH_KEYWORDS, "Performs flood fill from many seeds in parallel and returns a label volume."},
+    {"get_simd", (PyCFunction)get_simd, METH_NOARGS, "Returns the instruction set used by the SIMD kernels."},
+    {"set_simd", (PyCFunction)set_simd, METH_VARARGS, "Selects the instruction set used by the SIMD kernels."},
+    {"get_thread_budget", (PyCFunction)get_thread_budget, METH_NOARGS, "Returns the number of threads shared by concurrent calls (0 for no limit)."},
+    {"set_thread_budget", (PyCFunction)set_thread_budget, METH_VARARGS, "Sets the number of threads shared by concurrent calls (0 for no limit)."},
+    {"get_threads_in_use", (PyCFunction)get_threads_in_use, METH_NOARGS, "Returns the number of threads currently leased by running calls."},
+    {"get_stats_enabled", (PyCFunction)get_stats_enabled, METH_NOARGS, "Returns whether the native calls are being profiled."},
+    {"set_stats_enabled", (PyCFunction)set_stats_enabled, METH_VARARGS, "Turns profiling of the native calls on or off and returns the previous setting."},
+    {"get_stats", (PyCFunction)get_stats, METH_VARARGS | METH_KEYWORDS, "Returns the counters of the profiled calls, per function."},
+    {"reset_stats", (PyCFunction)reset_stats, METH_NOARGS, "Clears the counters and the trace events."},
+    {"stats_clock", (PyCFunction)stats_clock, METH_NOARGS, "Returns the clock of the trace events, in microseconds."},
+    {"trace_event", (PyCFunction)trace_event, METH_VARARGS | METH_KEYWORDS, "Records a span, timed with stats_clock(), as a trace event."},
+    {"get_trace", (PyCFunction)get_trace, METH_VARARGS | METH_KEYWORDS, "Returns the recorded events in the Chrome trace event format."},
     {NULL, NULL, 0, NULL}
 };
 
@@ -697,10 +1981,19 @@ PyInit_utils(void)
 #if PY_MAJOR_VERSION >= 3
     PyObject *module = PyModule_Create(&moduledef);
 #else
-    Py_InitModule("utils", module_methods);
+    PyObject *module = Py_InitModule("utils", module_methods);
 #endif
+    PyModule_AddIntConstant(module, "KDE_KERNEL_GAUSSIAN", KDE_KERNEL_GAUSSIAN);
+    PyModule_AddIntConstant(module, "KDE_KERNEL_GAUSSIAN_SEPARABLE", KDE_KERNEL_GAUSSIAN_SEPARABLE);
+    PyModule_AddIntConstant(module, "KDE_KERNEL_GAUSSIAN_BINNED", KDE_KERNEL_GAUSSIAN_BINNED);
+    PyModule_AddIntConstant(module, "KNN_CORRELATION", KNN_CORRELATION);
+    PyModule_AddIntConstant(module, "KNN_COSINE", KNN_COSINE);
+    PyModule_AddIntConstant(module, "KNN_EUCLIDEAN", KNN_EUCLIDEAN);
+    PyModule_AddIntConstant(module, "CORRMAP_DIRECT", CORRMAP_DIRECT);
+    PyModule_AddIntConstant(module, "CORRMAP_SLIDING", CORRMAP_SLIDING);
+    simd_level = simd_detect();
     import_array();
 #if PY_MAJOR_VERSION >= 3
     return module;
 #endif
-}
\ No newline at end of file
+}
@@ -1,4 +1,4 @@
 from ._analysis import SSAMAnalysis, run_sctransform, remove_outliers
-from ._dataset import SSAMDataset
+from ._dataset import SSAMDataset, write_transcripts
 
 __version__ = "1.1.1"
\ No newline at end of file
@@ -13,10 +13,12 @@ import warnings
 
 from sklearn import preprocessing
 import scipy
+import scipy.sparse
 from scipy import ndimage
 from sklearn.decomposition import PCA
 from tempfile import TemporaryDirectory
-from sklearn.neighbors import kneighbors_graph
+from sklearn.neighbors import NearestNeighbors
+from sklearn.utils import check_random_state
 import louvain, leidenalg
 import igraph as ig
 from sklearn.cluster import DBSCAN, OPTICS
@@ -34,29 +36,55 @@ from sklearn.ensemble import IsolationForest
 from sklearn.neighbors import LocalOutlierFactor
 
 import time
+import heapq
+import json
+import functools
 import pyarrow
 
 from scipy.ndimage import map_coordinates
 
 from packaging import version
 
-from .utils import calc_corrmap, calc_kde
-
-def corr(a, b):
-    return np.corrcoef(a, b)[0, 1]
-
-def calc_ctmap(x, Y, _):
-    mean_x = np.mean(x)
-    mean_Y = np.mean(Y, axis=1)
-
-    x_diff = x - mean_x
-    Y_diff = Y - mean_Y[:, None]  # np.newaxis 대신 None 사용 가능
-
-    numerator = np.einsum('i,ji->j', x_diff, Y_diff)
-    denominator = np.sqrt(np.einsum('i,i->', x_diff, x_diff) * np.einsum('ji,ji->j', Y_diff, Y_diff))
-    correlation = np.where(denominator == 0, np.nan, numerator / denominator)
-
-    return correlation
+from .utils import calc_corrmap, calc_ctmap, calc_ctmap_multi, calc_kde, calc_kde_multi, find_localmax, normalize_vectors
+from .utils import corr, flood_fill_many, knn_graph, snn_graph, unit_vectors
+from ._dataset import SparseVectorField, VF_CACHES
+from .utils import bin_celltypemaps, cell_by_gene, filter_blobs, label_adjacency
+from .utils import KDE_KERNEL_GAUSSIAN, KDE_KERNEL_GAUSSIAN_BINNED, KDE_KERNEL_GAUSSIAN_SEPARABLE
+from .utils import CORRMAP_DIRECT, CORRMAP_SLIDING
+from .utils import KNN_CORRELATION, KNN_COSINE, KNN_EUCLIDEAN
+from .utils import set_thread_budget
+from .utils import get_stats, reset_stats, get_trace, get_stats_enabled, set_stats_enabled, stats_clock, trace_event
+
+KDE_KERNELS = {
+    'gaussian': KDE_KERNEL_GAUSSIAN_SEPARABLE,
+    'gaussian_exact': KDE_KERNEL_GAUSSIAN,
+    'gaussian_binned': KDE_KERNEL_GAUSSIAN_BINNED,
+}
+
+CORRMAP_METHODS = {
+    'direct': CORRMAP_DIRECT,
+    'sliding': CORRMAP_SLIDING,
+}
+
+KNN_METRICS = {
+    'correlation': KNN_CORRELATION,
+    'cosine': KNN_COSINE,
+    'euclidean': KNN_EUCLIDEAN,
+}
+
+def _stage(func):
+    # Records a pipeline stage as a trace event while profiling is on, so the
+    # native calls it makes show up nested under it.
+    @functools.wraps(func)
+    def wrapper(*args, **kwargs):
+        if not get_stats_enabled():
+            return func(*args, **kwargs)
+        ts = stats_clock()
+        try:
+            return func(*args, **kwargs)
+        finally:
+            trace_event(func.__name__, ts, stats_clock(), "stage")
+    return wrapper
 
 def run_sctransform(data, clip_range=None, verbose=True, debug_path=None, plot_model_pars=False, **kwargs):
     """
@@ -144,18 +172,18 @@ class MedoidCorrelation:
     def fit_predict(self, X):
         X = np.array(X, copy=True)
         labels = np.ones(X.shape[0], dtype=int)
+        # Correlations to the medoid are dot products of the centred, L2-normalized vectors
+        U, _ = unit_vectors(X)
         prev_midx = -1
         while True:
             vindices = np.where(labels > -1)[0]
-            good_X = X[labels > -1]
-            midx = vindices[np.argmin(np.sum(cdist(good_X, good_X, metric='correlation'), axis=0))]
+            # The medoid minimizes the sum of correlation distances, sum(1 - u . v) = n - u . sum(v)
+            good_U = U[vindices]
+            midx = vindices[np.argmax(np.dot(good_U, good_U.sum(axis=0)))]
             if midx == prev_midx:
                 break
             prev_midx = midx
-            m = X[midx]
-            for vidx, v in zip(vindices, good_X):
-                if corr(v, m) < self.min_r:
-                    labels[vidx] = -1
+            labels[vindices[np.dot(U[vindices], U[midx]) < self.min_r]] = -1
         return labels
 
 
@@ -213,6 +241,8 @@ class SSAMAnalysis(object):
         os.environ["VECLIB_MAXIMUM_THREADS"] = str(ncores)
         os.environ["NUMEXPR_NUM_THREADS"] = str(ncores)
         dask.config.set(pool=ThreadPool(ncores))
+        # Native calls made concurrently (e.g. from dask workers) share ncores threads
+        set_thread_budget(ncores)
         self.ncores = ncores
         self.verbose = verbose
 
@@ -223,6 +253,9 @@ class SSAMAnalysis(object):
         if 'local_maxs' in self.dataset.zarr_group:
             self._m("Loaded existing local maxima.")
             self.dataset.local_maxs = tuple(self.dataset.zarr_group['local_maxs'][:])
+
+        if 'localmax_regions' in self.dataset.zarr_group:
+            self.dataset.localmax_regions = self.dataset.zarr_group['localmax_regions'][:]
         
         if 'vf_normalized' in self.dataset.zarr_group and 'normalized_vectors' in self.dataset.zarr_group:
             self._m("Loaded a precomputed normalized vector field.")
@@ -291,12 +324,58 @@ class SSAMAnalysis(object):
     def _m(self, message):
         if self.verbose:
             print(message, flush=True)
+
+    def enable_profiling(self, enabled=True, reset=True):
+        """
+        Turns profiling of the native calls and the analysis stages on or off.
+        Profiling is global to the process.
+
+        :param enabled: If True, the calls are timed and counted.
+        :type enabled: bool
+        :param reset: If True, the counters and trace events gathered so far are cleared.
+        :type reset: bool
+        """
+        if reset:
+            reset_stats()
+        set_stats_enabled(enabled)
+
+    def get_profile(self, reset=False):
+        """
+        Returns the counters of the profiled native calls, per function: the number of
+        calls, the wall time, the time the threads were busy or idle (waiting for the
+        others) in the parallel loops, the voxels and kernel evaluations processed,
+        the bytes converted or copied at the NumPy boundary, and the peak scratch memory.
+
+        :param reset: If True, the counters and trace events are cleared afterwards.
+        :type reset: bool
+        :return: A pandas DataFrame with one row per native function.
+        """
+        return pd.DataFrame.from_dict(get_stats(reset=reset), orient='index')
+
+    def dump_trace(self, path, reset=False):
+        """
+        Writes the analysis stages, the native calls and the spans of their threads as
+        a Chrome trace (open it with chrome://tracing or https://ui.perfetto.dev).
+
+        :param path: Path of the JSON file to write.
+        :type path: str
+        :param reset: If True, the counters and trace events are cleared afterwards.
+        :type reset: bool
+        """
+        trace = get_trace(reset=reset)
+        trace['traceEvents'].append({'name': 'process_name', 'ph': 'M', 'pid': os.getpid(), 'args': {'name': 'ssam'}})
+        with open(path, 'w') as f:
+            json.dump(trace, f)
     
     def _load_kde(self):
         assert 'kde_computed' in self.dataset.zarr_group, "KDE has not been computed!"
         assert all(self.dataset.zarr_group['kde_computed']), "KDE data is incomplete!"
         self.dataset.genes = list(self.dataset.zarr_group['genes'][:])
-        self.dataset._vf = da.from_zarr(self.dataset.zarr_group['vf'])
+        if 'vf' in self.dataset.zarr_group:
+            self.dataset._vf = da.from_zarr(self.dataset.zarr_group['vf'])
+        else:
+            self.dataset.vf_sparse = SparseVectorField.load(self.dataset.zarr_group)
+            self.dataset._vf = self.dataset.vf_sparse.to_dask()
         self.dataset._vf_norm = da.from_zarr(self.dataset.zarr_group['vf_norm'])
         self.dataset.sampling_distance = self.dataset.zarr_group['vf_params'][0]
         self.dataset.bandwidth = self.dataset.zarr_group['vf_params'][1]
@@ -343,10 +422,19 @@ class SSAMAnalysis(object):
         if norm_threshold is not None:
             self.dataset.norm_threshold = norm_threshold
             
-    def run_kde(self, locations=None, width=None, height=None, depth=1, kernel='gaussian', bandwidth=2.5, sampling_distance=1.0, prune_coefficient=4.3, re_run=False):
+    @_stage
+    def run_kde(self, locations=None, width=None, height=None, depth=1, kernel='gaussian', bandwidth=2.5, sampling_distance=1.0, prune_coefficient=4.3, re_run=False, max_chunk_size=1024**2*64, concurrency=1, sparse=False):
         """
         Run KDE. This method uses precomputed kernels to estimate density of mRNA by default. Set `prune_coefficient` negative to disable this behavior.
         :param kernel: Kernel for density estimation. Currently only Gaussian kernel is supported.
+            'gaussian' evaluates the kernel as the product of three precomputed 1D weight tables per mRNA,
+            bounded by `prune_coefficient`. 'gaussian_exact' evaluates the kernel at every voxel instead
+            (slower, differs from 'gaussian' only by floating point rounding).
+            'gaussian_binned' splats the mRNAs linearly onto the grid and smooths the result with a recursive
+            Gaussian filter, so the run time does not grow with the bandwidth. It deviates from 'gaussian' by up to
+            ~0.6% of the maximum density at a bandwidth of 2.5 pixels (~0.1% at 5 pixels, ~10% at 1 pixel),
+            and requires a bandwidth of at least 0.7 pixels. Several bandwidths can be computed from one binning
+            with `calc_kde`, e.g. for a bandwidth sweep.
         :type kernel: str
         :param bandwidth: Parameter to adjust width of kernel.
             Set it 2.5 to make FWTM of Gaussian kernel to be ~10um (assume that avg. cell diameter is ~10um).
@@ -355,27 +443,30 @@ class SSAMAnalysis(object):
         :type sampling_distance: float
         :param re_run: Recomputes KDE, ignoring all existing precomputed densities in the data directory.
         :type re_run: bool
+        :param max_chunk_size: Maximum size (in bytes) of a chunk of a newly created vector field.
+            All genes are computed in one pass per chunk-aligned block.
+        :type max_chunk_size: int
+        :param concurrency: Number of blocks (or genes, when resuming a per-gene KDE) computed at the same time,
+            each on `ncores // concurrency` threads. Results are saved in order.
+        :type concurrency: int
+        :param sparse: If True, the vector field is stored block-sparse (see `SparseVectorField`) as `vf_sparse`,
+            with one tile per chunk, instead of densely as `vf`. `vf` then reads the sparse field lazily,
+            and the correlation map and the normalization read it directly. A sparse KDE cannot be resumed.
+        :type sparse: bool
         """
 
         if not re_run and self.dataset.vf is not None:
             self._m("It seems that KDE has already been fully computed. Are you sure you want to re-run KDE? If so, set re_run=True.")
             return
             
-        if kernel != 'gaussian':
-            raise NotImplementedError('Only Gaussian kernel is supported for now.')
+        if kernel not in KDE_KERNELS:
+            raise NotImplementedError('Only Gaussian kernels are supported for now: %s.'%', '.join(KDE_KERNELS))
         if depth < 1 or width < 1 or height < 1:
             raise ValueError("Invalid image dimension")
+        if not 1 <= concurrency <= self.ncores:
+            raise ValueError("concurrency must be between 1 and ncores.")
         
-        assert locations.index.name == 'gene' or 'gene' in locations, "Format error! Please check whether the column 'gene' exists."
-        if locations.index.name != 'gene':
-            locations = locations.set_index('gene')
-        if depth > 1:
-            assert 'x' in locations and 'y' in locations and 'z' in locations, "Format error! Please check whether the columns 'x', 'y', 'z' exist."
-            locations = locations.reindex(['x', 'y', 'z'], axis=1)
-        else:
-            assert 'x' in locations and 'y' in locations, "Format error! Please check whether the columns 'x', 'y' exist."
-            locations = locations.reindex(['x', 'y'], axis=1)
-        
+        locations = self._kde_locations(locations, depth)
         genes = np.unique(locations.index)
         vf_shape = tuple(list(np.ceil(np.array([width, height, depth])/sampling_distance).astype(int)) + [len(genes)])
         
@@ -383,7 +474,7 @@ class SSAMAnalysis(object):
             # If KDE is incomplete and the shapes mismatch, set re_run True
             re_run = True
             
-        if re_run:
+        if re_run or sparse or 'vf_sparse' in self.dataset.zarr_group:
             def check_remove(k):
                 try:
                     del self.dataset.zarr_group[k]
@@ -391,26 +482,41 @@ class SSAMAnalysis(object):
                     pass
             check_remove('genes')
             check_remove('kde_computed')
+            check_remove('kde_blocks_computed')
+            check_remove('kde_dirty')
             check_remove('vf')
+            check_remove('vf_sparse')
             check_remove('vf_normalized')
             check_remove('vf_params')
 
-        if not 'vf' in self.dataset.zarr_group:
+        kde_shape = tuple(np.ceil(np.array([width, height, depth])/sampling_distance).astype(int))
+        if sparse:
+            block_shape = self._kde_chunks(vf_shape, max_chunk_size)[:3]
+            vf_sparse = self._run_kde_multi(locations, genes, kde_shape, kernel, bandwidth, sampling_distance, prune_coefficient, concurrency, block_shape)
+            self._m("Saving KDE...")
+            vf_sparse.save(self.dataset.zarr_group)
+            self.dataset.zarr_group.array(name='genes', data=list(genes))
+            self.dataset.zarr_group.array(name='vf_params', data=np.array([sampling_distance, bandwidth]))
+            self.dataset.zarr_group['vf_params'].attrs.update(kernel=kernel, prune_coefficient=prune_coefficient)
+            self.dataset.zarr_group.array(name='kde_computed', data=np.ones(len(genes), dtype=bool))
+            self.dataset._try_flush()
+        elif not 'vf' in self.dataset.zarr_group:
             # This is a newly created file
             self.dataset.zarr_group.array(name='genes', data=list(genes)) # for storage purpose - not used in this method
             self.dataset.zarr_group.array(name='vf_params', data=np.array([sampling_distance, bandwidth]))
+            self.dataset.zarr_group['vf_params'].attrs.update(kernel=kernel, prune_coefficient=prune_coefficient) # checked by append_kde
             self.dataset.zarr_group.zeros(name='kde_computed', shape=len(genes), dtype='bool') # flags, kde has computed or not
-            self.dataset.zarr_group.zeros(name='vf', shape=vf_shape, dtype='f4')
+            self.dataset.zarr_group.zeros(name='vf', shape=vf_shape, dtype='f4', chunks=self._kde_chunks(vf_shape, max_chunk_size))
         
-        if not all(self.dataset.zarr_group['kde_computed']) or re_run:
+        if not sparse and (not all(self.dataset.zarr_group['kde_computed']) or re_run):
             if not re_run and any(self.dataset.zarr_group['kde_computed']):
+                # Stores created by the per-gene KDE are resumed gene by gene
                 self._m("Resuming KDE computation...")
-            for gidx, (gene, loc) in enumerate(locations.groupby('gene', sort=True)):
-                if not re_run and self.dataset.zarr_group['kde_computed'][gidx]:
-                    continue
+            else:
+                self._run_kde_multi(locations, genes, kde_shape, kernel, bandwidth, sampling_distance, prune_coefficient, concurrency)
+            def run_gene(job):
+                gidx, gene, locs = job
                 self._m("Running KDE for gene %s..."%gene)
-                locs = np.array(loc)
-                kde_shape = tuple(np.ceil(np.array([width, height, depth])/sampling_distance).astype(int))
                 if locs.shape[-1] == 2:
                     loc_z = np.zeros(len(locs[:, 0]))
                 else:
@@ -421,60 +527,499 @@ class SSAMAnalysis(object):
                                         loc_z,
                                         kde_shape,
                                         prune_coefficient,
-                                        0,
-                                        self.ncores)
-                data = np.array(data) / ((2 * np.pi * (bandwidth ** 2)) ** (locs.shape[-1] / 2)) * sampling_distance ** 2
-                self._m("Saving KDE for gene %s..."%gene)
-                numcodecs.blosc.set_nthreads(self.ncores)
-                gidx_coords = [gidx] * len(coords[0])
-                if len(coords) == 0:
-                    self._m("Warning: Thee computed density is zero. Maybe something is wrong?")
-                else:
-                    self.dataset.zarr_group['vf'].set_coordinate_selection(tuple(list(coords) + [gidx_coords]), data)
-                self.dataset.zarr_group['kde_computed'][gidx] = True
-                self.dataset._try_flush()
+                                        KDE_KERNELS[kernel],
+                                        self.ncores // concurrency)
+                data /= (2 * np.pi * (bandwidth ** 2)) ** (locs.shape[-1] / 2)
+                data *= sampling_distance ** 2
+                return gidx, gene, coords, data
+            computed = self.dataset.zarr_group['kde_computed'][:]
+            jobs = [(gidx, gene, np.array(loc)) for gidx, (gene, loc) in enumerate(locations.groupby('gene', sort=True)) if not computed[gidx]]
+            pool = ThreadPool(concurrency)
+            try:
+                # Genes run concurrently on separate OpenMP teams, but are saved from this thread in order
+                for gidx, gene, coords, data in pool.imap(run_gene, jobs):
+                    self._m("Saving KDE for gene %s..."%gene)
+                    numcodecs.blosc.set_nthreads(self.ncores)
+                    gidx_coords = np.full(len(coords[0]), gidx, dtype=coords[0].dtype)
+                    if len(coords[0]) == 0:
+                        self._m("Warning: Thee computed density is zero. Maybe something is wrong?")
+                    else:
+                        self.dataset.zarr_group['vf'].set_coordinate_selection(tuple(list(coords) + [gidx_coords]), data)
+                    self.dataset.zarr_group['kde_computed'][gidx] = True
+                    self.dataset._try_flush()
+            finally:
+                pool.close()
+                pool.join()
 
         self.dataset.ndim = 2 if depth == 1 else 3
         self.dataset.expression_threshold = 1 / (np.sqrt(2 * np.pi) * bandwidth) ** self.dataset.ndim
         self.dataset.norm_threshold = self.dataset.expression_threshold * 2
         self.dataset.genes = list(genes)
-        self.dataset.vf = da.from_zarr(self.dataset.zarr_group['vf'])
+        if sparse:
+            self.dataset.vf = vf_sparse.to_dask()
+            self.dataset.vf_sparse = vf_sparse
+        else:
+            self.dataset.vf = da.from_zarr(self.dataset.zarr_group['vf'])
         self.dataset.shape = self.dataset.vf_norm.shape
         self._m("Done!")
         return
 
-    def calc_correlation_map(self, corr_size=3):
+    @staticmethod
+    def _kde_locations(locations, depth):
+        # Indexes the mRNAs by gene, with only the coordinate columns
+        assert locations.index.name == 'gene' or 'gene' in locations, "Format error! Please check whether the column 'gene' exists."
+        if locations.index.name != 'gene':
+            locations = locations.set_index('gene')
+        if depth > 1:
+            assert 'x' in locations and 'y' in locations and 'z' in locations, "Format error! Please check whether the columns 'x', 'y', 'z' exist."
+            return locations.reindex(['x', 'y', 'z'], axis=1)
+        assert 'x' in locations and 'y' in locations, "Format error! Please check whether the columns 'x', 'y' exist."
+        return locations.reindex(['x', 'y'], axis=1)
+
+    @_stage
+    def append_kde(self, locations, kernel=None, prune_coefficient=None, concurrency=1):
+        """
+        Adds the densities of a new batch of mRNAs (e.g. a newly decoded field of view) to the vector field
+        computed by `run_kde`, with the bandwidth and sampling distance it was computed with.
+        Only the chunks of `vf` within reach of the new mRNAs are read and rewritten, and `vf_norm`
+        is updated for these chunks if it has been computed. The result is the same as running `run_kde`
+        on all mRNAs, up to the float32 rounding of the stored densities.
+
+        The rewritten chunks are marked as dirty (see `dirty_regions`), so that `find_localmax` and
+        `map_celltypes` can be rerun on them only with `dirty_only=True`. Other cached results
+        (the correlation map, the unit vectors, the normalized and scaled vector fields) are not updated.
+
+        :param locations: The new mRNAs, in the format of `run_kde`. All genes must be in the vector field.
+        :type locations: pandas.DataFrame
+        :param kernel: Kernel for density estimation. By default, the one given to `run_kde`, which is
+            stored with the vector field; any other kernel is rejected.
+        :type kernel: str
+        :param prune_coefficient: By default, the value given to `run_kde`, which is stored with the vector field;
+            any other value is rejected. If not positive, the whole vector field is rewritten.
+        :type prune_coefficient: float
+        :param concurrency: Number of blocks computed at the same time, each on `ncores // concurrency` threads.
+        :type concurrency: int
+        :return: The number of chunks rewritten.
+        :rtype: int
+        """
+        if 'vf' not in self.dataset.zarr_group or not all(self.dataset.zarr_group['kde_computed']):
+            raise ValueError("Appending requires a complete, dense vector field. Please run `run_kde` (with sparse=False) first.")
+        # Densities computed with other settings cannot be added up. Vector fields of older
+        # versions do not record them, and are trusted to match the given (or default) settings.
+        vf_params = self.dataset.zarr_group['vf_params']
+        for name, value, default in [('kernel', kernel, 'gaussian'), ('prune_coefficient', prune_coefficient, 4.3)]:
+            stored = vf_params.attrs.get(name, value if value is not None else default)
+            if value is not None and value != stored:
+                raise ValueError("The vector field was computed with %s=%r, not %r."%(name, stored, value))
+            if name == 'kernel':
+                kernel = stored
+            else:
+                prune_coefficient = stored
+        if kernel not in KDE_KERNELS:
+            raise NotImplementedError('Only Gaussian kernels are supported for now: %s.'%', '.join(KDE_KERNELS))
+        if not 1 <= concurrency <= self.ncores:
+            raise ValueError("concurrency must be between 1 and ncores.")
+
+        vf = self.dataset.zarr_group['vf']
+        sampling_distance, bandwidth = vf_params[:2]
+        locations = self._kde_locations(locations, vf.shape[2])
+        genes = np.array(self.dataset.zarr_group['genes'][:])
+        unknown = np.setdiff1d(np.unique(locations.index), genes)
+        if len(unknown) > 0:
+            raise ValueError("Genes not in the vector field: %s."%', '.join(map(str, unknown[:10])))
+        if len(locations) == 0:
+            return 0
+
+        blocks = self._run_kde_multi(locations, genes, vf.shape[:3], kernel, bandwidth, sampling_distance, prune_coefficient, concurrency, append=True)
+        if self.dataset.in_memory:
+            self.dataset._vf = da.array(da.from_zarr(vf).compute())
+        # The stored norm was rewritten for the dirty chunks; without it, the norm is recomputed when needed
+        if 'vf_norm' in self.dataset.zarr_group:
+            self.dataset._vf_norm = da.from_zarr(self.dataset.zarr_group['vf_norm'])
+        else:
+            self.dataset._vf_norm = None
+        # The sampled local maxima vectors have to be read again
+        self.dataset.selected_vectors = None
+        self.dataset._drop_vf_caches([name for name in VF_CACHES if name != 'vf_norm'])
+        self._m("Updated %d chunks."%len(blocks))
+        return len(blocks)
+
+    def dirty_regions(self):
+        """
+        Returns the regions of the vector field changed by `append_kde` since the last `clear_dirty_regions`,
+        as a list of (start, end) voxel coordinates of the changed chunks.
+        """
+        if 'kde_dirty' not in self.dataset.zarr_group:
+            return []
+        dirty = self.dataset.zarr_group['kde_dirty'][:]
+        chunks = np.array(self.dataset.zarr_group['vf'].chunks[:3])
+        shape = np.array(self.dataset.zarr_group['vf'].shape[:3])
+        return [(tuple(np.array(ijk) * chunks), tuple(np.minimum((np.array(ijk) + 1) * chunks, shape))) for ijk in zip(*np.nonzero(dirty))]
+
+    def clear_dirty_regions(self):
+        """
+        Marks the whole vector field as clean, e.g. once the downstream results have been updated.
+        """
+        if 'kde_dirty' in self.dataset.zarr_group:
+            self.dataset.zarr_group['kde_dirty'][:] = False
+            self.dataset._try_flush()
+
+    def _dirty_mask(self):
+        # The pixels in the dirty regions
+        mask = np.zeros(self.dataset.vf.shape[:3], dtype=bool)
+        for start, end in self.dirty_regions():
+            mask[start[0]:end[0], start[1]:end[1], start[2]:end[2]] = True
+        return mask
+
+    def _dirty_chunks(self, chunks, halo=0):
+        # The chunks (of the given shape) overlapping the dirty regions grown by the halo
+        shape = np.array(self.dataset.vf.shape[:3])
+        dirty = np.zeros(tuple(np.ceil(shape / chunks).astype(int)), dtype=bool)
+        for start, end in self.dirty_regions():
+            lo = np.maximum(np.array(start) - halo, 0) // chunks
+            hi = (np.minimum(np.array(end) + halo, shape) - 1) // chunks
+            dirty[lo[0]:hi[0]+1, lo[1]:hi[1]+1, lo[2]:hi[2]+1] = True
+        return dirty
+
+    @staticmethod
+    def _kde_chunks(vf_shape, max_chunk_size):
+        # Chunks hold all genes of a spatial block, so that KDE blocks map to whole chunks
+        chunks = list(vf_shape[:3])
+        while np.prod(chunks) * vf_shape[3] * 4 > max_chunk_size and max(chunks) > 1:
+            i = int(np.argmax(chunks))
+            chunks[i] = int(np.ceil(chunks[i] / 2))
+        return tuple(chunks) + (vf_shape[3], )
+
+    def _run_kde_multi(self, locations, genes, kde_shape, kernel, bandwidth, sampling_distance, prune_coefficient, concurrency=1, sparse_block_shape=None, append=False):
+        # With sparse_block_shape, the blocks are kept sparse (one tile each) and returned as a SparseVectorField
+        # instead of being written to the zarr array 'vf'. With append, the densities are added to 'vf',
+        # only in the blocks within the prune distance of the mRNAs, which are marked in 'kde_dirty' and returned.
+        sparse = sparse_block_shape is not None
+        if sparse:
+            block_shape = np.array(sparse_block_shape)
+            nblocks = np.ceil(np.array(kde_shape) / block_shape).astype(int)
+            blocks_computed = np.zeros(tuple(nblocks), dtype=bool)
+        elif append:
+            vf = self.dataset.zarr_group['vf']
+            block_shape = np.array(vf.chunks[:3])
+            nblocks = np.ceil(np.array(kde_shape) / block_shape).astype(int)
+            if 'kde_dirty' not in self.dataset.zarr_group:
+                self.dataset.zarr_group.zeros(name='kde_dirty', shape=tuple(nblocks), dtype='bool')
+            dirty = self.dataset.zarr_group['kde_dirty']
+            vf_norm = self.dataset.zarr_group['vf_norm'] if 'vf_norm' in self.dataset.zarr_group else None
+        else:
+            vf = self.dataset.zarr_group['vf']
+            block_shape = np.array(vf.chunks[:3])
+            nblocks = np.ceil(np.array(kde_shape) / block_shape).astype(int)
+            if 'kde_blocks_computed' in self.dataset.zarr_group:
+                self._m("Resuming KDE computation...")
+            else:
+                self.dataset.zarr_group.zeros(name='kde_blocks_computed', shape=tuple(nblocks), dtype='bool')
+            blocks_computed = self.dataset.zarr_group['kde_blocks_computed']
+
+        locs = np.array(locations)
+        gene_codes = np.searchsorted(genes, locations.index).astype(np.int32)
+        if locs.shape[-1] == 2:
+            loc_z = np.zeros(len(locs[:, 0]))
+        else:
+            loc_z = locs[:, 2]/sampling_distance
+        loc_xyz = [locs[:, 0]/sampling_distance, locs[:, 1]/sampling_distance, loc_z]
+
+        # Sort the mRNAs by the block containing them; each block then gathers
+        # the mRNAs of the neighboring blocks within the prune distance.
+        h = bandwidth/sampling_distance
+        maxdist = int(h * prune_coefficient) if prune_coefficient > 0 else -1
+        if maxdist > 0:
+            halo = np.ceil(maxdist / block_shape).astype(int)
+        else:
+            halo = nblocks
+        home = [np.clip(np.trunc(c).astype(np.int64) // b, 0, n - 1) for c, b, n in zip(loc_xyz, block_shape, nblocks)]
+        order = np.lexsort(home[::-1])
+        sorted_bids = np.ravel_multi_index(home, nblocks)[order]
+
+        norm = (2 * np.pi * (bandwidth ** 2)) ** (locs.shape[-1] / 2)
+        numcodecs.blosc.set_nthreads(self.ncores)
+        total_blockcnt = int(np.prod(nblocks))
+        def run_block(job):
+            bidx, (i, j, k) = job
+            self._m("Processing block %d (of %d)..."%(bidx+1, total_blockcnt))
+            slices = []
+            for ii in range(max(0, i - halo[0]), min(nblocks[0], i + halo[0] + 1)):
+                for jj in range(max(0, j - halo[1]), min(nblocks[1], j + halo[1] + 1)):
+                    lo = np.searchsorted(sorted_bids, np.ravel_multi_index((ii, jj, max(0, k - halo[2])), nblocks), side='left')
+                    hi = np.searchsorted(sorted_bids, np.ravel_multi_index((ii, jj, min(nblocks[2] - 1, k + halo[2])), nblocks), side='right')
+                    slices.append(order[lo:hi])
+            # Keep the original mRNA order to reproduce the per-gene summation order
+            indices = np.sort(np.concatenate(slices))
+            origin = np.array([i, j, k]) * block_shape
+            bshape = np.minimum(block_shape, np.array(kde_shape) - origin)
+            if len(indices) == 0:
+                return (i, j, k), origin, bshape, None
+            block = calc_kde_multi(h,
+                                   gene_codes[indices],
+                                   loc_xyz[0][indices],
+                                   loc_xyz[1][indices],
+                                   loc_xyz[2][indices],
+                                   kde_shape,
+                                   len(genes),
+                                   prune_coefficient,
+                                   KDE_KERNELS[kernel],
+                                   self.ncores // concurrency,
+                                   origin,
+                                   bshape,
+                                   block_shape if sparse else None)
+            if sparse:
+                return (i, j, k), origin, bshape, block[:-1] + ((block[-1] / norm * sampling_distance ** 2).astype('f4'), )
+            return (i, j, k), origin, bshape, block / norm * sampling_distance ** 2
+
+        if append:
+            computed = np.ones(tuple(nblocks), dtype=bool)
+            for i, j, k in np.unique(np.stack(home, axis=1), axis=0):
+                computed[max(0, i - halo[0]):i + halo[0] + 1, max(0, j - halo[1]):j + halo[1] + 1, max(0, k - halo[2]):k + halo[2] + 1] = False
+        else:
+            computed = blocks_computed[:]
+        jobs = [(bidx, ijk) for bidx, ijk in enumerate(np.ndindex(*nblocks)) if not computed[ijk]]
+        tiles = []
+        pool = ThreadPool(concurrency)
+        try:
+            # Blocks run concurrently on separate OpenMP teams, but are saved from this thread in order
+            for (i, j, k), origin, bshape, block in pool.imap(run_block, jobs):
+                sl = tuple(slice(o, o + b) for o, b in zip(origin, bshape))
+                if sparse:
+                    tiles.append(block)
+                elif append:
+                    if block is None:
+                        continue
+                    block = (vf[sl] + block).astype('f4')
+                    vf[sl] = block
+                    if vf_norm is not None:
+                        vf_norm[sl] = block.sum(axis=3)
+                    dirty[i, j, k] = True
+                    tiles.append((i, j, k))
+                    self.dataset._try_flush()
+                    continue
+                elif block is not None:
+                    vf[sl] = block
+                blocks_computed[i, j, k] = True
+                self.dataset._try_flush()
+        finally:
+            pool.close()
+            pool.join()
+        if append:
+            return tiles
+        if sparse:
+            return SparseVectorField.from_tiles(tuple(kde_shape) + (len(genes), ), tuple(block_shape), tiles)
+        self.dataset.zarr_group['kde_computed'][:] = True
+        self.dataset._try_flush()
+
+    @_stage
+    def cache_unit_vectors(self, persist=False, chunk_size=1024**3):
+        """
+        Precompute the centred, L2-normalized vector field, which turns every Pearson correlation
+        between two pixels into a dot product. Once cached, `calc_correlation_map` uses it.
+        The cache is dropped when the vector field changes.
+
+        :param persist: If True, the cache is stored in the zarr group as `vf_unit` and `vf_unit_norm`,
+            otherwise it is kept in memory.
+        :type persist: bool
+        :param chunk_size: Maximum size (in bytes) of the vector field chunk processed at once.
+        :type chunk_size: int
+        """
+
+        vf = self.dataset.vf
+        shape = vf.shape
+        for name in ['vf_unit', 'vf_unit_norm']:
+            if name in self.dataset.zarr_group:
+                del self.dataset.zarr_group[name]
+        if persist:
+            vf_unit = self.dataset.zarr_group.zeros(name='vf_unit', shape=shape, dtype=vf.dtype, chunks=vf.chunksize)
+            vf_unit_norm = self.dataset.zarr_group.zeros(name='vf_unit_norm', shape=shape[:-1], dtype='f8', chunks=vf.chunksize[:-1])
+        else:
+            vf_unit = np.zeros(shape, dtype=vf.dtype)
+            vf_unit_norm = np.zeros(shape[:-1])
+        chunk_len = max(1, int(chunk_size / (np.prod(shape[1:]) * vf.dtype.itemsize)))
+        n_chunks = int(np.ceil(shape[0] / chunk_len))
+        for i in range(n_chunks):
+            self._m("Processing chunk %d (of %d)..."%(i+1, n_chunks))
+            sl = slice(i*chunk_len, (i+1)*chunk_len)
+            vf_unit[sl], vf_unit_norm[sl] = unit_vectors(np.asarray(vf[sl]), ncores=self.ncores)
+        if persist:
+            self.dataset._try_flush()
+            vf_unit, vf_unit_norm = da.from_zarr(vf_unit), da.from_zarr(vf_unit_norm)
+        else:
+            vf_unit, vf_unit_norm = da.from_array(vf_unit, chunks=vf.chunksize), da.from_array(vf_unit_norm, chunks=vf.chunksize[:-1])
+        self.dataset.vf_unit = vf_unit
+        self.dataset.vf_unit_norm = vf_unit_norm
+
+    @_stage
+    def calc_correlation_map(self, corr_size=3, method='sliding', streaming=False, max_memory=1024**3*2):
         """
         Calculate local correlation map of the vector field.
 
         :param corr_size: Size of square (or cube) that is used to compute the local correlation values.
             This value should be an odd number.
         :type corr_size: int
+        :param method: How the neighbourhood of each pixel is summed up.
+            'sliding' uses running sums over cache-sized tiles, so the cost does not grow with `corr_size`.
+            'direct' sums up every neighbour of each pixel. Both give the same result up to rounding.
+            A block-sparse vector field (see `run_kde`) is always summed up directly, over its occupied pixels only.
+        :type method: str
+        :param streaming: If True, the vector field is processed block by block (with a halo of `corr_size/2` pixels)
+            on `ncores` threads, and the result is written to the chunked zarr array `corr_map`
+            instead of being kept in memory.
+        :type streaming: bool
+        :param max_memory: Memory budget (in bytes) of all blocks processed at once in the streaming mode.
+        :type max_memory: int
         """
         
-        corr_map = calc_corrmap(self.dataset.vf, ncores=self.ncores, size=int(corr_size/2))
-        self.dataset.corr_map = np.array(corr_map, copy=True)
+        size = int(corr_size/2)
+        if streaming:
+            self._calc_correlation_map_streaming(size, method, max_memory)
+            return
+        vf, norms = self.dataset.vf, None
+        if self.dataset.vf_unit is not None:
+            vf, norms = self.dataset.vf_unit, np.asarray(self.dataset.vf_unit_norm)
+        if norms is None and self.dataset.vf_sparse is not None:
+            vf = self.dataset.vf_sparse.to_native() # skips the empty tiles and pixels
+        elif vf.shape[2] == 1:
+            vf = vf[:, :, 0] # 2D
+        corr_map = calc_corrmap(vf, ncores=self.ncores, size=size, method=CORRMAP_METHODS[method], norms=norms)
+        self.dataset.corr_map = np.array(corr_map, copy=True).reshape(self.dataset.vf.shape[:3])
         return
+
+    @staticmethod
+    def _corrmap_block_shape(shape, chunks, size, bytes_per_pixel, max_pixels):
+        # Start from the chunk shape of the vector field, so that blocks are read chunk by chunk,
+        # then shrink or grow the block until it fits into the budget together with its halo.
+        halo = np.array([size, size, size if shape[2] > 1 else 0])
+        block = np.minimum(np.array(chunks), shape)
+        fits = lambda b: np.prod(b + 2 * halo) * bytes_per_pixel <= max_pixels
+        while not fits(block) and np.any(block > 1):
+            block[np.argmax(block)] = int(np.ceil(block[np.argmax(block)] / 2))
+        if not fits(block):
+            raise ValueError("max_memory is too small to process a single pixel.")
+        grown = True
+        while grown:
+            grown = False
+            for d in np.argsort(block):
+                b = block.copy()
+                b[d] = min(b[d] * 2, shape[d])
+                if b[d] > block[d] and fits(b):
+                    block, grown = b, True
+        return tuple(int(b) for b in block)
+
+    def _calc_correlation_map_streaming(self, size, method, max_memory):
+        vf, unit_norm = self.dataset.vf, None
+        if self.dataset.vf_unit is not None:
+            vf, unit_norm = self.dataset.vf_unit, self.dataset.vf_unit_norm
+        shape = np.array(vf.shape[:3])
+        ngene = vf.shape[3]
+        if 'corr_map' in self.dataset.zarr_group:
+            del self.dataset.zarr_group['corr_map']
+
+        # Per pixel: the input vector (and its norm, from the unit vector cache), the native output,
+        # and the block of the result that is kept
+        bytes_per_pixel = ngene * vf.dtype.itemsize + 8 * (2 if unit_norm is None else 3)
+        chunks = vf.chunksize[:3] if hasattr(vf, 'chunksize') else vf.chunks[:3]
+        block = self._corrmap_block_shape(shape, chunks, size, bytes_per_pixel, max_memory / self.ncores)
+        corr_map = self.dataset.zarr_group.zeros(name='corr_map', shape=tuple(shape), dtype='f8', chunks=block)
+
+        nblocks = [int(np.ceil(s / b)) for s, b in zip(shape, block)]
+        block_indices = [(i, j, k) for i in range(nblocks[0]) for j in range(nblocks[1]) for k in range(nblocks[2])]
+        halo = np.array([size, size, size if shape[2] > 1 else 0])
+
+        def _process(bidx):
+            start = np.array(bidx) * block
+            end = np.minimum(start + block, shape)
+            hstart = np.maximum(start - halo, 0)
+            hend = np.minimum(end + halo, shape)
+            vf_block = np.asarray(vf[hstart[0]:hend[0], hstart[1]:hend[1], hstart[2]:hend[2]])
+            norms = None
+            if unit_norm is not None:
+                norms = np.asarray(unit_norm[hstart[0]:hend[0], hstart[1]:hend[1], hstart[2]:hend[2]])
+            if shape[2] == 1:
+                vf_block = vf_block[:, :, 0] # 2D
+            res = calc_corrmap(vf_block, ncores=1, size=size, method=CORRMAP_METHODS[method], norms=norms).reshape(hend - hstart)
+            o = start - hstart
+            # Each block is exactly one chunk of corr_map, so the workers never write to the same chunk
+            corr_map[start[0]:end[0], start[1]:end[1], start[2]:end[2]] = \
+                res[o[0]:o[0] + end[0] - start[0], o[1]:o[1] + end[1] - start[1], o[2]:o[2] + end[2] - start[2]]
+
+        pool = ThreadPool(self.ncores)
+        try:
+            for i, _ in enumerate(pool.imap_unordered(_process, block_indices)):
+                self._m("Processing chunk %d (of %d)..."%(i+1, len(block_indices)))
+        finally:
+            pool.close()
+            pool.join()
+        self.dataset._try_flush()
+        self.dataset.corr_map = da.from_zarr(corr_map)
     
-    def find_localmax(self, search_size=3, mask=None):
+    @_stage
+    def find_localmax(self, search_size=3, mask=None, store_norm=True, dirty_only=False):
         """
         Find local maxima vectors in the norm of the vector field.
 
+        The vector field is streamed once, chunk by chunk with a halo of `search_size // 2`;
+        the L1 norm, the expression threshold and the maximum filter are computed
+        together in a single native pass over each chunk.
+
         :param search_size: Size of square (or cube in 3D) that is used to search for the local maxima.
             This value should be an odd number.
         :type search_size: int
+        :param mask: If given, only the local maxima where the mask is True are kept.
+        :type mask: numpy.ndarray
+        :param store_norm: If True and `vf_norm` has not been computed yet, the L1 norm computed
+            along the way is saved as `vf_norm`.
+        :type store_norm: bool
+        :param dirty_only: If True, only the chunks within `search_size // 2` of the regions changed by
+            `append_kde` (see `dirty_regions`) are searched again, and the local maxima found before
+            are kept elsewhere.
+        :type dirty_only: bool
         """
 
-        max_mask = self.dataset.vf_norm == ndimage.maximum_filter(self.dataset.vf_norm, size=search_size)
-        max_mask &= self.dataset.vf_norm > self.dataset.norm_threshold
-        if self.dataset.expression_threshold > 0:
-            exp_mask = da.zeros_like(max_mask)
-            for i in range(len(self.dataset.genes)):
-                exp_mask |= self.dataset.vf[..., i] > self.dataset.expression_threshold
-            max_mask &= exp_mask
-        if mask is not None:
-            max_mask &= mask
-        local_maxs = np.where(max_mask.compute())
+        vf = self.dataset.vf
+        shape = np.array(vf.shape[:3])
+        chunks = np.array(vf.chunksize[:3])
+        lo, hi = search_size // 2, (search_size - 1) // 2
+        expression_threshold = self.dataset.expression_threshold if self.dataset.expression_threshold > 0 else -np.inf
+        nchunks = np.ceil(shape / chunks).astype(int)
+        local_maxs = []
+        todo = np.ones(tuple(nchunks), dtype=bool)
+        if dirty_only and self.dataset.local_maxs is not None:
+            # The maxima of a pixel's neighborhood change only if it overlaps a changed pixel
+            todo = self._dirty_chunks(chunks, halo=max(lo, hi))
+            old = np.array(self.dataset.local_maxs).reshape(3, -1)
+            local_maxs.append(old[:, ~todo[tuple(old // chunks[:, None])]])
+        vf_norm = None
+        if store_norm and self.dataset._vf_norm is None and todo.all():
+            vf_norm = self.dataset.zarr_group.zeros(name='vf_norm', shape=tuple(shape), chunks=tuple(chunks), overwrite=True)
+        for i, idx in enumerate(zip(*np.nonzero(todo))):
+            self._m("Processing chunk %d (of %d)..."%(i+1, np.count_nonzero(todo)))
+            start = np.array(idx) * chunks
+            end = np.minimum(start + chunks, shape)
+            hstart = np.maximum(start - lo, 0)
+            hend = np.minimum(end + hi, shape)
+            block = np.asarray(vf[hstart[0]:hend[0], hstart[1]:hend[1], hstart[2]:hend[2]])
+            coords, norm = find_localmax(block,
+                                         size=search_size,
+                                         norm_threshold=self.dataset.norm_threshold,
+                                         expression_threshold=expression_threshold,
+                                         origin=start - hstart,
+                                         block_shape=end - start,
+                                         ncores=self.ncores)
+            coords = np.array(coords) + start[:, None]
+            if mask is not None:
+                coords = coords[:, np.asarray(mask)[tuple(coords)]]
+            local_maxs.append(coords)
+            if vf_norm is not None:
+                vf_norm[start[0]:end[0], start[1]:end[1], start[2]:end[2]] = norm
+        local_maxs = np.concatenate(local_maxs, axis=1)
+        local_maxs = local_maxs[:, np.argsort(np.ravel_multi_index(local_maxs, shape))]
+        if vf_norm is not None:
+            self.dataset._try_flush()
+            self.dataset._vf_norm = da.from_zarr(vf_norm)
+        local_maxs = tuple(local_maxs)
         self._m("Found %d local max vectors."%len(local_maxs[0]))
         self.dataset.local_maxs = local_maxs        
         self.dataset.zarr_group['local_maxs'] = np.array(local_maxs)
@@ -486,6 +1031,32 @@ class SSAMAnalysis(object):
         self.dataset.local_maxs = tuple([self.dataset.local_maxs[i][ds_indices] for i in range(3)])
         return
 
+    @_stage
+    def grow_local_maxs(self, r=0.6, min_pixels=10, max_pixels=2000):
+        """
+        Grow a region around every local maximum, made of the connected pixels whose vectors
+        correlate with the local max vector by at least `r`. All regions are grown in parallel
+        in one native call; where regions overlap, the local max found first keeps the pixel.
+        The unit vectors are used if they were cached with `cache_unit_vectors`.
+
+        :param r: Minimum correlation of a pixel with the local max vector.
+        :type r: float
+        :param min_pixels: Regions with fewer pixels are discarded.
+        :type min_pixels: int
+        :param max_pixels: Maximum number of pixels of a region; larger regions are discarded.
+        :type max_pixels: int
+        """
+
+        unit = self.dataset.vf_unit is not None
+        vf = np.asarray(self.dataset.vf_unit if unit else self.dataset.vf)
+        seeds = np.array(self.dataset.local_maxs).T
+        labels = flood_fill_many(seeds, vf, r=r, min_pixels=min_pixels, max_pixels=max_pixels, ncores=self.ncores, unit=unit)
+        self._m("Grew %d regions around %d local max vectors."%(len(np.unique(labels[labels >= 0])), len(seeds)))
+        self.dataset.localmax_regions = labels
+        self.dataset.zarr_group['localmax_regions'] = labels
+        return
+
+    @_stage
     def normalize_vectors_sctransform(self, vst_kwargs={}, max_chunk_size=1024**3/2, re_run=False):
         """
         Normalize and regularize vectors using SCtransform
@@ -535,21 +1106,30 @@ class SSAMAnalysis(object):
             vf_normalized[i*chunk_size:(i+1)*chunk_size] = res
             
         self.dataset.normalized_vectors = self.dataset.zarr_group.array(name='normalized_vectors', data=np.array(norm_vec))[:]
+        self.dataset.normalized_moments = None
         self.dataset._try_flush()
         self.dataset.vf_normalized = da.from_zarr(vf_normalized)
         return
     
     
-    def normalize_vectors(self, normalize_gene=False, normalize_vector=True, normalize_median=False, size_after_normalization=10, log_transform=True, max_chunk_size=1024**3/2):
+    @_stage
+    def normalize_vectors(self, normalize_gene=False, normalize_vector=True, normalize_median=False, size_after_normalization=10, log_transform=True, max_chunk_size=1024**3/2, persist=True):
         """
         Normalize and regularize vectors.
 
+        Unless `normalize_gene` is set, the vector field is normalized natively in a single pass,
+        which also accumulates the per-gene mean and variance used by `scale_vectors`.
+        A block-sparse vector field (see `run_kde`) is normalized without visiting its empty pixels.
+
         :param normalize_gene: If True, normalize vectors by sum of each gene expression across all vectors.
         :type normalize_gene: bool
         :param normalize_vector: If True, normalize vectors by sum of all gene expression of each vector.
         :type normalize_vector: bool
         :param log_transform: If True, vectors are log transformed.
         :type log_transform: bool
+        :param persist: If False, `vf_normalized` is not stored, but normalized from `vf` on read
+            (only when `normalize_gene` is False).
+        :type persist: bool
         """
         
         def _normalize(vecs):
@@ -583,25 +1163,81 @@ class SSAMAnalysis(object):
         flat_vf = self.dataset.vf.reshape([-1, len(self.dataset.genes)])
         flat_vf.compute_chunk_sizes()
         nvec_total = flat_vf.shape[0]
-        vf_normalized = self.dataset.zarr_group.zeros(name='vf_normalized', shape=[nvec_total, len(self.dataset.genes)], dtype='f4')
         chunk_size = int(np.floor(max_chunk_size / (8 * len(self.dataset.genes)))) # TODO: check actual memory usage
         total_chunkcnt = int(np.ceil(nvec_total / chunk_size))
-        for i in range(total_chunkcnt):
-            self._m("Processing chunk %d (of %d)..."%(i+1, total_chunkcnt))
-            vecs = flat_vf[i*chunk_size:(i+1)*chunk_size].compute()
-            nonzero_mask = np.sum(vecs, axis=1) > 0
-            vecs_nonzero = vecs[nonzero_mask]
-            res = np.zeros_like(vecs)
-            res[nonzero_mask] = _normalize(vecs_nonzero)
-            vf_normalized[i*chunk_size:(i+1)*chunk_size] = res
-            
+        self.dataset.normalized_moments = None
+        if normalize_gene:
+            vf_normalized = self.dataset.zarr_group.zeros(name='vf_normalized', shape=[nvec_total, len(self.dataset.genes)], dtype='f4')
+            for i in range(total_chunkcnt):
+                self._m("Processing chunk %d (of %d)..."%(i+1, total_chunkcnt))
+                vecs = flat_vf[i*chunk_size:(i+1)*chunk_size].compute()
+                nonzero_mask = np.sum(vecs, axis=1) > 0
+                vecs_nonzero = vecs[nonzero_mask]
+                res = np.zeros_like(vecs)
+                res[nonzero_mask] = _normalize(vecs_nonzero)
+                vf_normalized[i*chunk_size:(i+1)*chunk_size] = res
+        else:
+            normalize_kwargs = dict(size=size_after_normalization,
+                                    normalize_vector=normalize_vector,
+                                    normalize_median=normalize_median,
+                                    log_transform=log_transform)
+            if persist:
+                vf_normalized = self.dataset.zarr_group.zeros(name='vf_normalized', shape=[nvec_total, len(self.dataset.genes)], dtype='f4')
+            vf_sparse = self.dataset.vf_sparse
+            if vf_sparse is not None:
+                # Only the nonzero values are normalized (zeros stay zeros), then written out slab by slab
+                values, moments = normalize_vectors(vf_sparse.to_native(), moments_threshold=self.dataset.norm_threshold, ncores=self.ncores, **normalize_kwargs)
+                vf_sparse = vf_sparse.with_values(values)
+                slab_pixels = vf_sparse.shape[1] * vf_sparse.shape[2]
+                slab_len = max(1, chunk_size // slab_pixels)
+                total_slabcnt = int(np.ceil(vf_sparse.shape[0] / slab_len))
+                for i in range(total_slabcnt if persist else 0):
+                    self._m("Processing chunk %d (of %d)..."%(i+1, total_slabcnt))
+                    x0, x1 = i*slab_len, min((i+1)*slab_len, vf_sparse.shape[0])
+                    res = vf_sparse.to_dense((x0, 0, 0), (x1 - x0, ) + vf_sparse.shape[1:3], ncores=self.ncores)
+                    vf_normalized[x0*slab_pixels:x1*slab_pixels] = res.reshape([-1, len(self.dataset.genes)])
+            else:
+                moments = (0, 0, 0)
+                for i in range(total_chunkcnt):
+                    self._m("Processing chunk %d (of %d)..."%(i+1, total_chunkcnt))
+                    vecs = np.asarray(flat_vf[i*chunk_size:(i+1)*chunk_size])
+                    res, chunk_moments = normalize_vectors(vecs, moments_threshold=self.dataset.norm_threshold, ncores=self.ncores, **normalize_kwargs)
+                    moments = self._merge_moments(moments, chunk_moments)
+                    if persist:
+                        vf_normalized[i*chunk_size:(i+1)*chunk_size] = res
+            # The moments of the vectors above the norm threshold, for scale_vectors
+            self.dataset.normalized_moments = (self.dataset.norm_threshold, ) + moments
+            if not persist and vf_sparse is not None:
+                vf_normalized = vf_sparse.to_dask().reshape([-1, len(self.dataset.genes)])
+            elif not persist:
+                vf_normalized = flat_vf.rechunk({1: -1}).map_blocks(
+                    lambda vecs: normalize_vectors(vecs, ncores=self.ncores, **normalize_kwargs)[0], dtype='f4')
+
         self.dataset.normalized_vectors = np.array(norm_vec)
         self.dataset.zarr_group['normalized_vectors'] = self.dataset.normalized_vectors
         self.dataset._try_flush()
-        self.dataset.vf_normalized = da.from_zarr(vf_normalized)
+        self.dataset.vf_normalized = da.from_zarr(vf_normalized) if persist or normalize_gene else vf_normalized
         return
 
-    def scale_vectors(self, max_chunk_size=1024**3/2):
+    @staticmethod
+    def _merge_moments(a, b):
+        # Merges (count, mean, m2) of two sets of vectors (Chan et al.)
+        (na, mean_a, m2_a), (nb, mean_b, m2_b) = a, b
+        n = na + nb
+        if n == 0:
+            return a
+        delta = mean_b - mean_a
+        return n, mean_a + delta * nb / n, m2_a + m2_b + delta ** 2 * na * nb / n
+
+    @_stage
+    def scale_vectors(self, max_chunk_size=1024**3/2, lazy=False):
+        """
+        Scale the normalized vector field to zero mean and unit variance per gene,
+        over the vectors whose norm exceeds the norm threshold.
+
+        :param lazy: If True, `vf_scaled` is not stored, but scaled from `vf_normalized` on read.
+        :type lazy: bool
+        """
         self._m("Scaling data...")
 
         if 'vf_scaled' in self.dataset.zarr_group:
@@ -609,26 +1245,45 @@ class SSAMAnalysis(object):
         if 'scaled_vectors' in self.dataset.zarr_group:
             del self.dataset.zarr_group['scaled_vectors']
 
-
-        vf_scaled = self.dataset.zarr_group.zeros(name='vf_scaled', shape=self.dataset.vf_normalized.shape, dtype='f4')
-        X = self.dataset.vf_normalized[np.ravel(self.dataset.vf_norm > self.dataset.norm_threshold)].compute()
-        mu = np.mean(X, axis=0)
-        sigma = np.std(X, axis=0)
-
         chunk_size = int(np.floor(max_chunk_size / (8 * len(self.dataset.genes)))) # TODO: check actual memory usage
-        total_chunkcnt = int(np.ceil(vf_scaled.shape[0] / chunk_size))
+        total_chunkcnt = int(np.ceil(self.dataset.vf_normalized.shape[0] / chunk_size))
 
+        moments = getattr(self.dataset, 'normalized_moments', None)
+        if moments is not None and moments[0] == self.dataset.norm_threshold:
+            moments = moments[1:]
+        else:
+            # No moments from normalize_vectors for this threshold; accumulate them in one pass
+            moments = (0, 0, 0)
+            norm_mask = np.ravel(np.asarray(self.dataset.vf_norm > self.dataset.norm_threshold))
+            for i in range(total_chunkcnt):
+                self._m("Processing chunk %d (of %d)..."%(i+1, total_chunkcnt))
+                X = np.asarray(self.dataset.vf_normalized[i*chunk_size:(i+1)*chunk_size][norm_mask[i*chunk_size:(i+1)*chunk_size]], dtype=float)
+                if len(X) > 0:
+                    mean = X.mean(axis=0)
+                    moments = self._merge_moments(moments, (len(X), mean, ((X - mean) ** 2).sum(axis=0)))
+        n, mean, m2 = moments
+        mu = np.asarray(mean, dtype='f4')
         with np.errstate(divide='ignore', invalid='ignore'):
+            sigma = np.sqrt(m2 / n).astype('f4')
+
+        def _scale(X):
+            with np.errstate(divide='ignore', invalid='ignore'):
+                return np.nan_to_num((X - mu) / sigma)
+
+        if lazy:
+            vf_scaled = self.dataset.vf_normalized.map_blocks(_scale, dtype='f4')
+        else:
+            vf_scaled = self.dataset.zarr_group.zeros(name='vf_scaled', shape=self.dataset.vf_normalized.shape, dtype='f4')
             for i in range(total_chunkcnt):
                 self._m("Processing chunk %d (of %d)..."%(i+1, total_chunkcnt))
-                X = self.dataset.vf_normalized[i*chunk_size:(i+1)*chunk_size].compute()
-                vf_scaled[i*chunk_size:(i+1)*chunk_size] = np.nan_to_num((X - mu) / sigma)
-        scaled_vec = np.nan_to_num((self.dataset.normalized_vectors - mu) / sigma)
+                X = np.asarray(self.dataset.vf_normalized[i*chunk_size:(i+1)*chunk_size])
+                vf_scaled[i*chunk_size:(i+1)*chunk_size] = _scale(X)
+        scaled_vec = _scale(self.dataset.normalized_vectors)
 
         self.dataset.scaled_vectors = scaled_vec
         self.dataset.zarr_group['scaled_vectors'] = self.dataset.scaled_vectors
         self.dataset._try_flush()
-        self.dataset.vf_scaled = da.from_zarr(vf_scaled)
+        self.dataset.vf_scaled = vf_scaled if lazy else da.from_zarr(vf_scaled)
 
     def _correct_cluster_labels(self, cluster_labels, outlier_detection_method, outlier_detection_kwargs):
         new_labels = remove_outliers(self.dataset.scaled_vectors, cluster_labels, outlier_detection_method, outlier_detection_kwargs)
@@ -653,6 +1308,7 @@ class SSAMAnalysis(object):
             centroids_stdev.append(centroid_stdev)
         return centroids, centroids_stdev#, medoids
 
+    @_stage
     def cluster_vectors(self, method="leiden", pca_dims=-1, min_cluster_size=2, max_correlation=1.0, metric="correlation",
                         outlier_detection_method='medoid-correlation', outlier_detection_kwargs={}, random_state=0, **kwargs):
         """
@@ -671,7 +1327,11 @@ class SSAMAnalysis(object):
         :param max_correlation: Clusters with higher correlation to this value will be merged.
         :type max_correlation: bool
         :param metric: Metric for calculation of distance between vectors in gene expression space.
+            For 'correlation', 'cosine' and 'euclidean' the neighbors are found natively, exactly for up to
+            4096 vectors and approximately (NN-descent) above that; other metrics use scikit-learn.
         :type metric: str
+        :param exact_knn: If True, always find the exact nearest neighbors (quadratic in the number of vectors).
+        :type exact_knn: bool
         :param subclustering: If True, each cluster will be clustered once again with DBSCAN algorithm to find more subclusters.
         :type subclustering: bool
         :param dbscan_eps: 'eps' value for DBSCAN subclustering. Not used when 'subclustering' is set False.
@@ -724,21 +1384,26 @@ class SSAMAnalysis(object):
             snn_neighbors = kwargs.get("snn_neighbors", 30)
             subclustering = kwargs.get("subclustering", False)
             dbscan_eps = kwargs.get("dbscan_eps", 0.4)
+            exact_knn = kwargs.get("exact_knn", False)
+            if isinstance(random_state, (int, np.integer)):
+                knn_seed = int(random_state)
+            else:
+                knn_seed = int(check_random_state(random_state).randint(np.iinfo(np.int32).max))
             
             def cluster_leiden_or_louvain(vecs):
                 k = min(snn_neighbors, vecs.shape[0])
-                knn_graph = kneighbors_graph(vecs, k, mode='connectivity', include_self=True, metric=metric).todense()
-                intersections = np.dot(knn_graph, knn_graph.T)
-                snn_graph = intersections / (k + (k - intersections)) # borrowed from Seurat
-                snn_graph[snn_graph < prune] = 0
-
-                source_vertices, target_vertices = np.where(snn_graph > 0)
-                weights = snn_graph[source_vertices, target_vertices]
+                if metric in KNN_METRICS:
+                    nbrs, _ = knn_graph(vecs, k, metric=KNN_METRICS[metric], exact=1 if exact_knn else -1,
+                                        seed=knn_seed, ncores=self.ncores)
+                else:
+                    nbrs = NearestNeighbors(n_neighbors=k, metric=metric).fit(vecs).kneighbors(vecs, return_distance=False)
+                # Jaccard index of the neighborhoods (borrowed from Seurat), pruned
+                source_vertices, target_vertices, weights = snn_graph(nbrs, prune=prune, ncores=self.ncores)
 
                 G = ig.Graph(directed=True)
                 G.add_vertices(vecs.shape[0])
-                G.add_edges(list(zip(source_vertices, target_vertices)))
-                G.es["weight"] = np.ravel(weights).tolist()
+                G.add_edges(np.column_stack((source_vertices, target_vertices)).tolist())
+                G.es["weight"] = weights.tolist()
 
                 if method == 'leiden':
                     partition = leidenalg.find_partition(G, leidenalg.RBConfigurationVertexPartition, seed=random_state, weights="weight", resolution_parameter=resolution)
@@ -1073,18 +1738,37 @@ class SSAMAnalysis(object):
             vf_chunk = vf_scaled[i*chunk_len:(i+1)*chunk_len].compute()
             if exclude_gene_indices is not None:
                 vf_chunk = np.delete(vf_chunk, exclude_gene_indices, axis=1) # np.delete creates a copy, not modifying the original
-            ctmap_chunk = calc_ctmap(centroid, vf_chunk, self.ncores)
+            # Correlations with the centred, normalized vectors are plain dot products
+            unit_chunk, _ = unit_vectors(vf_chunk, ncores=self.ncores)
+            ctmap_chunk = calc_ctmap(centroid, unit_chunk, self.ncores, unit=True)
             ctmap_chunk = np.nan_to_num(ctmap_chunk)
             ctmap[i*chunk_len:(i+1)*chunk_len] = ctmap_chunk
         return ctmap.reshape(self.dataset.vf_norm.shape)
         
-    def map_celltypes(self, centroids=None, exclude_gene_indices=None, chunk_size=1024**3):
+    @_stage
+    def map_celltypes(self, centroids=None, exclude_gene_indices=None, chunk_size=1024**3, top_k=1, dirty_only=False):
         """
         Create correlation maps between the centroids and the vector field.
         Each correlation map corresponds each cell type map.
 
+        All centroids are correlated with the vector field in a single pass over `vf_scaled`,
+        keeping only the best matching centroids of each pixel.
+
         :param centroids: If given, map celltypes with the given cluster centroids.
         :type centroids: list(np.array(int))
+        :param exclude_gene_indices: If given, these genes are not used for the mapping.
+        :type exclude_gene_indices: list(int)
+        :param chunk_size: Maximum size (in bytes) of the vector field chunk processed at once.
+        :type chunk_size: int
+        :param top_k: Number of best matching centroids kept for each pixel.
+            If larger than 1, the ranked cell types and correlations are also stored
+            as `celltype_maps_topk` and `max_correlations_topk`.
+        :type top_k: int
+        :param dirty_only: If True, only the pixels in the regions changed by `append_kde` (see `dirty_regions`)
+            are mapped again, and the cell type maps computed before (with the same `top_k`) are kept elsewhere.
+            `vf_scaled` must include the appended mRNAs, e.g. by creating it with `normalize_vectors(persist=False)`
+            and `scale_vectors(lazy=True)`.
+        :type dirty_only: bool
         """
 
         if self.dataset.vf_scaled is None:
@@ -1093,26 +1777,54 @@ class SSAMAnalysis(object):
 
         if centroids is None:
             centroids = self.dataset.centroids
-                
-        max_corr = np.zeros(self.dataset.vf_norm.shape) - 1 # range from -1 to +1
-        max_corr_idx = np.zeros(self.dataset.vf_norm.shape, dtype=int) - 1 # -1 for background
-        for cidx, centroid in enumerate(centroids):
-            self._m("Generating cell-type map for centroid #%d..."%cidx)
-            ctmap = self._map_celltype(centroid, self.dataset.vf_scaled, exclude_gene_indices=None, chunk_size=chunk_size)
-            mask = max_corr < ctmap
-            max_corr[mask] = ctmap[mask]
-            max_corr_idx[mask] = cidx
-
-        max_corr[self.dataset.vf_norm == 0] = -1
-        max_corr_idx[self.dataset.vf_norm == 0] = -1
+        centroids = np.array(centroids, dtype=float)
+        if exclude_gene_indices is not None:
+            centroids = np.delete(centroids, exclude_gene_indices, axis=1)
+        if not 1 <= top_k <= len(centroids):
+            raise ValueError("top_k must be between 1 and the number of centroids.")
+
+        vf_scaled = self.dataset.vf_scaled
+        nvec = vf_scaled.shape[0]
+        max_corr = np.zeros([nvec, top_k]) - 1 # range from -1 to +1
+        max_corr_idx = np.zeros([nvec, top_k], dtype=int) - 1 # -1 for background
+        rows = None
+        if dirty_only and getattr(self.dataset, 'celltype_maps', None) is not None:
+            if top_k > 1:
+                prev_corr, prev_idx = getattr(self.dataset, 'max_correlations_topk', None), getattr(self.dataset, 'celltype_maps_topk', None)
+            else:
+                prev_corr, prev_idx = self.dataset.max_correlations, self.dataset.celltype_maps
+            if prev_corr is not None and prev_corr.size == max_corr.size:
+                max_corr[:], max_corr_idx[:] = prev_corr.reshape(nvec, top_k), prev_idx.reshape(nvec, top_k)
+                rows = np.flatnonzero(self._dirty_mask())
+        chunk_len = max(1, int(chunk_size / len(self.dataset.genes) / 4))
+        n_chunks = int(np.ceil((nvec if rows is None else len(rows)) / chunk_len))
+        for i in range(n_chunks):
+            self._m("Processing chunk %d (of %d)..."%(i+1, n_chunks))
+            sel = slice(i*chunk_len, (i+1)*chunk_len) if rows is None else rows[i*chunk_len:(i+1)*chunk_len]
+            vf_chunk = np.asarray(vf_scaled[sel])
+            if exclude_gene_indices is not None:
+                vf_chunk = np.delete(vf_chunk, exclude_gene_indices, axis=1)
+            max_corr[sel], max_corr_idx[sel] = calc_ctmap_multi(centroids, vf_chunk, k=top_k, ncores=self.ncores)
+
+        max_corr = max_corr.reshape(list(self.dataset.vf_norm.shape) + [top_k])
+        max_corr_idx = max_corr_idx.reshape(list(self.dataset.vf_norm.shape) + [top_k])
+        bg_mask = (self.dataset.vf_norm == 0).compute()
+        max_corr[bg_mask] = -1
+        max_corr_idx[bg_mask] = -1
         self.dataset.max_probabilities = None
-        self.dataset.max_correlations = max_corr
-        self.dataset.celltype_maps = max_corr_idx
+        self.dataset.max_correlations = max_corr[..., 0]
+        self.dataset.celltype_maps = max_corr_idx[..., 0]
 
         self.dataset.zarr_group['max_correlations'] = self.dataset.max_correlations
         self.dataset.zarr_group['celltype_maps'] = self.dataset.celltype_maps
+        if top_k > 1:
+            self.dataset.max_correlations_topk = max_corr
+            self.dataset.celltype_maps_topk = max_corr_idx
+            self.dataset.zarr_group['max_correlations_topk'] = self.dataset.max_correlations_topk
+            self.dataset.zarr_group['celltype_maps_topk'] = self.dataset.celltype_maps_topk
         return
 
+    @_stage
     def filter_celltypemaps(self, min_p=0.6, min_r=0.6, min_norm=0.1, fill_blobs=True, min_blob_area=0, filter_params={}, output_mask=None):
         """
         Post-filter cell type maps created by `map_celltypes`.
@@ -1123,6 +1835,8 @@ class SSAMAnalysis(object):
             If a string is given instead, then the threshold is automatically determined using
             sklearn's `threshold filter functions <https://scikit-image.org/docs/dev/api/skimage.filters.html>`_ (The functions start with `threshold_`).
         :type min_norm: str or float
+        :param fill_blobs: If True, fill the holes of the blobs. A blob is a connected region of the same cell type.
+        :type fill_blobs: bool
         :param min_blob_area: The blobs with its area less than this value will be removed.
         :type min_blob_area: int
         :param filter_params: Filter parameters used for the sklearn's threshold filter functions.
@@ -1177,21 +1891,13 @@ class SSAMAnalysis(object):
                     mask[..., z][np.logical_and(vf_norm_z > min_norm_cut, ctcorr_mask_z)] = 1
             else:
                 mask[np.logical_and(self.dataset.vf_norm > min_norm, ctcorr > min_r)] = 1
-                
-            if min_blob_area > 0 or fill_blobs:
-                blob_labels = measure.label(mask, background=0)
-                for bp in measure.regionprops(blob_labels):
-                    if min_blob_area > 0 and bp.filled_area < min_blob_area:
-                        for c in bp.coords:
-                            mask[c[0], c[1], c[2]] = 0 # fill with zeros
-                            #mask[c[0], c[1]] = 0 # fill with zeros
-                        continue
-                    if fill_blobs and bp.area != bp.filled_area:
-                        minx, miny, minz, maxx, maxy, maxz = bp.bbox
-                        mask[minx:maxx, miny:maxy, minz:maxz] |= bp.filled_image
-                        #minr, minc, maxr, maxc = bp.bbox
-                        #mask[minr:maxr, minc:maxc] |= bp.filled_image
-                        
+
+        if min_blob_area > 0 or fill_blobs:
+            # Blobs are connected pixels of the same cell type; all of them are labeled,
+            # filled and cleared in a single native pass.
+            blob_labels = np.where(mask, self.dataset.celltype_maps, -1).astype(np.int32)
+            mask = filter_blobs(blob_labels, min_area=min_blob_area, fill=fill_blobs, ncores=self.ncores)
+
         filtered_ctmaps = np.array(self.dataset.celltype_maps, copy=True)
         filtered_ctmaps[mask == False] = -1
         
@@ -1200,6 +1906,7 @@ class SSAMAnalysis(object):
         self.dataset.filtered_celltype_maps = filtered_ctmaps
         self.dataset.zarr_group['filtered_celltype_maps'] = self.dataset.filtered_celltype_maps
         
+    @_stage
     def bin_celltypemaps(self, step=10, radius=100, min_r=0.6):
         """
         Sweep a sphere window along a lattice on the image, and count the number of cell types in each window.
@@ -1209,55 +1916,19 @@ class SSAMAnalysis(object):
         :param radius: The radius of the sphere window.
         :type radius: int
         """
-        def make_sphere_mask(radius):
-            dia = radius*2+1
-            X, Y, Z = np.ogrid[:dia, :dia, :dia]
-            dist_from_center = np.sqrt((X - radius)**2 + (Y - radius)**2 + (Z - radius)**2)
-            mask = dist_from_center <= radius
-            return mask
-
         centers = np.array(self.dataset.vf_norm.shape) // 2
         steps = np.array(np.floor(centers / step) * 2 + np.array(self.dataset.vf_norm.shape) % 2, dtype=int)
         starts = centers - step * np.floor(centers / step)
         ends = starts + steps * step
         X, Y, Z = [np.arange(s, e, step, dtype=int) for s, e in zip(starts, ends)]
 
-        ct_centers = np.zeros([len(X), len(Y), len(Z)], dtype=int)
-        ct_counts = np.zeros([len(X), len(Y), len(Z), len(self.dataset.centroids)], dtype=int)
-
         good_vecs_mask = np.logical_and(self.dataset.vf_norm > self.dataset.norm_threshold, self.dataset.max_correlations > min_r)
         good_celltype_maps = np.zeros_like(self.dataset.celltype_maps) - 1
         good_celltype_maps[good_vecs_mask] = self.dataset.celltype_maps[good_vecs_mask]
-        
-        ncelltypes = np.max(good_celltype_maps) + 1
-        cnt_matrix = np.zeros([ncelltypes, ncelltypes])
-        sphere_mask = make_sphere_mask(radius)
-
-        for xidx, x in enumerate(X):
-            for yidx, y in enumerate(Y):
-                for zidx, z in enumerate(Z):
-                    mask_slices = [slice(0, radius*2+1), slice(0, radius*2+1), slice(0, radius*2+1)]
-                    s = [x - radius,     y - radius,     z - radius    ]
-                    e = [x + radius + 1, y + radius + 1, z + radius + 1]
-
-                    for ms_idx, ms in enumerate(s):
-                        if ms < 0:
-                            mask_slices[ms_idx] = slice(abs(ms), mask_slices[ms_idx].stop)
-                            s[ms_idx] = 0
-                    for me_idx, me in enumerate(e):
-                        ctmap_size = good_celltype_maps.shape[me_idx]
-                        #ctmap_size = 50
-                        if me > ctmap_size:
-                            mask_slices[me_idx] = slice(mask_slices[me_idx].start, (radius * 2 + 1) + ctmap_size - me)
-                            e[me_idx] = ctmap_size
-
-                    w = good_celltype_maps[s[0]:e[0],
-                                           s[1]:e[1],
-                                           s[2]:e[2]][sphere_mask[tuple(mask_slices)]] + 1
-
-                    ct_centers[xidx, yidx, zidx] = good_celltype_maps[x, y, z]
-                    ct_counts[xidx, yidx, zidx] = np.bincount(np.ravel(w), minlength=len(self.dataset.centroids) + 1)[1:]
-                    
+
+        ct_centers = good_celltype_maps[np.ix_(X, Y, Z)]
+        ct_counts = bin_celltypemaps(good_celltype_maps, X, Y, Z, radius, len(self.dataset.centroids), ncores=self.ncores)
+
         self.dataset.celltype_binned_centers = ct_centers
         self.dataset.celltype_binned_counts = ct_counts
 
@@ -1265,6 +1936,7 @@ class SSAMAnalysis(object):
         self.dataset.zarr_group['celltype_binned_counts'] = self.dataset.celltype_binned_counts
         return
         
+    @_stage
     def find_domains(self, centroid_indices=[], n_clusters=10, norm_thres=0, merge_thres=0.6, merge_remote=True):
         """
         Find domains in the image, using the result of `bin_celltypemaps`.
@@ -1282,37 +1954,6 @@ class SSAMAnalysis(object):
         :param merge_remote: If true, allow merging clusters that are not adjacent to each other.
         :type merge_remote: bool
         """
-        def find_neighbors(m, l):
-            neighbors = set()
-            for x, y, z in zip(*np.where(m == l)):
-                neighbors.add(m[x - 1, y    , z    ])
-                neighbors.add(m[x + 1, y    , z    ])
-                neighbors.add(m[x    , y - 1, z    ])
-                neighbors.add(m[x    , y + 1, z    ])
-                neighbors.add(m[x    , y    , z - 1])
-                neighbors.add(m[x    , y    , z + 1])
-                neighbors.add(m[x - 1, y - 1, z    ])
-                neighbors.add(m[x + 1, y - 1, z    ])
-                neighbors.add(m[x - 1, y + 1, z    ])
-                neighbors.add(m[x + 1, y + 1, z    ])
-                neighbors.add(m[x - 1, y    , z - 1])
-                neighbors.add(m[x + 1, y    , z - 1])
-                neighbors.add(m[x - 1, y    , z + 1])
-                neighbors.add(m[x + 1, y    , z + 1])
-                neighbors.add(m[x    , y - 1, z - 1])
-                neighbors.add(m[x    , y + 1, z - 1])
-                neighbors.add(m[x    , y - 1, z + 1])
-                neighbors.add(m[x    , y + 1, z + 1])
-                neighbors.add(m[x - 1, y - 1, z - 1])
-                neighbors.add(m[x + 1, y - 1, z - 1])
-                neighbors.add(m[x - 1, y - 1, z + 1])
-                neighbors.add(m[x + 1, y - 1, z + 1])
-                neighbors.add(m[x - 1, y + 1, z - 1])
-                neighbors.add(m[x + 1, y + 1, z - 1])
-                neighbors.add(m[x - 1, y + 1, z + 1])
-                neighbors.add(m[x + 1, y + 1, z + 1])
-            return neighbors
-        
         if self.dataset.celltype_binned_counts is None:
             raise AssertionError("Run 'bin_celltypemap()' method first!")
 
@@ -1334,31 +1975,7 @@ class SSAMAnalysis(object):
         layer_map = measure.label(layer_map)
         
         if merge_thres < 1.0:
-            while True:
-                uniq_labels = np.array(list(set(list(np.ravel(layer_map))) - set([0])))
-                if not merge_remote:
-                    layer_map_padded = np.pad(layer_map, 1, mode='constant', constant_values=0)
-                    neighbors_dic = {}
-                    for lbl in uniq_labels:
-                        neighbors_dic[lbl] = find_neighbors(layer_map_padded, lbl)
-                cluster_centroids = []
-                for lbl in uniq_labels:
-                    cluster_centroids.append(np.mean(binned_ctmaps[layer_map == lbl], axis=0))
-                max_corr = 0
-                #max_corr_indices = (0, 0, )
-                for i in range(len(uniq_labels)):
-                    for j in range(i+1, len(uniq_labels)):
-                        lbl_i, lbl_j = uniq_labels[i], uniq_labels[j]
-                        if lbl_i == 0 or lbl_j == 0:
-                            continue
-                        corr_ij = corr(cluster_centroids[i], cluster_centroids[j])
-                        if corr_ij > max_corr and (merge_remote or lbl_j in neighbors_dic[lbl_i]):
-                            max_corr = corr_ij
-                            max_corr_indices = (lbl_i, lbl_j, )
-                if max_corr > merge_thres:
-                    layer_map[layer_map == max_corr_indices[1]] = max_corr_indices[0]
-                else:
-                    break
+            layer_map = self._merge_domains(layer_map, binned_ctmaps, merge_thres, merge_remote)
 
         """
         if min_size > 0:
@@ -1383,6 +2000,77 @@ class SSAMAnalysis(object):
         self.dataset.zarr_group['inferred_domains'] = self.dataset.inferred_domains
         self.dataset.zarr_group['inferred_domains_cells'] = self.dataset.inferred_domains_cells
      
+    def _merge_domains(self, layer_map, binned_ctmaps, merge_thres, merge_remote):
+        # Repeatedly merges the pair of domains (adjacent ones, unless merge_remote) whose
+        # centroids correlate best, while the correlation exceeds merge_thres. The centroids
+        # and the adjacency graph are updated incrementally on each merge; candidate pairs
+        # are kept in a heap, ordered like the pairwise scan (ties go to the lower labels).
+        uniq_labels = np.unique(layer_map)
+        uniq_labels = uniq_labels[uniq_labels != 0]
+        nlabels = len(uniq_labels)
+        if nlabels < 2:
+            return layer_map
+        fg = layer_map != 0
+        flat_labels = np.searchsorted(uniq_labels, layer_map[fg])
+        sums = np.zeros([nlabels, binned_ctmaps.shape[-1]])
+        np.add.at(sums, flat_labels, binned_ctmaps[fg])
+        sizes = np.bincount(flat_labels, minlength=nlabels).astype(float)
+
+        if merge_remote:
+            graph = None
+        else:
+            graph = [dict() for _ in range(nlabels)]
+            pairs, contacts = label_adjacency(layer_map, ncores=self.ncores)
+            for (a, b), c in zip(np.searchsorted(uniq_labels, pairs), contacts):
+                graph[a][b] = graph[b][a] = c
+
+        def correlations(i, others):
+            centroids = np.vstack([sums[i] / sizes[i], sums[others] / sizes[others, None]])
+            with np.errstate(divide='ignore', invalid='ignore'):
+                return np.corrcoef(centroids)[0, 1:]
+
+        min_corr = max(0, merge_thres)
+        alive = np.ones(nlabels, dtype=bool)
+        version = np.zeros(nlabels, dtype=int)
+        def candidates(i, others):
+            others = np.array(sorted(others), dtype=int)
+            if len(others) == 0:
+                return []
+            return [(-c, min(i, k), max(i, k), version[min(i, k)], version[max(i, k)])
+                    for k, c in zip(others, correlations(i, others)) if c > min_corr]
+        heap = []
+        for i in range(nlabels):
+            heap += candidates(i, range(i + 1, nlabels) if merge_remote else [k for k in graph[i] if k > i])
+        heapq.heapify(heap)
+
+        merged_into = np.arange(nlabels)
+        while heap:
+            _, i, j, vi, vj = heapq.heappop(heap)
+            if not (alive[i] and alive[j] and version[i] == vi and version[j] == vj):
+                continue # stale pair
+            # Merge j into i
+            sums[i] += sums[j]
+            sizes[i] += sizes[j]
+            alive[j] = False
+            version[i] += 1
+            merged_into[merged_into == j] = i
+            if merge_remote:
+                others = np.flatnonzero(alive)
+                others = others[others != i]
+            else:
+                for k, c in graph[j].items():
+                    del graph[k][j]
+                    if k != i:
+                        graph[i][k] = graph[k][i] = graph[i].get(k, 0) + c
+                graph[j] = {}
+                others = list(graph[i])
+            for item in candidates(i, others):
+                heapq.heappush(heap, item)
+
+        lut = np.zeros(int(uniq_labels.max()) + 1, dtype=layer_map.dtype)
+        lut[uniq_labels] = uniq_labels[merged_into]
+        return lut[layer_map]
+
     def exclude_and_merge_domains(self, exclude=[], merge=[]):
         """
         Manually exclude or merge domains.
@@ -1392,22 +2080,25 @@ class SSAMAnalysis(object):
         :param merge: List of indices of the domains which will be merged.
         :type merge: list(list(int))
         """
+        # The exclusions and merges are composed into one lookup table over the domain
+        # indices (offset by one for -1), and applied to the maps once.
+        nlabels = int(max(self.dataset.inferred_domains.max(), self.dataset.inferred_domains_cells.max(), *exclude, *[j for i in merge for j in i])) + 2
+        lut = np.arange(nlabels) - 1
         for i in exclude:
-            self.dataset.inferred_domains[self.dataset.inferred_domains == i] = -1
-            self.dataset.inferred_domains_cells[self.dataset.inferred_domains_cells == i] = -1
-            
+            lut[lut == i] = -1
         for i in merge:
             for j in i[1:]:
-                self.dataset.inferred_domains[self.dataset.inferred_domains == j] = i[0]
-                self.dataset.inferred_domains_cells[self.dataset.inferred_domains_cells == j] = i[0]
+                lut[lut == j] = i[0]
+        inferred_domains = lut[self.dataset.inferred_domains + 1]
+        inferred_domains_cells = lut[self.dataset.inferred_domains_cells + 1]
 
-        uniq_indices = np.unique(self.dataset.inferred_domains_cells)
+        uniq_indices = np.unique(inferred_domains_cells)
         if -1 in uniq_indices:
             uniq_indices = uniq_indices[1:]
-            
-        for new_idx, i in enumerate(uniq_indices):
-            self.dataset.inferred_domains[self.dataset.inferred_domains == i] = new_idx
-            self.dataset.inferred_domains_cells[self.dataset.inferred_domains_cells == i] = new_idx
+        renumber = np.arange(nlabels) - 1
+        renumber[uniq_indices + 1] = np.arange(len(uniq_indices))
+        self.dataset.inferred_domains = renumber[inferred_domains + 1]
+        self.dataset.inferred_domains_cells = renumber[inferred_domains_cells + 1]
 
         self.dataset.zarr_group['inferred_domains'] = self.dataset.inferred_domains
         self.dataset.zarr_group['inferred_domains_cells'] = self.dataset.inferred_domains_cells
@@ -1444,6 +2135,7 @@ class SSAMAnalysis(object):
 
         self.dataset.spatial_relationships = preprocessing.normalize(sparel, axis=1, norm='l1')
 
+    @_stage
     def run_watershed(self, mask, z=0):
         """
         Run watershed segmentation based on the cell-type map with a mask of marker image (experimental).
@@ -1513,36 +2205,42 @@ class SSAMAnalysis(object):
         self.dataset.zarr_group['watershed_segments'] = self.dataset.watershed_segments
         self.dataset.zarr_group['watershed_celltype_maps'] = self.dataset.watershed_celltype_maps
 
-    def compute_cell_by_gene_matrix(self, df):
+    @_stage
+    def compute_cell_by_gene_matrix(self, df, sparse=False):
         """
         Identify and count genes present within each cell segment based on mRNA coordinates.
 
+        The transcripts are aggregated natively in one pass, without a dense per-pixel count matrix.
+
         :param df: DataFrame containing genes and their corresponding mRNA coordinates. Must contain columns 'x' and 'y', and an index column containing gene names.
         :type df: pandas.DataFrame
+        :param sparse: If True, the matrix is stored as a `scipy.sparse.csr_matrix`, which saves memory with many cells;
+            otherwise as a dense numpy.ndarray, as before.
+        :type sparse: bool
         """
 
         n_segments = np.max(self.dataset.watershed_segments) + 1
-
-        cell_by_gene_matrix = np.zeros((n_segments, len(self.dataset.genes)), dtype=int)
-
-        x_values = np.round(df['x'].values).astype(int)
-        y_values = np.round(df['y'].values).astype(int)
-
-        good_mask = np.logical_and(np.logical_and(x_values < self.dataset.shape[0], x_values >= 0), np.logical_and(y_values < self.dataset.shape[1], y_values >= 0))
-        x_values = x_values[good_mask]
-        y_values = y_values[good_mask]
-        gene_names = df.index[good_mask]
-
-        print("Generating spatial mRNA count matrix...")
-        counts = np.zeros([self.dataset.shape[0], self.dataset.shape[1], len(self.dataset.genes)], dtype=int)
-        for gidx, gene in enumerate(self.dataset.genes):
-            gene_mask = gene_names == gene
-            for x, y in zip(x_values[gene_mask], y_values[gene_mask]):
-                counts[x, y, gidx] += 1
-    
-        print("Computing cell-by-gene matrix...")
-        for seg in np.arange(n_segments):
-            cell_by_gene_matrix[seg] = counts[self.dataset.watershed_segments == seg].sum(axis=0)
-            
-        self.dataset.cell_by_gene_matrix = cell_by_gene_matrix
-        self.dataset.zarr_group['cell_by_gene_matrix'] = self.dataset.cell_by_gene_matrix
+        gene_codes = pd.Index(self.dataset.genes).get_indexer(df.index) # -1 for unknown genes
+
+        self._m("Computing cell-by-gene matrix...")
+        data, indices, indptr = cell_by_gene(df['x'].values,
+                                             df['y'].values,
+                                             gene_codes,
+                                             self.dataset.watershed_segments,
+                                             n_segments,
+                                             len(self.dataset.genes),
+                                             ncores=self.ncores)
+        cell_by_gene_matrix = scipy.sparse.csr_matrix((data, indices, indptr), shape=(n_segments, len(self.dataset.genes)))
+
+        if sparse:
+            self.dataset.cell_by_gene_matrix = cell_by_gene_matrix
+            if 'cell_by_gene_matrix' in self.dataset.zarr_group:
+                del self.dataset.zarr_group['cell_by_gene_matrix']
+            group = self.dataset.zarr_group.create_group('cell_by_gene_matrix')
+            group['data'] = data
+            group['indices'] = indices
+            group['indptr'] = indptr
+            group.attrs['shape'] = list(cell_by_gene_matrix.shape)
+        else:
+            self.dataset.cell_by_gene_matrix = cell_by_gene_matrix.toarray()
+            self.dataset.zarr_group['cell_by_gene_matrix'] = self.dataset.cell_by_gene_matrix
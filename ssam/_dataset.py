@@ -4,6 +4,7 @@ from matplotlib.colors import to_rgba
 import seaborn as sns
 import multiprocessing
 import sys, os
+import struct
 sns.set()
 sns.set_style("whitegrid", {'axes.grid' : False})
 from sklearn.decomposition import PCA
@@ -16,7 +17,171 @@ import numbers
 import zarr
 import dask.array as da
 
-from .utils import corr
+from .utils import corr, vf_from_sparse, vf_to_sparse
+
+# Arrays derived from the vector field, dropped whenever it is replaced.
+# c/batch/batch.cpp removes the same names before writing a new vf.
+VF_CACHES = ['vf_norm', 'vf_unit', 'vf_unit_norm', 'corr_map', 'localmax_regions']
+
+class SparseVectorField(object):
+    """
+    A block-sparse vector field. The image is split into tiles; every tile keeps an occupancy
+    bitmap of its pixels, and every occupied pixel keeps the list of its nonzero genes and their values.
+    `calc_ctmap`, `calc_corrmap` and `normalize_vectors` take the field in this form (see `to_native`)
+    and skip the empty tiles and pixels.
+
+    :param shape: Shape of the dense vector field (width, height, depth, number of genes).
+    :type shape: tuple(int)
+    :param tile_shape: Shape of a tile in pixels.
+    :type tile_shape: tuple(int)
+    """
+
+    _arrays = ['tile_ptr', 'bitmap', 'vox_ptr', 'genes', 'values']
+
+    def __init__(self, shape, tile_shape, tile_ptr, bitmap, vox_ptr, genes, values):
+        self.shape = tuple(int(s) for s in shape)
+        self.tile_shape = tuple(int(s) for s in tile_shape)
+        self.tile_ptr = np.asarray(tile_ptr, dtype=np.int64)
+        self.bitmap = np.asarray(bitmap, dtype=np.uint64)
+        self.vox_ptr = np.asarray(vox_ptr, dtype=np.int64)
+        self.genes = np.asarray(genes, dtype=np.int32)
+        self.values = np.asarray(values, dtype=np.float32)
+
+    @classmethod
+    def from_dense(cls, vf, tile_shape, ncores=multiprocessing.cpu_count()):
+        """
+        Converts a dense vector field (width x height x depth x genes) into a sparse one.
+        """
+        return cls(*vf_to_sparse(np.asarray(vf), tile_shape, ncores=ncores))
+
+    @classmethod
+    def from_tiles(cls, shape, tile_shape, tiles):
+        """
+        Assembles a sparse vector field from the fields of its tiles, given in raster order.
+        Each tile is a single-tile field in the native form (e.g. returned by `calc_kde_multi` with `tile_shape`),
+        or None if the tile is empty.
+        """
+        nwords = int(np.ceil(np.prod(tile_shape) / 64))
+        tile_ptr, bitmap, vox_ptr, genes, values = [0], [], [], [], []
+        nnz = 0
+        for tile in tiles:
+            if tile is None:
+                tile_ptr.append(tile_ptr[-1])
+                bitmap.append(np.zeros(nwords, dtype=np.uint64))
+                continue
+            _, _, t_ptr, t_bitmap, t_vox_ptr, t_genes, t_values = tile
+            tile_ptr.append(tile_ptr[-1] + int(t_ptr[-1]))
+            bitmap.append(np.ravel(t_bitmap))
+            vox_ptr.append(np.asarray(t_vox_ptr[:-1]) + nnz)
+            genes.append(t_genes)
+            values.append(t_values)
+            nnz += len(t_genes)
+        vox_ptr.append([nnz])
+        return cls(shape, tile_shape, tile_ptr, np.stack(bitmap), np.concatenate(vox_ptr),
+                   np.concatenate(genes) if genes else [], np.concatenate(values) if values else [])
+
+    @property
+    def nnz(self):
+        """
+        Number of nonzero values.
+        """
+        return len(self.values)
+
+    def with_values(self, values):
+        """
+        Returns a field with the same occupancy and genes, but with other values (e.g. normalized ones).
+        """
+        return SparseVectorField(self.shape, self.tile_shape, self.tile_ptr, self.bitmap, self.vox_ptr, self.genes, values)
+
+    def to_native(self):
+        """
+        The field as the tuple taken by the native functions.
+        """
+        return (np.array(self.shape, dtype=np.int64), np.array(self.tile_shape, dtype=np.int64),
+                self.tile_ptr, self.bitmap, self.vox_ptr, self.genes, self.values)
+
+    def to_dense(self, origin=None, block_shape=None, ncores=multiprocessing.cpu_count()):
+        """
+        Converts the field (or a block of it) into a dense vector field.
+
+        :param origin: Origin of the block in pixels. Defaults to (0, 0, 0).
+        :type origin: tuple(int)
+        :param block_shape: Shape of the block in pixels. Defaults to the rest of the image.
+        :type block_shape: tuple(int)
+        """
+        return vf_from_sparse(self.to_native(), origin, block_shape, ncores=ncores)
+
+    def to_dask(self):
+        """
+        A lazy dense view of the field, with one chunk per tile.
+        """
+        native = self.to_native()
+        chunks = tuple(tuple(min(t, s - o) for o in range(0, s, t)) for s, t in zip(self.shape[:3], self.tile_shape))
+        def _block(block_info=None):
+            loc = block_info[None]['array-location'][:3]
+            return vf_from_sparse(native, [l[0] for l in loc], [l[1] - l[0] for l in loc], ncores=1)
+        return da.map_blocks(_block, chunks=chunks + ((self.shape[3], ), ), dtype='f4')
+
+    def save(self, group, name='vf_sparse'):
+        """
+        Stores the field as a subgroup of a zarr group.
+        """
+        if name in group:
+            del group[name]
+        g = group.create_group(name)
+        g.attrs['shape'] = list(self.shape)
+        g.attrs['tile_shape'] = list(self.tile_shape)
+        for k in self._arrays:
+            g.array(name=k, data=getattr(self, k))
+
+    @classmethod
+    def load(cls, group, name='vf_sparse'):
+        """
+        Loads a field stored by `save`.
+        """
+        g = group[name]
+        return cls(g.attrs['shape'], g.attrs['tile_shape'], *[g[k][:] for k in cls._arrays])
+
+def write_transcripts(path, locations, width, height, depth=1, coord_dtype='f8'):
+    """
+    Writes the mRNA locations as a columnar binary file, the input of the native batch
+    pipeline (`ssam_batch`, built with CMake from c/batch), which runs the KDE, `find_localmax`
+    and `map_celltypes` without Python and writes a zarr store `SSAMDataset` can open.
+    The columns are memory-mapped by the pipeline; see c/batch/transcripts.h for the layout.
+
+    :param path: Path of the file to write.
+    :type path: str
+    :param locations: Location of the mRNAs in um, as the `locations` of `SSAMAnalysis.run_kde`
+        (a pandas DataFrame with the columns (or index) 'gene', 'x', 'y' and, in 3D, 'z').
+    :type locations: pandas.DataFrame
+    :param width: Width of the image in um.
+    :type width: float
+    :param height: Height of the image in um.
+    :type height: float
+    :param depth: Depth of the image in um. Depth == 1 means 2D image.
+    :type depth: float
+    :param coord_dtype: Type of the stored coordinates, 'f8' (the same KDE as `run_kde` on
+        a float64 DataFrame) or 'f4' (half the size).
+    :type coord_dtype: str
+    """
+    if coord_dtype not in ('f4', 'f8'):
+        raise ValueError("coord_dtype must be 'f4' or 'f8'.")
+    if locations.index.name == 'gene':
+        locations = locations.reset_index()
+    axes = ['x', 'y', 'z'] if depth > 1 else ['x', 'y']
+    genes, codes = np.unique(np.asarray(locations['gene']), return_inverse=True)
+    names = b''.join(str(g).encode('utf-8') + b'\0' for g in genes)
+    header = struct.pack('<8sQIIII3dQ', b'SSAMTRX1', len(locations), len(genes), len(axes),
+                         int(coord_dtype[1]), 0, width, height, depth, len(names))
+    def write_aligned(f, data):
+        f.write(data)
+        f.write(b'\0' * (-len(data) % 64))
+    with open(path, 'wb') as f:
+        write_aligned(f, header)
+        write_aligned(f, names)
+        write_aligned(f, codes.astype('<i4').tobytes())
+        for a in axes:
+            write_aligned(f, np.asarray(locations[a], dtype='<' + coord_dtype).tobytes())
 
 class SSAMDataset(object):
     """
@@ -42,10 +207,15 @@ class SSAMDataset(object):
         self._vf = None
         self._vf_norm = None
         self._vf_normalized = None
+        self.vf_sparse = None
+        self.vf_unit = None
+        self.vf_unit_norm = None
         self.bandwidth = None
         self._local_maxs = None
+        self.localmax_regions = None
         self._selected_vectors = None
         self.normalized_vectors = None
+        self.normalized_moments = None
         self.expanded_vectors = None
         self.cluster_labels = None
         #self.corr_map = None
@@ -108,11 +278,16 @@ class SSAMDataset(object):
             self._vf = da.array(vf.compute())
         else:
             self._vf = vf
-        self._vf_norm = None
-        try:
-            del self.zarr_group['vf_norm']
-        except:
-            pass
+        self.vf_sparse = None
+        self._drop_vf_caches()
+
+    def _drop_vf_caches(self, names=VF_CACHES):
+        for name in names:
+            setattr(self, '_vf_norm' if name == 'vf_norm' else name, None)
+            try:
+                del self.zarr_group[name]
+            except:
+                pass
         
     @property
     def vf_normalized(self):